@@ -0,0 +1,516 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hash_table.h"
+#include "assembler.h"
+
+#define ASSEMBLER_INITIAL_CAPACITY 1024
+
+/* First RAM address given to variables */
+#define ASSEMBLER_VARIABLE_BASE 16
+
+/* Bits of a C instruction */
+#define C_INSTRUCTION_PREFIX 0xE000
+#define C_INSTRUCTION_COMP_SHIFT 6
+#define C_INSTRUCTION_DEST_A 0x20
+#define C_INSTRUCTION_DEST_D 0x10
+#define C_INSTRUCTION_DEST_M 0x08
+
+/* ALU computations, with the a bit in front of the six c bits */
+typedef struct AssemblerCompEntry
+{
+  const char     *mnemonic;
+  unsigned short bits;
+} AssemblerCompEntry;
+
+#define ASSEMBLER_COMP_TABLE_SIZE 34
+
+static const AssemblerCompEntry
+  assembler_comp_table[ASSEMBLER_COMP_TABLE_SIZE] =
+{
+  { "0", 0x2A },
+  { "1", 0x3F },
+  { "-1", 0x3A },
+  { "D", 0x0C },
+  { "A", 0x30 },
+  { "!D", 0x0D },
+  { "!A", 0x31 },
+  { "-D", 0x0F },
+  { "-A", 0x33 },
+  { "D+1", 0x1F },
+  { "A+1", 0x37 },
+  { "D-1", 0x0E },
+  { "A-1", 0x32 },
+  { "D+A", 0x02 },
+  { "D-A", 0x13 },
+  { "A-D", 0x07 },
+  { "D&A", 0x00 },
+  { "D|A", 0x15 },
+  { "M", 0x70 },
+  { "!M", 0x71 },
+  { "-M", 0x73 },
+  { "M+1", 0x77 },
+  { "M-1", 0x72 },
+  { "D+M", 0x42 },
+  { "D-M", 0x53 },
+  { "M-D", 0x47 },
+  { "D&M", 0x40 },
+  { "D|M", 0x55 },
+  /* Commuted operands */
+  { "A+D", 0x02 },
+  { "M+D", 0x42 },
+  { "A&D", 0x00 },
+  { "M&D", 0x40 },
+  { "A|D", 0x15 },
+  { "M|D", 0x55 },
+};
+
+#define ASSEMBLER_JUMP_TABLE_SIZE 7
+
+/* Jump mnemonics, the position in the table plus one is their code */
+static const char *assembler_jump_table[ASSEMBLER_JUMP_TABLE_SIZE] =
+{
+  "JGT", "JEQ", "JGE", "JLT", "JNE", "JLE", "JMP"
+};
+
+/* Symbols every Hack program starts with */
+typedef struct AssemblerPredefinedEntry
+{
+  const char *name;
+  int        value;
+} AssemblerPredefinedEntry;
+
+#define ASSEMBLER_PREDEFINED_TABLE_SIZE 23
+
+static const AssemblerPredefinedEntry
+  assembler_predefined_table[ASSEMBLER_PREDEFINED_TABLE_SIZE] =
+{
+  { "SP", 0 }, { "LCL", 1 }, { "ARG", 2 }, { "THIS", 3 }, { "THAT", 4 },
+  { "R0", 0 }, { "R1", 1 }, { "R2", 2 }, { "R3", 3 },
+  { "R4", 4 }, { "R5", 5 }, { "R6", 6 }, { "R7", 7 },
+  { "R8", 8 }, { "R9", 9 }, { "R10", 10 }, { "R11", 11 },
+  { "R12", 12 }, { "R13", 13 }, { "R14", 14 }, { "R15", 15 },
+  { "SCREEN", 16384 }, { "KBD", 24576 },
+};
+
+/* A symbol, defined once it is a label, a predefined symbol or
+ * a variable with its address */
+typedef struct AssemblerSymbol
+{
+  int    value;
+  bool   defined;
+} AssemblerSymbol;
+
+/* An A instruction whose symbol is resolved at the end */
+typedef struct AssemblerFixup
+{
+  size_t address;
+  size_t symbol;
+} AssemblerFixup;
+
+struct Assembler
+{
+  unsigned short  *rom;
+  size_t          rom_count;
+  size_t          rom_capacity;
+  AssemblerFixup  *fixups;
+  size_t          fixup_count;
+  size_t          fixup_capacity;
+  /* Symbols in the order they were first seen, at the index of
+   * their name in the name table */
+  AssemblerSymbol *symbols;
+  size_t          symbol_count;
+  size_t          symbol_capacity;
+  HashTable       *names;
+  /* RAM address of the next variable */
+  int             next_variable;
+  /* First error found */
+  AssemblerStatus status;
+};
+
+/* Internal Functions */
+
+/* Grows an array of *capacity elements of element_size bytes so it
+ * holds at least count + 1 elements
+ *
+ * Returns true if successful and false otherwise
+ */
+bool assembler_reserve(void **array, size_t *capacity, size_t count,
+                       size_t element_size);
+
+/* Finds a symbol, adding it undefined if it is new
+ *
+ * Returns its index, or HASH_TABLE_NOT_FOUND if it could not be added
+ */
+size_t assembler_symbol(Assembler *assembler, const char *name);
+
+/* Appends an instruction to the program */
+AssemblerStatus assembler_emit(Assembler *assembler, unsigned short word);
+
+/* End Internal Functions */
+
+/* Creates an assembler with the predefined Hack symbols */
+Assembler *assembler_init(void)
+{
+  Assembler *assembler = NULL;
+  size_t symbol;
+  size_t k;
+
+  assembler = (Assembler *)calloc(1, sizeof(Assembler));
+
+  if (!assembler)
+    return NULL;
+
+  assembler->status = ASSEMBLER_SUCC;
+  assembler->next_variable = ASSEMBLER_VARIABLE_BASE;
+  assembler->names = hash_table_init();
+
+  if (!assembler->names)
+  {
+    assembler_fini(assembler);
+    return NULL;
+  }
+
+  for (k = 0; k < ASSEMBLER_PREDEFINED_TABLE_SIZE; k++)
+  {
+    symbol = assembler_symbol(assembler, assembler_predefined_table[k].name);
+
+    if (symbol == HASH_TABLE_NOT_FOUND)
+    {
+      assembler_fini(assembler);
+      return NULL;
+    }
+
+    assembler->symbols[symbol].value = assembler_predefined_table[k].value;
+    assembler->symbols[symbol].defined = true;
+  }
+
+  return assembler;
+}
+
+/* Encodes a C instruction dest=comp;jump */
+bool assembler_encode_c_instruction(const char *instruction,
+                                    unsigned short *word)
+{
+  const char *equals = strchr(instruction, '=');
+  const char *semicolon = strchr(instruction, ';');
+  const char *comp = equals ? equals + 1 : instruction;
+  size_t comp_length = semicolon ? (size_t)(semicolon - comp) : strlen(comp);
+  const char *d = NULL;
+  int k;
+
+  if (semicolon && semicolon < comp)
+    return false;
+
+  *word = C_INSTRUCTION_PREFIX;
+
+  for (d = instruction; equals && d < equals; d++)
+  {
+    if (*d == 'A')
+      *word |= C_INSTRUCTION_DEST_A;
+    else if (*d == 'D')
+      *word |= C_INSTRUCTION_DEST_D;
+    else if (*d == 'M')
+      *word |= C_INSTRUCTION_DEST_M;
+    else
+      return false;
+  }
+
+  for (k = 0; k < ASSEMBLER_COMP_TABLE_SIZE; k++)
+  {
+    if (strlen(assembler_comp_table[k].mnemonic) == comp_length &&
+        strncmp(assembler_comp_table[k].mnemonic, comp, comp_length) == 0)
+      break;
+  }
+
+  if (k == ASSEMBLER_COMP_TABLE_SIZE)
+    return false;
+
+  *word |= assembler_comp_table[k].bits << C_INSTRUCTION_COMP_SHIFT;
+
+  if (!semicolon)
+    return true;
+
+  for (k = 0; k < ASSEMBLER_JUMP_TABLE_SIZE; k++)
+  {
+    if (strcmp(assembler_jump_table[k], semicolon + 1) == 0)
+    {
+      *word |= k + 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Appends an encoded instruction */
+AssemblerStatus assembler_add_word(Assembler *assembler, unsigned short word)
+{
+  assert(assembler);
+
+  if (assembler->status == ASSEMBLER_SUCC)
+    assembler->status = assembler_emit(assembler, word);
+
+  return assembler->status;
+}
+
+/* Appends an A instruction that loads a number */
+AssemblerStatus assembler_add_value(Assembler *assembler, long value)
+{
+  assert(assembler);
+
+  if (assembler->status == ASSEMBLER_SUCC &&
+      (value < 0 || value >= ASSEMBLER_ROM_WORDS))
+    assembler->status = ASSEMBLER_INVALID_INSTRUCTION;
+
+  return assembler_add_word(assembler, (unsigned short)value);
+}
+
+/* Appends an A instruction that loads a symbol */
+AssemblerStatus assembler_add_symbol(Assembler *assembler, const char *symbol)
+{
+  size_t index;
+
+  assert(assembler);
+  assert(symbol);
+
+  if (assembler->status != ASSEMBLER_SUCC)
+    return assembler->status;
+
+  if (symbol[0] == '\0' || (symbol[0] >= '0' && symbol[0] <= '9'))
+  {
+    assembler->status = ASSEMBLER_INVALID_SYMBOL;
+    return assembler->status;
+  }
+
+  /* Every symbol is resolved at the end, when all labels are known */
+  index = assembler_symbol(assembler, symbol);
+
+  if (index == HASH_TABLE_NOT_FOUND ||
+      !assembler_reserve((void **)&assembler->fixups, &assembler->fixup_capacity,
+                         assembler->fixup_count, sizeof(AssemblerFixup)))
+  {
+    assembler->status = ASSEMBLER_FAIL_ALLOC;
+    return assembler->status;
+  }
+
+  assembler->fixups[assembler->fixup_count].address = assembler->rom_count;
+  assembler->fixups[assembler->fixup_count].symbol = index;
+  assembler->fixup_count++;
+
+  return assembler_add_word(assembler, 0);
+}
+
+/* Defines a label at the next instruction */
+AssemblerStatus assembler_add_label(Assembler *assembler, const char *label)
+{
+  size_t index;
+
+  assert(assembler);
+  assert(label);
+
+  if (assembler->status != ASSEMBLER_SUCC)
+    return assembler->status;
+
+  if (label[0] == '\0')
+  {
+    assembler->status = ASSEMBLER_INVALID_SYMBOL;
+    return assembler->status;
+  }
+
+  index = assembler_symbol(assembler, label);
+
+  if (index == HASH_TABLE_NOT_FOUND)
+  {
+    assembler->status = ASSEMBLER_FAIL_ALLOC;
+    return assembler->status;
+  }
+
+  assembler->symbols[index].value = (int)assembler->rom_count;
+  assembler->symbols[index].defined = true;
+
+  return ASSEMBLER_SUCC;
+}
+
+/* Gives the remaining symbols addresses and fills in the instructions
+ * that use symbols */
+AssemblerStatus assembler_resolve(Assembler *assembler)
+{
+  AssemblerSymbol *symbol = NULL;
+  size_t i;
+
+  assert(assembler);
+
+  if (assembler->status != ASSEMBLER_SUCC)
+    return assembler->status;
+
+  /* Labels are all known now, the other symbols are variables */
+  for (i = 0; i < assembler->fixup_count; i++)
+  {
+    symbol = &assembler->symbols[assembler->fixups[i].symbol];
+
+    if (!symbol->defined)
+    {
+      symbol->value = assembler->next_variable++;
+      symbol->defined = true;
+    }
+
+    if (symbol->value < 0 || symbol->value >= ASSEMBLER_ROM_WORDS)
+    {
+      assembler->status = ASSEMBLER_INVALID_SYMBOL;
+      return assembler->status;
+    }
+
+    assembler->rom[assembler->fixups[i].address] = (unsigned short)symbol->value;
+  }
+
+  assembler->fixup_count = 0;
+
+  return ASSEMBLER_SUCC;
+}
+
+/* Resolves the symbols and writes the machine code into a file */
+AssemblerStatus assembler_write(Assembler *assembler, const char *filename,
+                                AssemblerFormat format)
+{
+  AssemblerStatus status;
+  FILE *output_file = NULL;
+  char digits[17];
+  unsigned short word;
+  bool success = true;
+  size_t i;
+  int bit;
+
+  assert(assembler);
+  assert(filename);
+
+  status = assembler_resolve(assembler);
+
+  if (status != ASSEMBLER_SUCC)
+    return status;
+
+  output_file = fopen(filename, format == ASSEMBLER_FORMAT_BINARY ? "wb" : "w");
+
+  if (!output_file)
+    return ASSEMBLER_FAIL_WRITE;
+
+  digits[16] = '\0';
+
+  for (i = 0; i < assembler->rom_count && success; i++)
+  {
+    word = assembler->rom[i];
+
+    if (format == ASSEMBLER_FORMAT_BINARY)
+    {
+      success = fputc(word >> 8, output_file) != EOF &&
+                fputc(word & 0xFF, output_file) != EOF;
+      continue;
+    }
+
+    for (bit = 0; bit < 16; bit++)
+      digits[bit] = (word & (0x8000 >> bit)) ? '1' : '0';
+
+    success = fprintf(output_file, "%s\n", digits) >= 0;
+  }
+
+  if (fclose(output_file) != 0)
+    success = false;
+
+  return success ? ASSEMBLER_SUCC : ASSEMBLER_FAIL_WRITE;
+}
+
+/* Returns the machine code assembled so far */
+const unsigned short *assembler_rom(const Assembler *assembler)
+{
+  assert(assembler);
+
+  return assembler->rom;
+}
+
+/* Returns the number of instructions assembled so far */
+size_t assembler_instruction_count(const Assembler *assembler)
+{
+  assert(assembler);
+
+  return assembler->rom_count;
+}
+
+/* Frees the assembler */
+void assembler_fini(Assembler *assembler)
+{
+  if (!assembler) return;
+
+  free(assembler->rom);
+  free(assembler->fixups);
+  free(assembler->symbols);
+  hash_table_fini(assembler->names);
+  free(assembler);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+bool assembler_reserve(void **array, size_t *capacity, size_t count,
+                       size_t element_size)
+{
+  size_t new_capacity;
+  void *new_array = NULL;
+
+  if (count < *capacity)
+    return true;
+
+  new_capacity = *capacity ? *capacity * 2 : ASSEMBLER_INITIAL_CAPACITY;
+
+  while (new_capacity <= count)
+    new_capacity *= 2;
+
+  new_array = realloc(*array, new_capacity * element_size);
+
+  if (!new_array)
+    return false;
+
+  *array = new_array;
+  *capacity = new_capacity;
+
+  return true;
+}
+
+size_t assembler_symbol(Assembler *assembler, const char *name)
+{
+  AssemblerSymbol *symbol = NULL;
+  size_t index;
+
+  /* A new symbol has room in the array before its name is added */
+  if (!assembler_reserve((void **)&assembler->symbols, &assembler->symbol_capacity,
+                         assembler->symbol_count, sizeof(AssemblerSymbol)))
+    return HASH_TABLE_NOT_FOUND;
+
+  index = hash_table_add_string(assembler->names, name);
+
+  if (index == HASH_TABLE_NOT_FOUND || index < assembler->symbol_count)
+    return index;
+
+  symbol = &assembler->symbols[assembler->symbol_count++];
+  symbol->value = 0;
+  symbol->defined = false;
+
+  return index;
+}
+
+AssemblerStatus assembler_emit(Assembler *assembler, unsigned short word)
+{
+  if (assembler->rom_count == ASSEMBLER_ROM_WORDS)
+    return ASSEMBLER_ROM_FULL;
+
+  if (!assembler_reserve((void **)&assembler->rom, &assembler->rom_capacity,
+                         assembler->rom_count, sizeof(unsigned short)))
+    return ASSEMBLER_FAIL_ALLOC;
+
+  assembler->rom[assembler->rom_count++] = word;
+
+  return ASSEMBLER_SUCC;
+}
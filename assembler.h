@@ -0,0 +1,103 @@
+/* assembler.h: Assembles the Hack instructions written by the code
+ *              writer into machine code in memory, without writing an
+ *              assembly file
+ */
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Words of the Hack instruction memory */
+#define ASSEMBLER_ROM_WORDS 32768
+
+typedef enum AssemblerStatus
+{
+  ASSEMBLER_INVALID_INSTRUCTION,
+  ASSEMBLER_INVALID_SYMBOL,
+  ASSEMBLER_ROM_FULL,
+  ASSEMBLER_FAIL_ALLOC,
+  ASSEMBLER_FAIL_WRITE,
+  ASSEMBLER_SUCC
+} AssemblerStatus;
+
+/* Layouts of the machine code file */
+typedef enum AssemblerFormat
+{
+  /* One line of 16 binary digits per instruction, as .hack files */
+  ASSEMBLER_FORMAT_HACK,
+  /* Two bytes per instruction, most significant byte first */
+  ASSEMBLER_FORMAT_BINARY
+} AssemblerFormat;
+
+/* Collects encoded instructions and labels as they are added and
+ * resolves their symbols once the whole program is known */
+typedef struct Assembler Assembler;
+
+/* Creates an assembler with the predefined Hack symbols
+ *
+ * Returns the assembler, or NULL if it could not be allocated
+ */
+Assembler *assembler_init(void);
+
+/* Encodes a C instruction dest=comp;jump, written without spaces
+ *
+ * Returns true if the instruction is valid and false otherwise
+ */
+bool assembler_encode_c_instruction(const char *instruction,
+                                    unsigned short *word);
+
+/* Appends an encoded instruction. After an error, further instructions
+ * and labels are ignored and the error is returned again
+ *
+ * Returns ASSEMBLER_SUCC if successful, or the first error
+ */
+AssemblerStatus assembler_add_word(Assembler *assembler, unsigned short word);
+
+/* Appends an A instruction that loads a number below 32768
+ *
+ * Returns ASSEMBLER_SUCC if successful, or the first error
+ */
+AssemblerStatus assembler_add_value(Assembler *assembler, long value);
+
+/* Appends an A instruction that loads a symbol, resolved once every
+ * label is known
+ *
+ * Returns ASSEMBLER_SUCC if successful, or the first error
+ */
+AssemblerStatus assembler_add_symbol(Assembler *assembler, const char *symbol);
+
+/* Defines a label at the next instruction. A label defined twice
+ * takes the last address
+ *
+ * Returns ASSEMBLER_SUCC if successful, or the first error
+ */
+AssemblerStatus assembler_add_label(Assembler *assembler, const char *label);
+
+/* Gives the symbols that are not labels RAM addresses from 16 on, in
+ * the order they are first used, and fills in the instructions that
+ * use symbols. Instructions added afterwards are resolved by the next
+ * call
+ *
+ * Returns ASSEMBLER_SUCC if successful, or the first error
+ */
+AssemblerStatus assembler_resolve(Assembler *assembler);
+
+/* Resolves the symbols and writes the machine code into a file
+ *
+ * Returns ASSEMBLER_SUCC if successful, or the first error
+ */
+AssemblerStatus assembler_write(Assembler *assembler, const char *filename,
+                                AssemblerFormat format);
+
+/* Returns the machine code assembled so far, which is only complete
+ * after assembler_resolve, or NULL if it is empty */
+const unsigned short *assembler_rom(const Assembler *assembler);
+
+/* Returns the number of instructions assembled so far */
+size_t assembler_instruction_count(const Assembler *assembler);
+
+/* Frees the assembler */
+void assembler_fini(Assembler *assembler);
+
+#endif
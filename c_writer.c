@@ -0,0 +1,841 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "c_writer.h"
+
+#define C_WRITER_INITIAL_CAPACITY 64
+
+#define C_INPUT_FILENAME_MAX_LENGTH 256
+#define C_FUNCTION_NAME_MAX_LENGTH 256
+#define C_LABEL_MAX_LENGTH 256
+
+/* Longest piece of a generated line read back at a time. Label lines
+ * are shorter: three escaped names of up to 256 characters each */
+#define C_LINE_CHUNK_LENGTH 4096
+
+/* Return address of the bootstrap call to Sys.init */
+#define BOOTSTRAP_RETURN_ADDRESS 0
+
+/* Statements of the arithmetic-logical commands. Comparisons test
+ * the sign of x - y, as the Hack translation does */
+typedef struct CArithmeticEntry
+{
+  ArithmeticLogicalCommand command;
+  const char               *statement;
+} CArithmeticEntry;
+
+#define C_ARITHMETIC_TABLE_SIZE 9
+
+static const CArithmeticEntry
+  c_arithmetic_table[C_ARITHMETIC_TABLE_SIZE] =
+{
+  { "add", "y = POP(); TOP += y;" },
+  { "sub", "y = POP(); TOP -= y;" },
+  { "neg", "TOP = -TOP;" },
+  { "eq", "y = POP(); TOP = TOP == y ? 0xFFFF : 0;" },
+  { "gt", "y = POP(); x = TOP; TOP = (int16_t)(uint16_t)(x - y) > 0 ? 0xFFFF : 0;" },
+  { "lt", "y = POP(); x = TOP; TOP = (int16_t)(uint16_t)(x - y) < 0 ? 0xFFFF : 0;" },
+  { "and", "y = POP(); TOP &= y;" },
+  { "or", "y = POP(); TOP |= y;" },
+  { "not", "TOP = ~TOP;" },
+};
+
+/* Segments addressed through a pointer register */
+typedef struct CSegmentEntry
+{
+  MemorySegment segment;
+  const char    *pointer;
+} CSegmentEntry;
+
+#define C_SEGMENT_TABLE_SIZE 4
+
+static const CSegmentEntry
+  c_segment_table[C_SEGMENT_TABLE_SIZE] =
+{
+  { "local", "LCL" },
+  { "argument", "ARG" },
+  { "this", "THIS" },
+  { "that", "THAT" },
+};
+
+/* Start of every generated program */
+static const char *c_program_prologue =
+  "/* Generated by vmtranslator --target=c */\n"
+  "#include <stdio.h>\n"
+  "#include <stdlib.h>\n"
+  "#include <stdint.h>\n"
+  "\n"
+  "#define RAM_WORDS 32768\n"
+  "/* Addresses wrap around as on the Hack computer */\n"
+  "#define ADDRESS(a) ((uint16_t)(a) & (RAM_WORDS - 1))\n"
+  "#define SP RAM[0]\n"
+  "#define LCL RAM[1]\n"
+  "#define ARG RAM[2]\n"
+  "#define THIS RAM[3]\n"
+  "#define THAT RAM[4]\n"
+  "#define PUSH(v) (RAM[ADDRESS(SP)] = (uint16_t)(v), SP++)\n"
+  "#define POP() (SP--, RAM[ADDRESS(SP)])\n"
+  "#define TOP RAM[ADDRESS(SP - 1)]\n"
+  "\n"
+  "static uint16_t RAM[RAM_WORDS];\n"
+  "\n"
+  "/* Prints the RAM words of each <first>[-<last>] argument */\n"
+  "static void print_ram(int argc, char **argv)\n"
+  "{\n"
+  "  unsigned long first, last, address;\n"
+  "  char *end;\n"
+  "  int i;\n"
+  "\n"
+  "  for (i = 1; i < argc; i++)\n"
+  "  {\n"
+  "    first = strtoul(argv[i], &end, 10);\n"
+  "    last = *end == '-' ? strtoul(end + 1, &end, 10) : first;\n"
+  "\n"
+  "    for (address = first; address <= last && address < RAM_WORDS; address++)\n"
+  "      printf(\"RAM[%lu] = %d\\n\", address, (int16_t)RAM[address]);\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "int main(int argc, char **argv)\n"
+  "{\n"
+  "  uint16_t x, y, frame, ret;\n"
+  "  int i;\n"
+  "\n"
+  "  /* Not every program uses all of them */\n"
+  "  (void)x; (void)y; (void)frame; (void)i;\n"
+  "\n"
+  "  /* Bootstrap code */\n"
+  "  SP = 256;\n";
+
+struct CWriter
+{
+  /* The program is written to a temporary file, and copied into the
+   * output file without the labels nothing jumps to when closed */
+  FILE         *output_file;
+  FILE         *target_file;
+  char         input_file[C_INPUT_FILENAME_MAX_LENGTH + 1];
+  char         current_function[C_FUNCTION_NAME_MAX_LENGTH + 1];
+  bool         input_file_set;
+  /* Return addresses given so far, 0 is the end of the bootstrap call */
+  unsigned int return_count;
+  /* Label written by the previous command, or empty */
+  char         last_label[C_LABEL_MAX_LENGTH + 1];
+  bool         halts;
+  /* RAM address of each static variable of the file, 0 until used */
+  int          *statics;
+  size_t       static_capacity;
+  int          next_static;
+  /* Names of the functions defined and called */
+  char         **defined;
+  size_t       defined_count;
+  size_t       defined_capacity;
+  char         **called;
+  size_t       called_count;
+  size_t       called_capacity;
+  /* C labels a goto, if-goto or call jumps to */
+  char         **referenced;
+  size_t       referenced_count;
+  size_t       referenced_capacity;
+  bool         returns;
+  bool         failed;
+};
+
+/* Internal Functions */
+
+/* Writes a name with every character but letters and digits written
+ * as _XX in hexadecimal, so that any VM name becomes a C identifier
+ * and "__" can separate names */
+void write_c_name(CWriter *writer, const char *name);
+
+/* Copies a name as write_c_name writes it into dest, which may be
+ * NULL to only measure it
+ *
+ * Returns the length of the written name
+ */
+size_t copy_c_name(char *dest, const char *name);
+
+/* Builds the C label of a VM label of the current function
+ *
+ * Returns the label, to be freed by the caller, or NULL if out of memory
+ */
+char *c_label_name(const CWriter *writer, const char *label);
+
+/* Writes the C label of a VM label of the current function */
+void write_c_label(CWriter *writer, const char *label);
+
+/* Writes a goto or if-goto to a VM label of the current function and
+ * records the label as jumped to
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_c_jump(CWriter *writer, const char *statement, const char *label);
+
+/* Copies the temporary file into the output file, leaving out the
+ * definitions of the labels nothing jumps to, so the program compiles
+ * without unused label warnings
+ *
+ * Returns true if successful and false otherwise
+ */
+bool copy_referenced_labels(CWriter *writer);
+
+/* Checks if a line of the program defines a label that no goto,
+ * if-goto or call jumps to */
+bool c_label_is_unreferenced(const CWriter *writer, char *line);
+
+/* Adds the C label of a function to the labels jumped to
+ *
+ * Returns true if successful and false otherwise
+ */
+bool add_function_reference(CWriter *writer, const char *function_name);
+
+/* Writes the push of the return address and the frame of a call,
+ * and the jump to the callee */
+void write_c_call(CWriter *writer, const char *function_name,
+                  unsigned int n_args, unsigned int return_address);
+
+/* Adds a copy of name to a list of names
+ *
+ * Returns true if successful and false otherwise
+ */
+bool c_name_list_add(char ***names, size_t *count, size_t *capacity,
+                     const char *name);
+
+/* Orders names for qsort and bsearch */
+int c_name_compare(const void *a, const void *b);
+
+/* End Internal Functions */
+
+/* Opens an output file and writes the bootstrap code into it */
+CWriter *c_writer_init(const char *output_filename)
+{
+  CWriter *writer = NULL;
+
+  assert(output_filename);
+
+  writer = (CWriter *)calloc(1, sizeof(CWriter));
+
+  if (!writer)
+    return NULL;
+
+  writer->target_file = fopen(output_filename, "w");
+
+  if (!writer->target_file)
+  {
+    free(writer);
+    return NULL;
+  }
+
+  writer->output_file = tmpfile();
+
+  if (!writer->output_file)
+  {
+    fclose(writer->target_file);
+    free(writer);
+    return NULL;
+  }
+
+  writer->return_count = BOOTSTRAP_RETURN_ADDRESS + 1;
+  writer->next_static = STATIC_SEGMENT_BASE;
+
+  fputs(c_program_prologue, writer->output_file);
+  write_c_call(writer, "Sys.init", 0, BOOTSTRAP_RETURN_ADDRESS);
+
+  if (!c_name_list_add(&writer->called, &writer->called_count,
+                       &writer->called_capacity, "Sys.init"))
+    writer->failed = true;
+
+  return writer;
+}
+
+/* Informs the translation of a new VM file */
+CodeWriterStatus c_writer_set_filename(CWriter *writer, const char *input_filename)
+{
+  const char *start = NULL;
+  const char *end = NULL;
+
+  assert(writer);
+  assert(input_filename);
+
+  /* Remove any directories and the extension */
+  start = strrchr(input_filename, '/');
+  start = start ? start + 1 : input_filename;
+  end = strrchr(start, '.');
+
+  if (!end)
+    end = start + strlen(start);
+
+  if ((size_t)(end - start) > C_INPUT_FILENAME_MAX_LENGTH)
+    return CODE_WRITER_FAIL_SET_INPUT_FILE;
+
+  memcpy(writer->input_file, start, end - start);
+  writer->input_file[end - start] = '\0';
+  writer->current_function[0] = '\0';
+  writer->last_label[0] = '\0';
+  writer->input_file_set = true;
+
+  /* Statics are numbered per file */
+  if (writer->statics)
+    memset(writer->statics, 0, writer->static_capacity * sizeof(int));
+
+  fprintf(writer->output_file, "\n  /* Translation %s */\n", writer->input_file);
+
+  return CODE_WRITER_SUCC;
+}
+
+/* Writes the C code of an arithmetic-logical command */
+CodeWriterStatus c_writer_write_arithmetic(CWriter *writer,
+                                           ArithmeticLogicalCommand cmd)
+{
+  int i;
+
+  assert(writer);
+
+  if (!writer->input_file_set)
+    return CODE_WRITER_FAIL_WRITE;
+  else if (!cmd)
+    return CODE_WRITER_INVALID_ARITHMETIC_CMD;
+
+  for (i = 0; i < C_ARITHMETIC_TABLE_SIZE; i++)
+  {
+    if (strcmp(cmd, c_arithmetic_table[i].command) == 0)
+      break;
+  }
+
+  if (i == C_ARITHMETIC_TABLE_SIZE)
+    return CODE_WRITER_INVALID_ARITHMETIC_CMD;
+
+  writer->last_label[0] = '\0';
+  fprintf(writer->output_file, "  %s\n", c_arithmetic_table[i].statement);
+
+  return CODE_WRITER_SUCC;
+}
+
+/* Writes the C code of a push or pop command */
+CodeWriterStatus c_writer_write_push_pop(CWriter *writer, CommandType cmd,
+                                         MemorySegment segment,
+                                         int segment_index)
+{
+  int *new_statics = NULL;
+  size_t new_capacity;
+  int address = -1;
+  int i;
+
+  assert(writer);
+
+  if (!writer->input_file_set)
+    return CODE_WRITER_FAIL_WRITE;
+  else if (!segment || (cmd != C_PUSH && cmd != C_POP))
+    return CODE_WRITER_INVALID_PUSH_POP_CMD;
+
+  writer->last_label[0] = '\0';
+
+  /* Folded constants may be negative */
+  if (strcmp(segment, "constant") == 0)
+  {
+    if (cmd != C_PUSH)
+      return CODE_WRITER_INVALID_PUSH_POP_SEGMENT;
+    else if (segment_index < VM_WORD_MIN || segment_index > VM_WORD_MAX)
+      return CODE_WRITER_INVALID_PUSH_POP_INDEX;
+
+    fprintf(writer->output_file, "  PUSH(%d);\n", segment_index);
+    return CODE_WRITER_SUCC;
+  }
+
+  if (segment_index < 0)
+    return CODE_WRITER_INVALID_PUSH_POP_INDEX;
+
+  for (i = 0; i < C_SEGMENT_TABLE_SIZE; i++)
+  {
+    if (strcmp(segment, c_segment_table[i].segment) == 0)
+    {
+      if (cmd == C_PUSH)
+        fprintf(writer->output_file, "  PUSH(RAM[ADDRESS(%s + %d)]);\n",
+                c_segment_table[i].pointer, segment_index);
+      else
+        fprintf(writer->output_file, "  x = POP(); RAM[ADDRESS(%s + %d)] = x;\n",
+                c_segment_table[i].pointer, segment_index);
+
+      return CODE_WRITER_SUCC;
+    }
+  }
+
+  /* The other segments are at fixed RAM addresses */
+  if (strcmp(segment, "pointer") == 0 && segment_index < POINTER_SEGMENT_WORDS)
+    address = POINTER_SEGMENT_BASE + segment_index;
+  else if (strcmp(segment, "temp") == 0 && segment_index < TEMP_SEGMENT_WORDS)
+    address = TEMP_SEGMENT_BASE + segment_index;
+  else if (strcmp(segment, "static") == 0)
+  {
+    if ((size_t)segment_index >= writer->static_capacity)
+    {
+      new_capacity = writer->static_capacity ? writer->static_capacity :
+                                               C_WRITER_INITIAL_CAPACITY;
+
+      while (new_capacity <= (size_t)segment_index)
+        new_capacity *= 2;
+
+      new_statics = (int *)realloc(writer->statics, new_capacity * sizeof(int));
+
+      if (!new_statics)
+        return CODE_WRITER_FAIL_WRITE;
+
+      memset(new_statics + writer->static_capacity, 0,
+             (new_capacity - writer->static_capacity) * sizeof(int));
+      writer->statics = new_statics;
+      writer->static_capacity = new_capacity;
+    }
+
+    if (writer->statics[segment_index] == 0)
+    {
+      if (writer->next_static >= STATIC_SEGMENT_END)
+        return CODE_WRITER_INVALID_PUSH_POP_INDEX;
+
+      writer->statics[segment_index] = writer->next_static++;
+    }
+
+    address = writer->statics[segment_index];
+  }
+  else if (strcmp(segment, "pointer") == 0 || strcmp(segment, "temp") == 0)
+    return CODE_WRITER_INVALID_PUSH_POP_INDEX;
+  else
+    return CODE_WRITER_INVALID_PUSH_POP_SEGMENT;
+
+  if (cmd == C_PUSH)
+    fprintf(writer->output_file, "  PUSH(RAM[%d]);\n", address);
+  else
+    fprintf(writer->output_file, "  RAM[%d] = POP();\n", address);
+
+  return CODE_WRITER_SUCC;
+}
+
+/* Writes the C code of a function command */
+CodeWriterStatus c_writer_write_function(CWriter *writer,
+                                         const char *function_name,
+                                         unsigned int n_vars)
+{
+  assert(writer);
+
+  if (!writer->input_file_set || !function_name ||
+      strlen(function_name) > C_FUNCTION_NAME_MAX_LENGTH)
+    return CODE_WRITER_FAIL_WRITE;
+
+  if (!c_name_list_add(&writer->defined, &writer->defined_count,
+                       &writer->defined_capacity, function_name))
+    return CODE_WRITER_FAIL_WRITE;
+
+  strcpy(writer->current_function, function_name);
+  writer->last_label[0] = '\0';
+
+  fprintf(writer->output_file, "\n  /* function %s %u */\nF_", function_name, n_vars);
+  write_c_name(writer, function_name);
+  fputs(":\n", writer->output_file);
+
+  if (n_vars > 0)
+    fprintf(writer->output_file, "  for (i = 0; i < %u; i++) PUSH(0);\n", n_vars);
+
+  return CODE_WRITER_SUCC;
+}
+
+/* Writes the C code of a call command */
+CodeWriterStatus c_writer_write_call(CWriter *writer,
+                                     const char *function_name,
+                                     unsigned int n_args)
+{
+  assert(writer);
+
+  if (!writer->input_file_set || !function_name)
+    return CODE_WRITER_FAIL_WRITE;
+
+  if (!c_name_list_add(&writer->called, &writer->called_count,
+                       &writer->called_capacity, function_name))
+    return CODE_WRITER_FAIL_WRITE;
+
+  writer->last_label[0] = '\0';
+
+  fprintf(writer->output_file, "  /* call %s %u */\n", function_name, n_args);
+  write_c_call(writer, function_name, n_args, writer->return_count);
+  fprintf(writer->output_file, "R%u:\n", writer->return_count);
+  writer->return_count++;
+
+  return CODE_WRITER_SUCC;
+}
+
+/* Writes the C code of a return command */
+CodeWriterStatus c_writer_write_return(CWriter *writer)
+{
+  assert(writer);
+
+  if (!writer->input_file_set)
+    return CODE_WRITER_FAIL_WRITE;
+
+  writer->last_label[0] = '\0';
+  writer->returns = true;
+
+  fputs("  /* return */\n"
+        "  frame = LCL;\n"
+        "  ret = RAM[ADDRESS(frame - 5)];\n"
+        "  x = POP(); RAM[ADDRESS(ARG)] = x;\n"
+        "  SP = ARG + 1;\n"
+        "  THAT = RAM[ADDRESS(frame - 1)];\n"
+        "  THIS = RAM[ADDRESS(frame - 2)];\n"
+        "  ARG = RAM[ADDRESS(frame - 3)];\n"
+        "  LCL = RAM[ADDRESS(frame - 4)];\n"
+        "  goto dispatch;\n", writer->output_file);
+
+  return CODE_WRITER_SUCC;
+}
+
+/* Writes the C label of a label command */
+CodeWriterStatus c_writer_write_label(CWriter *writer, const char *label)
+{
+  assert(writer);
+
+  if (!writer->input_file_set || !label || strlen(label) > C_LABEL_MAX_LENGTH)
+    return CODE_WRITER_FAIL_WRITE;
+
+  write_c_label(writer, label);
+  fputs(":;\n", writer->output_file);
+
+  strcpy(writer->last_label, label);
+
+  return CODE_WRITER_SUCC;
+}
+
+/* Writes the C code of a goto command */
+CodeWriterStatus c_writer_write_goto(CWriter *writer, const char *label)
+{
+  assert(writer);
+
+  if (!writer->input_file_set || !label)
+    return CODE_WRITER_FAIL_WRITE;
+
+  /* label L, goto L never ends */
+  if (strcmp(label, writer->last_label) == 0)
+  {
+    fputs("  goto halted;\n", writer->output_file);
+    writer->last_label[0] = '\0';
+    writer->halts = true;
+    return CODE_WRITER_SUCC;
+  }
+
+  return write_c_jump(writer, "goto", label) ? CODE_WRITER_SUCC :
+                                               CODE_WRITER_FAIL_WRITE;
+}
+
+/* Writes the C code of an if-goto command */
+CodeWriterStatus c_writer_write_if(CWriter *writer, const char *label)
+{
+  assert(writer);
+
+  if (!writer->input_file_set || !label)
+    return CODE_WRITER_FAIL_WRITE;
+
+  writer->last_label[0] = '\0';
+
+  return write_c_jump(writer, "if (POP() != 0) goto", label) ? CODE_WRITER_SUCC :
+                                                                CODE_WRITER_FAIL_WRITE;
+}
+
+/* Writes the end of main and closes the output file */
+CodeWriterStatus c_writer_close(CWriter *writer)
+{
+  bool success;
+  size_t i;
+
+  if (!writer)
+    return CODE_WRITER_FAIL_WRITE;
+
+  /* Code after the last function runs into the end of the program */
+  fputs("\n  puts(\"c: left the program\");\n"
+        "  print_ram(argc, argv);\n"
+        "  return 1;\n", writer->output_file);
+
+  /* Functions called but never defined stop the program */
+  qsort(writer->defined, writer->defined_count, sizeof(char *), c_name_compare);
+  qsort(writer->called, writer->called_count, sizeof(char *), c_name_compare);
+
+  for (i = 0; i < writer->called_count; i++)
+  {
+    if ((i > 0 && strcmp(writer->called[i], writer->called[i - 1]) == 0) ||
+        bsearch(&writer->called[i], writer->defined, writer->defined_count,
+                sizeof(char *), c_name_compare))
+      continue;
+
+    fputs("\nF_", writer->output_file);
+    write_c_name(writer, writer->called[i]);
+    fprintf(writer->output_file, ":\n  fprintf(stderr, \"%s is not defined\\n\");\n"
+                                 "  return 1;\n", writer->called[i]);
+  }
+
+  /* Returns go to the call saved in their frame */
+  fputs(writer->returns ? "\ndispatch:\n" : "\n", writer->output_file);
+  fputs("  switch (ret)\n  {\n", writer->output_file);
+  fprintf(writer->output_file, "    case %u: goto returned;\n", BOOTSTRAP_RETURN_ADDRESS);
+
+  for (i = BOOTSTRAP_RETURN_ADDRESS + 1; i < writer->return_count; i++)
+    fprintf(writer->output_file, "    case %zu: goto R%zu;\n", i, i);
+
+  fputs("    default:\n"
+        "      fprintf(stderr, \"Return to invalid address %u\\n\", ret);\n"
+        "      return 1;\n"
+        "  }\n"
+        "\nreturned:\n"
+        "  puts(\"c: Sys.init returned\");\n"
+        "  print_ram(argc, argv);\n"
+        "  return 0;\n", writer->output_file);
+
+  if (writer->halts)
+    fputs("\nhalted:\n"
+          "  puts(\"c: halted\");\n"
+          "  print_ram(argc, argv);\n"
+          "  return 0;\n", writer->output_file);
+
+  fputs("}\n", writer->output_file);
+
+  for (i = 0; i < writer->called_count; i++)
+  {
+    if (!add_function_reference(writer, writer->called[i]))
+      writer->failed = true;
+  }
+
+  qsort(writer->referenced, writer->referenced_count, sizeof(char *), c_name_compare);
+
+  success = !writer->failed && !ferror(writer->output_file) &&
+            copy_referenced_labels(writer);
+
+  fclose(writer->output_file);
+
+  if (fclose(writer->target_file) != 0)
+    success = false;
+
+  for (i = 0; i < writer->defined_count; i++)
+    free(writer->defined[i]);
+
+  for (i = 0; i < writer->called_count; i++)
+    free(writer->called[i]);
+
+  for (i = 0; i < writer->referenced_count; i++)
+    free(writer->referenced[i]);
+
+  free(writer->defined);
+  free(writer->called);
+  free(writer->referenced);
+  free(writer->statics);
+  free(writer);
+
+  return success ? CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+void write_c_name(CWriter *writer, const char *name)
+{
+  for (; *name; name++)
+  {
+    if (isalnum((unsigned char)*name))
+      fputc(*name, writer->output_file);
+    else
+      fprintf(writer->output_file, "_%02X", (unsigned char)*name);
+  }
+}
+
+size_t copy_c_name(char *dest, const char *name)
+{
+  size_t length = 0;
+
+  for (; *name; name++)
+  {
+    if (isalnum((unsigned char)*name))
+    {
+      if (dest)
+        dest[length] = *name;
+
+      length++;
+    }
+    else
+    {
+      if (dest)
+        sprintf(dest + length, "_%02X", (unsigned char)*name);
+
+      length += 3;
+    }
+  }
+
+  return length;
+}
+
+char *c_label_name(const CWriter *writer, const char *label)
+{
+  char *name = NULL;
+  size_t length;
+
+  length = 2 + copy_c_name(NULL, writer->input_file) +
+           2 + copy_c_name(NULL, writer->current_function) +
+           2 + copy_c_name(NULL, label);
+
+  name = (char *)malloc(length + 1);
+
+  if (!name)
+    return NULL;
+
+  memcpy(name, "L_", 2);
+  length = 2 + copy_c_name(name + 2, writer->input_file);
+  memcpy(name + length, "__", 2);
+  length += 2 + copy_c_name(name + length + 2, writer->current_function);
+  memcpy(name + length, "__", 2);
+  length += 2 + copy_c_name(name + length + 2, label);
+  name[length] = '\0';
+
+  return name;
+}
+
+void write_c_label(CWriter *writer, const char *label)
+{
+  char *name = c_label_name(writer, label);
+
+  if (!name)
+  {
+    writer->failed = true;
+    return;
+  }
+
+  fputs(name, writer->output_file);
+  free(name);
+}
+
+bool write_c_jump(CWriter *writer, const char *statement, const char *label)
+{
+  char *name = c_label_name(writer, label);
+  bool success;
+
+  if (!name)
+    return false;
+
+  fprintf(writer->output_file, "  %s %s;\n", statement, name);
+
+  /* The list keeps a copy, as for the other names */
+  success = c_name_list_add(&writer->referenced, &writer->referenced_count,
+                            &writer->referenced_capacity, name);
+  free(name);
+
+  return success;
+}
+
+bool copy_referenced_labels(CWriter *writer)
+{
+  char line[C_LINE_CHUNK_LENGTH];
+  bool line_start = true;
+  size_t length;
+
+  if (fflush(writer->output_file) != 0 || fseek(writer->output_file, 0, SEEK_SET) != 0)
+    return false;
+
+  while (fgets(line, sizeof(line), writer->output_file))
+  {
+    length = strlen(line);
+
+    if (!line_start || !c_label_is_unreferenced(writer, line))
+      fputs(line, writer->target_file);
+
+    line_start = length > 0 && line[length - 1] == '\n';
+  }
+
+  return !ferror(writer->output_file) && !ferror(writer->target_file);
+}
+
+bool c_label_is_unreferenced(const CWriter *writer, char *line)
+{
+  const char *name = line;
+  char *end = NULL;
+  bool found;
+
+  /* Label definitions are the only lines that start with a label,
+   * F_<function>: or L_<file>__<function>__<label>:; */
+  if (strncmp(line, "F_", 2) != 0 && strncmp(line, "L_", 2) != 0)
+    return false;
+
+  end = strchr(line, ':');
+
+  if (!end)
+    return false;
+
+  *end = '\0';
+
+  found = bsearch(&name, writer->referenced, writer->referenced_count,
+                  sizeof(char *), c_name_compare) != NULL;
+
+  *end = ':';
+
+  return !found;
+}
+
+bool add_function_reference(CWriter *writer, const char *function_name)
+{
+  char *name = NULL;
+  bool success;
+
+  name = (char *)malloc(2 + copy_c_name(NULL, function_name) + 1);
+
+  if (!name)
+    return false;
+
+  memcpy(name, "F_", 2);
+  name[2 + copy_c_name(name + 2, function_name)] = '\0';
+
+  success = c_name_list_add(&writer->referenced, &writer->referenced_count,
+                            &writer->referenced_capacity, name);
+  free(name);
+
+  return success;
+}
+
+void write_c_call(CWriter *writer, const char *function_name,
+                  unsigned int n_args, unsigned int return_address)
+{
+  fprintf(writer->output_file,
+          "  PUSH(%u); PUSH(LCL); PUSH(ARG); PUSH(THIS); PUSH(THAT);\n"
+          "  ARG = SP - %u; LCL = SP;\n"
+          "  goto F_", return_address, n_args + 5);
+  write_c_name(writer, function_name);
+  fputs(";\n", writer->output_file);
+}
+
+bool c_name_list_add(char ***names, size_t *count, size_t *capacity,
+                     const char *name)
+{
+  char **new_names = NULL;
+  size_t new_capacity;
+
+  if (*count == *capacity)
+  {
+    new_capacity = *capacity ? *capacity * 2 : C_WRITER_INITIAL_CAPACITY;
+    new_names = (char **)realloc(*names, new_capacity * sizeof(char *));
+
+    if (!new_names)
+      return false;
+
+    *names = new_names;
+    *capacity = new_capacity;
+  }
+
+  (*names)[*count] = (char *)malloc(strlen(name) + 1);
+
+  if (!(*names)[*count])
+    return false;
+
+  strcpy((*names)[*count], name);
+  (*count)++;
+
+  return true;
+}
+
+int c_name_compare(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
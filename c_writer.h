@@ -0,0 +1,67 @@
+/* c_writer.h: Translates parsed VM commands into a portable C program
+ *             with the RAM layout of the Hack translation
+ */
+#ifndef C_WRITER_H
+#define C_WRITER_H
+
+#include <stddef.h>
+#include "translator_common.h"
+#include "code_writer.h"
+
+/* Writes one C function, main, whose RAM is a uint16_t array. VM
+ * functions are blocks of main entered with goto, calls build the
+ * frame of code_writer_write_call in RAM and returns go back through
+ * a switch on the saved return address. Statics get RAM addresses
+ * from 16 on in order of first use, as the assembler gives them.
+ * The program prints how it stopped and the RAM ranges given as
+ * <first>-<last> arguments in the format of --ram. Only the labels
+ * something jumps to are written, so it compiles cleanly with -Wall */
+typedef struct CWriter CWriter;
+
+/* Opens an output file and writes the bootstrap code into it:
+ * SP = 256, call Sys.init
+ *
+ * Returns the writer, or NULL if the file could not be created
+ */
+CWriter *c_writer_init(const char *output_filename);
+
+/* Informs the translation of a new VM file */
+CodeWriterStatus c_writer_set_filename(CWriter *writer, const char *input_filename);
+
+/* Writes the C code of an arithmetic-logical command */
+CodeWriterStatus c_writer_write_arithmetic(CWriter *writer,
+                                           ArithmeticLogicalCommand cmd);
+
+/* Writes the C code of a push or pop command */
+CodeWriterStatus c_writer_write_push_pop(CWriter *writer, CommandType cmd,
+                                         MemorySegment segment,
+                                         int segment_index);
+
+/* Writes the C code of a function command */
+CodeWriterStatus c_writer_write_function(CWriter *writer,
+                                         const char *function_name,
+                                         unsigned int n_vars);
+
+/* Writes the C code of a call command */
+CodeWriterStatus c_writer_write_call(CWriter *writer,
+                                     const char *function_name,
+                                     unsigned int n_args);
+
+/* Writes the C code of a return command */
+CodeWriterStatus c_writer_write_return(CWriter *writer);
+
+/* Writes the C code of a label, goto or if-goto command. A goto to
+ * the label right before it is the halt loop, which ends the program */
+CodeWriterStatus c_writer_write_label(CWriter *writer, const char *label);
+CodeWriterStatus c_writer_write_goto(CWriter *writer, const char *label);
+CodeWriterStatus c_writer_write_if(CWriter *writer, const char *label);
+
+/* Writes the return dispatch, a block for every function called but
+ * not defined, which stops the program, and the end of main, then
+ * writes the program into the output file and closes it
+ *
+ * Returns CODE_WRITER_SUCC if the whole file could be written
+ */
+CodeWriterStatus c_writer_close(CWriter *writer);
+
+#endif
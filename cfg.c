@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "translator_common.h"
+#include "vm_program.h"
+#include "hash_table.h"
+#include "cfg.h"
+
+/* Internal Functions */
+
+/* Checks if a command is the last one of its block */
+bool command_ends_block(const VmCommand *command);
+
+/* Checks if a command of the function body starts a block */
+bool command_starts_block(const VmFile *file, size_t function, size_t command);
+
+/* Adds an edge to the successors of a block, once */
+void cfg_add_successor(CfgBlock *block, size_t successor);
+
+/* Propagates the stack depth from the entry block along the edges,
+ * using worklist to hold up to block_count blocks */
+void cfg_compute_depths(Cfg *cfg, size_t *worklist);
+
+/* End Internal Functions */
+
+/* Builds the control-flow graph of a function
+ *
+ * Returns the graph, or NULL if it could not be allocated
+ */
+Cfg *cfg_build(const VmFile *file, size_t function, size_t end)
+{
+  Cfg *cfg = NULL;
+  CfgBlock *block = NULL;
+  const VmCommand *last = NULL;
+  HashTable *labels = NULL;
+  size_t *label_blocks = NULL;
+  size_t *worklist = NULL;
+  size_t block_count = 0;
+  size_t label_count = 0;
+  size_t arena_size;
+  size_t b, i, k, label, target;
+
+  assert(file);
+  assert(function < end && end <= file->command_count);
+
+  for (i = function + 1; i < end; i++)
+  {
+    if (command_starts_block(file, function, i))
+      block_count++;
+
+    if (file->commands[i].type == C_LABEL)
+      label_count++;
+  }
+
+  /* An empty body still has its entry block */
+  if (block_count == 0)
+    block_count = 1;
+
+  cfg = (Cfg *)malloc(sizeof(Cfg));
+
+  if (!cfg)
+    return NULL;
+
+  /* Blocks, then predecessors and worklist, then the block of each
+   * label, at the index the label table gives it */
+  arena_size = block_count * sizeof(CfgBlock) +
+               (CFG_MAX_SUCCESSORS + 1) * block_count * sizeof(size_t) +
+               label_count * sizeof(size_t);
+
+  cfg->arena = malloc(arena_size);
+  labels = hash_table_init();
+
+  if (!cfg->arena || !labels)
+  {
+    hash_table_fini(labels);
+    free(cfg->arena);
+    free(cfg);
+    return NULL;
+  }
+
+  cfg->file = file;
+  cfg->function = function;
+  cfg->end = end;
+  cfg->blocks = (CfgBlock *)cfg->arena;
+  cfg->block_count = block_count;
+  cfg->predecessors = (size_t *)(cfg->blocks + block_count);
+  worklist = cfg->predecessors + CFG_MAX_SUCCESSORS * block_count;
+  label_blocks = worklist + block_count;
+  cfg->depth_consistent = true;
+  cfg->depth_min = 0;
+  cfg->depth_max = 0;
+
+  /* Split the body into blocks */
+  b = 0;
+  cfg->blocks[0].begin = function + 1;
+
+  for (i = function + 1; i < end; i++)
+  {
+    if (i > function + 1 && command_starts_block(file, function, i))
+    {
+      cfg->blocks[b].end = i;
+      cfg->blocks[++b].begin = i;
+    }
+
+    if (file->commands[i].type == C_LABEL)
+    {
+      label = hash_table_count(labels);
+      target = hash_table_add_string(labels, file->commands[i].arg1);
+
+      if (target == HASH_TABLE_NOT_FOUND)
+      {
+        hash_table_fini(labels);
+        cfg_fini(cfg);
+        return NULL;
+      }
+
+      /* The first definition of a duplicated label wins */
+      if (target == label)
+        label_blocks[label] = b;
+    }
+  }
+
+  cfg->blocks[b].end = end;
+
+  for (b = 0; b < block_count; b++)
+  {
+    block = &cfg->blocks[b];
+    block->successor_count = 0;
+    block->successors[0] = CFG_NO_BLOCK;
+    block->successors[1] = CFG_NO_BLOCK;
+    block->jump = CFG_NO_BLOCK;
+    block->predecessor_first = 0;
+    block->predecessor_count = 0;
+    block->depth_in = 0;
+    block->depth_out = 0;
+    block->depth_min = 0;
+    block->depth_max = 0;
+    block->depth_known = false;
+    block->reachable = false;
+  }
+
+  /* Successors: the jump target and the next block when the last
+   * command can fall through. Jumps to labels the function does not
+   * define are left for the assembler to report */
+  for (b = 0; b < block_count; b++)
+  {
+    block = &cfg->blocks[b];
+    last = block->end > block->begin ? &file->commands[block->end - 1] : NULL;
+
+    if (last && (last->type == C_GOTO || last->type == C_IF))
+    {
+      label = hash_table_find_string(labels, last->arg1);
+      target = label == HASH_TABLE_NOT_FOUND ? CFG_NO_BLOCK : label_blocks[label];
+      block->jump = target;
+
+      if (target != CFG_NO_BLOCK)
+        cfg_add_successor(block, target);
+    }
+
+    if ((!last || (last->type != C_GOTO && last->type != C_RETURN)) &&
+        b + 1 < block_count)
+      cfg_add_successor(block, b + 1);
+  }
+
+  hash_table_fini(labels);
+
+  /* Predecessors, grouped by block */
+  for (b = 0; b < block_count; b++)
+  {
+    for (k = 0; k < cfg->blocks[b].successor_count; k++)
+      cfg->blocks[cfg->blocks[b].successors[k]].predecessor_count++;
+  }
+
+  for (b = 1; b < block_count; b++)
+  {
+    cfg->blocks[b].predecessor_first = cfg->blocks[b - 1].predecessor_first +
+                                       cfg->blocks[b - 1].predecessor_count;
+  }
+
+  for (b = 0; b < block_count; b++)
+    cfg->blocks[b].predecessor_count = 0;
+
+  for (b = 0; b < block_count; b++)
+  {
+    for (k = 0; k < cfg->blocks[b].successor_count; k++)
+    {
+      block = &cfg->blocks[cfg->blocks[b].successors[k]];
+      cfg->predecessors[block->predecessor_first + block->predecessor_count++] = b;
+    }
+  }
+
+  cfg_compute_depths(cfg, worklist);
+
+  return cfg;
+}
+
+/* Finds the block a command belongs to */
+size_t cfg_block_of(const Cfg *cfg, size_t command)
+{
+  size_t low = 0;
+  size_t high;
+  size_t middle;
+
+  assert(cfg);
+
+  if (command <= cfg->function || command >= cfg->end)
+    return CFG_NO_BLOCK;
+
+  high = cfg->block_count;
+
+  /* Last block that begins at or before the command */
+  while (high - low > 1)
+  {
+    middle = low + (high - low) / 2;
+
+    if (cfg->blocks[middle].begin <= command)
+      low = middle;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+/* Frees the graph */
+void cfg_fini(Cfg *cfg)
+{
+  if (!cfg) return;
+
+  free(cfg->arena);
+  free(cfg);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+bool command_ends_block(const VmCommand *command)
+{
+  return command->type == C_GOTO || command->type == C_IF ||
+         command->type == C_CALL || command->type == C_RETURN;
+}
+
+bool command_starts_block(const VmFile *file, size_t function, size_t command)
+{
+  return command == function + 1 ||
+         file->commands[command].type == C_LABEL ||
+         command_ends_block(&file->commands[command - 1]);
+}
+
+void cfg_add_successor(CfgBlock *block, size_t successor)
+{
+  if (block->successor_count > 0 && block->successors[0] == successor)
+    return;
+
+  block->successors[block->successor_count++] = successor;
+}
+
+void cfg_compute_depths(Cfg *cfg, size_t *worklist)
+{
+  CfgBlock *block = NULL;
+  CfgBlock *successor = NULL;
+  size_t worklist_count = 0;
+  size_t i, k;
+  int depth;
+
+  /* Every block enters the worklist once, when its depth is found */
+  cfg->blocks[0].depth_known = true;
+  cfg->blocks[0].reachable = true;
+  worklist[worklist_count++] = 0;
+
+  while (worklist_count > 0)
+  {
+    block = &cfg->blocks[worklist[--worklist_count]];
+    depth = block->depth_in;
+    block->depth_min = depth;
+    block->depth_max = depth;
+
+    for (i = block->begin; i < block->end; i++)
+    {
+      depth += vm_command_stack_effect(&cfg->file->commands[i]);
+
+      if (depth < block->depth_min)
+        block->depth_min = depth;
+      else if (depth > block->depth_max)
+        block->depth_max = depth;
+    }
+
+    block->depth_out = depth;
+
+    if (block->depth_min < cfg->depth_min)
+      cfg->depth_min = block->depth_min;
+
+    if (block->depth_max > cfg->depth_max)
+      cfg->depth_max = block->depth_max;
+
+    for (k = 0; k < block->successor_count; k++)
+    {
+      successor = &cfg->blocks[block->successors[k]];
+
+      if (!successor->depth_known)
+      {
+        successor->depth_in = depth;
+        successor->depth_known = true;
+        successor->reachable = true;
+        worklist[worklist_count++] = block->successors[k];
+      }
+      else if (successor->depth_in != depth)
+        cfg->depth_consistent = false;
+    }
+  }
+}
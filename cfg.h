@@ -0,0 +1,80 @@
+/* cfg.h: Control-flow graph of the basic blocks of a VM function,
+ *        with the working stack depth at each block
+ */
+#ifndef CFG_H
+#define CFG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "vm_program.h"
+
+/* Marks an unused successor */
+#define CFG_NO_BLOCK ((size_t)-1)
+
+/* A block ends with at most a jump and a fall through */
+#define CFG_MAX_SUCCESSORS 2
+
+/* Commands that run one after the other, entered only at the first
+ * and left only after the last one */
+typedef struct CfgBlock
+{
+  /* Commands of the block, from begin to one before end */
+  size_t begin;
+  size_t end;
+  size_t successors[CFG_MAX_SUCCESSORS];
+  size_t successor_count;
+  /* Block the last command jumps to, or CFG_NO_BLOCK */
+  size_t jump;
+  /* Predecessors are cfg->predecessors[predecessor_first] onwards */
+  size_t predecessor_first;
+  size_t predecessor_count;
+  /* Working stack depth at the block entry and exit and its lowest
+   * and highest value inside the block, counted from the function
+   * entry. Valid only if depth_known */
+  int    depth_in;
+  int    depth_out;
+  int    depth_min;
+  int    depth_max;
+  bool   depth_known;
+  /* Whether the block can run after the function entry */
+  bool   reachable;
+} CfgBlock;
+
+/* Basic blocks of a function, the first one is its entry */
+typedef struct Cfg
+{
+  const VmFile *file;
+  /* Index of the function command and one past its last command */
+  size_t       function;
+  size_t       end;
+  CfgBlock     *blocks;
+  size_t       block_count;
+  size_t       *predecessors;
+  /* False if two paths reach a block with different stack depths */
+  bool         depth_consistent;
+  /* Lowest and highest stack depth of the reachable blocks */
+  int          depth_min;
+  int          depth_max;
+  /* Single allocation holding the blocks, edges and label table */
+  void         *arena;
+} Cfg;
+
+/* Builds the control-flow graph of the function whose command is at
+ * function in file and that spans until end, in time linear in the
+ * number of commands
+ *
+ * Returns the graph, or NULL if it could not be allocated
+ */
+Cfg *cfg_build(const VmFile *file, size_t function, size_t end);
+
+/* Finds the block a command belongs to
+ *
+ * Returns its index, or CFG_NO_BLOCK if the command is outside
+ * the function body
+ */
+size_t cfg_block_of(const Cfg *cfg, size_t command);
+
+/* Frees the graph */
+void cfg_fini(Cfg *cfg);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stddef.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -80,6 +81,104 @@ static const MemorySegmentEntry
   { MEMORY_SEGMENT_TEMP, "temp" },
 };
 
+typedef enum IntrinsicType
+{
+  INTRINSIC_PEEK,
+  INTRINSIC_POKE,
+  INTRINSIC_ABS
+} IntrinsicType;
+
+/* Jack OS functions translated inline, with their number of arguments */
+typedef struct IntrinsicEntry
+{
+  IntrinsicType type;
+  const char    *function_name;
+  unsigned int  n_args;
+} IntrinsicEntry;
+
+#define INTRINSIC_TABLE_SIZE 3
+
+static const IntrinsicEntry
+  intrinsic_table[INTRINSIC_TABLE_SIZE] =
+{
+  { INTRINSIC_PEEK, "Memory.peek", 1 },
+  { INTRINSIC_POKE, "Memory.poke", 2 },
+  { INTRINSIC_ABS, "Math.abs", 1 },
+};
+
+/* Values the Hack ALU computes without loading the A register */
+typedef struct AluConstantEntry
+{
+  int        value;
+  const char *computation;
+} AluConstantEntry;
+
+#define ALU_CONSTANT_TABLE_SIZE 3
+
+static const AluConstantEntry
+  alu_constant_table[ALU_CONSTANT_TABLE_SIZE] =
+{
+  { 0, "0" },
+  { 1, "1" },
+  { -1, "-1" },
+};
+
+/* Instructions executed by each way of moving to RAM[base + offset]
+ * of the argument, local, this and that segments:
+ * load: @offset, D=A, @SEGMENT, A=D+M
+ * walk: @SEGMENT, A=M, followed by one A=A+1 per word of offset */
+#define SEGMENT_ADDRESS_LOAD_COST 4
+#define SEGMENT_ADDRESS_WALK_COST 2
+/* A loaded address that must outlive the data register is parked
+ * in R13 and read back: @R13, M=D, ..., @R13, A=M */
+#define SEGMENT_ADDRESS_PARK_COST 4
+
+/* Functions with more local variables than this zero them with a loop
+ * (15 words, 6 cycles per variable) instead of unrolled stores
+ * (2 words and 2 cycles per variable) */
+#define BULK_LOCALS_UNROLL_LIMIT 16
+
+/* Words saved below LCL by each calling convention */
+#define FULL_FRAME_WORDS 5
+#define NO_POINTERS_FRAME_WORDS 3
+
+/* Label of the loop a failed stack guard jumps to */
+#define STACK_OVERFLOW_LABEL "STACK_OVERFLOW"
+
+/* Routines that cold calls, returns and comparisons jump to, written
+ * once at the end of the program. A comparison routine label is
+ * followed by the command, such as SHARED_COMPARISON.eq. With the top
+ * of stack cached, the comparison routines take y in R13 and leave
+ * the result in the data register instead of on the stack */
+#define SHARED_CALL_LABEL "SHARED_CALL"
+#define SHARED_RETURN_LABEL "SHARED_RETURN"
+#define SHARED_COMPARISON_LABEL "SHARED_COMPARISON"
+
+typedef enum SharedRoutine
+{
+  SHARED_ROUTINE_CALL,
+  SHARED_ROUTINE_RETURN,
+  /* In the order of the comparison command types */
+  SHARED_ROUTINE_EQ,
+  SHARED_ROUTINE_GT,
+  SHARED_ROUTINE_LT
+} SharedRoutine;
+
+#define SHARED_ROUTINE_COUNT 5
+
+/* Tail calls with up to this many arguments move each one with
+ * A=A-1/A=A+1 walks (n + 5 instructions per argument), more arguments
+ * are moved through pointers in R13 and R14 (10 instructions each) */
+#define TAIL_CALL_WALK_LIMIT 5
+
+/* Largest distance between RAM[SP] and the logical stack pointer
+ * before the stack pointer is committed. Stack slots are addressed
+ * with an A=A+1 chain, so the cost of each access grows with it */
+#define MAX_SP_OFFSET 3
+
+/* Longest line of assembly, comments and labels included */
+#define ASM_BUFFER_SIZE 1024
+
 #define CURRENT_FUNCTION_STR_MAX_LENGTH 256
 #define INPUT_FILENAME_MAX_LENGTH 256
 /* Encapsulates the logic to translate and write a parsed VM command
@@ -87,27 +186,154 @@ static const MemorySegmentEntry
 struct CodeWriter
 {
   FILE *output_file;
+  /* Receives the assembly instead of the output file, or NULL */
+  Assembler *assembler;
+  /* Hack instructions written so far, labels and comments excluded */
+  unsigned long instruction_count;
   bool input_file_set;
   char input_file[INPUT_FILENAME_MAX_LENGTH + 1];
   char current_function[CURRENT_FUNCTION_STR_MAX_LENGTH + 1];
   unsigned int boolean_op_count;
   unsigned int fn_call_count;
+  unsigned int intrinsic_count;
+  unsigned int options;
+  /* Top of the VM stack is held in the data register instead of RAM */
+  bool tos_in_d;
+  /* The stack pointer in RAM lags behind the stack in RAM by this amount */
+  int sp_offset;
+  /* Top of the VM stack is the result of a comparison that has not been
+   * materialized, the data register holds x - y */
+  bool comparison_pending;
+  ArithmeticLogicalCommandType pending_comparison;
+  bool pending_comparison_negated;
+  /* Calling conventions of the program functions, sorted by name */
+  const FunctionConvention *conventions;
+  size_t convention_count;
+  /* Calling convention of the function being translated */
+  CallConvention current_convention;
+  /* Static frame of the function being translated, or NULL,
+   * and its number of locals */
+  const FunctionConvention *static_frame;
+  unsigned int static_frame_locals;
+  /* Whether a stack guard jumps to the overflow loop */
+  bool stack_guard_written;
+  /* Receives an entry for each command, or NULL. The entry of the
+   * command last set is added at its first instruction, with the
+   * names of the file and function being written */
+  SourceMap *source_map;
+  bool source_pending;
+  unsigned int source_line;
+  CommandType source_type;
+  const char *source_operation;
+  int source_file;
+  int source_function;
+  /* Executions of the commands, or NULL. Commands that are not hot in
+   * it jump to shared routines instead of being written inline */
+  const Profile *profile;
+  /* Bit masks of the shared routines, 1 << SharedRoutine, that cold
+   * commands jump to, and of those cold commands may jump to, all of
+   * them until code_writer_plan_shared_routines */
+  unsigned int shared_routines_written;
+  unsigned int shared_routines_planned;
+  /* Instructions the jumps to each routine saved over the inline code */
+  long shared_routine_savings[SHARED_ROUTINE_COUNT];
 };
 
 /* Internal Functions */
 
+/* Lines of assembly, written by the functions below */
+typedef enum AsmLineType
+{
+  ASM_LINE_COMMENT,
+  ASM_LINE_LABEL,
+  ASM_LINE_A_SYMBOL,
+  ASM_LINE_C_INSTRUCTION
+} AsmLineType;
+
+/* Each of the following writes a line of assembly, formatted as
+ * printf does: a comment without its slashes, a label without its
+ * parentheses, an A instruction with a number or a symbol and a C
+ * instruction dest=comp;jump. The line goes as text to the output
+ * file and, encoded, to the assembler. Instructions are counted even
+ * when the writer has neither.
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_comment(CodeWriter *writer, const char *format, ...);
+bool write_label(CodeWriter *writer, const char *format, ...);
+bool write_a_value(CodeWriter *writer, int value);
+bool write_a_symbol(CodeWriter *writer, const char *format, ...);
+bool write_c_instruction(CodeWriter *writer, const char *format, ...);
+
+/* Writes a line of the given type for the functions above */
+bool write_asm_line(CodeWriter *writer, AsmLineType type,
+                    const char *format, va_list args);
+
+/* Counts an instruction, the first of the pending command if any
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_count_instruction(CodeWriter *writer);
+
+/* Adds the pending command to the source map at the next instruction
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_source_map_entry(CodeWriter *writer);
+
+/* Creates a writer into an open output file or an assembler, either
+ * may be NULL, and writes the bootstrap code
+ *
+ * Returns the writer, or NULL if it could not be allocated
+ */
+CodeWriter *code_writer_create(FILE *output_file, Assembler *assembler,
+                               unsigned int options);
+
 /* Generates an assembly instruction that moves to the address stored in
  * a segment pointer */
 bool write_follow_segment_pointer(CodeWriter *writer,
                                   MemorySegmentType segment_type,
                                   unsigned int offset);
   
+/* Generates an assembly instruction that moves to RAM[base + offset]
+ * where base is the address stored in base_pointer, walking from the
+ * base when it is cheaper than loading the offset
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_segment_offset_address(CodeWriter *writer,
+                                  const char *base_pointer,
+                                  unsigned int offset);
+
+/* Generates an assembly instruction that moves to RAM[base + offset]
+ * with an A=A+1 chain, leaving the data register intact
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_segment_walk_address(CodeWriter *writer,
+                                const char *base_pointer,
+                                unsigned int offset);
+
+/* Generates an assembly instruction that pops the top of the VM stack
+ * into RAM[base + offset] where base is the address stored in
+ * base_pointer, without moving the value through temp registers
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_direct_pop_operation(CodeWriter *writer,
+                                const char *base_pointer,
+                                unsigned int offset);
+
 /* Generates an assembly instruction that pushes the value stored in
  * the segment + offset provided into the VM stack */
 bool write_push_operation(CodeWriter *writer,
                           MemorySegmentType segment_type,
                           unsigned int offset);
 
+/* Generates an assembly instruction that pushes a 16-bit constant,
+ * including the negative results of constant folding, into the VM stack */
+bool write_push_constant_operation(CodeWriter *writer, int value);
+
 /* Generates an assembly instruction that pop a value from the
  * VM stack into the address stored at segment + offset
  */
@@ -115,6 +341,193 @@ bool write_pop_operation(CodeWriter *writer,
                          MemorySegmentType segment_type,
                          unsigned int offset);
                         
+/* Stores the result of an ALU computation (D, or a constant from the
+ * ALU constant table) in the next free slot of the VM stack in RAM
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_push_computation(CodeWriter *writer, const char *computation);
+
+/* Returns the ALU computation that produces value, or NULL if the
+ * value must be loaded through the A register */
+const char *alu_constant(int value);
+
+/* Checks if walking to RAM[base + offset] costs no more
+ * than the alternative_cost of reaching it otherwise */
+bool segment_walk_is_cheaper(unsigned int offset, unsigned int alternative_cost);
+
+/* Generates an assembly instruction that pushes n_vars zeros into
+ * the VM stack, updating the stack pointer once
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_bulk_locals_operation(CodeWriter *writer, unsigned int n_vars);
+
+/* Generates an assembly instruction that copies count words from the
+ * address in R13 to the address in R14, advancing both pointers
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_copy_words(CodeWriter *writer, unsigned int count);
+
+/* Generates an assembly instruction that moves the n_args words on top
+ * of the VM stack to ARG[0..n_args - 1]
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_move_arguments(CodeWriter *writer, unsigned int n_args);
+
+/* Returns the calling convention of a function */
+CallConvention function_convention(const CodeWriter *writer,
+                                   const char *function_name);
+
+/* Finds the calling convention entry of a function
+ *
+ * Returns the entry, or NULL if the function uses the full frame
+ * because it is not listed
+ */
+const FunctionConvention *function_convention_entry(const CodeWriter *writer,
+                                                    const char *function_name);
+
+/* Returns the static frame word holding argument or local offset of
+ * the function being translated, or -1 if it is not in a static frame */
+int static_frame_word(const CodeWriter *writer,
+                      MemorySegmentType segment_type,
+                      unsigned int offset);
+
+/* Generates a check that the stack has room for stack_words more
+ * words, jumping to the overflow loop otherwise */
+bool write_stack_guard(CodeWriter *writer, int stack_words);
+
+/* Generates the entry of a function with a static frame: saves the
+ * stack pointer and the pointers the function changes and zeroes
+ * the locals
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_static_frame_entry(CodeWriter *writer, unsigned int n_vars);
+
+/* Generates a call to a function with a static frame: the arguments
+ * are popped into the frame together with the return address
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_static_frame_call(CodeWriter *writer,
+                             const FunctionConvention *callee,
+                             unsigned int n_args);
+
+/* Generates the return of a function with a static frame
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_static_frame_return(CodeWriter *writer);
+
+/* Returns the number of words saved below LCL by a calling convention */
+unsigned int convention_frame_words(CallConvention convention);
+
+/* Finds the type of a memory segment name
+ *
+ * Returns true if the segment is valid and false otherwise
+ */
+bool memory_segment_lookup(MemorySegment segment, MemorySegmentType *segment_type);
+
+/* Returns the register holding the base address of the argument,
+ * local, this or that segment, or NULL for the other segments */
+const char *segment_base_pointer(MemorySegmentType segment_type);
+
+/* Loads a constant into the data register
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_load_constant(CodeWriter *writer, int value);
+
+/* Loads the value of a segment word or constant into the data register
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_load_operand(CodeWriter *writer,
+                        MemorySegmentType segment_type,
+                        int index);
+
+/* Checks if write_direct_operand_address can reach an operand
+ * without the data register and in no more instructions than
+ * loading its address */
+bool operand_is_direct(const CodeWriter *writer,
+                       MemorySegmentType segment_type,
+                       int index);
+
+/* Generates instructions that leave the value of a direct operand in
+ * the memory register, or in the address register for constants,
+ * without modifying the data register
+ *
+ * Returns the register holding the value
+ */
+const char *write_direct_operand_address(CodeWriter *writer,
+                                         MemorySegmentType segment_type,
+                                         int index);
+
+/* Generates x = x + c or x = x - c in place, operation being add or sub
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_increment_idiom(CodeWriter *writer,
+                           MemorySegmentType segment_type, int index,
+                           int constant, bool subtract);
+
+/* Generates a read of RAM[base + index] through THAT
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_array_read_idiom(CodeWriter *writer, const Idiom *idiom,
+                            const MemorySegmentType *segment_types);
+
+/* Makes the address in the data register the new THAT, unless
+ * that_dead is set, and replaces it with the word it points to as
+ * the new top of the VM stack
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_array_load(CodeWriter *writer, bool that_dead);
+
+/* Generates a store of the top of the VM stack at the address below
+ * it, setting temp 0 and THAT as the VM commands do
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_array_write_idiom(CodeWriter *writer, const Idiom *idiom);
+
+/* Generates a store of a segment word or constant at the address on
+ * top of the VM stack, setting temp 0 and THAT as the VM commands do
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_array_store_idiom(CodeWriter *writer, const Idiom *idiom,
+                             MemorySegmentType segment_type);
+
+/* Finds the intrinsic of a call when intrinsics are enabled
+ *
+ * Returns the table entry, or NULL if the call is translated as such
+ */
+const IntrinsicEntry *intrinsic_lookup(const CodeWriter *writer,
+                                       const char *function_name,
+                                       unsigned int n_args);
+
+/* Generates the inline code of an intrinsic, which takes its
+ * arguments from the VM stack and leaves its result there
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_intrinsic(CodeWriter *writer, const IntrinsicEntry *intrinsic);
+
+/* Generates the product of x by constant, a power of two, with
+ * additions. x is the given segment word, or the top of the VM stack
+ * when segment_type is NULL
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_multiply_idiom(CodeWriter *writer, int constant,
+                          const MemorySegmentType *segment_type, int index);
+
 /* Generates an assembly instruction to push the value stored in
  * the data register to the top of the stack.
  *
@@ -129,6 +542,53 @@ bool write_push_to_stack_operation(CodeWriter *writer);
  */
 bool write_pop_from_stack_operation(CodeWriter *writer);
 
+/* Makes the value stored in the data register the new top of the VM stack.
+ * When the top of stack is cached, the value stays in the data register
+ * and no instruction is generated.
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_push_top_operation(CodeWriter *writer);
+
+/* Moves the top of the VM stack into the data register, reusing
+ * the cached value when there is one
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_pop_top_operation(CodeWriter *writer);
+
+/* Stores a top of stack value cached in the data register into the
+ * VM stack. Must be called before the data register is overwritten.
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_spill_top_operation(CodeWriter *writer);
+
+/* Brings the VM stack in RAM and the stack pointer up to date.
+ * Must be called at every basic block boundary.
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_flush_stack_operation(CodeWriter *writer);
+
+/* Generates an assembly instruction that moves to the stack slot at
+ * RAM[SP] + slot without modifying the data register */
+bool write_stack_slot_address(CodeWriter *writer, int slot);
+
+/* Generates an assembly instruction that removes the top value of the
+ * VM stack in RAM and moves to its address
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_pop_stack_address(CodeWriter *writer);
+
+/* Adds the pending stack offset to the stack pointer in RAM
+ * without modifying the data register
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_commit_stack_pointer(CodeWriter *writer);
+
 /* Generates an assembly instruction for an arithmetic or
  * bitwise eperation between the data register and the memory
  * register, and copies it into a buffer
@@ -141,12 +601,76 @@ char *write_arithmetic_bitwise_operation(char *output_instruction,
                                          ArithmeticLogicalCommandType operation);
 
 /* Generates an assembly instruction for a boolean operation
- * between the data register and the memory register.
+ * on the difference x - y stored in the data register,
+ * or for its negation if negated is set.
  *
  * Returns true if succesful and false otherwise
  */
  bool write_boolean_operation(CodeWriter *writer,
-                              ArithmeticLogicalCommandType operation);
+                              ArithmeticLogicalCommandType operation,
+                              bool negated);
+
+/* Returns the jump mnemonic that is taken when the comparison
+ * operation holds for the difference x - y, or when it does not
+ * hold if negated is set */
+const char *comparison_jump(ArithmeticLogicalCommandType operation,
+                            bool negated);
+
+/* Returns whether the profile shows that the command about to be
+ * written runs rarely or never */
+bool command_is_cold(const CodeWriter *writer);
+
+/* Checks if cold commands may jump to a shared routine */
+bool shared_routine_planned(const CodeWriter *writer, SharedRoutine routine);
+
+/* Returns the shared routine of a comparison */
+SharedRoutine shared_comparison_routine(ArithmeticLogicalCommandType operation);
+
+/* Returns the number of instructions of the inline code of the command
+ * that jumps to a shared routine, a call to function_name with n_args
+ * arguments for the call routine, or 0 if it could not be counted */
+unsigned long inline_command_words(const CodeWriter *writer, SharedRoutine routine,
+                                   const char *function_name, unsigned int n_args);
+
+/* The following write a command by a jump to its shared routine, and
+ * add the instructions saved over the inline code to the savings of
+ * the routine.
+ *
+ * Return true if successful and false otherwise
+ */
+
+/* Generates the assembly code of a comparison of the two values on top
+ * of the stack */
+bool write_shared_comparison(CodeWriter *writer,
+                             ArithmeticLogicalCommandType operation);
+
+/* Generates the assembly code of a call to a function with the full
+ * frame */
+bool write_shared_call(CodeWriter *writer, const char *function_name,
+                       unsigned int n_args);
+
+/* Generates the assembly code of a return from a function with the
+ * full frame */
+bool write_shared_return(CodeWriter *writer);
+
+/* Generates the shared routines that the program jumps to
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_shared_routines(CodeWriter *writer);
+
+/* Generates one shared routine
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_shared_routine(CodeWriter *writer, SharedRoutine routine);
+
+/* Converts a pending comparison into its boolean value
+ * in the data register
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_materialize_comparison(CodeWriter *writer);
 
 /* Generates an assembly instruction to store the current value in the data
  * register in one of the temp registers
@@ -158,44 +682,147 @@ bool write_in_temp_register(CodeWriter *writer, unsigned int offset);
 /* End Internal Functions */
 
 /* Opens an output file and gets ready to write into it */
-CodeWriter *code_writer_init(const char *output_filename)
+CodeWriter *code_writer_init(const char *output_filename, unsigned int options)
 {
   CodeWriter *new_writer = NULL;
   FILE *new_file = NULL;
 
-  if (!output_filename) return NULL;
+  /* Without an output file the writer only counts instructions */
+  if (output_filename)
+  {
+    new_file = fopen(output_filename, "w");
 
-  new_file = fopen(output_filename, "w");
+    if (!new_file) return NULL;
+  }
 
-  if (!new_file) return NULL;
+  new_writer = code_writer_create(new_file, NULL, options);
 
-  new_writer = (CodeWriter *)malloc(sizeof(CodeWriter));
+  if (!new_writer && new_file)
+    fclose(new_file);
 
-  if (!new_writer) return NULL;
+  return new_writer;
+}
 
-  new_writer->output_file = new_file;
+/* Gets ready to write into an assembler, and an output file if any */
+CodeWriter *code_writer_init_assembler(Assembler *assembler,
+                                       const char *output_filename,
+                                       unsigned int options)
+{
+  CodeWriter *new_writer = NULL;
+  FILE *new_file = NULL;
 
-  strcpy(new_writer->input_file, "");
-  strncpy(new_writer->current_function, "", sizeof(new_writer->current_function));
-  new_writer->boolean_op_count = 0;
-  new_writer->fn_call_count = 0;
-  new_writer->input_file_set = false;
+  assert(assembler);
 
-  /* Set boostrap code
-   * SP = 256
-   * call Sys.init */
+  if (output_filename)
+  {
+    new_file = fopen(output_filename, "w");
 
-  fprintf(new_writer->output_file, "// BOOTSTRAP CODE\n");
-  fprintf(new_writer->output_file, "// SP=256\n@256\nD=A\n@SP\nM=D\n");
+    if (!new_file) return NULL;
+  }
 
-  code_writer_write_call(new_writer, "Sys.init", 0);
+  new_writer = code_writer_create(new_file, assembler, options);
 
-  // Enter infinite loop
-  //fprintf(new_writer->output_file, "// BOOTSTRAP INIFNITE LOOP\n@$ret0\n0;JMP\n");
+  if (!new_writer && new_file)
+    fclose(new_file);
 
   return new_writer;
 }
 
+/* Creates a writer that only counts instructions, continuing
+ * from the state of another writer */
+CodeWriter *code_writer_fork_counter(const CodeWriter *writer)
+{
+  CodeWriter *new_writer = NULL;
+
+  assert(writer);
+
+  new_writer = (CodeWriter *)malloc(sizeof(CodeWriter));
+
+  if (!new_writer)
+    return NULL;
+
+  *new_writer = *writer;
+  new_writer->output_file = NULL;
+  new_writer->assembler = NULL;
+  new_writer->instruction_count = 0;
+  new_writer->source_map = NULL;
+  new_writer->source_pending = false;
+
+  return new_writer;
+}
+
+/* Sets the calling convention of the functions in conventions */
+void code_writer_set_conventions(CodeWriter *writer,
+                                 const FunctionConvention *conventions,
+                                 size_t count)
+{
+  assert(writer);
+
+  writer->conventions = conventions;
+  writer->convention_count = conventions ? count : 0;
+}
+
+/* Adds an entry for each command written from now on to a source map */
+void code_writer_set_source_map(CodeWriter *writer, SourceMap *source_map)
+{
+  assert(writer);
+
+  writer->source_map = source_map;
+  writer->source_pending = false;
+
+  if (source_map)
+  {
+    writer->source_file = source_map_add_name(source_map, writer->input_file);
+    writer->source_function = source_map_add_name(source_map, writer->current_function);
+  }
+}
+
+/* Sets the VM line and type of the command about to be written */
+void code_writer_set_source_line(CodeWriter *writer, unsigned int line,
+                                 CommandType type, const char *operation)
+{
+  assert(writer);
+
+  /* The line also selects the entry of the command in the profile */
+  writer->source_pending = writer->source_map != NULL;
+  writer->source_line = line;
+  writer->source_type = type;
+  writer->source_operation = operation;
+}
+
+/* Writes the commands that are not hot in a profile compactly */
+void code_writer_set_profile(CodeWriter *writer, const Profile *profile)
+{
+  assert(writer);
+
+  writer->profile = profile;
+}
+
+/* Keeps inline the cold commands whose routine costs more than it saves */
+void code_writer_plan_shared_routines(CodeWriter *writer, const CodeWriter *planner)
+{
+  CodeWriter *counter = NULL;
+  long routine_words;
+  int routine;
+
+  assert(writer);
+  assert(planner);
+
+  for (routine = 0; routine < SHARED_ROUTINE_COUNT; routine++)
+  {
+    counter = code_writer_fork_counter(writer);
+    routine_words = -1;
+
+    if (counter && write_shared_routine(counter, (SharedRoutine)routine))
+      routine_words = (long)code_writer_instruction_count(counter);
+
+    code_writer_close(counter);
+
+    if (routine_words < 0 || planner->shared_routine_savings[routine] <= routine_words)
+      writer->shared_routines_planned &= ~(1u << routine);
+  }
+}
+
 /* Informs the translation of a new VM file */
 CodeWriterStatus code_writer_set_filename(CodeWriter *writer, const char *input_filename)
 {
@@ -205,10 +832,14 @@ CodeWriterStatus code_writer_set_filename(CodeWriter *writer, const char *input_
 
   assert(writer);
 
-  /* Reset writer file metadata */
+  /* Code of the previous file may fall through into this one */
+  write_flush_stack_operation(writer);
+
+  /* Reset writer file metadata.
+   * The boolean count is kept, since BOOLEAN_* labels are not
+   * prefixed by the file name and must be unique in the program */
   strcpy(writer->input_file, "");
   strcpy(writer->current_function, "");
-  writer->boolean_op_count = 0;
   writer->fn_call_count = 0;
   writer->input_file_set = false;
 
@@ -251,8 +882,14 @@ CodeWriterStatus code_writer_set_filename(CodeWriter *writer, const char *input_
 
   writer->input_file_set = true;
 
+  if (writer->source_map)
+  {
+    writer->source_file = source_map_add_name(writer->source_map, writer->input_file);
+    writer->source_function = source_map_add_name(writer->source_map, "");
+  }
+
   /* Set file start comment */
-  fprintf(writer->output_file, "// Translation %s\n", writer->input_file);
+  write_comment(writer, "Translation %s", writer->input_file);
 
   return CODE_WRITER_SUCC;
 
@@ -290,25 +927,68 @@ CodeWriterStatus code_writer_write_arithmetic(CodeWriter* writer,
     return CODE_WRITER_INVALID_ARITHMETIC_CMD;
 
   /* write instruction comment */
-  fprintf(writer->output_file, "// %s\n",
-                              arithmetic_logical_cmd_table[command_type].command);
+  write_comment(writer, "%s", arithmetic_logical_cmd_table[command_type].command);
+
+  /* Negating a pending comparison only flips its jump condition */
+  if (command_type == ARITHMETIC_LOGICAL_NOT && writer->comparison_pending)
+  {
+    writer->pending_comparison_negated = !writer->pending_comparison_negated;
+    return CODE_WRITER_SUCC;
+  }
+
+  /* A fused comparison is already compact, other cold ones are shared
+   * when their routine pays off */
+  if ((command_type == ARITHMETIC_LOGICAL_EQ || command_type == ARITHMETIC_LOGICAL_GT ||
+       command_type == ARITHMETIC_LOGICAL_LT) &&
+      !(writer->options & CODE_WRITER_OPT_FUSE_BRANCHES) &&
+      shared_routine_planned(writer, shared_comparison_routine(command_type)) &&
+      command_is_cold(writer))
+    return write_shared_comparison(writer, command_type) ?
+           CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
   
   /* Pop first operand from stack */
-  write_pop_from_stack_operation(writer);
+  write_pop_top_operation(writer);
 
   /* Perform computation */
   switch (command_type)
   {
     case ARITHMETIC_LOGICAL_NEG:
       /* Compute negation */
-      fprintf(writer->output_file, "D=-D\n");
+      write_c_instruction(writer, "D=-D");
       break;
     case ARITHMETIC_LOGICAL_NOT:
       /* Compute logical not */
-      fprintf(writer->output_file, "D=!D\n");
+      write_c_instruction(writer, "D=!D");
       break;
     /* Rest of operations */
     default:
+      if (writer->options & (CODE_WRITER_OPT_TOS_CACHE | CODE_WRITER_OPT_DEFER_SP))
+      {
+        /* Operate directly on the second operand in the stack,
+         * the data register holds y and the memory register holds x */
+        write_pop_stack_address(writer);
+
+        switch (command_type)
+        {
+          case ARITHMETIC_LOGICAL_ADD:
+            write_c_instruction(writer, "D=D+M");
+            break;
+          case ARITHMETIC_LOGICAL_SUB:
+            write_c_instruction(writer, "D=M-D");
+            break;
+          case ARITHMETIC_LOGICAL_AND:
+            write_c_instruction(writer, "D=D&M");
+            break;
+          case ARITHMETIC_LOGICAL_OR:
+            write_c_instruction(writer, "D=D|M");
+            break;
+          default:
+            write_c_instruction(writer, "D=M-D");
+            break;
+        }
+        break;
+      }
+
       /* Store first operand in temp register R13 */
       write_in_temp_register(writer, 0);
 
@@ -323,32 +1003,52 @@ CodeWriterStatus code_writer_write_arithmetic(CodeWriter* writer,
       {
         /* Arithmetic and bitwise operations (Supported natively) */
         case ARITHMETIC_LOGICAL_ADD:
-          fprintf(writer->output_file, "D=D+M\n");
+          write_c_instruction(writer, "D=D+M");
           break;
         case ARITHMETIC_LOGICAL_SUB:
-          fprintf(writer->output_file, "D=D-M\n");
+          write_c_instruction(writer, "D=D-M");
           break;
         case ARITHMETIC_LOGICAL_AND:
-          fprintf(writer->output_file, "D=D&M\n");
+          write_c_instruction(writer, "D=D&M");
           break;
         case ARITHMETIC_LOGICAL_OR:
-          fprintf(writer->output_file, "D=D|M\n");
+          write_c_instruction(writer, "D=D|M");
           break;
         /* Boolean operations (Require more processing )*/
         default:
-          write_boolean_operation(writer, command_type);
+          write_c_instruction(writer, "D=D-M");
           break;
       }
       break;
   }
 
-  /* Push computed value to stack */
-  write_push_to_stack_operation(writer);
-
-  return CODE_WRITER_SUCC;
-}
-
-/* Writes to the output file the assembly code that implements
+  switch (command_type)
+  {
+    case ARITHMETIC_LOGICAL_EQ:
+    case ARITHMETIC_LOGICAL_GT:
+    case ARITHMETIC_LOGICAL_LT:
+      /* Leave x - y in the data register until the consumer is known */
+      if (writer->options & CODE_WRITER_OPT_FUSE_BRANCHES)
+      {
+        writer->comparison_pending = true;
+        writer->pending_comparison = command_type;
+        writer->pending_comparison_negated = false;
+        return CODE_WRITER_SUCC;
+      }
+
+      write_boolean_operation(writer, command_type, false);
+      break;
+    default:
+      break;
+  }
+
+  /* Push computed value to stack */
+  write_push_top_operation(writer);
+
+  return CODE_WRITER_SUCC;
+}
+
+/* Writes to the output file the assembly code that implements
  * the given push or pop command */
 CodeWriterStatus code_writer_write_push_pop(CodeWriter *writer,
                                             CommandType cmd,
@@ -356,7 +1056,6 @@ CodeWriterStatus code_writer_write_push_pop(CodeWriter *writer,
                                             int segment_index)
 {
   MemorySegmentType segment_type;
-  int index;
 
   assert(writer);
 
@@ -369,30 +1068,24 @@ CodeWriterStatus code_writer_write_push_pop(CodeWriter *writer,
   else if (!segment) return CODE_WRITER_INVALID_PUSH_POP_SEGMENT;
 
   /* get type of segment type */
-  for (index = 0; index < MEMORY_SEGMENT_TABLE_SIZE; index++)
-  {
-    if (strlen(segment) == strlen(memory_segment_table[index].segment) &&
-        strcmp(segment, memory_segment_table[index].segment) == 0)
-    {
-      segment_type = memory_segment_table[index].type;
-      break;
-    }
-  }
-
-  if (index >= MEMORY_SEGMENT_TABLE_SIZE) return CODE_WRITER_INVALID_PUSH_POP_SEGMENT;
-  else if (segment_index < 0) return CODE_WRITER_INVALID_PUSH_POP_INDEX;
+  if (!memory_segment_lookup(segment, &segment_type))
+    return CODE_WRITER_INVALID_PUSH_POP_SEGMENT;
+  else if (segment_index < 0 &&
+           (segment_type != MEMORY_SEGMENT_CONSTANT || segment_index < VM_WORD_MIN))
+    return CODE_WRITER_INVALID_PUSH_POP_INDEX;
 
   /* write instruction comment */
-  fprintf(writer->output_file, "// %s %s %d\n",
-          cmd == C_PUSH ? "push" : "pop",
-          memory_segment_table[segment_type].segment,
-          segment_index);                         
+  write_comment(writer, "%s %s %d", cmd == C_PUSH ? "push" : "pop",
+                memory_segment_table[segment_type].segment, segment_index);
 
   switch (cmd)
   {
     case C_PUSH:
       /* write push operation */
-      write_push_operation(writer, segment_type, segment_index);
+      if (segment_type == MEMORY_SEGMENT_CONSTANT)
+        write_push_constant_operation(writer, segment_index);
+      else
+        write_push_operation(writer, segment_type, segment_index);
       break;
     case C_POP:
     default:
@@ -410,6 +1103,7 @@ CodeWriterStatus code_writer_write_function(CodeWriter *writer,
                                             unsigned int function_name_length,
                                             unsigned int n_vars)
 {
+  const FunctionConvention *convention = NULL;
   int i;
   assert(writer);
 
@@ -422,16 +1116,48 @@ CodeWriterStatus code_writer_write_function(CodeWriter *writer,
     return CODE_WRITER_FAIL_WRITE;
 
   /* Add instruction comment */
-  fprintf(writer->output_file, "// function %s %d\n", function_name, n_vars);
+  write_comment(writer, "function %s %d", function_name, n_vars);
+
+  /* Code above may fall through into the function label */
+  write_flush_stack_operation(writer);
 
   /* Copy current function name */
   strncpy(writer->current_function, function_name, function_name_length);
 
+  /* The flush above belongs to the previous function */
+  if (writer->source_map)
+  {
+    writer->source_function = source_map_add_name(writer->source_map,
+                                                   writer->current_function);
+    writer->source_pending = true;
+  }
+
+  convention = function_convention_entry(writer, function_name);
+  writer->current_convention = convention ? convention->convention : CALL_CONVENTION_FULL;
+  writer->static_frame = NULL;
+
   /* Create function label */
-  fprintf(writer->output_file, "(%s)\n", function_name);
+  write_label(writer, "%s", function_name);
+
+  if ((writer->options & CODE_WRITER_OPT_STACK_GUARD) &&
+      convention && convention->stack_words > 0)
+    write_stack_guard(writer, convention->stack_words);
+
+  if (writer->current_convention == CALL_CONVENTION_STATIC_FRAME)
+  {
+    writer->static_frame = convention;
+    writer->static_frame_locals = n_vars;
+
+    return write_static_frame_entry(writer, n_vars) ?
+           CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
+  }
+
+  if ((writer->options & CODE_WRITER_OPT_BULK_LOCALS) && n_vars > 0)
+    return write_bulk_locals_operation(writer, n_vars) ?
+           CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
 
   /* Initialize local variables to zero*/
-  fprintf(writer->output_file, "D=0\n");
+  write_c_instruction(writer, "D=0");
   for (i = 0; i < n_vars; i++)
   {
     write_push_to_stack_operation(writer);
@@ -446,63 +1172,120 @@ CodeWriterStatus code_writer_write_function(CodeWriter *writer,
                                          const char *function_name,
                                          unsigned int n_args)
 {
+  const IntrinsicEntry *intrinsic = NULL;
+  CallConvention convention;
+
   assert(writer);
 
   if (!function_name)
     return CODE_WRITER_FAIL_WRITE;
 
   /* Add instruction comment */
-  fprintf(writer->output_file, "// call %s %d\n", function_name, n_args);
+  write_comment(writer, "call %s %d", function_name, n_args);
+
+  intrinsic = intrinsic_lookup(writer, function_name, n_args);
+
+  if (intrinsic)
+    return write_intrinsic(writer, intrinsic) ?
+           CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
+
+  convention = function_convention(writer, function_name);
+
+  /* Arguments of a static frame are popped from the cached stack */
+  if (convention == CALL_CONVENTION_STATIC_FRAME)
+    return write_static_frame_call(writer,
+                                   function_convention_entry(writer, function_name),
+                                   n_args) ?
+           CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
+
+  /* Arguments must be in the stack before the frame is built */
+  write_flush_stack_operation(writer);
+
+  if (convention == CALL_CONVENTION_FULL &&
+      shared_routine_planned(writer, SHARED_ROUTINE_CALL) && command_is_cold(writer))
+    return write_shared_call(writer, function_name, n_args) ?
+           CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
+
+  /* Only the return address is pushed, the callee has no arguments
+   * and does not use LCL or ARG */
+  if (convention == CALL_CONVENTION_NO_FRAME)
+  {
+    write_a_symbol(writer, "%s$ret%d", writer->current_function,
+                   writer->fn_call_count);
+    write_c_instruction(writer, "D=A");
+
+    write_push_to_stack_operation(writer);
+
+    write_a_symbol(writer, "%s", function_name);
+    write_c_instruction(writer, "0;JMP");
+    write_label(writer, "%s$ret%d", writer->current_function, writer->fn_call_count);
+
+    writer->fn_call_count++;
+
+    return CODE_WRITER_SUCC;
+  }
 
   /* Save current stack location as callee ARG segment in temp register R13 */
-  fprintf(writer->output_file, "@SP\nD=M\n");
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "D=M");
 
   write_in_temp_register(writer, 0);
 
   /* Save return address and push it to stack */
-  fprintf(writer->output_file, "@%s$ret%d\nD=A\n",
-          writer->current_function, writer->fn_call_count);
+  write_a_symbol(writer, "%s$ret%d", writer->current_function, writer->fn_call_count);
+  write_c_instruction(writer, "D=A");
 
   write_push_to_stack_operation(writer);
 
   /* Save local segment and push it to stack */
-  fprintf(writer->output_file, "@LCL\nD=M\n");
+  write_a_symbol(writer, "LCL");
+  write_c_instruction(writer, "D=M");
 
   write_push_to_stack_operation(writer);
 
   /* Save arg segment and push it to stack */
-  fprintf(writer->output_file, "@ARG\nD=M\n");
+  write_a_symbol(writer, "ARG");
+  write_c_instruction(writer, "D=M");
 
   write_push_to_stack_operation(writer);
 
-  /* Save this segment and push it to stack */
-  fprintf(writer->output_file, "@THIS\nD=M\n");
+  if (convention == CALL_CONVENTION_FULL)
+  {
+    /* Save this segment and push it to stack */
+    write_a_symbol(writer, "THIS");
+    write_c_instruction(writer, "D=M");
 
-  write_push_to_stack_operation(writer);
+    write_push_to_stack_operation(writer);
 
-  /* Save this segment and push it to stack */
-  fprintf(writer->output_file, "@THAT\nD=M\n");
+    /* Save this segment and push it to stack */
+    write_a_symbol(writer, "THAT");
+    write_c_instruction(writer, "D=M");
 
-  write_push_to_stack_operation(writer);
+    write_push_to_stack_operation(writer);
+  }
 
   /* Set current stack position as the callee local segment */
-  fprintf(writer->output_file, "@SP\nD=M\n@LCL\nM=D\n");
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "D=M");
+  write_a_symbol(writer, "LCL");
+  write_c_instruction(writer, "M=D");
 
   /* Retrieve ARG location in temp register*/
   write_follow_segment_pointer(writer, MEMORY_SEGMENT_CONSTANT, 13);
-  fprintf(writer->output_file, "D=M\n");
+  write_c_instruction(writer, "D=M");
 
   /* Compute ARG = ARG - nArgs */
   write_follow_segment_pointer(writer, MEMORY_SEGMENT_CONSTANT, n_args);
-  fprintf(writer->output_file, "D=D-A\n@ARG\nM=D\n");
+  write_c_instruction(writer, "D=D-A");
+  write_a_symbol(writer, "ARG");
+  write_c_instruction(writer, "M=D");
 
   /* goto function */
-  fprintf(writer->output_file, "@%s\n0;JMP\n", function_name);
+  write_a_symbol(writer, "%s", function_name);
+  write_c_instruction(writer, "0;JMP");
 
   /* Create return label */
-  fprintf(writer->output_file, "(%s$ret%d)\n",
-          writer->current_function,
-          writer->fn_call_count);
+  write_label(writer, "%s$ret%d", writer->current_function, writer->fn_call_count);
   
   /* Increment call fount */
   writer->fn_call_count++;         
@@ -510,6 +1293,130 @@ CodeWriterStatus code_writer_write_function(CodeWriter *writer,
   return CODE_WRITER_SUCC;
 }
 
+/* Write to the output file the assembly code that effects a call
+ * immediately followed by a return */
+CodeWriterStatus code_writer_write_tail_call(CodeWriter *writer,
+                                             const char *function_name,
+                                             unsigned int n_args)
+{
+  CodeWriterStatus err;
+  unsigned int frame_words;
+  unsigned int k;
+  unsigned int i;
+
+  assert(writer);
+
+  /* The callee returns through the caller frame, so both must have
+   * the same frame layout */
+  if (!(writer->options & CODE_WRITER_OPT_TAIL_CALLS) ||
+      !function_name ||
+      intrinsic_lookup(writer, function_name, n_args) ||
+      writer->current_convention == CALL_CONVENTION_NO_FRAME ||
+      writer->current_convention == CALL_CONVENTION_STATIC_FRAME ||
+      function_convention(writer, function_name) != writer->current_convention)
+  {
+    err = code_writer_write_call(writer, function_name, n_args);
+
+    if (err != CODE_WRITER_SUCC)
+      return err;
+
+    return code_writer_write_return(writer);
+  }
+  else if (!writer->input_file_set)
+  {
+    fprintf(stderr, "code_writer: Input file is not set\n");
+    return CODE_WRITER_FAIL_WRITE;
+  }
+
+  frame_words = convention_frame_words(writer->current_convention);
+
+  /* Add instruction comment */
+  write_comment(writer, "call %s %d", function_name, n_args);
+  write_comment(writer, "return");
+
+  /* Arguments must be in RAM to be moved */
+  write_flush_stack_operation(writer);
+
+  /* When the arguments fit below the caller frame, that is
+   * n_args <= LCL - frame_words - ARG, the callee keeps the caller LCL, ARG and
+   * saved frame, and returns straight to the caller of the caller.
+   * A self call becomes a loop back to the function entry */
+  if (n_args > 0)
+  {
+    write_a_symbol(writer, "LCL");
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "ARG");
+    write_c_instruction(writer, "D=D-M");
+    write_a_value(writer, n_args + frame_words);
+    write_c_instruction(writer, "D=D-A");
+    write_a_symbol(writer, "%s$tail%d", writer->current_function,
+                   writer->fn_call_count);
+    write_c_instruction(writer, "D;JLT");
+
+    write_move_arguments(writer, n_args);
+  }
+
+  write_a_symbol(writer, "LCL");
+  write_c_instruction(writer, "D=M");
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "M=D");
+  write_a_symbol(writer, "%s", function_name);
+  write_c_instruction(writer, "0;JMP");
+
+  if (n_args == 0)
+    return CODE_WRITER_SUCC;
+
+  /* Otherwise build the callee frame right above the arguments:
+   * copy the saved frame over the stack top, then move the arguments
+   * and the frame down to ARG */
+  write_label(writer, "%s$tail%d", writer->current_function, writer->fn_call_count);
+
+  writer->fn_call_count++;
+
+  for (k = 0; k < frame_words; k++)
+  {
+    write_a_symbol(writer, "LCL");
+    write_c_instruction(writer, "A=M-1");
+
+    for (i = k + 1; i < frame_words; i++)
+      write_c_instruction(writer, "A=A-1");
+
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "SP");
+    write_c_instruction(writer, "A=M");
+
+    for (i = 0; i < k; i++)
+      write_c_instruction(writer, "A=A+1");
+
+    write_c_instruction(writer, "M=D");
+  }
+
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "D=M");
+  write_a_value(writer, n_args);
+  write_c_instruction(writer, "D=D-A");
+  write_a_symbol(writer, "R13");
+  write_c_instruction(writer, "M=D");
+  write_a_symbol(writer, "ARG");
+  write_c_instruction(writer, "D=M");
+  write_a_symbol(writer, "R14");
+  write_c_instruction(writer, "M=D");
+
+  write_copy_words(writer, n_args + frame_words);
+
+  /* R14 now points right after the frame */
+  write_a_symbol(writer, "R14");
+  write_c_instruction(writer, "D=M");
+  write_a_symbol(writer, "LCL");
+  write_c_instruction(writer, "M=D");
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "M=D");
+  write_a_symbol(writer, "%s", function_name);
+  write_c_instruction(writer, "0;JMP");
+
+  return CODE_WRITER_SUCC;
+}
+
 /* Write to the output file the assembly code that setups a function
  * return command */
 CodeWriterStatus code_writer_write_return(CodeWriter *writer)
@@ -523,41 +1430,128 @@ CodeWriterStatus code_writer_write_return(CodeWriter *writer)
   }
 
   /* Add instruction comment */
-  fprintf(writer->output_file, "// return\n");
+  write_comment(writer, "return");
+
+  if (writer->comparison_pending)
+  {
+    write_materialize_comparison(writer);
+    write_push_top_operation(writer);
+  }
+
+  if (writer->current_convention == CALL_CONVENTION_STATIC_FRAME)
+  {
+    return write_static_frame_return(writer) ?
+           CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
+  }
+  else if (writer->current_convention == CALL_CONVENTION_NO_FRAME)
+  {
+    /* The return value replaces the return address below it */
+    write_pop_top_operation(writer);
+    write_commit_stack_pointer(writer);
+
+    write_in_temp_register(writer, 0);
+    write_a_symbol(writer, "SP");
+    write_c_instruction(writer, "A=M-1");
+    write_c_instruction(writer, "D=M");
+    write_in_temp_register(writer, 1);
+    write_a_symbol(writer, "R13");
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "SP");
+    write_c_instruction(writer, "A=M-1");
+    write_c_instruction(writer, "M=D");
+    write_a_symbol(writer, "R14");
+    write_c_instruction(writer, "A=M");
+    write_c_instruction(writer, "0;JMP");
+
+    return CODE_WRITER_SUCC;
+  }
+  else if (writer->current_convention == CALL_CONVENTION_FULL &&
+           shared_routine_planned(writer, SHARED_ROUTINE_RETURN) &&
+           command_is_cold(writer))
+  {
+    return write_shared_return(writer) ?
+           CODE_WRITER_SUCC : CODE_WRITER_FAIL_WRITE;
+  }
+
+  /* Keep a cached return value in R15 while the frame is read */
+  if (writer->tos_in_d)
+  {
+    write_in_temp_register(writer, 2);
+  }
 
   /* Get local segment address */
-  fprintf(writer->output_file, "@LCL\nD=M\n");
+  write_a_symbol(writer, "LCL");
+  write_c_instruction(writer, "D=M");
 
   /* Store local segment in temp register R13 */
   write_in_temp_register(writer, 0);
 
   /* Store return address in temp register R14 */
-  fprintf(writer->output_file, "@5\nA=D-A\nD=M\n");
+  write_a_value(writer, convention_frame_words(writer->current_convention));
+  write_c_instruction(writer, "A=D-A");
+  write_c_instruction(writer, "D=M");
 
   write_in_temp_register(writer, 1);
 
   /* Set return value in ARG[0] */
-  write_pop_from_stack_operation(writer);
+  if (writer->tos_in_d)
+  {
+    write_a_symbol(writer, "R15");
+    write_c_instruction(writer, "D=M");
+    writer->tos_in_d = false;
+  }
+  else
+  {
+    write_pop_top_operation(writer);
+  }
 
-  fprintf(writer->output_file, "@ARG\nA=M\nM=D\n");
+  /* SP is recomputed from ARG below */
+  writer->sp_offset = 0;
 
-  /* Reposition caller working stack at ARG + 1*/
-  fprintf(writer->output_file, "D=A+1\n@SP\nM=D\n");
+  write_a_symbol(writer, "ARG");
+  write_c_instruction(writer, "A=M");
+  write_c_instruction(writer, "M=D");
 
-  /* Restore caller THAT segment */
-  fprintf(writer->output_file, "@R13\nAM=M-1\nD=M\n@THAT\nM=D\n");
+  /* Reposition caller working stack at ARG + 1*/
+  write_c_instruction(writer, "D=A+1");
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "M=D");
 
-  /* Restore caller THIS segment */
-  fprintf(writer->output_file, "@R13\nAM=M-1\nD=M\n@THIS\nM=D\n");
+  if (writer->current_convention == CALL_CONVENTION_FULL)
+  {
+    /* Restore caller THAT segment */
+    write_a_symbol(writer, "R13");
+    write_c_instruction(writer, "AM=M-1");
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "THAT");
+    write_c_instruction(writer, "M=D");
+
+    /* Restore caller THIS segment */
+    write_a_symbol(writer, "R13");
+    write_c_instruction(writer, "AM=M-1");
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "THIS");
+    write_c_instruction(writer, "M=D");
+  }
 
   /* Restore caller ARG segment */
-  fprintf(writer->output_file, "@R13\nAM=M-1\nD=M\n@ARG\nM=D\n");
+  write_a_symbol(writer, "R13");
+  write_c_instruction(writer, "AM=M-1");
+  write_c_instruction(writer, "D=M");
+  write_a_symbol(writer, "ARG");
+  write_c_instruction(writer, "M=D");
 
   /* Restore caller LCL segment */
-  fprintf(writer->output_file, "@R13\nAM=M-1\nD=M\n@LCL\nM=D\n");
+  write_a_symbol(writer, "R13");
+  write_c_instruction(writer, "AM=M-1");
+  write_c_instruction(writer, "D=M");
+  write_a_symbol(writer, "LCL");
+  write_c_instruction(writer, "M=D");
 
   /* Get return address and jump back */
-  fprintf(writer->output_file, "@R14\nA=M\n0;JMP\n");
+  write_a_symbol(writer, "R14");
+  write_c_instruction(writer, "A=M");
+  write_c_instruction(writer, "0;JMP");
 
   return CODE_WRITER_SUCC;
 }
@@ -577,12 +1571,13 @@ CodeWriterStatus code_writer_write_label(CodeWriter *writer,
     return CODE_WRITER_FAIL_WRITE;
 
   /* Add instruction comment */
-  fprintf(writer->output_file, "// label %s\n", label);
+  write_comment(writer, "label %s", label);
 
-  fprintf(writer->output_file, "(%s.%s$%s)\n",
-                               writer->input_file,
-                               writer->current_function,
-                               label);
+  /* Every jump to the label expects the whole stack in RAM */
+  write_flush_stack_operation(writer);
+
+  write_label(writer, "%s.%s$%s", writer->input_file, writer->current_function,
+              label);
   
   return CODE_WRITER_SUCC;
 }
@@ -603,12 +1598,13 @@ CodeWriterStatus code_writer_write_goto(CodeWriter *writer,
     return CODE_WRITER_FAIL_WRITE;
 
   /* Add instruction comment */
-  fprintf(writer->output_file, "// goto %s\n", label);
+  write_comment(writer, "goto %s", label);
+
+  write_flush_stack_operation(writer);
  
-  fprintf(writer->output_file, "@%s.%s$%s\n0;JMP\n",
-                               writer->input_file,
-                               writer->current_function,
-                               label);
+  write_a_symbol(writer, "%s.%s$%s", writer->input_file,
+                 writer->current_function, label);
+  write_c_instruction(writer, "0;JMP");
  
   return CODE_WRITER_SUCC;
 }
@@ -629,180 +1625,1436 @@ CodeWriterStatus code_writer_write_if(CodeWriter *writer,
     return CODE_WRITER_FAIL_WRITE;
 
   /* Add instruction comment */
-  fprintf(writer->output_file, "// if-goto %s\n", label);
+  write_comment(writer, "if-goto %s", label);
+
+  if (writer->options & CODE_WRITER_OPT_FUSE_BRANCHES)
+  {
+    ArithmeticLogicalCommandType comparison = ARITHMETIC_LOGICAL_EQ;
+    bool negated = true;
+
+    /* Branch on x - y of a pending comparison, or on value != 0 */
+    if (writer->comparison_pending)
+    {
+      comparison = writer->pending_comparison;
+      negated = writer->pending_comparison_negated;
+      writer->comparison_pending = false;
+    }
+    else
+    {
+      write_pop_top_operation(writer);
+    }
+
+    /* Stack must be up to date at the jump, this keeps the data register */
+    write_flush_stack_operation(writer);
+
+    write_a_symbol(writer, "%s.%s$%s", writer->input_file,
+                   writer->current_function, label);
+    write_c_instruction(writer, "D;%s", comparison_jump(comparison, negated));
+
+    return CODE_WRITER_SUCC;
+  }
 
   /* Pop top value in stack */
-  write_pop_from_stack_operation(writer);
+  write_pop_top_operation(writer);
+
+  /* Stack must be up to date at the jump */
+  write_flush_stack_operation(writer);
 
   /* Store top value in temp register R13 */
   write_in_temp_register(writer, 0);
 
   /* Store O in data register */
-  fprintf(writer->output_file, "D=0\n");
+  write_c_instruction(writer, "D=0");
 
   /* Compare if value == 0, to get true (-1) or false  (0)
    * False implies the value in the stack is not zero,
    * so we should jump to the label location */
-  write_boolean_operation(writer, ARITHMETIC_LOGICAL_EQ);
+  write_c_instruction(writer, "D=D-M");
+  write_boolean_operation(writer, ARITHMETIC_LOGICAL_EQ, false);
 
   /* Jump to label if the value is not zero */
-  fprintf(writer->output_file, "@%s.%s$%s\nD;JEQ\n",
-                               writer->input_file,
-                               writer->current_function,
-                               label);
+  write_a_symbol(writer, "%s.%s$%s", writer->input_file,
+                 writer->current_function, label);
+  write_c_instruction(writer, "D;JEQ");
   
   return CODE_WRITER_SUCC;
 }
 
-/* Closes the output file */
-void code_writer_close(CodeWriter *writer)
+/* Write to the output file the assembly code of a command sequence
+ * recognized as an idiom */
+CodeWriterStatus code_writer_write_idiom(CodeWriter *writer, const Idiom *idiom)
 {
-  if (!writer)
-    return;
-
-  fclose(writer->output_file);
-
-  free(writer);
-}
-
-/*
- * INTERNAL FUNCTIONS
- */
+  MemorySegmentType segment_types[IDIOM_MAX_OPERANDS];
+  const IdiomOperand *operand = NULL;
+  char comment[ASM_BUFFER_SIZE];
+  int length;
+  size_t i;
 
-bool write_push_operation(CodeWriter *writer,
-                          MemorySegmentType segment_type,
-                          unsigned int offset)
-{
   assert(writer);
+  assert(idiom);
 
-  /* Move to address stored in segment */
-  write_follow_segment_pointer(writer, segment_type, offset);
+  if (!writer->input_file_set)
+  {
+    fprintf(stderr, "code_writer: Input file is not set\n");
+    return CODE_WRITER_FAIL_WRITE;
+  }
 
-  switch (segment_type)
+  /* Operands are checked as their push and pop commands would be */
+  for (i = 0; i < idiom->operand_count; i++)
   {
-    /* Store segment value in data register */
-    case MEMORY_SEGMENT_CONSTANT:
-      fprintf(writer->output_file, "D=A\n");
-      break;
-    case MEMORY_SEGMENT_STATIC:
-    case MEMORY_SEGMENT_TEMP:
-    case MEMORY_SEGMENT_POINTER:
-    case MEMORY_SEGMENT_ARGUMENT:
-    case MEMORY_SEGMENT_LOCAL:
-    case MEMORY_SEGMENT_THIS:
-    case MEMORY_SEGMENT_THAT:
-      fprintf(writer->output_file, "D=M\n");
-      break;
-    default:
-      fprintf(stderr, "write_push_operation: Invalid segment %d\n", segment_type);
-      return false; 
+    operand = &idiom->operands[i];
+
+    if (!operand->segment || !memory_segment_lookup(operand->segment, &segment_types[i]))
+      return CODE_WRITER_INVALID_PUSH_POP_SEGMENT;
+    else if (operand->index < 0 &&
+             (segment_types[i] != MEMORY_SEGMENT_CONSTANT || operand->index < VM_WORD_MIN))
+      return CODE_WRITER_INVALID_PUSH_POP_INDEX;
   }
 
-  /* Push data register to stack */
-  return write_push_to_stack_operation(writer);
-}
+  /* write instruction comment */
+  length = snprintf(comment, sizeof(comment), "%s", idiom->name);
 
-bool write_follow_segment_pointer(CodeWriter *writer,
-                                  MemorySegmentType segment_type,
-                                  unsigned int offset)
-{
-  assert(writer);
-  switch (segment_type)
+  for (i = 0; i < idiom->operand_count && length > 0 && (size_t)length < sizeof(comment); i++)
+    length += snprintf(comment + length, sizeof(comment) - length, " %s %d",
+                       idiom->operands[i].segment, idiom->operands[i].index);
+
+  write_comment(writer, "%s", comment);
+
+  switch (idiom->kind)
   {
-    case MEMORY_SEGMENT_STATIC:
-      /* Move to variable label */
-      fprintf(writer->output_file, "@%s.%d\n", writer->input_file, offset);
-      break;
-    case MEMORY_SEGMENT_CONSTANT:
-      /* Move to address */
-      fprintf(writer->output_file, "@%d\n", offset);
-      break;
-    case MEMORY_SEGMENT_TEMP:
-      /* Base address of temp starts at R5 */
-      fprintf(writer->output_file, "@R%d\n", 5 + offset);
+    case IDIOM_INCREMENT:
+      if (segment_types[0] == MEMORY_SEGMENT_CONSTANT)
+        return CODE_WRITER_INVALID_PUSH_POP_SEGMENT;
+
+      write_increment_idiom(writer, segment_types[0], idiom->operands[0].index,
+                            idiom->operands[1].index,
+                            strcmp(idiom->operation, "sub") == 0);
       break;
-    case MEMORY_SEGMENT_POINTER:
-      /* Base address of temp starts at R3 */
-      fprintf(writer->output_file, "@R%d\n", 3 + offset);
+    case IDIOM_ARRAY_READ:
+      write_array_read_idiom(writer, idiom, segment_types);
       break;
-    /* For the rest of cases, store offset value in data register,
-     * get segment base address and store RAM[base + offset] in data register
-     */
-    case MEMORY_SEGMENT_ARGUMENT:
-      fprintf(writer->output_file, "@%d\nD=A\n@ARG\nA=D+M\n" , offset);
+    case IDIOM_ARRAY_LOAD:
+      write_pop_top_operation(writer);
+      write_array_load(writer, idiom->that_dead);
       break;
-    case MEMORY_SEGMENT_LOCAL:
-      fprintf(writer->output_file, "@%d\nD=A\n@LCL\nA=D+M\n", offset);
+    case IDIOM_ARRAY_STORE:
+      write_array_store_idiom(writer, idiom, segment_types[0]);
       break;
-    case MEMORY_SEGMENT_THIS:
-      fprintf(writer->output_file, "@%d\nD=A\n@THIS\nA=D+M\n", offset);
+    case IDIOM_ARRAY_WRITE:
+      write_array_write_idiom(writer, idiom);
       break;
-    case MEMORY_SEGMENT_THAT:
-      fprintf(writer->output_file, "@%d\nD=A\n@THAT\nA=D+M\n", offset);
+    case IDIOM_MULTIPLY:
+      write_multiply_idiom(writer, idiom->operands[0].index,
+                           idiom->operand_count > 1 ? &segment_types[1] : NULL,
+                           idiom->operands[1].index);
       break;
     default:
-      fprintf(stderr, "write_push_operation: Invalid segment %d\n", segment_type);
-      return false;
+      return CODE_WRITER_FAIL_WRITE;
   }
 
-  return true;
+  return CODE_WRITER_SUCC;
 }
 
-bool write_push_to_stack_operation(CodeWriter *writer)
+/* Closes the output file */
+void code_writer_close(CodeWriter *writer)
 {
-  assert(writer);
-  if (fprintf(writer->output_file, "@SP\nA=M\nM=D\n@SP\nM=M+1\n") < 0)
-    return false;
+  if (!writer)
+    return;
 
-  return true;
+  write_flush_stack_operation(writer);
+
+  /* Where a failed stack guard stops the program */
+  if (writer->stack_guard_written && writer->source_map)
+  {
+    writer->source_function = source_map_add_name(writer->source_map, "");
+    code_writer_set_source_line(writer, 0, C_LABEL, NULL);
+  }
+
+  if (writer->stack_guard_written)
+  {
+    write_comment(writer, "STACK OVERFLOW");
+    write_label(writer, "%s", STACK_OVERFLOW_LABEL);
+    write_a_symbol(writer, "%s", STACK_OVERFLOW_LABEL);
+    write_c_instruction(writer, "0;JMP");
+  }
+
+  write_shared_routines(writer);
+
+  if (writer->source_map)
+    source_map_set_size(writer->source_map, writer->instruction_count);
+
+  if (writer->output_file)
+    fclose(writer->output_file);
+
+  free(writer);
 }
 
-bool write_pop_operation(CodeWriter *writer,
-                         MemorySegmentType segment_type,
-                         unsigned int offset)
+/* Returns the number of Hack instructions written so far */
+unsigned long code_writer_instruction_count(const CodeWriter *writer)
 {
   assert(writer);
 
-  if (segment_type == MEMORY_SEGMENT_CONSTANT)
+  return writer->instruction_count;
+}
+
+/* Checks if CODE_WRITER_OPT_INTRINSICS translates a call inline */
+bool code_writer_is_intrinsic(const char *function_name, unsigned int n_args)
+{
+  int i;
+
+  assert(function_name);
+
+  for (i = 0; i < INTRINSIC_TABLE_SIZE; i++)
   {
-    fprintf(stderr, "write_pop_operation: segment CONSTANT is not valid for pop operation\n");
-    return false;
+    if (intrinsic_table[i].n_args == n_args &&
+        strcmp(intrinsic_table[i].function_name, function_name) == 0)
+      return true;
   }
 
-  /* Remove value from stack */
-  write_pop_from_stack_operation(writer);
+  return false;
+}
 
-  switch (segment_type) {
-    case MEMORY_SEGMENT_ARGUMENT:
-    case MEMORY_SEGMENT_LOCAL:
-    case MEMORY_SEGMENT_THIS:
-    case MEMORY_SEGMENT_THAT:
-      /* Store stack value in temp register R13 since data register will be used to calculate offset */
-      write_in_temp_register(writer, 0);
-      break;
-    default:
-      break;
-  
-  }
+/*
+ * INTERNAL FUNCTIONS
+ */
 
-  /* Move to address stored in segment */
-  write_follow_segment_pointer(writer, segment_type, offset);
+bool write_comment(CodeWriter *writer, const char *format, ...)
+{
+  va_list args;
+  bool success;
 
-  switch (segment_type) {
+  va_start(args, format);
+  success = write_asm_line(writer, ASM_LINE_COMMENT, format, args);
+  va_end(args);
+
+  return success;
+}
+
+bool write_label(CodeWriter *writer, const char *format, ...)
+{
+  va_list args;
+  bool success;
+
+  va_start(args, format);
+  success = write_asm_line(writer, ASM_LINE_LABEL, format, args);
+  va_end(args);
+
+  return success;
+}
+
+bool write_a_value(CodeWriter *writer, int value)
+{
+  assert(writer);
+
+  if (!write_count_instruction(writer))
+    return false;
+
+  if (writer->output_file && fprintf(writer->output_file, "@%d\n", value) < 0)
+    return false;
+
+  return !writer->assembler ||
+         assembler_add_value(writer->assembler, value) == ASSEMBLER_SUCC;
+}
+
+bool write_a_symbol(CodeWriter *writer, const char *format, ...)
+{
+  va_list args;
+  bool success;
+
+  va_start(args, format);
+  success = write_asm_line(writer, ASM_LINE_A_SYMBOL, format, args);
+  va_end(args);
+
+  return success;
+}
+
+bool write_c_instruction(CodeWriter *writer, const char *format, ...)
+{
+  va_list args;
+  bool success;
+
+  va_start(args, format);
+  success = write_asm_line(writer, ASM_LINE_C_INSTRUCTION, format, args);
+  va_end(args);
+
+  return success;
+}
+
+bool write_asm_line(CodeWriter *writer, AsmLineType type,
+                    const char *format, va_list args)
+{
+  char buffer[ASM_BUFFER_SIZE];
+  const char *line = format;
+  AssemblerStatus status = ASSEMBLER_SUCC;
+  unsigned short word;
+  int length;
+
+  assert(writer);
+  assert(format);
+
+  if (type != ASM_LINE_COMMENT && type != ASM_LINE_LABEL &&
+      !write_count_instruction(writer))
+    return false;
+
+  /* Nothing to format when the writer only counts instructions */
+  if (!writer->output_file && !writer->assembler)
+    return true;
+
+  if (strchr(format, '%'))
+  {
+    length = vsnprintf(buffer, sizeof(buffer), format, args);
+
+    if (length < 0 || (size_t)length >= sizeof(buffer))
+      return false;
+
+    line = buffer;
+  }
+
+  if (writer->output_file)
+  {
+    switch (type)
+    {
+      case ASM_LINE_COMMENT:
+        length = fprintf(writer->output_file, "// %s\n", line);
+        break;
+      case ASM_LINE_LABEL:
+        length = fprintf(writer->output_file, "(%s)\n", line);
+        break;
+      case ASM_LINE_A_SYMBOL:
+        length = fprintf(writer->output_file, "@%s\n", line);
+        break;
+      default:
+        length = fprintf(writer->output_file, "%s\n", line);
+        break;
+    }
+
+    if (length < 0)
+      return false;
+  }
+
+  if (!writer->assembler)
+    return true;
+
+  switch (type)
+  {
+    case ASM_LINE_LABEL:
+      status = assembler_add_label(writer->assembler, line);
+      break;
+    case ASM_LINE_A_SYMBOL:
+      status = assembler_add_symbol(writer->assembler, line);
+      break;
+    case ASM_LINE_C_INSTRUCTION:
+      status = assembler_encode_c_instruction(line, &word) ?
+               assembler_add_word(writer->assembler, word) :
+               ASSEMBLER_INVALID_INSTRUCTION;
+      break;
+    default:
+      break;
+  }
+
+  return status == ASSEMBLER_SUCC;
+}
+
+bool write_count_instruction(CodeWriter *writer)
+{
+  if (writer->source_pending && !write_source_map_entry(writer))
+    return false;
+
+  writer->instruction_count++;
+
+  return true;
+}
+
+bool write_source_map_entry(CodeWriter *writer)
+{
+  writer->source_pending = false;
+
+  if (writer->source_file < 0 || writer->source_function < 0)
+    return false;
+
+  return source_map_add(writer->source_map, writer->instruction_count,
+                        (unsigned int)writer->source_file,
+                        (unsigned int)writer->source_function,
+                        writer->source_line, writer->source_type,
+                        writer->source_operation);
+}
+
+CodeWriter *code_writer_create(FILE *output_file, Assembler *assembler,
+                               unsigned int options)
+{
+  CodeWriter *new_writer = NULL;
+  int i;
+
+  new_writer = (CodeWriter *)malloc(sizeof(CodeWriter));
+
+  if (!new_writer)
+    return NULL;
+
+  new_writer->output_file = output_file;
+  new_writer->assembler = assembler;
+  new_writer->instruction_count = 0;
+
+  strcpy(new_writer->input_file, "");
+  strncpy(new_writer->current_function, "", sizeof(new_writer->current_function));
+  new_writer->boolean_op_count = 0;
+  new_writer->fn_call_count = 0;
+  new_writer->intrinsic_count = 0;
+  new_writer->input_file_set = false;
+  new_writer->options = options;
+  new_writer->tos_in_d = false;
+  new_writer->sp_offset = 0;
+  new_writer->comparison_pending = false;
+  new_writer->conventions = NULL;
+  new_writer->convention_count = 0;
+  new_writer->current_convention = CALL_CONVENTION_FULL;
+  new_writer->static_frame = NULL;
+  new_writer->static_frame_locals = 0;
+  new_writer->stack_guard_written = false;
+  new_writer->source_map = NULL;
+  new_writer->source_pending = false;
+  new_writer->source_line = 0;
+  new_writer->source_type = C_ARITHMETIC;
+  new_writer->source_operation = NULL;
+  new_writer->source_file = -1;
+  new_writer->source_function = -1;
+  new_writer->profile = NULL;
+  new_writer->shared_routines_written = 0;
+  new_writer->shared_routines_planned = ~0u;
+
+  for (i = 0; i < SHARED_ROUTINE_COUNT; i++)
+    new_writer->shared_routine_savings[i] = 0;
+
+  /* Set boostrap code
+   * SP = 256
+   * call Sys.init */
+
+  write_comment(new_writer, "BOOTSTRAP CODE");
+  write_comment(new_writer, "SP=256");
+  write_a_value(new_writer, 256);
+  write_c_instruction(new_writer, "D=A");
+  write_a_symbol(new_writer, "SP");
+  write_c_instruction(new_writer, "M=D");
+
+  code_writer_write_call(new_writer, "Sys.init", 0);
+
+  // Enter infinite loop
+  //write_asm(new_writer, "// BOOTSTRAP INIFNITE LOOP\n@$ret0\n0;JMP\n");
+
+  return new_writer;
+}
+
+bool write_push_operation(CodeWriter *writer,
+                          MemorySegmentType segment_type,
+                          unsigned int offset)
+{
+  assert(writer);
+
+  /* The data register is about to be overwritten */
+  write_spill_top_operation(writer);
+
+  /* Move to address stored in segment */
+  write_follow_segment_pointer(writer, segment_type, offset);
+
+  switch (segment_type)
+  {
+    /* Store segment value in data register */
+    case MEMORY_SEGMENT_CONSTANT:
+      write_c_instruction(writer, "D=A");
+      break;
+    case MEMORY_SEGMENT_STATIC:
+    case MEMORY_SEGMENT_TEMP:
+    case MEMORY_SEGMENT_POINTER:
+    case MEMORY_SEGMENT_ARGUMENT:
+    case MEMORY_SEGMENT_LOCAL:
+    case MEMORY_SEGMENT_THIS:
+    case MEMORY_SEGMENT_THAT:
+      write_c_instruction(writer, "D=M");
+      break;
+    default:
+      fprintf(stderr, "write_push_operation: Invalid segment %d\n", segment_type);
+      return false; 
+  }
+
+  /* Push data register to stack */
+  return write_push_top_operation(writer);
+}
+
+bool write_push_constant_operation(CodeWriter *writer, int value)
+{
+  const char *computation = NULL;
+
+  assert(writer);
+
+  /* The data register is about to be overwritten */
+  write_spill_top_operation(writer);
+
+  if (writer->options & CODE_WRITER_OPT_SMALL_OPERANDS)
+    computation = alu_constant(value);
+
+  /* Store 0, 1 and -1 directly, unless the top of stack lives in D */
+  if (computation && !(writer->options & CODE_WRITER_OPT_TOS_CACHE))
+    return write_push_computation(writer, computation);
+  else if (computation)
+  {
+    write_c_instruction(writer, "D=%s", computation);
+    return write_push_top_operation(writer);
+  }
+
+  write_load_constant(writer, value);
+
+  return write_push_top_operation(writer);
+}
+
+bool write_load_constant(CodeWriter *writer, int value)
+{
+  assert(writer);
+
+  /* A instructions only load 15-bit values, negative constants
+   * are loaded through the ALU */
+  if (value >= 0)
+  {
+    write_a_value(writer, value);
+    write_c_instruction(writer, "D=A");
+  }
+  else if (value > VM_WORD_MIN)
+  {
+    write_a_value(writer, -value);
+    write_c_instruction(writer, "D=-A");
+  }
+  else
+  {
+    write_a_value(writer, VM_WORD_MAX);
+    write_c_instruction(writer, "D=!A");
+  }
+
+  return true;
+}
+
+bool write_load_operand(CodeWriter *writer,
+                        MemorySegmentType segment_type,
+                        int index)
+{
+  const char *computation = NULL;
+
+  assert(writer);
+
+  if (segment_type != MEMORY_SEGMENT_CONSTANT)
+  {
+    write_follow_segment_pointer(writer, segment_type, index);
+    return write_c_instruction(writer, "D=M");
+  }
+
+  if (writer->options & CODE_WRITER_OPT_SMALL_OPERANDS)
+    computation = alu_constant(index);
+
+  if (computation)
+    return write_c_instruction(writer, "D=%s", computation);
+
+  return write_load_constant(writer, index);
+}
+
+bool operand_is_direct(const CodeWriter *writer,
+                       MemorySegmentType segment_type,
+                       int index)
+{
+  assert(writer);
+
+  switch (segment_type)
+  {
+    case MEMORY_SEGMENT_CONSTANT:
+      return index >= 0;
+    case MEMORY_SEGMENT_STATIC:
+    case MEMORY_SEGMENT_TEMP:
+    case MEMORY_SEGMENT_POINTER:
+      return true;
+    case MEMORY_SEGMENT_ARGUMENT:
+    case MEMORY_SEGMENT_LOCAL:
+      if (writer->static_frame)
+        return true;
+      /* fall through */
+    default:
+      return segment_walk_is_cheaper(index, SEGMENT_ADDRESS_LOAD_COST +
+                                            SEGMENT_ADDRESS_PARK_COST);
+  }
+}
+
+const char *write_direct_operand_address(CodeWriter *writer,
+                                         MemorySegmentType segment_type,
+                                         int index)
+{
+  assert(writer);
+  assert(operand_is_direct(writer, segment_type, index));
+
+  switch (segment_type)
+  {
+    case MEMORY_SEGMENT_CONSTANT:
+      write_a_value(writer, index);
+      return "A";
+    case MEMORY_SEGMENT_ARGUMENT:
+    case MEMORY_SEGMENT_LOCAL:
+      if (writer->static_frame)
+        break;
+      /* fall through */
+    case MEMORY_SEGMENT_THIS:
+    case MEMORY_SEGMENT_THAT:
+      write_segment_walk_address(writer, segment_base_pointer(segment_type), index);
+      return "M";
+    default:
+      break;
+  }
+
+  write_follow_segment_pointer(writer, segment_type, index);
+
+  return "M";
+}
+
+bool write_increment_idiom(CodeWriter *writer,
+                           MemorySegmentType segment_type, int index,
+                           int constant, bool subtract)
+{
+  const char *step = NULL;
+
+  assert(writer);
+
+  /* x + 0 leaves x as it is */
+  if (constant == 0)
+    return true;
+
+  /* Steps of one keep the data register, and a cached top with it */
+  if (constant == 1 || constant == -1)
+    step = (constant == 1) != subtract ? "M=M+1" : "M=M-1";
+
+  if (step && operand_is_direct(writer, segment_type, index))
+  {
+    write_direct_operand_address(writer, segment_type, index);
+    return write_c_instruction(writer, "%s", step);
+  }
+
+  /* The data register is about to be overwritten */
+  write_spill_top_operation(writer);
+
+  if (step)
+  {
+    write_follow_segment_pointer(writer, segment_type, index);
+    return write_c_instruction(writer, "%s", step);
+  }
+
+  if (operand_is_direct(writer, segment_type, index))
+  {
+    write_load_operand(writer, MEMORY_SEGMENT_CONSTANT, constant);
+    write_direct_operand_address(writer, segment_type, index);
+  }
+  else
+  {
+    /* Park the address while the constant is loaded */
+    write_follow_segment_pointer(writer, segment_type, index);
+    write_c_instruction(writer, "D=A");
+    write_in_temp_register(writer, 0);
+    write_load_operand(writer, MEMORY_SEGMENT_CONSTANT, constant);
+    write_a_symbol(writer, "R13");
+    write_c_instruction(writer, "A=M");
+  }
+
+  return write_c_instruction(writer, subtract ? "M=M-D" : "M=D+M");
+}
+
+bool write_array_read_idiom(CodeWriter *writer, const Idiom *idiom,
+                            const MemorySegmentType *segment_types)
+{
+  const char *value = NULL;
+  size_t first = 0;
+  size_t second = 1;
+
+  assert(writer);
+  assert(idiom);
+
+  /* The data register is about to be overwritten */
+  write_spill_top_operation(writer);
+
+  /* The sum does not depend on the order, so the operand that can be
+   * reached without the data register goes second */
+  if (!operand_is_direct(writer, segment_types[1], idiom->operands[1].index) &&
+      operand_is_direct(writer, segment_types[0], idiom->operands[0].index))
+  {
+    first = 1;
+    second = 0;
+  }
+
+  write_load_operand(writer, segment_types[first], idiom->operands[first].index);
+
+  if (operand_is_direct(writer, segment_types[second], idiom->operands[second].index))
+  {
+    value = write_direct_operand_address(writer, segment_types[second],
+                                         idiom->operands[second].index);
+    write_c_instruction(writer, "D=D+%s", value);
+  }
+  else
+  {
+    write_in_temp_register(writer, 0);
+    write_load_operand(writer, segment_types[second], idiom->operands[second].index);
+    write_a_symbol(writer, "R13");
+    write_c_instruction(writer, "D=D+M");
+  }
+
+  return write_array_load(writer, idiom->that_dead);
+}
+
+bool write_array_load(CodeWriter *writer, bool that_dead)
+{
+  assert(writer);
+
+  if (!that_dead)
+  {
+    write_a_symbol(writer, "THAT");
+    write_c_instruction(writer, "M=D");
+  }
+
+  write_c_instruction(writer, "A=D");
+  write_c_instruction(writer, "D=M");
+
+  return write_push_top_operation(writer);
+}
+
+bool write_array_write_idiom(CodeWriter *writer, const Idiom *idiom)
+{
+  assert(writer);
+  assert(idiom);
+
+  /* Value in D, then the address below it in A */
+  write_pop_top_operation(writer);
+
+  if (!idiom->temp_dead)
+  {
+    write_a_symbol(writer, "R5");
+    write_c_instruction(writer, "M=D");
+  }
+
+  write_pop_stack_address(writer);
+  write_c_instruction(writer, "A=M");
+  write_c_instruction(writer, "M=D");
+
+  if (!idiom->that_dead)
+  {
+    write_c_instruction(writer, "D=A");
+    write_a_symbol(writer, "THAT");
+    write_c_instruction(writer, "M=D");
+  }
+
+  return true;
+}
+
+bool write_array_store_idiom(CodeWriter *writer, const Idiom *idiom,
+                             MemorySegmentType segment_type)
+{
+  assert(writer);
+  assert(idiom);
+
+  /* The value must be read before THAT changes */
+  if (segment_type == MEMORY_SEGMENT_POINTER || segment_type == MEMORY_SEGMENT_THAT)
+  {
+    write_spill_top_operation(writer);
+    write_load_operand(writer, segment_type, idiom->operands[0].index);
+    write_push_top_operation(writer);
+
+    return write_array_write_idiom(writer, idiom);
+  }
+
+  /* THAT holds the address while the value is loaded */
+  write_pop_top_operation(writer);
+  write_a_symbol(writer, "THAT");
+  write_c_instruction(writer, "M=D");
+
+  write_load_operand(writer, segment_type, idiom->operands[0].index);
+
+  if (!idiom->temp_dead)
+  {
+    write_a_symbol(writer, "R5");
+    write_c_instruction(writer, "M=D");
+  }
+
+  return write_a_symbol(writer, "THAT") &&
+         write_c_instruction(writer, "A=M") &&
+         write_c_instruction(writer, "M=D");
+}
+
+bool write_follow_segment_pointer(CodeWriter *writer,
+                                  MemorySegmentType segment_type,
+                                  unsigned int offset)
+{
+  assert(writer);
+  switch (segment_type)
+  {
+    case MEMORY_SEGMENT_STATIC:
+      /* Move to variable label */
+      write_a_symbol(writer, "%s.%d", writer->input_file, offset);
+      break;
+    case MEMORY_SEGMENT_CONSTANT:
+      /* Move to address */
+      write_a_value(writer, offset);
+      break;
+    case MEMORY_SEGMENT_TEMP:
+      /* Base address of temp starts at R5 */
+      write_a_symbol(writer, "R%d", TEMP_SEGMENT_BASE + offset);
+      break;
+    case MEMORY_SEGMENT_POINTER:
+      /* Base address of temp starts at R3 */
+      write_a_symbol(writer, "R%d", POINTER_SEGMENT_BASE + offset);
+      break;
+    /* For the rest of cases, store offset value in data register,
+     * get segment base address and store RAM[base + offset] in data register
+     */
+    case MEMORY_SEGMENT_ARGUMENT:
+    case MEMORY_SEGMENT_LOCAL:
+      if (writer->static_frame)
+      {
+        write_a_value(writer, static_frame_word(writer, segment_type, offset));
+        break;
+      }
+
+      return write_segment_offset_address(writer,
+                                          segment_type == MEMORY_SEGMENT_LOCAL ?
+                                          "LCL" : "ARG",
+                                          offset);
+    case MEMORY_SEGMENT_THIS:
+      return write_segment_offset_address(writer, "THIS", offset);
+    case MEMORY_SEGMENT_THAT:
+      return write_segment_offset_address(writer, "THAT", offset);
+    default:
+      fprintf(stderr, "write_push_operation: Invalid segment %d\n", segment_type);
+      return false;
+  }
+
+  return true;
+}
+
+bool write_segment_offset_address(CodeWriter *writer,
+                                  const char *base_pointer,
+                                  unsigned int offset)
+{
+  assert(writer);
+
+  if ((writer->options & CODE_WRITER_OPT_SMALL_OPERANDS) &&
+      segment_walk_is_cheaper(offset, SEGMENT_ADDRESS_LOAD_COST))
+    return write_segment_walk_address(writer, base_pointer, offset);
+
+  if (!(write_a_value(writer, offset) &&
+        write_c_instruction(writer, "D=A") &&
+        write_a_symbol(writer, "%s", base_pointer) &&
+        write_c_instruction(writer, "A=D+M")))
+    return false;
+
+  return true;
+}
+
+bool write_segment_walk_address(CodeWriter *writer,
+                                const char *base_pointer,
+                                unsigned int offset)
+{
+  assert(writer);
+
+  write_a_symbol(writer, "%s", base_pointer);
+  write_c_instruction(writer, "A=M");
+
+  for (; offset > 0; offset--)
+    write_c_instruction(writer, "A=A+1");
+
+  return true;
+}
+
+bool write_direct_pop_operation(CodeWriter *writer,
+                                const char *base_pointer,
+                                unsigned int offset)
+{
+  assert(writer);
+
+  /* Small offsets: pop into D and walk to the slot */
+  if (segment_walk_is_cheaper(offset,
+                              SEGMENT_ADDRESS_LOAD_COST + SEGMENT_ADDRESS_PARK_COST))
+  {
+    write_pop_top_operation(writer);
+    write_segment_walk_address(writer, base_pointer, offset);
+    write_c_instruction(writer, "M=D");
+    return true;
+  }
+
+  if (!writer->tos_in_d && !writer->comparison_pending)
+  {
+    /* Compute the address into R13 while D is free, then pop into D */
+    write_a_value(writer, offset);
+    write_c_instruction(writer, "D=A");
+    write_a_symbol(writer, "%s", base_pointer);
+    write_c_instruction(writer, "D=D+M");
+    write_in_temp_register(writer, 0);
+
+    write_pop_top_operation(writer);
+
+    write_a_symbol(writer, "R13");
+    write_c_instruction(writer, "A=M");
+    write_c_instruction(writer, "M=D");
+    return true;
+  }
+
+  /* The value is already in D: park it in R13, compute the address
+   * and recover both from their sum, A = (addr + v) - v and
+   * M = (addr + v) - addr */
+  write_pop_top_operation(writer);
+  write_in_temp_register(writer, 0);
+
+  write_a_value(writer, offset);
+  write_c_instruction(writer, "D=A");
+  write_a_symbol(writer, "%s", base_pointer);
+  write_c_instruction(writer, "D=D+M");
+  write_a_symbol(writer, "R13");
+  write_c_instruction(writer, "D=D+M");
+  write_c_instruction(writer, "A=D-M");
+  write_c_instruction(writer, "M=D-A");
+
+  return true;
+}
+
+bool write_bulk_locals_operation(CodeWriter *writer, unsigned int n_vars)
+{
+  unsigned int i;
+
+  assert(writer);
+
+  if (n_vars > BULK_LOCALS_UNROLL_LIMIT)
+  {
+    /* Move SP past the locals, then clear RAM[SP - n] for n = n_vars..1 */
+    write_a_value(writer, n_vars);
+    write_c_instruction(writer, "D=A");
+    write_a_symbol(writer, "SP");
+    write_c_instruction(writer, "M=D+M");
+    write_label(writer, "%s$INIT_LOCALS", writer->current_function);
+    write_a_symbol(writer, "SP");
+    write_c_instruction(writer, "A=M-D");
+    write_c_instruction(writer, "M=0");
+    write_c_instruction(writer, "D=D-1");
+
+    if (!(write_a_symbol(writer, "%s$INIT_LOCALS", writer->current_function) &&
+          write_c_instruction(writer, "D;JGT")))
+      return false;
+
+    return true;
+  }
+
+  /* Clear consecutive slots starting at RAM[SP] */
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "A=M");
+  write_c_instruction(writer, "M=0");
+
+  for (i = 1; i < n_vars; i++)
+  {
+    write_c_instruction(writer, "A=A+1");
+    write_c_instruction(writer, "M=0");
+  }
+
+  /* A chain of increments is shorter than storing A + 1 for two locals */
+  if (n_vars <= 2)
+  {
+    write_a_symbol(writer, "SP");
+
+    for (i = 0; i < n_vars; i++)
+      write_c_instruction(writer, "M=M+1");
+
+    return true;
+  }
+
+  if (!(write_c_instruction(writer, "D=A+1") &&
+        write_a_symbol(writer, "SP") &&
+        write_c_instruction(writer, "M=D")))
+    return false;
+
+  return true;
+}
+
+bool write_copy_words(CodeWriter *writer, unsigned int count)
+{
+  assert(writer);
+
+  for (; count > 0; count--)
+  {
+    if (!(write_a_symbol(writer, "R13") &&
+          write_c_instruction(writer, "A=M") &&
+          write_c_instruction(writer, "D=M") &&
+          write_a_symbol(writer, "R13") &&
+          write_c_instruction(writer, "M=M+1") &&
+          write_a_symbol(writer, "R14") &&
+          write_c_instruction(writer, "A=M") &&
+          write_c_instruction(writer, "M=D") &&
+          write_a_symbol(writer, "R14") &&
+          write_c_instruction(writer, "M=M+1")))
+      return false;
+  }
+
+  return true;
+}
+
+bool write_move_arguments(CodeWriter *writer, unsigned int n_args)
+{
+  unsigned int i;
+  unsigned int k;
+
+  assert(writer);
+
+  if (n_args > TAIL_CALL_WALK_LIMIT)
+  {
+    write_a_symbol(writer, "SP");
+    write_c_instruction(writer, "D=M");
+    write_a_value(writer, n_args);
+    write_c_instruction(writer, "D=D-A");
+    write_a_symbol(writer, "R13");
+    write_c_instruction(writer, "M=D");
+    write_a_symbol(writer, "ARG");
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "R14");
+    write_c_instruction(writer, "M=D");
+
+    return write_copy_words(writer, n_args);
+  }
+
+  /* Ascending order, the destination is never above the source */
+  for (i = 0; i < n_args; i++)
+  {
+    write_a_symbol(writer, "SP");
+    write_c_instruction(writer, "A=M-1");
+
+    for (k = i + 1; k < n_args; k++)
+      write_c_instruction(writer, "A=A-1");
+
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "ARG");
+    write_c_instruction(writer, "A=M");
+
+    for (k = 0; k < i; k++)
+      write_c_instruction(writer, "A=A+1");
+
+    write_c_instruction(writer, "M=D");
+  }
+
+  return true;
+}
+
+CallConvention function_convention(const CodeWriter *writer,
+                                   const char *function_name)
+{
+  const FunctionConvention *entry = NULL;
+
+  entry = function_convention_entry(writer, function_name);
+
+  return entry ? entry->convention : CALL_CONVENTION_FULL;
+}
+
+const FunctionConvention *function_convention_entry(const CodeWriter *writer,
+                                                    const char *function_name)
+{
+  size_t low = 0;
+  size_t high;
+  size_t middle;
+  int order;
+
+  assert(writer);
+
+  high = writer->convention_count;
+
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+    order = strcmp(writer->conventions[middle].name, function_name);
+
+    if (order == 0)
+      return &writer->conventions[middle];
+    else if (order < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return NULL;
+}
+
+int static_frame_word(const CodeWriter *writer,
+                      MemorySegmentType segment_type,
+                      unsigned int offset)
+{
+  assert(writer);
+
+  if (!writer->static_frame)
+    return -1;
+  else if (segment_type == MEMORY_SEGMENT_ARGUMENT)
+    return writer->static_frame->frame + STATIC_FRAME_HEADER_WORDS + offset;
+  else if (segment_type == MEMORY_SEGMENT_LOCAL)
+    return writer->static_frame->frame + STATIC_FRAME_HEADER_WORDS +
+           writer->static_frame->argument_count + offset;
+
+  return -1;
+}
+
+bool write_stack_guard(CodeWriter *writer, int stack_words)
+{
+  int limit;
+
+  assert(writer);
+
+  /* Overflow when SP + stack_words > VM_STACK_END */
+  limit = VM_STACK_END - stack_words;
+
+  if (limit < 0)
+    limit = 0;
+
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "D=M");
+  write_a_value(writer, limit);
+  write_c_instruction(writer, "D=D-A");
+  write_a_symbol(writer, "%s", STACK_OVERFLOW_LABEL);
+  write_c_instruction(writer, "D;JGT");
+
+  writer->stack_guard_written = true;
+
+  return true;
+}
+
+bool write_static_frame_entry(CodeWriter *writer, unsigned int n_vars)
+{
+  const FunctionConvention *frame = NULL;
+  int word;
+  unsigned int i;
+
+  assert(writer);
+  assert(writer->static_frame);
+
+  frame = writer->static_frame;
+
+  /* The return value goes where the arguments were */
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "D=M");
+  write_a_value(writer, frame->frame + 1);
+  write_c_instruction(writer, "M=D");
+
+  word = static_frame_word(writer, MEMORY_SEGMENT_LOCAL, n_vars);
+
+  if (frame->saved_pointers & STATIC_FRAME_SAVES_THIS)
+  {
+    write_a_symbol(writer, "THIS");
+    write_c_instruction(writer, "D=M");
+    write_a_value(writer, word++);
+    write_c_instruction(writer, "M=D");
+  }
+
+  if (frame->saved_pointers & STATIC_FRAME_SAVES_THAT)
+  {
+    write_a_symbol(writer, "THAT");
+    write_c_instruction(writer, "D=M");
+    write_a_value(writer, word);
+    write_c_instruction(writer, "M=D");
+  }
+
+  for (i = 0; i < n_vars; i++)
+  {
+    write_a_value(writer, static_frame_word(writer, MEMORY_SEGMENT_LOCAL, i));
+    write_c_instruction(writer, "M=0");
+  }
+
+  return true;
+}
+
+bool write_static_frame_call(CodeWriter *writer,
+                             const FunctionConvention *callee,
+                             unsigned int n_args)
+{
+  unsigned int i;
+
+  assert(writer);
+  assert(callee);
+
+  /* Last argument first, straight from the cached top of the stack */
+  for (i = n_args; i > 0; i--)
+  {
+    write_pop_top_operation(writer);
+    write_a_value(writer, callee->frame + STATIC_FRAME_HEADER_WORDS + (int)(i - 1));
+    write_c_instruction(writer, "M=D");
+  }
+
+  write_flush_stack_operation(writer);
+
+  write_a_symbol(writer, "%s$ret%d", writer->current_function, writer->fn_call_count);
+  write_c_instruction(writer, "D=A");
+  write_a_value(writer, callee->frame);
+  write_c_instruction(writer, "M=D");
+  write_a_symbol(writer, "%s", callee->name);
+  write_c_instruction(writer, "0;JMP");
+  write_label(writer, "%s$ret%d", writer->current_function, writer->fn_call_count);
+
+  writer->fn_call_count++;
+
+  return true;
+}
+
+bool write_static_frame_return(CodeWriter *writer)
+{
+  const FunctionConvention *frame = NULL;
+  int word;
+
+  assert(writer);
+  assert(writer->static_frame);
+
+  frame = writer->static_frame;
+
+  write_pop_top_operation(writer);
+
+  /* The stack pointer is reset from the one saved at entry */
+  writer->sp_offset = 0;
+
+  write_a_value(writer, frame->frame + 1);
+  write_c_instruction(writer, "A=M");
+  write_c_instruction(writer, "M=D");
+  write_c_instruction(writer, "D=A+1");
+  write_a_symbol(writer, "SP");
+  write_c_instruction(writer, "M=D");
+
+  word = static_frame_word(writer, MEMORY_SEGMENT_LOCAL, writer->static_frame_locals);
+
+  if (frame->saved_pointers & STATIC_FRAME_SAVES_THIS)
+  {
+    write_a_value(writer, word++);
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "THIS");
+    write_c_instruction(writer, "M=D");
+  }
+
+  if (frame->saved_pointers & STATIC_FRAME_SAVES_THAT)
+  {
+    write_a_value(writer, word);
+    write_c_instruction(writer, "D=M");
+    write_a_symbol(writer, "THAT");
+    write_c_instruction(writer, "M=D");
+  }
+
+  write_a_value(writer, frame->frame);
+  write_c_instruction(writer, "A=M");
+  write_c_instruction(writer, "0;JMP");
+
+  return true;
+}
+
+unsigned int convention_frame_words(CallConvention convention)
+{
+  switch (convention)
+  {
+    case CALL_CONVENTION_NO_POINTERS:
+      return NO_POINTERS_FRAME_WORDS;
+    case CALL_CONVENTION_NO_FRAME:
+      return 1;
+    default:
+      return FULL_FRAME_WORDS;
+  }
+}
+
+bool write_multiply_idiom(CodeWriter *writer, int constant,
+                          const MemorySegmentType *segment_type, int index)
+{
+  assert(writer);
+  assert(constant > 0 && (constant & (constant - 1)) == 0);
+
+  if (segment_type)
+  {
+    write_spill_top_operation(writer);
+    write_load_operand(writer, *segment_type, index);
+  }
+  else
+    write_pop_top_operation(writer);
+
+  /* Each addition doubles x, products wrap around like Math.multiply.
+   * The ALU adds D only to A or M */
+  for (; constant > 1; constant /= 2)
+  {
+    write_c_instruction(writer, "A=D");
+    write_c_instruction(writer, "D=D+A");
+  }
+
+  return write_push_top_operation(writer);
+}
+
+const IntrinsicEntry *intrinsic_lookup(const CodeWriter *writer,
+                                       const char *function_name,
+                                       unsigned int n_args)
+{
+  int i;
+
+  if (!(writer->options & CODE_WRITER_OPT_INTRINSICS))
+    return NULL;
+
+  for (i = 0; i < INTRINSIC_TABLE_SIZE; i++)
+  {
+    if (intrinsic_table[i].n_args == n_args &&
+        strcmp(intrinsic_table[i].function_name, function_name) == 0)
+      return &intrinsic_table[i];
+  }
+
+  return NULL;
+}
+
+bool write_intrinsic(CodeWriter *writer, const IntrinsicEntry *intrinsic)
+{
+  assert(writer);
+  assert(intrinsic);
+
+  /* The argument, or the value for poke, is moved into D */
+  write_pop_top_operation(writer);
+
+  switch (intrinsic->type)
+  {
+    case INTRINSIC_PEEK:
+      write_c_instruction(writer, "A=D");
+      write_c_instruction(writer, "D=M");
+      break;
+    case INTRINSIC_POKE:
+      /* Store below the address, then return 0 like a void function */
+      write_pop_stack_address(writer);
+      write_c_instruction(writer, "A=M");
+      write_c_instruction(writer, "M=D");
+      write_c_instruction(writer, "D=0");
+      break;
+    case INTRINSIC_ABS:
+      /* The ALU has no shifts to build a sign mask, so negative
+       * values branch over to the negation */
+      write_a_symbol(writer, "%s$abs%u", writer->current_function,
+                     writer->intrinsic_count);
+      write_c_instruction(writer, "D;JGE");
+      write_c_instruction(writer, "D=-D");
+      write_label(writer, "%s$abs%u", writer->current_function,
+                  writer->intrinsic_count);
+      writer->intrinsic_count++;
+      break;
+    default:
+      return false;
+  }
+
+  return write_push_top_operation(writer);
+}
+
+bool memory_segment_lookup(MemorySegment segment, MemorySegmentType *segment_type)
+{
+  int index;
+
+  for (index = 0; index < MEMORY_SEGMENT_TABLE_SIZE; index++)
+  {
+    if (strlen(segment) == strlen(memory_segment_table[index].segment) &&
+        strcmp(segment, memory_segment_table[index].segment) == 0)
+    {
+      *segment_type = memory_segment_table[index].type;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const char *segment_base_pointer(MemorySegmentType segment_type)
+{
+  switch (segment_type)
+  {
+    case MEMORY_SEGMENT_ARGUMENT:
+      return "ARG";
+    case MEMORY_SEGMENT_LOCAL:
+      return "LCL";
+    case MEMORY_SEGMENT_THIS:
+      return "THIS";
+    case MEMORY_SEGMENT_THAT:
+      return "THAT";
+    default:
+      return NULL;
+  }
+}
+
+bool write_push_to_stack_operation(CodeWriter *writer)
+{
+  assert(writer);
+  if (!(write_a_symbol(writer, "SP") &&
+        write_c_instruction(writer, "A=M") &&
+        write_c_instruction(writer, "M=D") &&
+        write_a_symbol(writer, "SP") &&
+        write_c_instruction(writer, "M=M+1")))
+    return false;
+
+  return true;
+}
+
+bool write_pop_operation(CodeWriter *writer,
+                         MemorySegmentType segment_type,
+                         unsigned int offset)
+{
+  assert(writer);
+
+  if (segment_type == MEMORY_SEGMENT_CONSTANT)
+  {
+    fprintf(stderr, "write_pop_operation: segment CONSTANT is not valid for pop operation\n");
+    return false;
+  }
+
+  /* Static frame words are addressed like static variables */
+  if (writer->static_frame &&
+      (segment_type == MEMORY_SEGMENT_ARGUMENT || segment_type == MEMORY_SEGMENT_LOCAL))
+  {
+    write_pop_top_operation(writer);
+    write_a_value(writer, static_frame_word(writer, segment_type, offset));
+    write_c_instruction(writer, "M=D");
+
+    return true;
+  }
+
+  if (writer->options & CODE_WRITER_OPT_DIRECT_POP)
+  {
+    switch (segment_type) {
+      case MEMORY_SEGMENT_ARGUMENT:
+        return write_direct_pop_operation(writer, "ARG", offset);
+      case MEMORY_SEGMENT_LOCAL:
+        return write_direct_pop_operation(writer, "LCL", offset);
+      case MEMORY_SEGMENT_THIS:
+        return write_direct_pop_operation(writer, "THIS", offset);
+      case MEMORY_SEGMENT_THAT:
+        return write_direct_pop_operation(writer, "THAT", offset);
+      default:
+        break;
+    }
+  }
+
+  /* Remove value from stack */
+  write_pop_top_operation(writer);
+
+  switch (segment_type) {
+    case MEMORY_SEGMENT_ARGUMENT:
+    case MEMORY_SEGMENT_LOCAL:
+    case MEMORY_SEGMENT_THIS:
+    case MEMORY_SEGMENT_THAT:
+      /* Store stack value in temp register R13 since data register will be used to calculate offset */
+      write_in_temp_register(writer, 0);
+      break;
+    default:
+      break;
+  
+  }
+
+  /* Move to address stored in segment */
+  write_follow_segment_pointer(writer, segment_type, offset);
+
+  switch (segment_type) {
     case MEMORY_SEGMENT_ARGUMENT:
     case MEMORY_SEGMENT_LOCAL:
     case MEMORY_SEGMENT_THIS:
     case MEMORY_SEGMENT_THAT:
       /* Store segment address in temp register R14 */
-      fprintf(writer->output_file, "D=A\n@R14\nM=D\n");
+      write_c_instruction(writer, "D=A");
+      write_a_symbol(writer, "R14");
+      write_c_instruction(writer, "M=D");
 
       /* Retrieve stack value stored in temp register R13 */
       write_follow_segment_pointer(writer, MEMORY_SEGMENT_CONSTANT, 13);
-      fprintf(writer->output_file, "D=M\n");
+      write_c_instruction(writer, "D=M");
 
       /* Move to address stored in temp register R14 */
       write_follow_segment_pointer(writer, MEMORY_SEGMENT_CONSTANT, 14);
-      fprintf(writer->output_file, "A=M\n");
+      write_c_instruction(writer, "A=M");
       break;
     default:
       break;
@@ -810,7 +3062,7 @@ bool write_pop_operation(CodeWriter *writer,
   }
 
   /* Copy value removed from stack into segment */
-  fprintf(writer->output_file, "M=D\n");
+  write_c_instruction(writer, "M=D");
 
   return true;
 }
@@ -818,9 +3070,193 @@ bool write_pop_operation(CodeWriter *writer,
 bool write_pop_from_stack_operation(CodeWriter *writer)
 {
   assert(writer);
-  if (fprintf(writer->output_file, "@SP\nAM=M-1\nD=M\n") < 0)
+  if (!(write_a_symbol(writer, "SP") &&
+        write_c_instruction(writer, "AM=M-1") &&
+        write_c_instruction(writer, "D=M")))
+    return false;
+
+  return true;
+}
+
+bool write_push_top_operation(CodeWriter *writer)
+{
+  assert(writer);
+  assert(!writer->tos_in_d);
+
+  if (writer->options & CODE_WRITER_OPT_TOS_CACHE)
+  {
+    writer->tos_in_d = true;
+    return true;
+  }
+
+  return write_push_computation(writer, "D");
+}
+
+bool write_pop_top_operation(CodeWriter *writer)
+{
+  assert(writer);
+
+  if (writer->comparison_pending)
+    return write_materialize_comparison(writer);
+  else if (writer->tos_in_d)
+  {
+    writer->tos_in_d = false;
+    return true;
+  }
+  else if (!(writer->options & CODE_WRITER_OPT_DEFER_SP))
+    return write_pop_from_stack_operation(writer);
+
+  write_pop_stack_address(writer);
+
+  if (!write_c_instruction(writer, "D=M"))
+    return false;
+
+  return true;
+}
+
+bool write_spill_top_operation(CodeWriter *writer)
+{
+  assert(writer);
+
+  if (writer->comparison_pending)
+  {
+    write_materialize_comparison(writer);
+    write_push_top_operation(writer);
+  }
+
+  if (!writer->tos_in_d)
+    return true;
+
+  writer->tos_in_d = false;
+
+  return write_push_computation(writer, "D");
+}
+
+bool write_push_computation(CodeWriter *writer, const char *computation)
+{
+  assert(writer);
+  assert(computation);
+
+  if (!(writer->options & CODE_WRITER_OPT_DEFER_SP))
+  {
+    if (!(write_a_symbol(writer, "SP") &&
+          write_c_instruction(writer, "A=M") &&
+          write_c_instruction(writer, "M=%s", computation) &&
+          write_a_symbol(writer, "SP") &&
+          write_c_instruction(writer, "M=M+1")))
+      return false;
+
+    return true;
+  }
+
+  /* Store in the next free slot, leaving SP behind */
+  if (writer->sp_offset >= MAX_SP_OFFSET)
+    write_commit_stack_pointer(writer);
+
+  write_stack_slot_address(writer, writer->sp_offset);
+
+  writer->sp_offset++;
+
+  if (!write_c_instruction(writer, "M=%s", computation))
+    return false;
+
+  return true;
+}
+
+const char *alu_constant(int value)
+{
+  int i;
+
+  for (i = 0; i < ALU_CONSTANT_TABLE_SIZE; i++)
+  {
+    if (alu_constant_table[i].value == value)
+      return alu_constant_table[i].computation;
+  }
+
+  return NULL;
+}
+
+bool segment_walk_is_cheaper(unsigned int offset, unsigned int alternative_cost)
+{
+  return SEGMENT_ADDRESS_WALK_COST + offset <= alternative_cost;
+}
+
+bool write_flush_stack_operation(CodeWriter *writer)
+{
+  assert(writer);
+
+  if (!write_spill_top_operation(writer))
     return false;
 
+  return write_commit_stack_pointer(writer);
+}
+
+bool write_stack_slot_address(CodeWriter *writer, int slot)
+{
+  assert(writer);
+
+  write_a_symbol(writer, "SP");
+
+  if (slot == 0)
+  {
+    write_c_instruction(writer, "A=M");
+  }
+  else if (slot > 0)
+  {
+    write_c_instruction(writer, "A=M+1");
+
+    for (slot--; slot > 0; slot--)
+      write_c_instruction(writer, "A=A+1");
+  }
+  else
+  {
+    write_c_instruction(writer, "A=M-1");
+
+    for (slot++; slot < 0; slot++)
+      write_c_instruction(writer, "A=A-1");
+  }
+
+  return true;
+}
+
+bool write_pop_stack_address(CodeWriter *writer)
+{
+  assert(writer);
+
+  if (!(writer->options & CODE_WRITER_OPT_DEFER_SP))
+  {
+    if (!(write_a_symbol(writer, "SP") &&
+          write_c_instruction(writer, "AM=M-1")))
+      return false;
+
+    return true;
+  }
+
+  if (writer->sp_offset <= -MAX_SP_OFFSET)
+    write_commit_stack_pointer(writer);
+
+  writer->sp_offset--;
+
+  return write_stack_slot_address(writer, writer->sp_offset);
+}
+
+bool write_commit_stack_pointer(CodeWriter *writer)
+{
+  assert(writer);
+
+  if (writer->sp_offset == 0)
+    return true;
+
+  /* Offsets are kept small, so a chain of increments is as short as
+   * loading the offset and keeps the data register intact */
+  write_a_symbol(writer, "SP");
+
+  for (; writer->sp_offset > 0; writer->sp_offset--)
+    write_c_instruction(writer, "M=M+1");
+
+  for (; writer->sp_offset < 0; writer->sp_offset++)
+    write_c_instruction(writer, "M=M-1");
+
   return true;
 }
 
@@ -828,18 +3264,20 @@ bool write_in_temp_register(CodeWriter *writer, unsigned int offset)
 {
   assert(writer);
 
-  if (fprintf(writer->output_file, "@R%d\nM=D\n", 13 + offset) < 0)
+  if (!(write_a_symbol(writer, "R%d", 13 + offset) &&
+        write_c_instruction(writer, "M=D")))
     return false;
 
   return true;
 }
 
 bool write_boolean_operation(CodeWriter *writer,
-                             ArithmeticLogicalCommandType operation)
+                             ArithmeticLogicalCommandType operation,
+                             bool negated)
 {
   unsigned int boolean_count;
   /* Logic for boolean operations:
-   * 1. Compute x - y --> D = D - M
+   * 1. The caller computes x - y into the data register
    * 2. If operation == "==" and D == 0, then D = true --> D;JEQ
    * 3. If operation == ">" and D > 0, then D = true --> D;JGT
    * 4. If operation == "<" and D < 0, then D = true --> D;JLT
@@ -853,37 +3291,390 @@ bool write_boolean_operation(CodeWriter *writer,
 
   boolean_count = writer->boolean_op_count;
 
-  fprintf(writer->output_file, "D=D-M\n@BOOLEAN_TRUE.%d\n", boolean_count);
+  if (!comparison_jump(operation, negated))
+    return false;
+
+  write_a_symbol(writer, "BOOLEAN_TRUE.%d", boolean_count);
+  write_c_instruction(writer, "D;%s", comparison_jump(operation, negated));
+
+  if (!(write_c_instruction(writer, "D=0") &&
+        write_a_symbol(writer, "BOOLEAN_CONTINUE.%d", boolean_count) &&
+        write_c_instruction(writer, "0;JMP") &&
+        write_label(writer, "BOOLEAN_TRUE.%d", boolean_count) &&
+        write_c_instruction(writer, "D=-1") &&
+        write_label(writer, "BOOLEAN_CONTINUE.%d", boolean_count)))
+  {
+    return false;
+  }
+
+  /* Increase boolean count */
+  writer->boolean_op_count++;
+
+  return true;
+}
 
+const char *comparison_jump(ArithmeticLogicalCommandType operation,
+                            bool negated)
+{
   switch (operation) {
     case ARITHMETIC_LOGICAL_EQ:
-      fprintf(writer->output_file, "D;JEQ\n");
-      break;
+      return negated ? "JNE" : "JEQ";
     case ARITHMETIC_LOGICAL_GT:
-      fprintf(writer->output_file, "D;JGT\n");
-      break;
+      return negated ? "JLE" : "JGT";
     case ARITHMETIC_LOGICAL_LT:
-      fprintf(writer->output_file, "D;JLT\n");
+      return negated ? "JGE" : "JLT";
+    default:
+      return NULL;
+  }
+}
+
+bool write_materialize_comparison(CodeWriter *writer)
+{
+  assert(writer);
+
+  if (!writer->comparison_pending)
+    return true;
+
+  writer->comparison_pending = false;
+
+  return write_boolean_operation(writer,
+                                 writer->pending_comparison,
+                                 writer->pending_comparison_negated);
+}
+
+bool command_is_cold(const CodeWriter *writer)
+{
+  return writer->profile &&
+         !profile_is_hot(writer->profile, writer->input_file, writer->source_line);
+}
+
+bool shared_routine_planned(const CodeWriter *writer, SharedRoutine routine)
+{
+  return (writer->shared_routines_planned & (1u << routine)) != 0;
+}
+
+SharedRoutine shared_comparison_routine(ArithmeticLogicalCommandType operation)
+{
+  return (SharedRoutine)(SHARED_ROUTINE_EQ + (operation - ARITHMETIC_LOGICAL_EQ));
+}
+
+unsigned long inline_command_words(const CodeWriter *writer, SharedRoutine routine,
+                                   const char *function_name, unsigned int n_args)
+{
+  CodeWriter *counter = NULL;
+  CodeWriterStatus status;
+  unsigned long words = 0;
+
+  counter = code_writer_fork_counter(writer);
+
+  if (!counter)
+    return 0;
+
+  /* Without a profile no command is cold */
+  counter->profile = NULL;
+
+  switch (routine)
+  {
+    case SHARED_ROUTINE_CALL:
+      status = code_writer_write_call(counter, function_name, n_args);
+      break;
+    case SHARED_ROUTINE_RETURN:
+      status = code_writer_write_return(counter);
       break;
     default:
-      return false;
+      status = code_writer_write_arithmetic(counter,
+        arithmetic_logical_cmd_table[ARITHMETIC_LOGICAL_EQ + (routine - SHARED_ROUTINE_EQ)].command);
+      break;
   }
 
-  if ((fprintf(writer->output_file,
-          "D=0\n"
-          "@BOOLEAN_CONTINUE.%d\n"
-          "0;JMP\n"
-          "(BOOLEAN_TRUE.%d)\n"
-          "D=-1\n"
-          "(BOOLEAN_CONTINUE.%d)\n",
-          boolean_count, boolean_count, boolean_count
-        )) < 0)
+  if (status == CODE_WRITER_SUCC)
+    words = code_writer_instruction_count(counter);
+
+  code_writer_close(counter);
+
+  return words;
+}
+
+bool write_shared_comparison(CodeWriter *writer,
+                             ArithmeticLogicalCommandType operation)
+{
+  SharedRoutine routine = shared_comparison_routine(operation);
+  unsigned long inline_words;
+  unsigned long previous_count;
+
+  assert(writer);
+
+  inline_words = inline_command_words(writer, routine, NULL, 0);
+  previous_count = writer->instruction_count;
+
+  if (writer->options & CODE_WRITER_OPT_TOS_CACHE)
   {
-    return false;
+    /* y goes to R13 and the result comes back in the data register,
+     * where the inline code leaves it, so the cache is not flushed */
+    write_pop_top_operation(writer);
+    write_commit_stack_pointer(writer);
+
+    if (!(write_a_symbol(writer, "R13") &&
+          write_c_instruction(writer, "M=D")))
+      return false;
   }
+  /* The routine works on the stack in RAM */
+  else
+    write_flush_stack_operation(writer);
+
+  /* The routine returns to the address in the data register */
+  if (!(write_a_symbol(writer, "BOOLEAN_CONTINUE.%d", writer->boolean_op_count) &&
+        write_c_instruction(writer, "D=A") &&
+        write_a_symbol(writer, "%s.%s", SHARED_COMPARISON_LABEL,
+                       arithmetic_logical_cmd_table[operation].command) &&
+        write_c_instruction(writer, "0;JMP") &&
+        write_label(writer, "BOOLEAN_CONTINUE.%d", writer->boolean_op_count)))
+    return false;
+
+  if (writer->options & CODE_WRITER_OPT_TOS_CACHE)
+    write_push_top_operation(writer);
 
-  /* Increase boolean count */
   writer->boolean_op_count++;
+  writer->shared_routines_written |= 1u << routine;
+  writer->shared_routine_savings[routine] +=
+    (long)inline_words - (long)(writer->instruction_count - previous_count);
+
+  return true;
+}
+
+bool write_shared_call(CodeWriter *writer, const char *function_name,
+                       unsigned int n_args)
+{
+  unsigned long inline_words;
+  unsigned long previous_count;
+
+  assert(writer);
+
+  inline_words = inline_command_words(writer, SHARED_ROUTINE_CALL, function_name, n_args);
+  previous_count = writer->instruction_count;
+
+  /* R13 holds the words from ARG to the callee LCL, R14 the callee and
+   * the data register the return address */
+  if (!(write_a_value(writer, n_args + FULL_FRAME_WORDS) &&
+        write_c_instruction(writer, "D=A") &&
+        write_a_symbol(writer, "R13") &&
+        write_c_instruction(writer, "M=D") &&
+        write_a_symbol(writer, "%s", function_name) &&
+        write_c_instruction(writer, "D=A") &&
+        write_a_symbol(writer, "R14") &&
+        write_c_instruction(writer, "M=D") &&
+        write_a_symbol(writer, "%s$ret%d", writer->current_function,
+                       writer->fn_call_count) &&
+        write_c_instruction(writer, "D=A") &&
+        write_a_symbol(writer, "%s", SHARED_CALL_LABEL) &&
+        write_c_instruction(writer, "0;JMP") &&
+        write_label(writer, "%s$ret%d", writer->current_function,
+                    writer->fn_call_count)))
+    return false;
+
+  writer->fn_call_count++;
+  writer->shared_routines_written |= 1u << SHARED_ROUTINE_CALL;
+  writer->shared_routine_savings[SHARED_ROUTINE_CALL] +=
+    (long)inline_words - (long)(writer->instruction_count - previous_count);
+
+  return true;
+}
+
+bool write_shared_return(CodeWriter *writer)
+{
+  unsigned long inline_words;
+  unsigned long previous_count;
+
+  assert(writer);
+
+  inline_words = inline_command_words(writer, SHARED_ROUTINE_RETURN, NULL, 0);
+  previous_count = writer->instruction_count;
+
+  /* The shared routine takes the return value from the stack */
+  write_flush_stack_operation(writer);
+
+  if (!(write_a_symbol(writer, "%s", SHARED_RETURN_LABEL) &&
+        write_c_instruction(writer, "0;JMP")))
+    return false;
+
+  writer->shared_routines_written |= 1u << SHARED_ROUTINE_RETURN;
+  writer->shared_routine_savings[SHARED_ROUTINE_RETURN] +=
+    (long)inline_words - (long)(writer->instruction_count - previous_count);
+
+  return true;
+}
+
+bool write_shared_routines(CodeWriter *writer)
+{
+  int routine;
+
+  assert(writer);
+
+  if (writer->source_map)
+    writer->source_function = source_map_add_name(writer->source_map, "");
+
+  for (routine = 0; routine < SHARED_ROUTINE_COUNT; routine++)
+  {
+    if ((writer->shared_routines_written & (1u << routine)) &&
+        !write_shared_routine(writer, (SharedRoutine)routine))
+      return false;
+  }
 
   return true;
-}
\ No newline at end of file
+}
+
+bool write_shared_routine(CodeWriter *writer, SharedRoutine routine)
+{
+  ArithmeticLogicalCommandType operation;
+  const char *command = NULL;
+
+  assert(writer);
+
+  switch (routine)
+  {
+    case SHARED_ROUTINE_CALL:
+      code_writer_set_source_line(writer, 0, C_CALL, NULL);
+
+      /* Push the return address and the caller segment pointers, then
+       * point LCL right after them and ARG at the arguments */
+      return write_comment(writer, "SHARED CALL") &&
+             write_label(writer, "%s", SHARED_CALL_LABEL) &&
+             write_a_symbol(writer, "SP") &&
+             write_c_instruction(writer, "A=M") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "LCL") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "SP") &&
+             write_c_instruction(writer, "AM=M+1") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "ARG") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "SP") &&
+             write_c_instruction(writer, "AM=M+1") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "THIS") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "SP") &&
+             write_c_instruction(writer, "AM=M+1") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "THAT") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "SP") &&
+             write_c_instruction(writer, "AM=M+1") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "SP") &&
+             write_c_instruction(writer, "MD=M+1") &&
+             write_a_symbol(writer, "LCL") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "R13") &&
+             write_c_instruction(writer, "D=D-M") &&
+             write_a_symbol(writer, "ARG") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "R14") &&
+             write_c_instruction(writer, "A=M") &&
+             write_c_instruction(writer, "0;JMP");
+    case SHARED_ROUTINE_RETURN:
+      code_writer_set_source_line(writer, 0, C_RETURN, NULL);
+
+      /* The return of code_writer_write_return with the full frame and
+       * the return value on the stack */
+      return write_comment(writer, "SHARED RETURN") &&
+             write_label(writer, "%s", SHARED_RETURN_LABEL) &&
+             write_a_symbol(writer, "LCL") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "R13") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_value(writer, FULL_FRAME_WORDS) &&
+             write_c_instruction(writer, "A=D-A") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "R14") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "SP") &&
+             write_c_instruction(writer, "AM=M-1") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "ARG") &&
+             write_c_instruction(writer, "A=M") &&
+             write_c_instruction(writer, "M=D") &&
+             write_c_instruction(writer, "D=A+1") &&
+             write_a_symbol(writer, "SP") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "R13") &&
+             write_c_instruction(writer, "AM=M-1") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "THAT") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "R13") &&
+             write_c_instruction(writer, "AM=M-1") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "THIS") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "R13") &&
+             write_c_instruction(writer, "AM=M-1") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "ARG") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "R13") &&
+             write_c_instruction(writer, "AM=M-1") &&
+             write_c_instruction(writer, "D=M") &&
+             write_a_symbol(writer, "LCL") &&
+             write_c_instruction(writer, "M=D") &&
+             write_a_symbol(writer, "R14") &&
+             write_c_instruction(writer, "A=M") &&
+             write_c_instruction(writer, "0;JMP");
+    default:
+      break;
+  }
+
+  operation = (ArithmeticLogicalCommandType)(ARITHMETIC_LOGICAL_EQ +
+                                             (routine - SHARED_ROUTINE_EQ));
+  command = arithmetic_logical_cmd_table[operation].command;
+  code_writer_set_source_line(writer, 0, C_ARITHMETIC, command);
+
+  /* Pop x, leave true, then false unless x - y holds, in the data
+   * register and return to the address in R14 */
+  if (writer->options & CODE_WRITER_OPT_TOS_CACHE)
+    return write_comment(writer, "SHARED %s", command) &&
+           write_label(writer, "%s.%s", SHARED_COMPARISON_LABEL, command) &&
+           write_a_symbol(writer, "R14") &&
+           write_c_instruction(writer, "M=D") &&
+           write_a_symbol(writer, "SP") &&
+           write_c_instruction(writer, "AM=M-1") &&
+           write_c_instruction(writer, "D=M") &&
+           write_a_symbol(writer, "R13") &&
+           write_c_instruction(writer, "D=D-M") &&
+           write_a_symbol(writer, "%s.%s.TRUE", SHARED_COMPARISON_LABEL,
+                          command) &&
+           write_c_instruction(writer, "D;%s",
+                               comparison_jump(operation, false)) &&
+           write_c_instruction(writer, "D=0") &&
+           write_a_symbol(writer, "R14") &&
+           write_c_instruction(writer, "A=M") &&
+           write_c_instruction(writer, "0;JMP") &&
+           write_label(writer, "%s.%s.TRUE", SHARED_COMPARISON_LABEL, command) &&
+           write_c_instruction(writer, "D=-1") &&
+           write_a_symbol(writer, "R14") &&
+           write_c_instruction(writer, "A=M") &&
+           write_c_instruction(writer, "0;JMP");
+
+  /* Replace x and y with true, then with false unless x - y holds,
+   * and return to the address in R13 */
+  return write_comment(writer, "SHARED %s", command) &&
+         write_label(writer, "%s.%s", SHARED_COMPARISON_LABEL, command) &&
+         write_a_symbol(writer, "R13") &&
+         write_c_instruction(writer, "M=D") &&
+         write_a_symbol(writer, "SP") &&
+         write_c_instruction(writer, "AM=M-1") &&
+         write_c_instruction(writer, "D=M") &&
+         write_c_instruction(writer, "A=A-1") &&
+         write_c_instruction(writer, "D=M-D") &&
+         write_c_instruction(writer, "M=-1") &&
+         write_a_symbol(writer, "%s.%s.TRUE", SHARED_COMPARISON_LABEL, command) &&
+         write_c_instruction(writer, "D;%s", comparison_jump(operation, false)) &&
+         write_a_symbol(writer, "SP") &&
+         write_c_instruction(writer, "A=M-1") &&
+         write_c_instruction(writer, "M=0") &&
+         write_label(writer, "%s.%s.TRUE", SHARED_COMPARISON_LABEL, command) &&
+         write_a_symbol(writer, "R13") &&
+         write_c_instruction(writer, "A=M") &&
+         write_c_instruction(writer, "0;JMP");
+}
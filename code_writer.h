@@ -4,7 +4,11 @@
 #ifndef CODE_WRITER_H 
 #define CODE_WRITER_H
 
+#include <stddef.h>
 #include "translator_common.h"
+#include "assembler.h"
+#include "source_map.h"
+#include "profile.h"
 
 typedef enum CodeWriterStatus
 {
@@ -17,12 +21,85 @@ typedef enum CodeWriterStatus
   CODE_WRITER_SUCC
 } CodeWriterStatus;
 
+/* Optional code generation features, combined as a bit mask */
+typedef enum CodeWriterOption
+{
+  CODE_WRITER_OPT_NONE = 0,
+  /* Keep the top of the VM stack in the data register between commands */
+  CODE_WRITER_OPT_TOS_CACHE = 1 << 0,
+  /* Update the stack pointer once per basic block instead of per push/pop */
+  CODE_WRITER_OPT_DEFER_SP = 1 << 1,
+  /* Branch on comparisons directly instead of materializing a boolean */
+  CODE_WRITER_OPT_FUSE_BRANCHES = 1 << 2,
+  /* Use the ALU constants 0, 1 and -1 and walk to small segment offsets */
+  CODE_WRITER_OPT_SMALL_OPERANDS = 1 << 3,
+  /* Pop into segments without parking the value and address in R13/R14 */
+  CODE_WRITER_OPT_DIRECT_POP = 1 << 4,
+  /* Zero the local variables of a function with one stack pointer update */
+  CODE_WRITER_OPT_BULK_LOCALS = 1 << 5,
+  /* Reuse the caller frame for a call followed by return */
+  CODE_WRITER_OPT_TAIL_CALLS = 1 << 6,
+  /* Check at function entry that the stack the function needs fits */
+  CODE_WRITER_OPT_STACK_GUARD = 1 << 7,
+  /* Translate common command sequences as a single unit */
+  CODE_WRITER_OPT_SUPERINSTRUCTIONS = 1 << 8,
+  /* Translate calls to some Jack OS functions inline, assuming their
+   * standard behavior */
+  CODE_WRITER_OPT_INTRINSICS = 1 << 9
+} CodeWriterOption;
+
 /* Encapsulates the logic to translate and write a parsed VM command
  * into Hack assembly code */
 typedef struct CodeWriter CodeWriter;
 
-/* Opens an output file and gets ready to write into it */
-CodeWriter *code_writer_init(const char *output_filename);
+/* Opens an output file and gets ready to write into it,
+ * options is a mask of CodeWriterOption flags.
+ * A NULL output_filename creates a writer that only counts instructions */
+CodeWriter *code_writer_init(const char *output_filename, unsigned int options);
+
+/* Gets ready to write into an assembler, which receives every
+ * instruction encoded as it is written, and into an output file
+ * unless output_filename is NULL. The assembler is not freed by
+ * code_writer_close */
+CodeWriter *code_writer_init_assembler(Assembler *assembler,
+                                       const char *output_filename,
+                                       unsigned int options);
+
+/* Creates a writer that only counts instructions, continuing from
+ * the state of writer, to measure alternative translations.
+ * Nothing it writes reaches the output of writer */
+CodeWriter *code_writer_fork_counter(const CodeWriter *writer);
+
+/* Sets the calling convention of the functions in conventions,
+ * sorted by name. Functions not listed use CALL_CONVENTION_FULL.
+ * The table must outlive the writer */
+void code_writer_set_conventions(CodeWriter *writer,
+                                 const FunctionConvention *conventions,
+                                 size_t count);
+
+/* Adds to source_map an entry for each command written from now on,
+ * at its first instruction, and the size of the program when the
+ * writer is closed. The map is not freed by code_writer_close */
+void code_writer_set_source_map(CodeWriter *writer, SourceMap *source_map);
+
+/* Sets the VM line, type and, for arithmetic-logical commands, the
+ * operation of the command about to be written, for the source map
+ * and the profile.
+ * operation must stay valid until the command is written */
+void code_writer_set_source_line(CodeWriter *writer, unsigned int line,
+                                 CommandType type, const char *operation);
+
+/* Writes the commands that are not hot in profile, by their file and
+ * the line set with code_writer_set_source_line, as jumps to routines
+ * shared by the whole program: calls to functions with the full frame,
+ * returns from them and, unless branches are fused, comparisons. Hot
+ * commands keep their inline code. The profile must outlive the writer */
+void code_writer_set_profile(CodeWriter *writer, const Profile *profile);
+
+/* Keeps the inline code of the cold comparisons whose shared routine
+ * is larger than the instructions their jumps save in planner, a
+ * writer that translated the same program with the same profile */
+void code_writer_plan_shared_routines(CodeWriter *writer, const CodeWriter *planner);
 
 /* Informs the translation of a new VM file */
 CodeWriterStatus code_writer_set_filename(CodeWriter *writer, const char *input_filename);
@@ -52,6 +129,13 @@ CodeWriterStatus code_writer_write_call(CodeWriter *writer,
                                         const char *function_name,
                                         unsigned int n_args);
 
+/* Write to the output file the assembly code that effects a call
+ * immediately followed by a return. Unless tail calls are enabled,
+ * this is the same as writing both commands */
+CodeWriterStatus code_writer_write_tail_call(CodeWriter *writer,
+                                             const char *function_name,
+                                             unsigned int n_args);
+
 /* Write to the output file the assembly code that setups a function
  * return command */
 CodeWriterStatus code_writer_write_return(CodeWriter *Writer);
@@ -70,7 +154,19 @@ CodeWriterStatus code_writer_write_goto(CodeWriter *writer,
 CodeWriterStatus code_writer_write_if(CodeWriter *writer,
                                       const char *label);
 
+/* Write to the output file the assembly code of a command sequence
+ * recognized as an idiom, with the same effect on the VM state as
+ * writing its commands one by one */
+CodeWriterStatus code_writer_write_idiom(CodeWriter *writer, const Idiom *idiom);
+
 /* Closes the output file */
 void code_writer_close(CodeWriter *writer);
 
+/* Returns the number of Hack instructions written so far */
+unsigned long code_writer_instruction_count(const CodeWriter *writer);
+
+/* Checks if CODE_WRITER_OPT_INTRINSICS translates a call inline,
+ * without calling the function */
+bool code_writer_is_intrinsic(const char *function_name, unsigned int n_args);
+
 #endif
\ No newline at end of file
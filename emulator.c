@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "emulator.h"
+
+/* Fields of a C instruction */
+#define C_INSTRUCTION_BIT 0x8000
+#define C_INSTRUCTION_A_BIT 0x1000
+#define C_INSTRUCTION_COMP_SHIFT 6
+#define C_INSTRUCTION_DEST_A 0x20
+#define C_INSTRUCTION_DEST_D 0x10
+#define C_INSTRUCTION_DEST_M 0x08
+#define C_INSTRUCTION_JUMP_MASK 0x07
+#define C_INSTRUCTION_JUMP_ALWAYS 0x07
+
+/* Control bits of the ALU, in the order of the comp field */
+#define ALU_ZERO_X 0x20
+#define ALU_NEGATE_X 0x10
+#define ALU_ZERO_Y 0x08
+#define ALU_NEGATE_Y 0x04
+#define ALU_ADD 0x02
+#define ALU_NEGATE_OUT 0x01
+
+/* Jump bits */
+#define JUMP_NEGATIVE 0x04
+#define JUMP_ZERO 0x02
+#define JUMP_POSITIVE 0x01
+
+#define RAM_ADDRESS_MASK (EMULATOR_RAM_WORDS - 1)
+
+struct Emulator
+{
+  unsigned short     rom[EMULATOR_ROM_WORDS];
+  unsigned short     ram[EMULATOR_RAM_WORDS];
+  size_t             rom_count;
+  EmulatorCpu        cpu;
+  /* Executions of each ROM address, or NULL */
+  unsigned long long *counts;
+};
+
+/* Internal Functions */
+
+/* Computes the output of the ALU for the six control bits of the
+ * comp field, with x the D register and y the A register or memory */
+unsigned short alu_compute(unsigned int control, unsigned short x,
+                           unsigned short y);
+
+/* End Internal Functions */
+
+/* Creates a computer with cleared memories */
+Emulator *emulator_init(void)
+{
+  return (Emulator *)calloc(1, sizeof(Emulator));
+}
+
+/* Copies a program into ROM and resets the CPU */
+EmulatorStatus emulator_load(Emulator *emulator, const unsigned short *program,
+                             size_t count)
+{
+  assert(emulator);
+  assert(program || count == 0);
+
+  if (count > EMULATOR_ROM_WORDS)
+    return EMULATOR_FAIL_LOAD;
+
+  if (count > 0)
+    memcpy(emulator->rom, program, count * sizeof(unsigned short));
+
+  memset(emulator->rom + count, 0,
+         (EMULATOR_ROM_WORDS - count) * sizeof(unsigned short));
+
+  emulator->rom_count = count;
+  emulator->cpu.a = 0;
+  emulator->cpu.d = 0;
+  emulator->cpu.pc = 0;
+  emulator->cpu.cycles = 0;
+
+  return EMULATOR_SUCC;
+}
+
+/* Executes instructions until the program halts or a limit is reached */
+EmulatorStatus emulator_run(Emulator *emulator, unsigned long long max_cycles)
+{
+  const unsigned short *rom = NULL;
+  unsigned short *ram = NULL;
+  unsigned long long *counts = NULL;
+  unsigned short instruction;
+  unsigned short a, d, out;
+  unsigned int pc;
+  unsigned int jump;
+  unsigned long long cycles;
+  unsigned long long end;
+  EmulatorStatus status = EMULATOR_CYCLE_LIMIT;
+  short value;
+  bool taken;
+
+  assert(emulator);
+
+  /* Registers are kept in locals so the loop does not go through memory */
+  rom = emulator->rom;
+  ram = emulator->ram;
+  counts = emulator->counts;
+  a = emulator->cpu.a;
+  d = emulator->cpu.d;
+  pc = emulator->cpu.pc;
+  cycles = emulator->cpu.cycles;
+  end = cycles + max_cycles < cycles ? (unsigned long long)-1 : cycles + max_cycles;
+
+  while (cycles < end)
+  {
+    if (pc >= emulator->rom_count)
+    {
+      status = EMULATOR_END_OF_PROGRAM;
+      break;
+    }
+
+    instruction = rom[pc];
+    cycles++;
+
+    if (counts)
+      counts[pc]++;
+
+    /* A instruction */
+    if (!(instruction & C_INSTRUCTION_BIT))
+    {
+      a = instruction;
+      pc++;
+      continue;
+    }
+
+    out = alu_compute((instruction >> C_INSTRUCTION_COMP_SHIFT) & 0x3F, d,
+                      (instruction & C_INSTRUCTION_A_BIT) ? ram[a & RAM_ADDRESS_MASK] : a);
+
+    jump = instruction & C_INSTRUCTION_JUMP_MASK;
+    value = (short)out;
+    taken = ((jump & JUMP_NEGATIVE) && value < 0) ||
+            ((jump & JUMP_ZERO) && value == 0) ||
+            ((jump & JUMP_POSITIVE) && value > 0);
+
+    /* The jump goes to the address in A before this instruction */
+    if (taken)
+    {
+      if (jump == C_INSTRUCTION_JUMP_ALWAYS && (unsigned int)a + 1 == pc &&
+          rom[a] == a && !(instruction & (C_INSTRUCTION_DEST_A | C_INSTRUCTION_DEST_D |
+                           C_INSTRUCTION_DEST_M)))
+      {
+        status = EMULATOR_HALTED;
+        break;
+      }
+
+      pc = a;
+    }
+    else
+      pc++;
+
+    /* Memory is written at the address in A before this instruction */
+    if (instruction & C_INSTRUCTION_DEST_M)
+      ram[a & RAM_ADDRESS_MASK] = out;
+
+    if (instruction & C_INSTRUCTION_DEST_A)
+      a = out;
+
+    if (instruction & C_INSTRUCTION_DEST_D)
+      d = out;
+  }
+
+  emulator->cpu.a = a;
+  emulator->cpu.d = d;
+  emulator->cpu.pc = pc;
+  emulator->cpu.cycles = cycles;
+
+  return status;
+}
+
+/* Counts the executions of each ROM address into counts */
+void emulator_set_counters(Emulator *emulator, unsigned long long *counts)
+{
+  assert(emulator);
+
+  emulator->counts = counts;
+}
+
+/* Returns the RAM of the computer */
+unsigned short *emulator_ram(Emulator *emulator)
+{
+  assert(emulator);
+
+  return emulator->ram;
+}
+
+/* Returns the number of instructions executed */
+unsigned long long emulator_cycles(const Emulator *emulator)
+{
+  assert(emulator);
+
+  return emulator->cpu.cycles;
+}
+
+/* Returns the address of the next instruction */
+unsigned int emulator_pc(const Emulator *emulator)
+{
+  assert(emulator);
+
+  return emulator->cpu.pc;
+}
+
+/* Returns the ROM of the computer */
+const unsigned short *emulator_rom(const Emulator *emulator)
+{
+  assert(emulator);
+
+  return emulator->rom;
+}
+
+/* Returns the number of instructions of the loaded program */
+size_t emulator_program_size(const Emulator *emulator)
+{
+  assert(emulator);
+
+  return emulator->rom_count;
+}
+
+/* Returns the CPU */
+EmulatorCpu *emulator_cpu(Emulator *emulator)
+{
+  assert(emulator);
+
+  return &emulator->cpu;
+}
+
+/* Frees the emulator */
+void emulator_fini(Emulator *emulator)
+{
+  free(emulator);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+unsigned short alu_compute(unsigned int control, unsigned short x,
+                           unsigned short y)
+{
+  unsigned short out;
+
+  if (control & ALU_ZERO_X) x = 0;
+  if (control & ALU_NEGATE_X) x = (unsigned short)~x;
+  if (control & ALU_ZERO_Y) y = 0;
+  if (control & ALU_NEGATE_Y) y = (unsigned short)~y;
+
+  out = (control & ALU_ADD) ? (unsigned short)(x + y) : (unsigned short)(x & y);
+
+  if (control & ALU_NEGATE_OUT) out = (unsigned short)~out;
+
+  return out;
+}
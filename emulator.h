@@ -0,0 +1,93 @@
+/* emulator.h: Runs Hack machine code on an emulated Hack computer,
+ *             without screen or keyboard devices
+ */
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <stddef.h>
+
+/* Words of the instruction and data memories */
+#define EMULATOR_ROM_WORDS 32768
+#define EMULATOR_RAM_WORDS 32768
+
+/* Memory maps of the screen and the keyboard in RAM */
+#define EMULATOR_SCREEN_ADDRESS 16384
+#define EMULATOR_SCREEN_WORDS 8192
+#define EMULATOR_KEYBOARD_ADDRESS 24576
+
+typedef enum EmulatorStatus
+{
+  /* The program jumped to itself forever, as Sys.halt does */
+  EMULATOR_HALTED,
+  /* The program counter left the program */
+  EMULATOR_END_OF_PROGRAM,
+  /* The program was still running after the cycle limit */
+  EMULATOR_CYCLE_LIMIT,
+  EMULATOR_FAIL_LOAD,
+  EMULATOR_SUCC
+} EmulatorStatus;
+
+/* Registers of the CPU and the number of instructions executed */
+typedef struct EmulatorCpu
+{
+  unsigned short     a;
+  unsigned short     d;
+  unsigned int       pc;
+  unsigned long long cycles;
+} EmulatorCpu;
+
+/* A Hack CPU with its ROM and RAM. The screen and the keyboard are
+ * plain words of RAM that a caller may read or set between runs */
+typedef struct Emulator Emulator;
+
+/* Creates a computer with cleared memories
+ *
+ * Returns the emulator, or NULL if it could not be allocated
+ */
+Emulator *emulator_init(void);
+
+/* Copies count instructions into ROM and resets the CPU, RAM is kept
+ *
+ * Returns EMULATOR_SUCC, or EMULATOR_FAIL_LOAD if the program does
+ * not fit in ROM
+ */
+EmulatorStatus emulator_load(Emulator *emulator, const unsigned short *program,
+                             size_t count);
+
+/* Executes instructions until the program halts, leaves ROM or
+ * max_cycles more instructions have been executed. A halt is an
+ * unconditional jump to the instruction loading its own address,
+ * (LOOP) @LOOP 0;JMP, and that jump is the last cycle counted
+ *
+ * Returns why the execution stopped
+ */
+EmulatorStatus emulator_run(Emulator *emulator, unsigned long long max_cycles);
+
+/* Counts the executions of each ROM address into counts, which has
+ * EMULATOR_ROM_WORDS words, from the next run on. A NULL counts stops
+ * counting. The counts are not cleared */
+void emulator_set_counters(Emulator *emulator, unsigned long long *counts);
+
+/* Returns the RAM of the computer, EMULATOR_RAM_WORDS words */
+unsigned short *emulator_ram(Emulator *emulator);
+
+/* Returns the ROM of the computer, EMULATOR_ROM_WORDS words */
+const unsigned short *emulator_rom(const Emulator *emulator);
+
+/* Returns the number of instructions of the loaded program */
+size_t emulator_program_size(const Emulator *emulator);
+
+/* Returns the CPU, so that other execution engines can continue from
+ * its state and leave theirs for emulator_run */
+EmulatorCpu *emulator_cpu(Emulator *emulator);
+
+/* Returns the number of instructions executed since the program was loaded */
+unsigned long long emulator_cycles(const Emulator *emulator);
+
+/* Returns the address of the next instruction */
+unsigned int emulator_pc(const Emulator *emulator);
+
+/* Frees the emulator */
+void emulator_fini(Emulator *emulator);
+
+#endif
@@ -0,0 +1,268 @@
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hash_table.h"
+
+#define HASH_TABLE_INITIAL_KEYS 64
+#define HASH_TABLE_INITIAL_BYTES 1024
+
+/* FNV-1a parameters */
+#define HASH_OFFSET 2166136261UL
+#define HASH_PRIME 16777619UL
+
+/* A key, at an offset of the key bytes */
+typedef struct HashTableKey
+{
+  size_t        offset;
+  size_t        length;
+  unsigned long hash;
+} HashTableKey;
+
+struct HashTable
+{
+  HashTableKey *keys;
+  size_t       key_count;
+  size_t       key_capacity;
+  char         *bytes;
+  size_t       byte_count;
+  size_t       byte_capacity;
+  /* Indexes of the keys, twice as many slots as their capacity */
+  size_t       *slots;
+};
+
+/* Internal Functions */
+
+/* Returns the FNV-1a hash of a key */
+unsigned long key_hash(const void *key, size_t length);
+
+/* Returns the slot of a key, which is empty if the key is not there */
+size_t key_slot(const HashTable *table, const void *key, size_t length,
+                unsigned long hash);
+
+/* Doubles the key array and rebuilds the slots for it
+ *
+ * Returns true if successful and false otherwise
+ */
+bool grow_keys(HashTable *table);
+
+/* End Internal Functions */
+
+/* Creates an empty table */
+HashTable *hash_table_init(void)
+{
+  HashTable *table = NULL;
+
+  table = (HashTable *)calloc(1, sizeof(HashTable));
+
+  if (!table)
+    return NULL;
+
+  table->bytes = (char *)malloc(HASH_TABLE_INITIAL_BYTES);
+
+  if (!table->bytes || !grow_keys(table))
+  {
+    hash_table_fini(table);
+    return NULL;
+  }
+
+  table->byte_capacity = HASH_TABLE_INITIAL_BYTES;
+
+  return table;
+}
+
+/* Returns the index of a key, adding it if needed */
+size_t hash_table_add(HashTable *table, const void *key, size_t length)
+{
+  HashTableKey *entry = NULL;
+  char *new_bytes = NULL;
+  size_t new_capacity;
+  unsigned long hash;
+  size_t slot;
+
+  assert(table);
+  assert(key || length == 0);
+
+  hash = key_hash(key, length);
+  slot = key_slot(table, key, length, hash);
+
+  if (table->slots[slot] != HASH_TABLE_NOT_FOUND)
+    return table->slots[slot];
+
+  if (table->key_count == table->key_capacity)
+  {
+    if (!grow_keys(table))
+      return HASH_TABLE_NOT_FOUND;
+
+    slot = key_slot(table, key, length, hash);
+  }
+
+  if (table->byte_count + length + 1 > table->byte_capacity)
+  {
+    new_capacity = 2 * table->byte_capacity;
+
+    while (table->byte_count + length + 1 > new_capacity)
+      new_capacity *= 2;
+
+    new_bytes = (char *)realloc(table->bytes, new_capacity);
+
+    if (!new_bytes)
+      return HASH_TABLE_NOT_FOUND;
+
+    table->bytes = new_bytes;
+    table->byte_capacity = new_capacity;
+  }
+
+  entry = &table->keys[table->key_count];
+  entry->offset = table->byte_count;
+  entry->length = length;
+  entry->hash = hash;
+
+  if (length > 0)
+    memcpy(table->bytes + table->byte_count, key, length);
+
+  table->bytes[table->byte_count + length] = '\0';
+  table->byte_count += length + 1;
+  table->slots[slot] = table->key_count;
+
+  return table->key_count++;
+}
+
+/* Returns the index of a key */
+size_t hash_table_find(const HashTable *table, const void *key, size_t length)
+{
+  assert(table);
+  assert(key || length == 0);
+
+  return table->slots[key_slot(table, key, length, key_hash(key, length))];
+}
+
+/* Returns the index of a string key, adding it if needed */
+size_t hash_table_add_string(HashTable *table, const char *key)
+{
+  assert(key);
+
+  return hash_table_add(table, key, strlen(key));
+}
+
+/* Returns the index of a string key */
+size_t hash_table_find_string(const HashTable *table, const char *key)
+{
+  assert(key);
+
+  return hash_table_find(table, key, strlen(key));
+}
+
+/* Returns the key with the given index */
+const char *hash_table_key(const HashTable *table, size_t index)
+{
+  assert(table);
+  assert(index < table->key_count);
+
+  return table->bytes + table->keys[index].offset;
+}
+
+/* Returns the number of keys in the table */
+size_t hash_table_count(const HashTable *table)
+{
+  assert(table);
+
+  return table->key_count;
+}
+
+/* Frees the table */
+void hash_table_fini(HashTable *table)
+{
+  if (!table)
+    return;
+
+  free(table->keys);
+  free(table->bytes);
+  free(table->slots);
+  free(table);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+unsigned long key_hash(const void *key, size_t length)
+{
+  const unsigned char *bytes = (const unsigned char *)key;
+  unsigned long hash = HASH_OFFSET;
+  size_t i;
+
+  for (i = 0; i < length; i++)
+  {
+    hash ^= bytes[i];
+    hash = (hash * HASH_PRIME) & 0xFFFFFFFFUL;
+  }
+
+  return hash;
+}
+
+size_t key_slot(const HashTable *table, const void *key, size_t length,
+                unsigned long hash)
+{
+  const HashTableKey *entry = NULL;
+  size_t mask;
+  size_t k;
+
+  mask = 2 * table->key_capacity - 1;
+
+  for (k = hash & mask; table->slots[k] != HASH_TABLE_NOT_FOUND; k = (k + 1) & mask)
+  {
+    entry = &table->keys[table->slots[k]];
+
+    if (entry->hash == hash && entry->length == length &&
+        (length == 0 || memcmp(table->bytes + entry->offset, key, length) == 0))
+      break;
+  }
+
+  return k;
+}
+
+bool grow_keys(HashTable *table)
+{
+  HashTableKey *new_keys = NULL;
+  size_t *new_slots = NULL;
+  size_t new_capacity;
+  size_t mask;
+  size_t i, k;
+
+  new_capacity = table->key_capacity ? 2 * table->key_capacity :
+                                       HASH_TABLE_INITIAL_KEYS;
+
+  new_keys = (HashTableKey *)realloc(table->keys,
+                                     new_capacity * sizeof(HashTableKey));
+
+  if (!new_keys)
+    return false;
+
+  table->keys = new_keys;
+  new_slots = (size_t *)malloc(2 * new_capacity * sizeof(size_t));
+
+  if (!new_slots)
+    return false;
+
+  for (i = 0; i < 2 * new_capacity; i++)
+    new_slots[i] = HASH_TABLE_NOT_FOUND;
+
+  mask = 2 * new_capacity - 1;
+
+  for (i = 0; i < table->key_count; i++)
+  {
+    for (k = table->keys[i].hash & mask; new_slots[k] != HASH_TABLE_NOT_FOUND;
+         k = (k + 1) & mask)
+      ;
+
+    new_slots[k] = i;
+  }
+
+  free(table->slots);
+  table->slots = new_slots;
+  table->key_capacity = new_capacity;
+
+  return true;
+}
@@ -0,0 +1,45 @@
+/* hash_table.h: Open addressing hash table from byte string keys to
+ *               the indexes they were added with
+ */
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <stddef.h>
+
+/* Returned for keys that are not in the table */
+#define HASH_TABLE_NOT_FOUND ((size_t)-1)
+
+/* Keys numbered from 0 in order of addition, so that users keep the
+ * values of a key at its index in an array of their own */
+typedef struct HashTable HashTable;
+
+/* Creates an empty table
+ *
+ * Returns the table, or NULL if it could not be allocated
+ */
+HashTable *hash_table_init(void);
+
+/* Returns the index of a key, adding a copy of it with the next index
+ * if it is not there yet, or HASH_TABLE_NOT_FOUND if it could not be
+ * added */
+size_t hash_table_add(HashTable *table, const void *key, size_t length);
+
+/* Returns the index of a key, or HASH_TABLE_NOT_FOUND if it is not
+ * in the table */
+size_t hash_table_find(const HashTable *table, const void *key, size_t length);
+
+/* Same as hash_table_add and hash_table_find for a string key */
+size_t hash_table_add_string(HashTable *table, const char *key);
+size_t hash_table_find_string(const HashTable *table, const char *key);
+
+/* Returns the key with the given index. Keys are followed by a null
+ * character, so that string keys can be read back as strings */
+const char *hash_table_key(const HashTable *table, size_t index);
+
+/* Returns the number of keys in the table */
+size_t hash_table_count(const HashTable *table);
+
+/* Frees the table and its keys */
+void hash_table_fini(HashTable *table);
+
+#endif
@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "translator_common.h"
+#include "vm_program.h"
+#include "idiom.h"
+
+/* Longest pattern of the table */
+#define IDIOM_PATTERN_MAX_LENGTH 5
+
+/* Element fields that match any command */
+#define IDIOM_ANY_INDEX (-1)
+#define IDIOM_NO_OPERAND (-1)
+
+/* Marks a trie node that no pattern ends at and a missing node */
+#define IDIOM_NO_PATTERN ((size_t)-1)
+#define IDIOM_NO_NODE ((size_t)-1)
+
+/* A command of a pattern */
+typedef struct IdiomElement
+{
+  CommandType type;
+  /* Required segment or arithmetic command, NULL for any */
+  const char  *arg1;
+  /* Required index, or IDIOM_ANY_INDEX */
+  int         arg2;
+  /* Operand the command is captured into, or IDIOM_NO_OPERAND */
+  int         operand;
+  /* The command must repeat the operand captured earlier */
+  bool        repeat;
+  /* The index must be a power of two */
+  bool        power_of_two;
+} IdiomElement;
+
+typedef struct IdiomPattern
+{
+  IdiomKind    kind;
+  size_t       length;
+  IdiomElement elements[IDIOM_PATTERN_MAX_LENGTH];
+} IdiomPattern;
+
+#define IDIOM_PATTERN_TABLE_SIZE 9
+
+/* Idioms of the Jack compiler output. When two patterns match, the
+ * longest one wins, then the first one of the table */
+static const IdiomPattern idiom_pattern_table[IDIOM_PATTERN_TABLE_SIZE] =
+{
+  /* let x = x + c */
+  { IDIOM_INCREMENT, 4,
+    { { C_PUSH, NULL, IDIOM_ANY_INDEX, 0, false, false },
+      { C_PUSH, "constant", IDIOM_ANY_INDEX, 1, false, false },
+      { C_ARITHMETIC, "add", IDIOM_ANY_INDEX, IDIOM_NO_OPERAND, false, false },
+      { C_POP, NULL, IDIOM_ANY_INDEX, 0, true, false } } },
+  /* let x = x - c */
+  { IDIOM_INCREMENT, 4,
+    { { C_PUSH, NULL, IDIOM_ANY_INDEX, 0, false, false },
+      { C_PUSH, "constant", IDIOM_ANY_INDEX, 1, false, false },
+      { C_ARITHMETIC, "sub", IDIOM_ANY_INDEX, IDIOM_NO_OPERAND, false, false },
+      { C_POP, NULL, IDIOM_ANY_INDEX, 0, true, false } } },
+  /* let x = c + x */
+  { IDIOM_INCREMENT, 4,
+    { { C_PUSH, "constant", IDIOM_ANY_INDEX, 1, false, false },
+      { C_PUSH, NULL, IDIOM_ANY_INDEX, 0, false, false },
+      { C_ARITHMETIC, "add", IDIOM_ANY_INDEX, IDIOM_NO_OPERAND, false, false },
+      { C_POP, NULL, IDIOM_ANY_INDEX, 0, true, false } } },
+  /* a[i] */
+  { IDIOM_ARRAY_READ, 5,
+    { { C_PUSH, NULL, IDIOM_ANY_INDEX, 0, false, false },
+      { C_PUSH, NULL, IDIOM_ANY_INDEX, 1, false, false },
+      { C_ARITHMETIC, "add", IDIOM_ANY_INDEX, IDIOM_NO_OPERAND, false, false },
+      { C_POP, "pointer", 1, IDIOM_NO_OPERAND, false, false },
+      { C_PUSH, "that", 0, IDIOM_NO_OPERAND, false, false } } },
+  /* a[expression] */
+  { IDIOM_ARRAY_LOAD, 2,
+    { { C_POP, "pointer", 1, IDIOM_NO_OPERAND, false, false },
+      { C_PUSH, "that", 0, IDIOM_NO_OPERAND, false, false } } },
+  /* let a[expression] = x */
+  { IDIOM_ARRAY_STORE, 5,
+    { { C_PUSH, NULL, IDIOM_ANY_INDEX, 0, false, false },
+      { C_POP, "temp", 0, IDIOM_NO_OPERAND, false, false },
+      { C_POP, "pointer", 1, IDIOM_NO_OPERAND, false, false },
+      { C_PUSH, "temp", 0, IDIOM_NO_OPERAND, false, false },
+      { C_POP, "that", 0, IDIOM_NO_OPERAND, false, false } } },
+  /* let a[expression] = expression */
+  { IDIOM_ARRAY_WRITE, 4,
+    { { C_POP, "temp", 0, IDIOM_NO_OPERAND, false, false },
+      { C_POP, "pointer", 1, IDIOM_NO_OPERAND, false, false },
+      { C_PUSH, "temp", 0, IDIOM_NO_OPERAND, false, false },
+      { C_POP, "that", 0, IDIOM_NO_OPERAND, false, false } } },
+  /* expression * 2^k */
+  { IDIOM_MULTIPLY, 2,
+    { { C_PUSH, "constant", IDIOM_ANY_INDEX, 0, false, true },
+      { C_CALL, "Math.multiply", 2, IDIOM_NO_OPERAND, false, false } } },
+  /* 2^k * x */
+  { IDIOM_MULTIPLY, 3,
+    { { C_PUSH, "constant", IDIOM_ANY_INDEX, 0, false, true },
+      { C_PUSH, NULL, IDIOM_ANY_INDEX, 1, false, false },
+      { C_CALL, "Math.multiply", 2, IDIOM_NO_OPERAND, false, false } } },
+};
+
+/* Names of the idiom kinds, reported by --stats */
+static const char *idiom_kind_names[IDIOM_KIND_COUNT] =
+{
+  "increment",
+  "array-read",
+  "array-load",
+  "array-store",
+  "array-write",
+  "multiply",
+};
+
+/* Every pattern element may need a node of its own, plus the root */
+#define IDIOM_TRIE_MAX_NODES \
+  (IDIOM_PATTERN_TABLE_SIZE * IDIOM_PATTERN_MAX_LENGTH + 1)
+
+/* A node of the trie, reached from its parent through element */
+typedef struct IdiomTrieNode
+{
+  const IdiomElement *element;
+  size_t             first_child;
+  size_t             next_sibling;
+  /* Pattern that ends at the node, or IDIOM_NO_PATTERN */
+  size_t             pattern;
+} IdiomTrieNode;
+
+struct IdiomMatcher
+{
+  /* The root is the first node */
+  IdiomTrieNode nodes[IDIOM_TRIE_MAX_NODES];
+  size_t        node_count;
+};
+
+/* Internal Functions */
+
+/* Checks if two pattern elements match the same commands */
+bool idiom_elements_equal(const IdiomElement *a, const IdiomElement *b);
+
+/* Checks if a command matches a pattern element, given the commands
+ * captured so far into each operand */
+bool idiom_element_matches(const IdiomElement *element,
+                           const VmCommand *command,
+                           const VmCommand **captures);
+
+/* Walks the trie from node, matching the command at index command.
+ * Records in best the longest pattern found so far and its length
+ * in best_length */
+void idiom_trie_match(const IdiomMatcher *matcher, size_t node,
+                      const VmFile *file, size_t command, size_t length,
+                      const VmCommand **captures,
+                      size_t *best, size_t *best_length);
+
+/* Checks if the commands from start overwrite a register before any
+ * of them reads it. For pointer 1, the that segment reads it too */
+bool idiom_register_is_dead(const VmFile *file, size_t start,
+                            MemorySegment segment, int index);
+
+/* End Internal Functions */
+
+/* Builds the trie of the patterns of the selected kinds */
+IdiomMatcher *idiom_matcher_init(unsigned int kinds)
+{
+  IdiomMatcher *matcher = NULL;
+  const IdiomPattern *pattern = NULL;
+  size_t node, child, last;
+  size_t p, k;
+
+  matcher = (IdiomMatcher *)malloc(sizeof(IdiomMatcher));
+
+  if (!matcher)
+    return NULL;
+
+  matcher->nodes[0].element = NULL;
+  matcher->nodes[0].first_child = IDIOM_NO_NODE;
+  matcher->nodes[0].next_sibling = IDIOM_NO_NODE;
+  matcher->nodes[0].pattern = IDIOM_NO_PATTERN;
+  matcher->node_count = 1;
+
+  for (p = 0; p < IDIOM_PATTERN_TABLE_SIZE; p++)
+  {
+    pattern = &idiom_pattern_table[p];
+    node = 0;
+
+    if (!(kinds & IDIOM_KIND_BIT(pattern->kind)))
+      continue;
+
+    for (k = 0; k < pattern->length; k++)
+    {
+      last = IDIOM_NO_NODE;
+
+      for (child = matcher->nodes[node].first_child; child != IDIOM_NO_NODE;
+           child = matcher->nodes[child].next_sibling)
+      {
+        if (idiom_elements_equal(matcher->nodes[child].element,
+                                 &pattern->elements[k]))
+          break;
+
+        last = child;
+      }
+
+      /* New children go last, so earlier patterns are tried first */
+      if (child == IDIOM_NO_NODE)
+      {
+        assert(matcher->node_count < IDIOM_TRIE_MAX_NODES);
+
+        child = matcher->node_count++;
+        matcher->nodes[child].element = &pattern->elements[k];
+        matcher->nodes[child].first_child = IDIOM_NO_NODE;
+        matcher->nodes[child].next_sibling = IDIOM_NO_NODE;
+        matcher->nodes[child].pattern = IDIOM_NO_PATTERN;
+
+        if (last == IDIOM_NO_NODE)
+          matcher->nodes[node].first_child = child;
+        else
+          matcher->nodes[last].next_sibling = child;
+      }
+
+      node = child;
+    }
+
+    if (matcher->nodes[node].pattern == IDIOM_NO_PATTERN)
+      matcher->nodes[node].pattern = p;
+  }
+
+  return matcher;
+}
+
+/* Finds the longest idiom starting at a command */
+size_t idiom_match(const IdiomMatcher *matcher, const VmFile *file,
+                   size_t start, Idiom *idiom)
+{
+  const VmCommand *captures[IDIOM_MAX_OPERANDS] = { NULL };
+  const IdiomPattern *pattern = NULL;
+  const IdiomElement *element = NULL;
+  const VmCommand *command = NULL;
+  size_t best = IDIOM_NO_PATTERN;
+  size_t best_length = 0;
+  size_t k;
+
+  assert(matcher);
+  assert(file);
+  assert(idiom);
+
+  idiom_trie_match(matcher, 0, file, start, 0, captures, &best, &best_length);
+
+  if (best == IDIOM_NO_PATTERN)
+    return 0;
+
+  pattern = &idiom_pattern_table[best];
+
+  idiom->kind = pattern->kind;
+  idiom->name = idiom_kind_names[pattern->kind];
+  idiom->operand_count = 0;
+  idiom->operation = NULL;
+
+  for (k = 0; k < pattern->length; k++)
+  {
+    element = &pattern->elements[k];
+    command = &file->commands[start + k];
+
+    if (command->type == C_ARITHMETIC)
+      idiom->operation = command->arg1;
+
+    if (element->operand != IDIOM_NO_OPERAND && !element->repeat)
+    {
+      idiom->operands[element->operand].segment = command->arg1;
+      idiom->operands[element->operand].index = command->arg2;
+
+      if ((size_t)element->operand >= idiom->operand_count)
+        idiom->operand_count = element->operand + 1;
+    }
+  }
+
+  idiom->that_dead = idiom_register_is_dead(file, start + pattern->length,
+                                            "pointer", 1);
+  idiom->temp_dead = idiom_register_is_dead(file, start + pattern->length,
+                                            "temp", 0);
+
+  return pattern->length;
+}
+
+/* Returns the name of an idiom kind */
+const char *idiom_kind_name(IdiomKind kind)
+{
+  assert(kind < IDIOM_KIND_COUNT);
+
+  return idiom_kind_names[kind];
+}
+
+/* Frees the matcher */
+void idiom_matcher_fini(IdiomMatcher *matcher)
+{
+  free(matcher);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+bool idiom_elements_equal(const IdiomElement *a, const IdiomElement *b)
+{
+  if (a->type != b->type || a->arg2 != b->arg2 ||
+      a->operand != b->operand || a->repeat != b->repeat ||
+      a->power_of_two != b->power_of_two)
+    return false;
+
+  if (!a->arg1 || !b->arg1)
+    return a->arg1 == b->arg1;
+
+  return strcmp(a->arg1, b->arg1) == 0;
+}
+
+bool idiom_element_matches(const IdiomElement *element,
+                           const VmCommand *command,
+                           const VmCommand **captures)
+{
+  const VmCommand *captured = NULL;
+
+  if (command->type != element->type)
+    return false;
+
+  if (element->arg1 && strcmp(command->arg1, element->arg1) != 0)
+    return false;
+
+  if (element->arg2 != IDIOM_ANY_INDEX && command->arg2 != element->arg2)
+    return false;
+
+  if (element->power_of_two &&
+      (command->arg2 <= 0 || (command->arg2 & (command->arg2 - 1)) != 0))
+    return false;
+
+  if (element->operand == IDIOM_NO_OPERAND || !element->repeat)
+    return true;
+
+  captured = captures[element->operand];
+
+  return captured && captured->arg2 == command->arg2 &&
+         strcmp(captured->arg1, command->arg1) == 0;
+}
+
+void idiom_trie_match(const IdiomMatcher *matcher, size_t node,
+                      const VmFile *file, size_t command, size_t length,
+                      const VmCommand **captures,
+                      size_t *best, size_t *best_length)
+{
+  const IdiomTrieNode *child = NULL;
+  const VmCommand *previous = NULL;
+  size_t c;
+
+  if (matcher->nodes[node].pattern != IDIOM_NO_PATTERN && length > *best_length)
+  {
+    *best = matcher->nodes[node].pattern;
+    *best_length = length;
+  }
+
+  if (command >= file->command_count)
+    return;
+
+  for (c = matcher->nodes[node].first_child; c != IDIOM_NO_NODE;
+       c = child->next_sibling)
+  {
+    child = &matcher->nodes[c];
+
+    if (!idiom_element_matches(child->element, &file->commands[command], captures))
+      continue;
+
+    /* Capture for the deeper nodes and restore for the siblings */
+    if (child->element->operand != IDIOM_NO_OPERAND && !child->element->repeat)
+    {
+      previous = captures[child->element->operand];
+      captures[child->element->operand] = &file->commands[command];
+    }
+
+    idiom_trie_match(matcher, c, file, command + 1, length + 1,
+                     captures, best, best_length);
+
+    if (child->element->operand != IDIOM_NO_OPERAND && !child->element->repeat)
+      captures[child->element->operand] = previous;
+  }
+}
+
+bool idiom_register_is_dead(const VmFile *file, size_t start,
+                            MemorySegment segment, int index)
+{
+  const VmCommand *command = NULL;
+  bool sets_that = strcmp(segment, "pointer") == 0 && index == 1;
+  size_t i;
+
+  for (i = start; i < file->command_count; i++)
+  {
+    command = &file->commands[i];
+
+    switch (command->type)
+    {
+      case C_PUSH:
+      case C_POP:
+        if (sets_that && strcmp(command->arg1, "that") == 0)
+          return false;
+
+        if (command->arg2 == index && strcmp(command->arg1, segment) == 0)
+          return command->type == C_POP;
+
+        break;
+      case C_ARITHMETIC:
+        break;
+      /* Other functions and code reached through jumps may read it */
+      default:
+        return false;
+    }
+  }
+
+  return false;
+}
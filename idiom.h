@@ -0,0 +1,46 @@
+/* idiom.h: Recognizes the command sequences the code writer
+ *          translates as a single unit
+ */
+#ifndef IDIOM_H
+#define IDIOM_H
+
+#include <stddef.h>
+#include "translator_common.h"
+#include "vm_program.h"
+
+/* Matches the idioms of the pattern table against the command stream,
+ * with a trie sharing the common prefixes of the patterns */
+typedef struct IdiomMatcher IdiomMatcher;
+
+/* Idioms translated and the instructions they saved */
+typedef struct IdiomStats
+{
+  unsigned long matches[IDIOM_KIND_COUNT];
+  long          saved_words[IDIOM_KIND_COUNT];
+} IdiomStats;
+
+/* Selects an idiom kind in the mask given to idiom_matcher_init */
+#define IDIOM_KIND_BIT(kind) (1u << (kind))
+
+/* Builds the trie of the patterns of the kinds set in kinds, a mask
+ * of IDIOM_KIND_BIT values
+ *
+ * Returns the matcher, or NULL if it could not be allocated
+ */
+IdiomMatcher *idiom_matcher_init(unsigned int kinds);
+
+/* Finds the longest idiom starting at command start of file and
+ * describes it in idiom
+ *
+ * Returns the number of commands of the idiom, or 0 if none starts there
+ */
+size_t idiom_match(const IdiomMatcher *matcher, const VmFile *file,
+                   size_t start, Idiom *idiom);
+
+/* Returns the name of an idiom kind */
+const char *idiom_kind_name(IdiomKind kind);
+
+/* Frees the matcher */
+void idiom_matcher_fini(IdiomMatcher *matcher);
+
+#endif
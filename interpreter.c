@@ -0,0 +1,860 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "interpreter.h"
+
+#define RAM_ADDRESS_MASK (INTERPRETER_RAM_WORDS - 1)
+
+/* Pointer registers at the start of RAM */
+#define RAM_SP 0
+#define RAM_LCL 1
+#define RAM_ARG 2
+#define RAM_THIS 3
+#define RAM_THAT 4
+
+/* Words saved by a call below the locals of the callee */
+#define FRAME_WORDS 5
+
+/* Return addresses are stored in 16-bit RAM words */
+#define INTERPRETER_MAX_INSTRUCTIONS 32768
+
+/* Instructions before the first function: call Sys.init 0, and the
+ * end of the program it returns to */
+#define BOOTSTRAP_FUNCTION "Sys.init"
+#define BOOTSTRAP_INSTRUCTIONS 2
+
+/* Marks a call to a function the program does not define */
+#define UNDEFINED_TARGET ((unsigned int)-1)
+
+/* Operations of the compiled program, one per VM command except
+ * labels. Segment accesses whose address is known before running,
+ * pointer, temp and static, all become RAM accesses */
+typedef enum InterpreterOpcode
+{
+  OP_PUSH_CONSTANT,
+  OP_PUSH_LOCAL,
+  OP_PUSH_ARGUMENT,
+  OP_PUSH_THIS,
+  OP_PUSH_THAT,
+  OP_PUSH_RAM,
+  OP_POP_LOCAL,
+  OP_POP_ARGUMENT,
+  OP_POP_THIS,
+  OP_POP_THAT,
+  OP_POP_RAM,
+  OP_ADD,
+  OP_SUB,
+  OP_NEG,
+  OP_EQ,
+  OP_GT,
+  OP_LT,
+  OP_AND,
+  OP_OR,
+  OP_NOT,
+  OP_GOTO,
+  OP_IF_GOTO,
+  OP_HALT,
+  OP_FUNCTION,
+  OP_CALL,
+  OP_RETURN,
+  OP_END,
+  OP_COUNT
+} InterpreterOpcode;
+
+/* A compiled command. operand is the constant, the segment index or
+ * RAM address, the number of locals or the number of arguments, and
+ * target the instruction a jump or call goes to */
+typedef struct InterpreterInstruction
+{
+  InterpreterOpcode opcode;
+  int               operand;
+  unsigned int      target;
+  /* Callee of a call, for error messages */
+  const char        *name;
+  /* Position of the command in the program, labels included */
+  size_t            command;
+} InterpreterInstruction;
+
+typedef struct InterpreterArithmeticEntry
+{
+  const char        *command;
+  InterpreterOpcode opcode;
+} InterpreterArithmeticEntry;
+
+#define INTERPRETER_ARITHMETIC_TABLE_SIZE 9
+
+static const InterpreterArithmeticEntry
+  interpreter_arithmetic_table[INTERPRETER_ARITHMETIC_TABLE_SIZE] =
+{
+  { "add", OP_ADD },
+  { "sub", OP_SUB },
+  { "neg", OP_NEG },
+  { "eq", OP_EQ },
+  { "gt", OP_GT },
+  { "lt", OP_LT },
+  { "and", OP_AND },
+  { "or", OP_OR },
+  { "not", OP_NOT },
+};
+
+/* Segments addressed through a pointer register */
+typedef struct InterpreterSegmentEntry
+{
+  const char        *segment;
+  InterpreterOpcode push_opcode;
+  InterpreterOpcode pop_opcode;
+} InterpreterSegmentEntry;
+
+#define INTERPRETER_SEGMENT_TABLE_SIZE 4
+
+static const InterpreterSegmentEntry
+  interpreter_segment_table[INTERPRETER_SEGMENT_TABLE_SIZE] =
+{
+  { "local", OP_PUSH_LOCAL, OP_POP_LOCAL },
+  { "argument", OP_PUSH_ARGUMENT, OP_POP_ARGUMENT },
+  { "this", OP_PUSH_THIS, OP_POP_THIS },
+  { "that", OP_PUSH_THAT, OP_POP_THAT },
+};
+
+/* A function or label and the instruction it starts at */
+typedef struct InterpreterSymbol
+{
+  const char   *name;
+  unsigned int instruction;
+} InterpreterSymbol;
+
+struct Interpreter
+{
+  unsigned short         ram[INTERPRETER_RAM_WORDS];
+  InterpreterInstruction *instructions;
+  size_t                 instruction_count;
+  /* Next instruction */
+  unsigned int           pc;
+  unsigned long long     command_count;
+  /* Executions of each instruction, or NULL when not counting */
+  unsigned long long     *counts;
+};
+
+/* State of the compilation of a program */
+typedef struct InterpreterCompiler
+{
+  Interpreter       *interpreter;
+  /* Functions sorted by name */
+  InterpreterSymbol *functions;
+  size_t            function_count;
+  /* Labels of the function being compiled and the jumps to them */
+  InterpreterSymbol *labels;
+  size_t            label_count;
+  InterpreterSymbol *jumps;
+  size_t            jump_count;
+  /* RAM address of each static variable of the file being compiled,
+   * 0 until it is first used */
+  int               *statics;
+  size_t            static_count;
+  int               next_static;
+  /* Position in the program of the command being compiled */
+  size_t            command;
+} InterpreterCompiler;
+
+/* Internal Functions */
+
+/* Orders symbols by name */
+int interpreter_symbol_compare(const void *a, const void *b);
+
+/* Finds the instruction a function starts at
+ *
+ * Returns the instruction, or UNDEFINED_TARGET if it is not defined
+ */
+unsigned int interpreter_function_lookup(const InterpreterCompiler *compiler,
+                                         const char *name);
+
+/* Compiles every command of the program after the bootstrap code */
+InterpreterStatus interpreter_compile_program(InterpreterCompiler *compiler,
+                                              const VmProgram *program);
+
+/* Compiles a command into the next instruction */
+InterpreterStatus interpreter_compile_command(InterpreterCompiler *compiler,
+                                              const VmCommand *command);
+
+/* Compiles a push or pop */
+InterpreterStatus interpreter_compile_push_pop(InterpreterCompiler *compiler,
+                                               const VmCommand *command,
+                                               InterpreterInstruction *instruction);
+
+/* Points the jumps of the function just compiled to its labels */
+InterpreterStatus interpreter_resolve_labels(InterpreterCompiler *compiler,
+                                             const char *function_name);
+
+/* End Internal Functions */
+
+/* Creates an interpreter with cleared RAM */
+Interpreter *interpreter_init(void)
+{
+  return (Interpreter *)calloc(1, sizeof(Interpreter));
+}
+
+/* Compiles a program and gets ready to run it from the bootstrap code */
+InterpreterStatus interpreter_load(Interpreter *interpreter,
+                                   const VmProgram *program)
+{
+  InterpreterCompiler compiler = { NULL, NULL, 0, NULL, 0, NULL, 0, NULL, 0,
+                                   STATIC_SEGMENT_BASE, 0 };
+  InterpreterStatus status;
+  const VmCommand *command = NULL;
+  size_t count = BOOTSTRAP_INSTRUCTIONS;
+  size_t label_count = 0;
+  size_t i, j;
+
+  assert(interpreter);
+  assert(program);
+
+  free(interpreter->instructions);
+  free(interpreter->counts);
+  interpreter->instructions = NULL;
+  interpreter->instruction_count = 0;
+  interpreter->counts = NULL;
+  compiler.interpreter = interpreter;
+
+  /* Every command but labels is an instruction */
+  for (i = 0; i < program->file_count; i++)
+  {
+    for (j = 0; j < program->files[i].command_count; j++)
+    {
+      command = &program->files[i].commands[j];
+
+      if (command->type == C_FUNCTION)
+        compiler.function_count++;
+      else if (command->type == C_LABEL || command->type == C_GOTO ||
+               command->type == C_IF)
+        label_count++;
+
+      if (command->type != C_LABEL)
+        count++;
+    }
+  }
+
+  if (count > INTERPRETER_MAX_INSTRUCTIONS)
+  {
+    fprintf(stderr, "interpreter: The program has too many commands\n");
+    return INTERPRETER_INVALID_COMMAND;
+  }
+
+  interpreter->instructions =
+    (InterpreterInstruction *)calloc(count, sizeof(InterpreterInstruction));
+  compiler.functions = (InterpreterSymbol *)malloc((compiler.function_count + 1) *
+                                                   sizeof(InterpreterSymbol));
+  compiler.labels = (InterpreterSymbol *)malloc((label_count + 1) *
+                                                sizeof(InterpreterSymbol));
+  compiler.jumps = (InterpreterSymbol *)malloc((label_count + 1) *
+                                               sizeof(InterpreterSymbol));
+
+  if (!interpreter->instructions || !compiler.functions ||
+      !compiler.labels || !compiler.jumps)
+    status = INTERPRETER_FAIL_ALLOC;
+  else
+    status = interpreter_compile_program(&compiler, program);
+
+  free(compiler.functions);
+  free(compiler.labels);
+  free(compiler.jumps);
+  free(compiler.statics);
+
+  if (status != INTERPRETER_SUCC)
+  {
+    free(interpreter->instructions);
+    interpreter->instructions = NULL;
+    interpreter->instruction_count = 0;
+    return status;
+  }
+
+  interpreter->ram[RAM_SP] = VM_STACK_BASE;
+  interpreter->pc = 0;
+  interpreter->command_count = 0;
+
+  return INTERPRETER_SUCC;
+}
+
+/* Executes commands until the program halts or a limit is reached.
+ * Each operation jumps straight to the code of the next one through
+ * a table of label addresses, a GNU C extension */
+InterpreterStatus interpreter_run(Interpreter *interpreter,
+                                  unsigned long long max_commands)
+{
+  static const void *handlers[OP_COUNT] =
+  {
+    [OP_PUSH_CONSTANT] = &&push_constant,
+    [OP_PUSH_LOCAL] = &&push_local,
+    [OP_PUSH_ARGUMENT] = &&push_argument,
+    [OP_PUSH_THIS] = &&push_this,
+    [OP_PUSH_THAT] = &&push_that,
+    [OP_PUSH_RAM] = &&push_ram,
+    [OP_POP_LOCAL] = &&pop_local,
+    [OP_POP_ARGUMENT] = &&pop_argument,
+    [OP_POP_THIS] = &&pop_this,
+    [OP_POP_THAT] = &&pop_that,
+    [OP_POP_RAM] = &&pop_ram,
+    [OP_ADD] = &&add,
+    [OP_SUB] = &&sub,
+    [OP_NEG] = &&neg,
+    [OP_EQ] = &&eq,
+    [OP_GT] = &&gt,
+    [OP_LT] = &&lt,
+    [OP_AND] = &&and,
+    [OP_OR] = &&or,
+    [OP_NOT] = &&not,
+    [OP_GOTO] = &&jump,
+    [OP_IF_GOTO] = &&if_jump,
+    [OP_HALT] = &&halt,
+    [OP_FUNCTION] = &&function,
+    [OP_CALL] = &&call,
+    [OP_RETURN] = &&return_,
+    [OP_END] = &&end,
+  };
+  const InterpreterInstruction *instructions = NULL;
+  const InterpreterInstruction *instruction = NULL;
+  unsigned short *ram = NULL;
+  unsigned long long *counts = NULL;
+  unsigned long long count;
+  unsigned long long limit;
+  InterpreterStatus status;
+  unsigned short x, y;
+  unsigned int frame;
+  unsigned int address;
+  int k;
+
+  assert(interpreter);
+
+  if (!interpreter->instructions)
+    return INTERPRETER_INVALID_COMMAND;
+
+  instructions = interpreter->instructions;
+  instruction = &instructions[interpreter->pc];
+  ram = interpreter->ram;
+  counts = interpreter->counts;
+  count = interpreter->command_count;
+  limit = count + max_commands < count ? (unsigned long long)-1 : count + max_commands;
+
+/* Words of RAM, addresses wrap around as on the Hack computer */
+#define RAM(address) ram[(address) & RAM_ADDRESS_MASK]
+#define PUSH(value) (RAM(ram[RAM_SP]) = (value), ram[RAM_SP]++)
+#define POP() (ram[RAM_SP]--, RAM(ram[RAM_SP]))
+#define TOP RAM(ram[RAM_SP] - 1)
+#define DISPATCH() \
+  do { \
+    if (count == limit) { status = INTERPRETER_COMMAND_LIMIT; goto stop; } \
+    count++; \
+    if (counts) counts[instruction - instructions]++; \
+    goto *handlers[instruction->opcode]; \
+  } while (0)
+#define NEXT() do { instruction++; DISPATCH(); } while (0)
+
+  DISPATCH();
+
+push_constant:
+  PUSH((unsigned short)instruction->operand);
+  NEXT();
+push_local:
+  PUSH(RAM(ram[RAM_LCL] + instruction->operand));
+  NEXT();
+push_argument:
+  PUSH(RAM(ram[RAM_ARG] + instruction->operand));
+  NEXT();
+push_this:
+  PUSH(RAM(ram[RAM_THIS] + instruction->operand));
+  NEXT();
+push_that:
+  PUSH(RAM(ram[RAM_THAT] + instruction->operand));
+  NEXT();
+push_ram:
+  PUSH(ram[instruction->operand]);
+  NEXT();
+pop_local:
+  address = ram[RAM_LCL] + instruction->operand;
+  RAM(address) = POP();
+  NEXT();
+pop_argument:
+  address = ram[RAM_ARG] + instruction->operand;
+  RAM(address) = POP();
+  NEXT();
+pop_this:
+  address = ram[RAM_THIS] + instruction->operand;
+  RAM(address) = POP();
+  NEXT();
+pop_that:
+  address = ram[RAM_THAT] + instruction->operand;
+  RAM(address) = POP();
+  NEXT();
+pop_ram:
+  ram[instruction->operand] = POP();
+  NEXT();
+add:
+  y = POP();
+  TOP += y;
+  NEXT();
+sub:
+  y = POP();
+  TOP -= y;
+  NEXT();
+neg:
+  TOP = (unsigned short)-TOP;
+  NEXT();
+/* Comparisons test the sign of x - y, as the translated code does */
+eq:
+  y = POP();
+  TOP = TOP == y ? 0xFFFF : 0;
+  NEXT();
+gt:
+  y = POP();
+  x = TOP;
+  TOP = (short)(unsigned short)(x - y) > 0 ? 0xFFFF : 0;
+  NEXT();
+lt:
+  y = POP();
+  x = TOP;
+  TOP = (short)(unsigned short)(x - y) < 0 ? 0xFFFF : 0;
+  NEXT();
+and:
+  y = POP();
+  TOP &= y;
+  NEXT();
+or:
+  y = POP();
+  TOP |= y;
+  NEXT();
+not:
+  TOP = (unsigned short)~TOP;
+  NEXT();
+jump:
+  instruction = &instructions[instruction->target];
+  DISPATCH();
+if_jump:
+  if (POP() != 0)
+  {
+    instruction = &instructions[instruction->target];
+    DISPATCH();
+  }
+  NEXT();
+halt:
+  status = INTERPRETER_HALTED;
+  goto stop;
+function:
+  for (k = 0; k < instruction->operand; k++)
+    PUSH(0);
+  NEXT();
+call:
+  if (instruction->target == UNDEFINED_TARGET)
+  {
+    fprintf(stderr, "interpreter: %s is not defined\n", instruction->name);
+    status = INTERPRETER_UNDEFINED_FUNCTION;
+    goto stop;
+  }
+  PUSH((unsigned short)(instruction - instructions + 1));
+  PUSH(ram[RAM_LCL]);
+  PUSH(ram[RAM_ARG]);
+  PUSH(ram[RAM_THIS]);
+  PUSH(ram[RAM_THAT]);
+  ram[RAM_ARG] = (unsigned short)(ram[RAM_SP] - FRAME_WORDS - instruction->operand);
+  ram[RAM_LCL] = ram[RAM_SP];
+  instruction = &instructions[instruction->target];
+  DISPATCH();
+return_:
+  frame = ram[RAM_LCL];
+  address = RAM(frame - FRAME_WORDS);
+  RAM(ram[RAM_ARG]) = POP();
+  ram[RAM_SP] = (unsigned short)(ram[RAM_ARG] + 1);
+  ram[RAM_THAT] = RAM(frame - 1);
+  ram[RAM_THIS] = RAM(frame - 2);
+  ram[RAM_ARG] = RAM(frame - 3);
+  ram[RAM_LCL] = RAM(frame - 4);
+  if (address >= interpreter->instruction_count)
+  {
+    fprintf(stderr, "interpreter: Return to invalid address %u\n", address);
+    status = INTERPRETER_INVALID_COMMAND;
+    goto stop;
+  }
+  instruction = &instructions[address];
+  DISPATCH();
+end:
+  status = INTERPRETER_RETURNED;
+
+stop:
+#undef RAM
+#undef PUSH
+#undef POP
+#undef TOP
+#undef DISPATCH
+#undef NEXT
+
+  interpreter->pc = (unsigned int)(instruction - instructions);
+  interpreter->command_count = count;
+
+  return status;
+}
+
+/* Counts the executions of each command from now on */
+InterpreterStatus interpreter_set_counting(Interpreter *interpreter, bool counting)
+{
+  assert(interpreter);
+
+  free(interpreter->counts);
+  interpreter->counts = NULL;
+
+  if (!counting || !interpreter->instructions)
+    return INTERPRETER_SUCC;
+
+  interpreter->counts = (unsigned long long *)calloc(interpreter->instruction_count,
+                                                     sizeof(unsigned long long));
+
+  return interpreter->counts ? INTERPRETER_SUCC : INTERPRETER_FAIL_ALLOC;
+}
+
+/* Stores the executions of each command of the program */
+void interpreter_command_counts(const Interpreter *interpreter,
+                                unsigned long long *counts, size_t count)
+{
+  const InterpreterInstruction *instruction = NULL;
+  size_t i;
+
+  assert(interpreter);
+  assert(counts || count == 0);
+
+  memset(counts, 0, count * sizeof(unsigned long long));
+
+  if (!interpreter->counts)
+    return;
+
+  /* The bootstrap code belongs to no command */
+  for (i = BOOTSTRAP_INSTRUCTIONS; i < interpreter->instruction_count; i++)
+  {
+    instruction = &interpreter->instructions[i];
+
+    if (instruction->command < count)
+      counts[instruction->command] = interpreter->counts[i];
+  }
+}
+
+/* Returns the RAM of the interpreter */
+unsigned short *interpreter_ram(Interpreter *interpreter)
+{
+  assert(interpreter);
+
+  return interpreter->ram;
+}
+
+/* Returns the number of commands executed */
+unsigned long long interpreter_command_count(const Interpreter *interpreter)
+{
+  assert(interpreter);
+
+  return interpreter->command_count;
+}
+
+/* Frees the interpreter */
+void interpreter_fini(Interpreter *interpreter)
+{
+  if (!interpreter) return;
+
+  free(interpreter->instructions);
+  free(interpreter->counts);
+  free(interpreter);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+int interpreter_symbol_compare(const void *a, const void *b)
+{
+  return strcmp(((const InterpreterSymbol *)a)->name,
+                ((const InterpreterSymbol *)b)->name);
+}
+
+unsigned int interpreter_function_lookup(const InterpreterCompiler *compiler,
+                                         const char *name)
+{
+  InterpreterSymbol key = { name, 0 };
+  const InterpreterSymbol *function = NULL;
+
+  function = (const InterpreterSymbol *)bsearch(&key, compiler->functions,
+                                                compiler->function_count,
+                                                sizeof(InterpreterSymbol),
+                                                interpreter_symbol_compare);
+
+  return function ? function->instruction : UNDEFINED_TARGET;
+}
+
+InterpreterStatus interpreter_compile_program(InterpreterCompiler *compiler,
+                                              const VmProgram *program)
+{
+  InterpreterStatus status = INTERPRETER_SUCC;
+  InterpreterInstruction *bootstrap = NULL;
+  const VmFile *file = NULL;
+  const VmCommand *command = NULL;
+  const char *function_name = NULL;
+  size_t count;
+  size_t i, j;
+
+  /* Functions start at the instruction of their function command */
+  compiler->function_count = 0;
+  count = BOOTSTRAP_INSTRUCTIONS;
+
+  for (i = 0; i < program->file_count; i++)
+  {
+    for (j = 0; j < program->files[i].command_count; j++)
+    {
+      command = &program->files[i].commands[j];
+
+      if (command->type == C_FUNCTION)
+      {
+        compiler->functions[compiler->function_count].name = command->arg1;
+        compiler->functions[compiler->function_count].instruction = (unsigned int)count;
+        compiler->function_count++;
+      }
+
+      if (command->type != C_LABEL)
+        count++;
+    }
+  }
+
+  qsort(compiler->functions, compiler->function_count, sizeof(InterpreterSymbol),
+        interpreter_symbol_compare);
+
+  bootstrap = compiler->interpreter->instructions;
+  bootstrap[0].opcode = OP_CALL;
+  bootstrap[0].operand = 0;
+  bootstrap[0].name = BOOTSTRAP_FUNCTION;
+  bootstrap[0].target = interpreter_function_lookup(compiler, BOOTSTRAP_FUNCTION);
+  bootstrap[1].opcode = OP_END;
+  compiler->interpreter->instruction_count = BOOTSTRAP_INSTRUCTIONS;
+
+  for (i = 0; i < program->file_count && status == INTERPRETER_SUCC; i++)
+  {
+    file = &program->files[i];
+    function_name = "";
+
+    /* Statics are numbered per file */
+    free(compiler->statics);
+    compiler->statics = NULL;
+    compiler->static_count = 0;
+
+    for (j = 0; j < file->command_count; j++)
+    {
+      command = &file->commands[j];
+
+      if ((command->type == C_PUSH || command->type == C_POP) &&
+          strcmp(command->arg1, "static") == 0 && command->arg2 >= 0 &&
+          (size_t)command->arg2 >= compiler->static_count)
+        compiler->static_count = (size_t)command->arg2 + 1;
+    }
+
+    compiler->statics = (int *)calloc(compiler->static_count + 1, sizeof(int));
+
+    if (!compiler->statics)
+    {
+      status = INTERPRETER_FAIL_ALLOC;
+      break;
+    }
+
+    for (j = 0; j < file->command_count && status == INTERPRETER_SUCC; j++)
+    {
+      command = &file->commands[j];
+
+      /* Labels belong to the function they appear in */
+      if (command->type == C_FUNCTION)
+      {
+        status = interpreter_resolve_labels(compiler, function_name);
+        function_name = command->arg1;
+      }
+
+      if (status == INTERPRETER_SUCC)
+        status = interpreter_compile_command(compiler, command);
+
+      compiler->command++;
+
+      if (status != INTERPRETER_SUCC && status != INTERPRETER_UNDEFINED_LABEL)
+        fprintf(stderr, "interpreter: Invalid command at %s:%u\n",
+                file->filename, command->line);
+    }
+
+    if (status == INTERPRETER_SUCC)
+      status = interpreter_resolve_labels(compiler, function_name);
+  }
+
+  return status;
+}
+
+InterpreterStatus interpreter_compile_command(InterpreterCompiler *compiler,
+                                              const VmCommand *command)
+{
+  Interpreter *interpreter = compiler->interpreter;
+  InterpreterInstruction *instruction = NULL;
+  unsigned int index = (unsigned int)interpreter->instruction_count;
+  int i;
+
+  /* A label marks the next instruction */
+  if (command->type == C_LABEL)
+  {
+    compiler->labels[compiler->label_count].name = command->arg1;
+    compiler->labels[compiler->label_count].instruction = index;
+    compiler->label_count++;
+    return INTERPRETER_SUCC;
+  }
+
+  instruction = &interpreter->instructions[index];
+  instruction->operand = command->arg2;
+  instruction->target = 0;
+  instruction->name = NULL;
+  instruction->command = compiler->command;
+
+  switch (command->type)
+  {
+    case C_ARITHMETIC:
+      for (i = 0; i < INTERPRETER_ARITHMETIC_TABLE_SIZE; i++)
+      {
+        if (strcmp(command->arg1, interpreter_arithmetic_table[i].command) == 0)
+          break;
+      }
+
+      if (i == INTERPRETER_ARITHMETIC_TABLE_SIZE)
+        return INTERPRETER_INVALID_COMMAND;
+
+      instruction->opcode = interpreter_arithmetic_table[i].opcode;
+      break;
+    case C_PUSH:
+    case C_POP:
+      if (interpreter_compile_push_pop(compiler, command, instruction) !=
+          INTERPRETER_SUCC)
+        return INTERPRETER_INVALID_COMMAND;
+      break;
+    case C_GOTO:
+    case C_IF:
+      /* Labels may come after the jump, they are resolved at the end
+       * of the function */
+      instruction->opcode = command->type == C_GOTO ? OP_GOTO : OP_IF_GOTO;
+      compiler->jumps[compiler->jump_count].name = command->arg1;
+      compiler->jumps[compiler->jump_count].instruction = index;
+      compiler->jump_count++;
+      break;
+    case C_FUNCTION:
+      if (command->arg2 < 0)
+        return INTERPRETER_INVALID_COMMAND;
+
+      instruction->opcode = OP_FUNCTION;
+      break;
+    case C_CALL:
+      if (command->arg2 < 0)
+        return INTERPRETER_INVALID_COMMAND;
+
+      instruction->opcode = OP_CALL;
+      instruction->name = command->arg1;
+      instruction->target = interpreter_function_lookup(compiler, command->arg1);
+      break;
+    case C_RETURN:
+      instruction->opcode = OP_RETURN;
+      break;
+    default:
+      return INTERPRETER_INVALID_COMMAND;
+  }
+
+  interpreter->instruction_count++;
+
+  return INTERPRETER_SUCC;
+}
+
+InterpreterStatus interpreter_compile_push_pop(InterpreterCompiler *compiler,
+                                               const VmCommand *command,
+                                               InterpreterInstruction *instruction)
+{
+  bool push = command->type == C_PUSH;
+  int index = command->arg2;
+  int i;
+
+  /* Folded constants may be negative */
+  if (strcmp(command->arg1, "constant") == 0)
+  {
+    if (!push || index < VM_WORD_MIN || index > VM_WORD_MAX)
+      return INTERPRETER_INVALID_COMMAND;
+
+    instruction->opcode = OP_PUSH_CONSTANT;
+    return INTERPRETER_SUCC;
+  }
+
+  if (index < 0)
+    return INTERPRETER_INVALID_COMMAND;
+
+  for (i = 0; i < INTERPRETER_SEGMENT_TABLE_SIZE; i++)
+  {
+    if (strcmp(command->arg1, interpreter_segment_table[i].segment) == 0)
+    {
+      instruction->opcode = push ? interpreter_segment_table[i].push_opcode :
+                                   interpreter_segment_table[i].pop_opcode;
+      return INTERPRETER_SUCC;
+    }
+  }
+
+  /* The other segments are at fixed RAM addresses */
+  instruction->opcode = push ? OP_PUSH_RAM : OP_POP_RAM;
+
+  if (strcmp(command->arg1, "pointer") == 0 && index < POINTER_SEGMENT_WORDS)
+    instruction->operand = POINTER_SEGMENT_BASE + index;
+  else if (strcmp(command->arg1, "temp") == 0 && index < TEMP_SEGMENT_WORDS)
+    instruction->operand = TEMP_SEGMENT_BASE + index;
+  else if (strcmp(command->arg1, "static") == 0)
+  {
+    if (compiler->statics[index] == 0)
+    {
+      if (compiler->next_static >= INTERPRETER_RAM_WORDS)
+        return INTERPRETER_INVALID_COMMAND;
+
+      compiler->statics[index] = compiler->next_static++;
+    }
+
+    instruction->operand = compiler->statics[index];
+  }
+  else
+    return INTERPRETER_INVALID_COMMAND;
+
+  return INTERPRETER_SUCC;
+}
+
+InterpreterStatus interpreter_resolve_labels(InterpreterCompiler *compiler,
+                                             const char *function_name)
+{
+  InterpreterInstruction *instruction = NULL;
+  const InterpreterSymbol *jump = NULL;
+  size_t i, k;
+
+  for (i = 0; i < compiler->jump_count; i++)
+  {
+    jump = &compiler->jumps[i];
+
+    /* The last definition of a label wins, as in the assembler */
+    for (k = compiler->label_count; k > 0; k--)
+    {
+      if (strcmp(compiler->labels[k - 1].name, jump->name) == 0)
+        break;
+    }
+
+    if (k == 0)
+    {
+      fprintf(stderr, "interpreter: Label %s of %s is not defined\n",
+              jump->name, function_name);
+      return INTERPRETER_UNDEFINED_LABEL;
+    }
+
+    instruction = &compiler->interpreter->instructions[jump->instruction];
+    instruction->target = compiler->labels[k - 1].instruction;
+
+    /* A goto to itself never ends */
+    if (instruction->opcode == OP_GOTO && instruction->target == jump->instruction)
+      instruction->opcode = OP_HALT;
+  }
+
+  compiler->label_count = 0;
+  compiler->jump_count = 0;
+
+  return INTERPRETER_SUCC;
+}
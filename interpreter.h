@@ -0,0 +1,87 @@
+/* interpreter.h: Executes the parsed VM commands of a program directly,
+ *                with the RAM layout of the translated program
+ */
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "vm_program.h"
+
+/* Words of the Hack RAM the interpreter works on */
+#define INTERPRETER_RAM_WORDS 32768
+
+typedef enum InterpreterStatus
+{
+  /* The program jumped to itself forever, as Sys.halt does */
+  INTERPRETER_HALTED,
+  /* Sys.init returned */
+  INTERPRETER_RETURNED,
+  /* The program was still running after the command limit */
+  INTERPRETER_COMMAND_LIMIT,
+  /* A function that the program does not define was called */
+  INTERPRETER_UNDEFINED_FUNCTION,
+  INTERPRETER_UNDEFINED_LABEL,
+  INTERPRETER_INVALID_COMMAND,
+  INTERPRETER_FAIL_ALLOC,
+  INTERPRETER_SUCC
+} InterpreterStatus;
+
+/* The program compiled into a flat array of instructions with resolved
+ * jump targets, callees and RAM addresses, and the RAM it runs on */
+typedef struct Interpreter Interpreter;
+
+/* Creates an interpreter with cleared RAM
+ *
+ * Returns the interpreter, or NULL if it could not be allocated
+ */
+Interpreter *interpreter_init(void);
+
+/* Compiles the commands of program, which must outlive the interpreter
+ * until the next load, and gets ready to run it from the bootstrap
+ * code: SP = 256, call Sys.init. Static variables get RAM addresses
+ * from 16 on, in the order they are first used, as the assembler does.
+ * Errors are reported on stderr
+ *
+ * Returns INTERPRETER_SUCC, or the first error
+ */
+InterpreterStatus interpreter_load(Interpreter *interpreter,
+                                   const VmProgram *program);
+
+/* Executes commands until the program halts or max_commands more
+ * commands have been executed. Calls and returns follow the standard
+ * VM frame of the code writer, so the stack, the segments and the
+ * statics hold the same values as in the translated program, except
+ * return addresses, which are instruction numbers here, and the
+ * R13-R15 scratch registers, which are not used. A halt is a goto to
+ * the label just before it, and counts as the last command
+ *
+ * Returns why the execution stopped
+ */
+InterpreterStatus interpreter_run(Interpreter *interpreter,
+                                  unsigned long long max_commands);
+
+/* Counts the executions of each command of the loaded program from
+ * now on if counting is set, which slows the run slightly, and stops
+ * counting otherwise. Loading another program stops counting
+ *
+ * Returns INTERPRETER_SUCC, or INTERPRETER_FAIL_ALLOC
+ */
+InterpreterStatus interpreter_set_counting(Interpreter *interpreter, bool counting);
+
+/* Stores in counts the executions of the first count commands of the
+ * program since counting was set, one word per command in file order,
+ * labels included, which are never executed */
+void interpreter_command_counts(const Interpreter *interpreter,
+                                unsigned long long *counts, size_t count);
+
+/* Returns the RAM of the interpreter, INTERPRETER_RAM_WORDS words */
+unsigned short *interpreter_ram(Interpreter *interpreter);
+
+/* Returns the number of commands executed since the program was loaded */
+unsigned long long interpreter_command_count(const Interpreter *interpreter);
+
+/* Frees the interpreter */
+void interpreter_fini(Interpreter *interpreter);
+
+#endif
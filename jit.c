@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#include <sys/mman.h>
+
+/* Executable memory for translations. When it is full every
+ * translation is dropped and blocks are translated again */
+#define JIT_CODE_BYTES (16 * 1024 * 1024)
+
+/* Longest basic block, in Hack instructions, and the most machine code
+ * one can take: no instruction but the last jump needs 64 bytes */
+#define JIT_BLOCK_MAX_INSTRUCTIONS 256
+#define JIT_BLOCK_MAX_BYTES (JIT_BLOCK_MAX_INSTRUCTIONS * 64 + 256)
+
+/* Fields of a C instruction */
+#define C_INSTRUCTION_BIT 0x8000
+#define C_INSTRUCTION_A_BIT 0x1000
+#define C_INSTRUCTION_COMP_SHIFT 6
+#define C_INSTRUCTION_DEST_A 0x20
+#define C_INSTRUCTION_DEST_D 0x10
+#define C_INSTRUCTION_DEST_M 0x08
+#define C_INSTRUCTION_DEST_MASK 0x38
+#define C_INSTRUCTION_JUMP_MASK 0x07
+#define C_INSTRUCTION_JUMP_ALWAYS 0x07
+
+/* Control bits of the ALU, in the order of the comp field */
+#define ALU_ZERO_X 0x20
+#define ALU_NEGATE_X 0x10
+#define ALU_ZERO_Y 0x08
+#define ALU_NEGATE_Y 0x04
+#define ALU_ADD 0x02
+#define ALU_NEGATE_OUT 0x01
+
+#define RAM_ADDRESS_MASK (EMULATOR_RAM_WORDS - 1)
+
+/* State shared by the dispatcher and the translated blocks. A block
+ * keeps A in ebx, D in r12d and the RAM base in r13, and gets the
+ * state in rdi */
+typedef struct JitState
+{
+  unsigned int       a;
+  unsigned int       d;
+  unsigned short     *ram;
+  unsigned long long cycles;
+  /* Set by a block that stopped in a halt loop */
+  unsigned int       halted;
+} JitState;
+
+/* A translated block returns the address of the next instruction */
+typedef unsigned int (*JitBlock)(JitState *state);
+
+/* Second opcode byte of the jcc rel32 instruction taken for each
+ * jump condition of a C instruction, after testing the ALU output */
+static const unsigned char jit_condition_table[C_INSTRUCTION_JUMP_ALWAYS] =
+{
+  0x8F, /* JGT: jg */
+  0x84, /* JEQ: je */
+  0x8D, /* JGE: jge */
+  0x8C, /* JLT: jl */
+  0x85, /* JNE: jne */
+  0x8E, /* JLE: jle */
+  0x00, /* JMP: no test */
+};
+
+struct Jit
+{
+  Emulator      *emulator;
+  unsigned char *code;
+  size_t        code_used;
+  /* Translation of the block starting at each ROM address, or NULL,
+   * and its number of instructions */
+  unsigned char  *blocks[EMULATOR_ROM_WORDS];
+  unsigned short block_lengths[EMULATOR_ROM_WORDS];
+  unsigned long  block_count;
+};
+
+/* Internal Functions */
+
+/* Appends machine code to the translation being written */
+void jit_emit(Jit *jit, const unsigned char *bytes, size_t count);
+void jit_emit_byte(Jit *jit, unsigned char byte);
+void jit_emit_u32(Jit *jit, unsigned int value);
+
+/* Appends the return from a block of length instructions, with the
+ * address of the next instruction already in eax */
+void jit_emit_exit(Jit *jit, unsigned int length);
+
+/* Appends the translation of the C instruction at address, the last
+ * one of the block when it jumps */
+void jit_emit_c_instruction(Jit *jit, unsigned int address, unsigned int length);
+
+/* Translates the block starting at address, dropping every translation
+ * first if the executable memory is full */
+void jit_translate_block(Jit *jit, unsigned int address);
+
+/* End Internal Functions */
+
+/* Gets ready to translate the program loaded in emulator */
+Jit *jit_init(Emulator *emulator)
+{
+  Jit *jit = NULL;
+  void *code = NULL;
+
+  assert(emulator);
+
+  code = mmap(NULL, JIT_CODE_BYTES, PROT_READ | PROT_WRITE | PROT_EXEC,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (code == MAP_FAILED)
+    return NULL;
+
+  jit = (Jit *)calloc(1, sizeof(Jit));
+
+  if (!jit)
+  {
+    munmap(code, JIT_CODE_BYTES);
+    return NULL;
+  }
+
+  jit->emulator = emulator;
+  jit->code = (unsigned char *)code;
+
+  return jit;
+}
+
+/* Executes instructions with translated blocks */
+EmulatorStatus jit_run(Jit *jit, unsigned long long max_cycles)
+{
+  EmulatorCpu *cpu = NULL;
+  JitState state;
+  JitBlock block;
+  EmulatorStatus status = EMULATOR_CYCLE_LIMIT;
+  unsigned long long end;
+  size_t program_size;
+  unsigned int pc;
+
+  assert(jit);
+
+  cpu = emulator_cpu(jit->emulator);
+  program_size = emulator_program_size(jit->emulator);
+
+  state.a = cpu->a;
+  state.d = cpu->d;
+  state.ram = emulator_ram(jit->emulator);
+  state.cycles = cpu->cycles;
+  state.halted = 0;
+  pc = cpu->pc;
+  end = cpu->cycles + max_cycles < cpu->cycles ? (unsigned long long)-1 :
+                                                 cpu->cycles + max_cycles;
+
+  while (true)
+  {
+    if (pc >= program_size)
+    {
+      status = EMULATOR_END_OF_PROGRAM;
+      break;
+    }
+
+    if (!jit->blocks[pc])
+      jit_translate_block(jit, pc);
+
+    /* A block runs to its end, the emulator stops exactly at the limit */
+    if (end - state.cycles < jit->block_lengths[pc])
+      break;
+
+    block = (JitBlock)jit->blocks[pc];
+    pc = block(&state);
+
+    if (state.halted)
+    {
+      status = EMULATOR_HALTED;
+      break;
+    }
+  }
+
+  cpu->a = (unsigned short)state.a;
+  cpu->d = (unsigned short)state.d;
+  cpu->pc = pc;
+  cpu->cycles = state.cycles;
+
+  if (status == EMULATOR_CYCLE_LIMIT && pc < program_size)
+    return emulator_run(jit->emulator, end - state.cycles);
+
+  return status;
+}
+
+/* Returns the number of basic blocks translated so far */
+unsigned long jit_block_count(const Jit *jit)
+{
+  assert(jit);
+
+  return jit->block_count;
+}
+
+/* Frees the translations */
+void jit_fini(Jit *jit)
+{
+  if (!jit) return;
+
+  munmap(jit->code, JIT_CODE_BYTES);
+  free(jit);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+void jit_emit(Jit *jit, const unsigned char *bytes, size_t count)
+{
+  memcpy(jit->code + jit->code_used, bytes, count);
+  jit->code_used += count;
+}
+
+void jit_emit_byte(Jit *jit, unsigned char byte)
+{
+  jit->code[jit->code_used++] = byte;
+}
+
+void jit_emit_u32(Jit *jit, unsigned int value)
+{
+  jit_emit_byte(jit, value & 0xFF);
+  jit_emit_byte(jit, (value >> 8) & 0xFF);
+  jit_emit_byte(jit, (value >> 16) & 0xFF);
+  jit_emit_byte(jit, (value >> 24) & 0xFF);
+}
+
+void jit_emit_exit(Jit *jit, unsigned int length)
+{
+  /* mov [rdi + a], ebx; mov [rdi + d], r12d */
+  jit_emit(jit, (const unsigned char[]){ 0x89, 0x5F, offsetof(JitState, a) }, 3);
+  jit_emit(jit, (const unsigned char[]){ 0x44, 0x89, 0x67, offsetof(JitState, d) }, 4);
+
+  /* add qword [rdi + cycles], length */
+  jit_emit(jit, (const unsigned char[]){ 0x48, 0x81, 0x47, offsetof(JitState, cycles) }, 4);
+  jit_emit_u32(jit, length);
+
+  /* pop r13; pop r12; pop rbx; ret */
+  jit_emit(jit, (const unsigned char[]){ 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 }, 6);
+}
+
+void jit_emit_c_instruction(Jit *jit, unsigned int address, unsigned int length)
+{
+  const unsigned short *rom = emulator_rom(jit->emulator);
+  unsigned short instruction = rom[address];
+  unsigned int control = (instruction >> C_INSTRUCTION_COMP_SHIFT) & 0x3F;
+  unsigned int jump = instruction & C_INSTRUCTION_JUMP_MASK;
+  size_t taken_patch = 0;
+  size_t halt_patch = 0;
+  bool may_halt;
+
+  /* An instruction without destination or jump only takes a cycle */
+  if (!(instruction & C_INSTRUCTION_DEST_MASK) && jump == 0)
+    return;
+
+  /* x in eax: mov eax, r12d */
+  jit_emit(jit, (const unsigned char[]){ 0x44, 0x89, 0xE0 }, 3);
+
+  /* y in ecx: mov ecx, ebx, then movzx ecx, word [r13 + rcx * 2]
+   * after masking the address for M */
+  jit_emit(jit, (const unsigned char[]){ 0x89, 0xD9 }, 2);
+
+  if (instruction & C_INSTRUCTION_A_BIT)
+  {
+    jit_emit(jit, (const unsigned char[]){ 0x81, 0xE1 }, 2);
+    jit_emit_u32(jit, RAM_ADDRESS_MASK);
+    jit_emit(jit, (const unsigned char[]){ 0x41, 0x0F, 0xB7, 0x4C, 0x4D, 0x00 }, 6);
+  }
+
+  /* xor eax, eax; not eax; xor ecx, ecx; not ecx */
+  if (control & ALU_ZERO_X) jit_emit(jit, (const unsigned char[]){ 0x31, 0xC0 }, 2);
+  if (control & ALU_NEGATE_X) jit_emit(jit, (const unsigned char[]){ 0xF7, 0xD0 }, 2);
+  if (control & ALU_ZERO_Y) jit_emit(jit, (const unsigned char[]){ 0x31, 0xC9 }, 2);
+  if (control & ALU_NEGATE_Y) jit_emit(jit, (const unsigned char[]){ 0xF7, 0xD1 }, 2);
+
+  /* add eax, ecx or and eax, ecx, then not eax */
+  if (control & ALU_ADD)
+    jit_emit(jit, (const unsigned char[]){ 0x01, 0xC8 }, 2);
+  else
+    jit_emit(jit, (const unsigned char[]){ 0x21, 0xC8 }, 2);
+
+  if (control & ALU_NEGATE_OUT) jit_emit(jit, (const unsigned char[]){ 0xF7, 0xD0 }, 2);
+
+  /* movzx eax, ax */
+  jit_emit(jit, (const unsigned char[]){ 0x0F, 0xB7, 0xC0 }, 3);
+
+  /* M is written at the address in A before this instruction:
+   * mov edx, ebx; and edx, mask; mov [r13 + rdx * 2], ax */
+  if (instruction & C_INSTRUCTION_DEST_M)
+  {
+    jit_emit(jit, (const unsigned char[]){ 0x89, 0xDA, 0x81, 0xE2 }, 4);
+    jit_emit_u32(jit, RAM_ADDRESS_MASK);
+    jit_emit(jit, (const unsigned char[]){ 0x66, 0x41, 0x89, 0x44, 0x55, 0x00 }, 6);
+  }
+
+  /* So is the jump target: mov esi, ebx */
+  if (jump != 0)
+    jit_emit(jit, (const unsigned char[]){ 0x89, 0xDE }, 2);
+
+  /* mov ebx, eax; mov r12d, eax */
+  if (instruction & C_INSTRUCTION_DEST_A)
+    jit_emit(jit, (const unsigned char[]){ 0x89, 0xC3 }, 2);
+
+  if (instruction & C_INSTRUCTION_DEST_D)
+    jit_emit(jit, (const unsigned char[]){ 0x41, 0x89, 0xC4 }, 3);
+
+  if (jump == 0)
+    return;
+
+  /* test ax, ax; jcc taken; mov eax, address + 1; exit */
+  if (jump != C_INSTRUCTION_JUMP_ALWAYS)
+  {
+    jit_emit(jit, (const unsigned char[]){ 0x66, 0x85, 0xC0, 0x0F,
+                                           jit_condition_table[jump - 1] }, 5);
+    taken_patch = jit->code_used;
+    jit_emit_u32(jit, 0);
+
+    jit_emit_byte(jit, 0xB8);
+    jit_emit_u32(jit, address + 1);
+    jit_emit_exit(jit, length);
+
+    memcpy(jit->code + taken_patch,
+           &(unsigned int){ (unsigned int)(jit->code_used - taken_patch - 4) }, 4);
+  }
+
+  /* The halt loop of the emulator can only be an unconditional jump
+   * without destination after an A instruction loading its own
+   * address: cmp esi, address - 1; jne not halted; set halted */
+  may_halt = jump == C_INSTRUCTION_JUMP_ALWAYS &&
+             !(instruction & C_INSTRUCTION_DEST_MASK) &&
+             address > 0 && rom[address - 1] == address - 1;
+
+  if (may_halt)
+  {
+    jit_emit(jit, (const unsigned char[]){ 0x81, 0xFE }, 2);
+    jit_emit_u32(jit, address - 1);
+    jit_emit(jit, (const unsigned char[]){ 0x75, 0x00 }, 2);
+    halt_patch = jit->code_used;
+
+    /* mov dword [rdi + halted], 1; mov eax, address; exit */
+    jit_emit(jit, (const unsigned char[]){ 0xC7, 0x47, offsetof(JitState, halted) }, 3);
+    jit_emit_u32(jit, 1);
+    jit_emit_byte(jit, 0xB8);
+    jit_emit_u32(jit, address);
+    jit_emit_exit(jit, length);
+
+    jit->code[halt_patch - 1] = (unsigned char)(jit->code_used - halt_patch);
+  }
+
+  /* mov eax, esi; exit */
+  jit_emit(jit, (const unsigned char[]){ 0x89, 0xF0 }, 2);
+  jit_emit_exit(jit, length);
+}
+
+void jit_translate_block(Jit *jit, unsigned int address)
+{
+  const unsigned short *rom = emulator_rom(jit->emulator);
+  size_t program_size = emulator_program_size(jit->emulator);
+  unsigned int length = 0;
+  unsigned int k;
+
+  if (jit->code_used + JIT_BLOCK_MAX_BYTES > JIT_CODE_BYTES)
+  {
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    jit->code_used = 0;
+  }
+
+  /* The block ends with its first jump */
+  while (address + length < program_size && length < JIT_BLOCK_MAX_INSTRUCTIONS)
+  {
+    length++;
+
+    if ((rom[address + length - 1] & C_INSTRUCTION_BIT) &&
+        (rom[address + length - 1] & C_INSTRUCTION_JUMP_MASK))
+      break;
+  }
+
+  jit->blocks[address] = jit->code + jit->code_used;
+  jit->block_lengths[address] = (unsigned short)length;
+  jit->block_count++;
+
+  /* push rbx; push r12; push r13; mov ebx, [rdi + a];
+   * mov r12d, [rdi + d]; mov r13, [rdi + ram] */
+  jit_emit(jit, (const unsigned char[]){ 0x53, 0x41, 0x54, 0x41, 0x55 }, 5);
+  jit_emit(jit, (const unsigned char[]){ 0x8B, 0x5F, offsetof(JitState, a) }, 3);
+  jit_emit(jit, (const unsigned char[]){ 0x44, 0x8B, 0x67, offsetof(JitState, d) }, 4);
+  jit_emit(jit, (const unsigned char[]){ 0x4C, 0x8B, 0x6F, offsetof(JitState, ram) }, 4);
+
+  for (k = address; k < address + length; k++)
+  {
+    if (rom[k] & C_INSTRUCTION_BIT)
+      jit_emit_c_instruction(jit, k, length);
+    else
+    {
+      /* mov ebx, value */
+      jit_emit_byte(jit, 0xBB);
+      jit_emit_u32(jit, rom[k]);
+    }
+  }
+
+  /* A block without a jump goes on with the next instruction */
+  if (!(rom[address + length - 1] & C_INSTRUCTION_BIT) ||
+      !(rom[address + length - 1] & C_INSTRUCTION_JUMP_MASK))
+  {
+    jit_emit_byte(jit, 0xB8);
+    jit_emit_u32(jit, address + length);
+    jit_emit_exit(jit, length);
+  }
+}
+
+#else
+
+/* Translations need an x86-64 machine */
+Jit *jit_init(Emulator *emulator)
+{
+  (void)emulator;
+
+  return NULL;
+}
+
+EmulatorStatus jit_run(Jit *jit, unsigned long long max_cycles)
+{
+  (void)jit;
+  (void)max_cycles;
+
+  return EMULATOR_FAIL_LOAD;
+}
+
+unsigned long jit_block_count(const Jit *jit)
+{
+  (void)jit;
+
+  return 0;
+}
+
+void jit_fini(Jit *jit)
+{
+  (void)jit;
+}
+
+#endif
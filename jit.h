@@ -0,0 +1,35 @@
+/* jit.h: Runs the program loaded in an emulator by translating its
+ *        Hack instructions into x86-64 machine code
+ */
+#ifndef JIT_H
+#define JIT_H
+
+#include "emulator.h"
+
+/* Translations of the basic blocks of the ROM of an emulator, made
+ * the first time each block is reached and kept for later visits */
+typedef struct Jit Jit;
+
+/* Gets ready to translate the program loaded in emulator, which must
+ * not be reloaded while the JIT is used
+ *
+ * Returns the JIT, or NULL if this machine is not x86-64 or executable
+ * memory could not be allocated
+ */
+Jit *jit_init(Emulator *emulator);
+
+/* Executes instructions of the emulator from the state of its CPU,
+ * with the same results and cycle counts as emulator_run, and leaves
+ * the final state in the CPU
+ *
+ * Returns why the execution stopped
+ */
+EmulatorStatus jit_run(Jit *jit, unsigned long long max_cycles);
+
+/* Returns the number of basic blocks translated so far */
+unsigned long jit_block_count(const Jit *jit);
+
+/* Frees the translations */
+void jit_fini(Jit *jit);
+
+#endif
@@ -0,0 +1,1975 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "translator_common.h"
+#include "vm_program.h"
+#include "optimizer.h"
+#include "cfg.h"
+
+/* Largest number of commands, function and return excluded,
+ * of a function body substituted at its call sites */
+#define INLINE_MAX_COMMANDS 10
+
+/* Words of the frame a call saves below the callee locals */
+#define FULL_CALL_FRAME_WORDS 5
+
+/* Largest number of jump cleanup rounds over a file. Each round
+ * removes what the previous one left unreachable or unreferenced */
+#define CLEANUP_MAX_ROUNDS 8
+
+/* Constants known to be stored in the temp and pointer segments
+ * at the current point of a basic block */
+typedef struct KnownConstants
+{
+  bool temp_known[TEMP_SEGMENT_WORDS];
+  int  temp[TEMP_SEGMENT_WORDS];
+  bool pointer_known[POINTER_SEGMENT_WORDS];
+  int  pointer[POINTER_SEGMENT_WORDS];
+} KnownConstants;
+
+/* A function of the program and the commands it spans */
+typedef struct FunctionEntry
+{
+  const char *name;
+  size_t     file;
+  /* Index of the function command and one past its last command */
+  size_t     begin;
+  size_t     end;
+  bool       reachable;
+} FunctionEntry;
+
+/* Calls between the functions of a table. The callees of function k
+ * are callees[first[k]] to callees[first[k + 1] - 1] */
+typedef struct CallGraph
+{
+  size_t *first;
+  size_t *callees;
+  /* Largest number of arguments each function is called with */
+  int    *call_arguments;
+} CallGraph;
+
+/* Whether and how a function can be substituted at its call sites */
+typedef struct InlineCandidate
+{
+  /* Why the function cannot be inlined, NULL if it can */
+  const char *reason;
+  int        local_count;
+  /* Highest argument index used by the function, -1 if none */
+  int        max_argument;
+  bool       uses_static;
+  bool       writes_pointer[POINTER_SEGMENT_WORDS];
+  size_t     sites;
+  /* Call sites that cannot use the function static variables,
+   * or pass fewer arguments than it uses */
+  size_t     skipped_sites;
+} InlineCandidate;
+
+/* Internal Functions */
+
+/* Checks if a command accesses the given memory segment */
+bool command_uses_segment(const VmCommand *command, MemorySegment segment);
+
+/* Checks if a command pushes a constant that fits in a VM word */
+bool command_is_constant(const VmCommand *command);
+
+/* Wraps a value into a 16-bit two's complement VM word */
+int fold_word(long value);
+
+/* Computes a unary arithmetic-logical command on a constant
+ *
+ * Returns true if the command is unary and false otherwise
+ */
+bool fold_unary(const char *operation, int x, int *result);
+
+/* Computes a binary arithmetic-logical command on two constants,
+ * comparisons use the sign of x - y like the generated code does
+ *
+ * Returns true if the command is binary and false otherwise
+ */
+bool fold_binary(const char *operation, int x, int y, int *result);
+
+/* Forgets the known temp constants, or every known constant when
+ * include_pointers is set */
+void known_constants_clear(KnownConstants *known, bool include_pointers);
+
+/* Forgets the known constants a pop command may overwrite */
+void known_constants_pop(KnownConstants *known, const VmCommand *command);
+
+/* Lists the functions of the program in program order. A function
+ * spans until the next function of its file.
+ *
+ * Returns the list, to be freed by the caller, or NULL if the program
+ * has no functions or the list could not be allocated
+ */
+FunctionEntry *function_table_build(const VmProgram *program, size_t *count);
+
+/* Orders function entries by name */
+int function_entry_compare_name(const void *a, const void *b);
+
+/* Orders function entries by their position in the program */
+int function_entry_compare_position(const void *a, const void *b);
+
+/* Finds the first entry of a function in entries sorted by name
+ *
+ * Returns its index, or count if the function is not defined
+ */
+size_t function_entry_find(const FunctionEntry *functions, size_t count,
+                           const char *name);
+
+/* Marks every definition of the named function as reachable and adds
+ * the newly reached ones to the worklist */
+void function_entry_reach(FunctionEntry *functions, size_t count,
+                          const char *name,
+                          size_t *worklist, size_t *worklist_count);
+
+/* Checks if the function at index k of entries sorted by name shares
+ * its name with another entry */
+bool function_entry_is_duplicated(const FunctionEntry *functions, size_t count,
+                                  size_t k);
+
+/* Builds the call graph of functions sorted by name
+ *
+ * Returns true if successful and false if out of memory
+ */
+bool call_graph_build(const VmProgram *program,
+                      const FunctionEntry *functions, size_t count,
+                      CallGraph *graph);
+
+/* Frees the lists of a call graph */
+void call_graph_fini(CallGraph *graph);
+
+/* Numbers the strongly connected components of the call graph so that
+ * callees come before their callers
+ *
+ * Returns the number of components, or 0 if out of memory
+ */
+size_t call_graph_components(const CallGraph *graph, size_t count,
+                             size_t *component);
+
+/* Gives static frames to the non-recursive functions that fit in the
+ * words left by static variables, callers before callees
+ *
+ * Returns true if successful and false if out of memory
+ */
+bool static_frames_assign(const VmProgram *program,
+                          const FunctionEntry *functions, size_t count,
+                          FunctionConvention *conventions);
+
+/* Fills the static frame layout of a function called with up to
+ * call_arguments arguments
+ *
+ * Returns the number of words of the frame
+ */
+int static_frame_layout(const VmProgram *program,
+                        const FunctionEntry *function, int call_arguments,
+                        FunctionConvention *convention);
+
+/* Counts the RAM words the assembler may give to static variables,
+ * an upper bound taken from the highest index used in each file */
+size_t static_variable_count(const VmProgram *program);
+
+/* Checks if a function can be inlined and collects what its call
+ * sites need to know about it */
+void inline_candidate_check(const VmProgram *program,
+                            const FunctionEntry *function,
+                            InlineCandidate *candidate);
+
+/* Appends the commands that replace a call to an inlined function,
+ * using the caller locals from base onwards
+ *
+ * Returns the number of caller locals used, or -1 if out of memory
+ */
+int inline_call_site(VmFile *output, const VmProgram *program,
+                     const FunctionEntry *callee,
+                     const InlineCandidate *candidate,
+                     const VmCommand *call, int base);
+
+/* Selects the calling convention of a function from its body and
+ * the stack depths of its control-flow graph. Call sites are checked
+ * by the caller */
+CallConvention function_convention_check(const VmProgram *program,
+                                         const FunctionEntry *function);
+
+/* Cleans up the jumps of the function at function in file, clearing
+ * keep for the commands to remove
+ *
+ * Returns the number of commands to remove
+ */
+size_t cleanup_function_jumps(VmFile *file, size_t function, size_t end,
+                              bool invert_branches, bool *keep);
+
+/* Follows blocks made of labels and at most a goto
+ *
+ * Returns the first block that does something, if it starts with
+ * a label, and block otherwise
+ */
+size_t jump_final_block(const Cfg *cfg, size_t block);
+
+/* Checks if the command at index leaves 0 or -1 on the stack */
+bool command_is_boolean(const VmFile *file, size_t begin, size_t index);
+
+/* Computes usage[k], the stack usage of function k, taking calls to
+ * functions of other components, whose usage is already known, into
+ * its worst case */
+void function_stack_usage(const VmProgram *program,
+                          const FunctionEntry *functions, size_t count,
+                          size_t k, const size_t *component,
+                          FunctionStackUsage *usage);
+
+/* End Internal Functions */
+
+/* Folds arithmetic, comparison and bitwise commands on constant
+ * operands and propagates constants stored in the temp and pointer
+ * segments.
+ *
+ * Returns the number of commands removed from the file
+ */
+size_t optimizer_fold_constants(VmFile *file)
+{
+  KnownConstants known;
+  VmCommand command;
+  VmCommand *output = NULL;
+  size_t output_count = 0;
+  size_t i;
+  int result;
+
+  assert(file);
+
+  /* Folded commands are written over the input, which is never behind */
+  output = file->commands;
+
+  known_constants_clear(&known, true);
+
+  for (i = 0; i < file->command_count; i++)
+  {
+    command = file->commands[i];
+
+    switch (command.type)
+    {
+      case C_PUSH:
+        /* Replace reads of known temp and pointer values */
+        if (command_uses_segment(&command, "temp") &&
+            command.arg2 < TEMP_SEGMENT_WORDS &&
+            known.temp_known[command.arg2])
+        {
+          strcpy(command.arg1, "constant");
+          command.arg2 = known.temp[command.arg2];
+        }
+        else if (command_uses_segment(&command, "pointer") &&
+                 command.arg2 < POINTER_SEGMENT_WORDS &&
+                 known.pointer_known[command.arg2])
+        {
+          strcpy(command.arg1, "constant");
+          command.arg2 = known.pointer[command.arg2];
+        }
+        break;
+      case C_POP:
+        known_constants_pop(&known, &command);
+
+        /* Record constants stored in temp and pointer */
+        if (output_count > 0 && command_is_constant(&output[output_count - 1]))
+        {
+          if (command_uses_segment(&command, "temp") &&
+              command.arg2 < TEMP_SEGMENT_WORDS)
+          {
+            known.temp_known[command.arg2] = true;
+            known.temp[command.arg2] = output[output_count - 1].arg2;
+          }
+          else if (command_uses_segment(&command, "pointer") &&
+                   command.arg2 < POINTER_SEGMENT_WORDS)
+          {
+            known.pointer_known[command.arg2] = true;
+            known.pointer[command.arg2] = output[output_count - 1].arg2;
+          }
+        }
+        break;
+      case C_ARITHMETIC:
+        if (output_count > 0 &&
+            command_is_constant(&output[output_count - 1]) &&
+            fold_unary(command.arg1, output[output_count - 1].arg2, &result))
+        {
+          output[output_count - 1].arg2 = result;
+          output[output_count - 1].line = command.line;
+          continue;
+        }
+        else if (output_count > 1 &&
+                 command_is_constant(&output[output_count - 2]) &&
+                 command_is_constant(&output[output_count - 1]) &&
+                 fold_binary(command.arg1,
+                             output[output_count - 2].arg2,
+                             output[output_count - 1].arg2,
+                             &result))
+        {
+          output_count--;
+          output[output_count - 1].arg2 = result;
+          output[output_count - 1].line = command.line;
+          continue;
+        }
+        break;
+      case C_IF:
+        /* A constant condition either always or never jumps */
+        if (output_count > 0 && command_is_constant(&output[output_count - 1]))
+        {
+          output_count--;
+
+          if (output[output_count].arg2 == 0)
+            continue;
+
+          command.type = C_GOTO;
+        }
+        break;
+      case C_CALL:
+        /* The callee may use temp, pointer is restored on return */
+        known_constants_clear(&known, false);
+        break;
+      case C_LABEL:
+      case C_FUNCTION:
+        /* Other paths join here */
+        known_constants_clear(&known, true);
+        break;
+      default:
+        break;
+    }
+
+    output[output_count++] = command;
+  }
+
+  i = file->command_count - output_count;
+
+  file->command_count = output_count;
+
+  return i;
+}
+
+/* Removes unreachable code, jump chains and unused labels.
+ *
+ * Returns the number of commands removed from the file
+ */
+size_t optimizer_cleanup_jumps(VmFile *file, bool invert_branches)
+{
+  bool *keep = NULL;
+  size_t removed_count = 0;
+  size_t removed;
+  size_t round, function, i, k;
+
+  assert(file);
+
+  keep = (bool *)malloc((file->command_count + 1) * sizeof(bool));
+
+  if (!keep)
+    return 0;
+
+  for (round = 0; round < CLEANUP_MAX_ROUNDS; round++)
+  {
+    removed = 0;
+
+    for (i = 0; i < file->command_count; i++)
+      keep[i] = true;
+
+    /* Commands before the first function are left alone */
+    for (function = 0; function < file->command_count; function = i)
+    {
+      for (i = function + 1;
+           i < file->command_count && file->commands[i].type != C_FUNCTION;
+           i++)
+        ;
+
+      if (file->commands[function].type == C_FUNCTION)
+        removed += cleanup_function_jumps(file, function, i,
+                                          invert_branches, keep);
+    }
+
+    if (removed == 0)
+      break;
+
+    for (i = 0, k = 0; i < file->command_count; i++)
+    {
+      if (keep[i])
+        file->commands[k++] = file->commands[i];
+    }
+
+    file->command_count = k;
+    removed_count += removed;
+  }
+
+  free(keep);
+
+  return removed_count;
+}
+
+/* Removes the functions that cannot be reached through calls from
+ * Sys.init or from the functions named in keep.
+ *
+ * Returns the number of functions removed from the program
+ */
+size_t optimizer_eliminate_dead_functions(VmProgram *program,
+                                          const char *const *keep,
+                                          size_t keep_count,
+                                          OptimizerIntrinsicCheck is_intrinsic,
+                                          VmProgram *removed)
+{
+  FunctionEntry *functions = NULL;
+  size_t *worklist = NULL;
+  size_t function_count = 0;
+  size_t worklist_count = 0;
+  size_t removed_count = 0;
+  size_t output_count;
+  size_t f, i, k;
+  VmFile *file = NULL;
+  VmFile *removed_file = NULL;
+  const FunctionEntry *current = NULL;
+
+  assert(program);
+
+  functions = function_table_build(program, &function_count);
+
+  if (!functions)
+    return 0;
+
+  worklist = (size_t *)malloc(function_count * sizeof(size_t));
+
+  if (!worklist)
+  {
+    free(functions);
+    return 0;
+  }
+
+  qsort(functions, function_count, sizeof(FunctionEntry),
+        function_entry_compare_name);
+
+  /* Without an entry point every function may be used */
+  if (function_entry_find(functions, function_count,
+                          OPTIMIZER_ENTRY_FUNCTION) == function_count)
+  {
+    free(functions);
+    free(worklist);
+    return 0;
+  }
+
+  function_entry_reach(functions, function_count, OPTIMIZER_ENTRY_FUNCTION,
+                       worklist, &worklist_count);
+
+  for (k = 0; k < keep_count; k++)
+  {
+    function_entry_reach(functions, function_count, keep[k],
+                         worklist, &worklist_count);
+  }
+
+  /* Follow the calls of every reached function */
+  while (worklist_count > 0)
+  {
+    current = &functions[worklist[--worklist_count]];
+    file = &program->files[current->file];
+
+    for (i = current->begin; i < current->end; i++)
+    {
+      /* Intrinsics do not call their function */
+      if (file->commands[i].type == C_CALL &&
+          !(is_intrinsic && is_intrinsic(file->commands[i].arg1,
+                                         (unsigned int)file->commands[i].arg2)))
+        function_entry_reach(functions, function_count, file->commands[i].arg1,
+                             worklist, &worklist_count);
+    }
+  }
+
+  qsort(functions, function_count, sizeof(FunctionEntry),
+        function_entry_compare_position);
+
+  /* Move the commands of unreachable functions out of their files */
+  k = 0;
+
+  for (f = 0; f < program->file_count; f++)
+  {
+    file = &program->files[f];
+    output_count = 0;
+
+    for (i = 0; i < file->command_count; i++)
+    {
+      if (k < function_count && functions[k].file == f && functions[k].begin == i)
+      {
+        current = &functions[k++];
+
+        if (!current->reachable)
+        {
+          removed_file = removed ? vm_program_add_file(removed, file->filename) : NULL;
+
+          for (; i < current->end; i++)
+          {
+            if (removed_file)
+              vm_file_append(removed_file, &file->commands[i]);
+          }
+
+          i--;
+          removed_count++;
+          continue;
+        }
+      }
+
+      file->commands[output_count++] = file->commands[i];
+    }
+
+    file->command_count = output_count;
+  }
+
+  free(functions);
+  free(worklist);
+
+  return removed_count;
+}
+
+/* Replaces calls to small leaf functions by their bodies.
+ *
+ * Returns the number of call sites inlined
+ */
+size_t optimizer_inline_functions(VmProgram *program,
+                                  OptimizerIntrinsicCheck is_intrinsic,
+                                  FILE *report)
+{
+  FunctionEntry *functions = NULL;
+  InlineCandidate *candidates = NULL;
+  VmFile *outputs = NULL;
+  VmFile *output = NULL;
+  const VmCommand *command = NULL;
+  size_t function_count = 0;
+  size_t inlined_count = 0;
+  size_t caller = 0;
+  size_t f, i, k;
+  int used;
+  int region = 0;
+  bool in_function;
+  bool success = true;
+
+  assert(program);
+
+  functions = function_table_build(program, &function_count);
+
+  if (!functions)
+    return 0;
+
+  qsort(functions, function_count, sizeof(FunctionEntry),
+        function_entry_compare_name);
+
+  candidates = (InlineCandidate *)calloc(function_count, sizeof(InlineCandidate));
+  outputs = (VmFile *)calloc(program->file_count, sizeof(VmFile));
+
+  if (!candidates || !outputs)
+  {
+    free(functions);
+    free(candidates);
+    free(outputs);
+    return 0;
+  }
+
+  for (k = 0; k < function_count; k++)
+  {
+    inline_candidate_check(program, &functions[k], &candidates[k]);
+
+    /* A call to a duplicated name reaches only one of the definitions */
+    if (function_entry_is_duplicated(functions, function_count, k))
+      candidates[k].reason = "defined more than once";
+  }
+
+  /* Rewrite every file into a new command list. The old lists are
+   * kept until the end since callee bodies are copied from them */
+  for (f = 0; success && f < program->file_count; f++)
+  {
+    output = &outputs[f];
+    in_function = false;
+
+    for (i = 0; success && i < program->files[f].command_count; i++)
+    {
+      command = &program->files[f].commands[i];
+
+      if (command->type == C_FUNCTION)
+      {
+        /* The callee variables of every site share the same caller locals */
+        if (in_function)
+          output->commands[caller].arg2 += region;
+
+        in_function = true;
+        caller = output->command_count;
+        region = 0;
+      }
+      else if (command->type == C_CALL && in_function &&
+               !(is_intrinsic && is_intrinsic(command->arg1, (unsigned int)command->arg2)))
+      {
+        k = function_entry_find(functions, function_count, command->arg1);
+
+        if (k < function_count && !candidates[k].reason &&
+            (!candidates[k].uses_static || functions[k].file == f) &&
+            candidates[k].max_argument < command->arg2)
+        {
+          used = inline_call_site(output, program, &functions[k], &candidates[k],
+                                  command, output->commands[caller].arg2);
+
+          if (used < 0)
+          {
+            success = false;
+            break;
+          }
+
+          if (used > region)
+            region = used;
+
+          candidates[k].sites++;
+          inlined_count++;
+          continue;
+        }
+        else if (k < function_count && !candidates[k].reason)
+        {
+          candidates[k].skipped_sites++;
+        }
+      }
+
+      success = vm_file_append(output, command);
+    }
+
+    if (success && in_function)
+      output->commands[caller].arg2 += region;
+  }
+
+  /* Function names point into the old command lists */
+  for (k = 0; report && success && k < function_count; k++)
+  {
+    if (candidates[k].sites > 0)
+      fprintf(report, "inline: %s inlined at %zu call sites\n",
+              functions[k].name, candidates[k].sites);
+
+    if (candidates[k].skipped_sites > 0)
+      fprintf(report, "inline: %s kept at %zu call sites in other files "
+                      "or with missing arguments\n",
+              functions[k].name, candidates[k].skipped_sites);
+    else if (candidates[k].reason &&
+             functions[k].end - functions[k].begin <= INLINE_MAX_COMMANDS + 2)
+      fprintf(report, "inline: %s not inlined, %s\n",
+              functions[k].name, candidates[k].reason);
+  }
+
+  /* Install the new command lists, or keep the program as it was */
+  for (f = 0; f < program->file_count; f++)
+  {
+    if (success)
+    {
+      free(program->files[f].commands);
+      program->files[f].commands = outputs[f].commands;
+      program->files[f].command_count = outputs[f].command_count;
+      program->files[f].command_capacity = outputs[f].command_capacity;
+    }
+    else
+    {
+      free(outputs[f].commands);
+    }
+  }
+
+  if (!success)
+    inlined_count = 0;
+
+  free(functions);
+  free(candidates);
+  free(outputs);
+
+  return inlined_count;
+}
+
+/* Selects the calling convention of every function of the program.
+ *
+ * Returns the conventions sorted by name, or NULL on failure
+ */
+FunctionConvention *optimizer_select_conventions(const VmProgram *program,
+                                                 unsigned int options,
+                                                 size_t *count)
+{
+  FunctionEntry *functions = NULL;
+  FunctionConvention *conventions = NULL;
+  const VmCommand *command = NULL;
+  size_t function_count = 0;
+  size_t f, i, k;
+
+  assert(program);
+  assert(count);
+
+  *count = 0;
+
+  functions = function_table_build(program, &function_count);
+
+  if (!functions)
+    return NULL;
+
+  conventions = (FunctionConvention *)malloc(function_count * sizeof(FunctionConvention));
+
+  if (!conventions)
+  {
+    free(functions);
+    return NULL;
+  }
+
+  qsort(functions, function_count, sizeof(FunctionEntry),
+        function_entry_compare_name);
+
+  for (k = 0; k < function_count; k++)
+  {
+    conventions[k].name = functions[k].name;
+    conventions[k].convention = CALL_CONVENTION_FULL;
+    conventions[k].frame = 0;
+    conventions[k].argument_count = 0;
+    conventions[k].saved_pointers = 0;
+    conventions[k].stack_words = 0;
+
+    /* Caller and callee must agree on the frame, so a call to a
+     * duplicated name cannot know which one it reaches */
+    if ((options & OPTIMIZER_OPT_CALL_CONVENTIONS) &&
+        !function_entry_is_duplicated(functions, function_count, k))
+      conventions[k].convention = function_convention_check(program, &functions[k]);
+  }
+
+  /* A function without a frame has no arguments segment, so every call
+   * site must pass none */
+  for (f = 0; f < program->file_count; f++)
+  {
+    for (i = 0; i < program->files[f].command_count; i++)
+    {
+      command = &program->files[f].commands[i];
+
+      if (command->type != C_CALL || command->arg2 == 0)
+        continue;
+
+      k = function_entry_find(functions, function_count, command->arg1);
+
+      if (k < function_count &&
+          conventions[k].convention == CALL_CONVENTION_NO_FRAME)
+        conventions[k].convention = CALL_CONVENTION_NO_POINTERS;
+    }
+  }
+
+  if ((options & OPTIMIZER_OPT_STATIC_FRAMES) &&
+      !static_frames_assign(program, functions, function_count, conventions))
+  {
+    free(functions);
+    free(conventions);
+    return NULL;
+  }
+
+  free(functions);
+
+  *count = function_count;
+
+  return conventions;
+}
+
+/* Computes the stack usage of every function.
+ *
+ * Returns the usage sorted by name, or NULL on failure
+ */
+FunctionStackUsage *optimizer_stack_usage(const VmProgram *program,
+                                          size_t *count)
+{
+  FunctionEntry *functions = NULL;
+  FunctionStackUsage *usage = NULL;
+  CallGraph graph;
+  size_t *component = NULL;
+  size_t *order = NULL;
+  size_t *first = NULL;
+  size_t function_count = 0;
+  size_t component_count = 0;
+  size_t c, k, e;
+
+  assert(program);
+  assert(count);
+
+  *count = 0;
+
+  functions = function_table_build(program, &function_count);
+
+  if (!functions)
+    return NULL;
+
+  qsort(functions, function_count, sizeof(FunctionEntry),
+        function_entry_compare_name);
+
+  if (!call_graph_build(program, functions, function_count, &graph))
+  {
+    free(functions);
+    return NULL;
+  }
+
+  usage = (FunctionStackUsage *)calloc(function_count, sizeof(FunctionStackUsage));
+  component = (size_t *)calloc(function_count, sizeof(size_t));
+  order = (size_t *)calloc(function_count, sizeof(size_t));
+  first = (size_t *)calloc(function_count + 1, sizeof(size_t));
+
+  if (usage && component && order && first)
+    component_count = call_graph_components(&graph, function_count, component);
+
+  if (component_count == 0)
+  {
+    call_graph_fini(&graph);
+    free(functions);
+    free(usage);
+    free(component);
+    free(order);
+    free(first);
+    return NULL;
+  }
+
+  /* Functions ordered by component, so callees come first */
+  for (k = 0; k < function_count; k++)
+    first[component[k] + 1]++;
+
+  for (c = 0; c < component_count; c++)
+    first[c + 1] += first[c];
+
+  for (k = 0; k < function_count; k++)
+    order[first[component[k]]++] = k;
+
+  for (k = 0; k < function_count; k++)
+  {
+    usage[k].name = functions[k].name;
+    usage[k].recursive = false;
+  }
+
+  /* A function is recursive when its component is a cycle */
+  for (k = 0; k < function_count; k++)
+  {
+    for (e = graph.first[k]; e < graph.first[k + 1]; e++)
+    {
+      if (component[graph.callees[e]] == component[k])
+        usage[k].recursive = true;
+    }
+  }
+
+  for (k = 0; k < function_count; k++)
+  {
+    function_stack_usage(program, functions, function_count,
+                         order[k], component, usage);
+  }
+
+  call_graph_fini(&graph);
+  free(functions);
+  free(component);
+  free(order);
+  free(first);
+
+  *count = function_count;
+
+  return usage;
+}
+
+/* Runs the per-file passes selected by options over every file of
+ * the program. Whole-program passes are run by their own functions */
+void optimizer_run(VmProgram *program, unsigned int options)
+{
+  size_t i;
+
+  assert(program);
+
+  for (i = 0; i < program->file_count; i++)
+  {
+    if (options & OPTIMIZER_OPT_FOLD_CONSTANTS)
+      optimizer_fold_constants(&program->files[i]);
+  }
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+FunctionEntry *function_table_build(const VmProgram *program, size_t *count)
+{
+  FunctionEntry *functions = NULL;
+  const VmFile *file = NULL;
+  size_t function_count = 0;
+  size_t f, i, k;
+
+  assert(program);
+  assert(count);
+
+  for (f = 0; f < program->file_count; f++)
+  {
+    for (i = 0; i < program->files[f].command_count; i++)
+    {
+      if (program->files[f].commands[i].type == C_FUNCTION)
+        function_count++;
+    }
+  }
+
+  *count = function_count;
+
+  if (function_count == 0)
+    return NULL;
+
+  functions = (FunctionEntry *)malloc(function_count * sizeof(FunctionEntry));
+
+  if (!functions)
+    return NULL;
+
+  k = 0;
+
+  for (f = 0; f < program->file_count; f++)
+  {
+    file = &program->files[f];
+
+    for (i = 0; i < file->command_count; i++)
+    {
+      if (file->commands[i].type != C_FUNCTION)
+        continue;
+
+      if (k > 0 && functions[k - 1].file == f)
+        functions[k - 1].end = i;
+
+      functions[k].name = file->commands[i].arg1;
+      functions[k].file = f;
+      functions[k].begin = i;
+      functions[k].end = file->command_count;
+      functions[k].reachable = false;
+      k++;
+    }
+  }
+
+  return functions;
+}
+
+int function_entry_compare_name(const void *a, const void *b)
+{
+  return strcmp(((const FunctionEntry *)a)->name,
+                ((const FunctionEntry *)b)->name);
+}
+
+int function_entry_compare_position(const void *a, const void *b)
+{
+  const FunctionEntry *x = (const FunctionEntry *)a;
+  const FunctionEntry *y = (const FunctionEntry *)b;
+
+  if (x->file != y->file)
+    return x->file < y->file ? -1 : 1;
+
+  return x->begin < y->begin ? -1 : (x->begin > y->begin);
+}
+
+size_t function_entry_find(const FunctionEntry *functions, size_t count,
+                           const char *name)
+{
+  size_t low = 0;
+  size_t high = count;
+  size_t middle;
+
+  /* Lower bound, so that the first of duplicated definitions is found */
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+
+    if (strcmp(functions[middle].name, name) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  if (low < count && strcmp(functions[low].name, name) == 0)
+    return low;
+
+  return count;
+}
+
+bool function_entry_is_duplicated(const FunctionEntry *functions, size_t count,
+                                  size_t k)
+{
+  return (k > 0 && strcmp(functions[k].name, functions[k - 1].name) == 0) ||
+         (k + 1 < count && strcmp(functions[k].name, functions[k + 1].name) == 0);
+}
+
+bool call_graph_build(const VmProgram *program,
+                      const FunctionEntry *functions, size_t count,
+                      CallGraph *graph)
+{
+  const VmCommand *command = NULL;
+  size_t edge_count = 0;
+  size_t pass, k, i, j;
+
+  assert(program);
+  assert(functions);
+  assert(graph);
+
+  graph->first = (size_t *)calloc(count + 1, sizeof(size_t));
+  graph->callees = NULL;
+  graph->call_arguments = (int *)calloc(count, sizeof(int));
+
+  if (!graph->first || !graph->call_arguments)
+  {
+    call_graph_fini(graph);
+    return false;
+  }
+
+  /* The first pass counts the edges, the second one lists them */
+  for (pass = 0; pass < 2; pass++)
+  {
+    edge_count = 0;
+
+    for (k = 0; k < count; k++)
+    {
+      graph->first[k] = edge_count;
+
+      for (i = functions[k].begin; i < functions[k].end; i++)
+      {
+        command = &program->files[functions[k].file].commands[i];
+
+        if (command->type != C_CALL)
+          continue;
+
+        /* A call to a duplicated name may reach any of the definitions */
+        for (j = function_entry_find(functions, count, command->arg1);
+             j < count && strcmp(functions[j].name, command->arg1) == 0;
+             j++)
+        {
+          if (pass == 1)
+          {
+            graph->callees[edge_count] = j;
+
+            if (command->arg2 > graph->call_arguments[j])
+              graph->call_arguments[j] = command->arg2;
+          }
+
+          edge_count++;
+        }
+      }
+    }
+
+    graph->first[count] = edge_count;
+
+    if (pass == 0)
+    {
+      graph->callees = (size_t *)malloc((edge_count + 1) * sizeof(size_t));
+
+      if (!graph->callees)
+      {
+        call_graph_fini(graph);
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+void call_graph_fini(CallGraph *graph)
+{
+  assert(graph);
+
+  free(graph->first);
+  free(graph->callees);
+  free(graph->call_arguments);
+
+  graph->first = NULL;
+  graph->callees = NULL;
+  graph->call_arguments = NULL;
+}
+
+size_t call_graph_components(const CallGraph *graph, size_t count,
+                             size_t *component)
+{
+  size_t *index = NULL;
+  size_t *lowlink = NULL;
+  size_t *next_edge = NULL;
+  size_t *stack = NULL;
+  size_t *path = NULL;
+  bool *on_stack = NULL;
+  size_t stack_count = 0;
+  size_t path_count = 0;
+  size_t next_index = 1;
+  size_t component_count = 0;
+  size_t root, v, w;
+
+  assert(graph);
+  assert(component);
+
+  /* Index 0 marks functions not visited yet */
+  index = (size_t *)calloc(count, sizeof(size_t));
+  lowlink = (size_t *)calloc(count, sizeof(size_t));
+  next_edge = (size_t *)calloc(count, sizeof(size_t));
+  stack = (size_t *)calloc(count, sizeof(size_t));
+  path = (size_t *)calloc(count, sizeof(size_t));
+  on_stack = (bool *)calloc(count, sizeof(bool));
+
+  if (!index || !lowlink || !next_edge || !stack || !path || !on_stack)
+    count = 0;
+
+  /* Tarjan's algorithm, with the recursion kept in path so that deep
+   * call chains cannot overflow the C stack */
+  for (root = 0; root < count; root++)
+  {
+    if (index[root] != 0)
+      continue;
+
+    w = root;
+
+    while (w != count)
+    {
+      /* Enter w */
+      index[w] = lowlink[w] = next_index++;
+      next_edge[w] = graph->first[w];
+      stack[stack_count++] = w;
+      on_stack[w] = true;
+      path[path_count++] = w;
+
+      /* Follow edges until an unvisited callee is found
+       * or the whole tree from root is done */
+      w = count;
+
+      while (path_count > 0 && w == count)
+      {
+        v = path[path_count - 1];
+
+        if (next_edge[v] < graph->first[v + 1])
+        {
+          w = graph->callees[next_edge[v]++];
+
+          if (index[w] != 0)
+          {
+            if (on_stack[w] && index[w] < lowlink[v])
+              lowlink[v] = index[w];
+
+            w = count;
+          }
+
+          continue;
+        }
+
+        /* Leave v */
+        path_count--;
+
+        if (path_count > 0 && lowlink[v] < lowlink[path[path_count - 1]])
+          lowlink[path[path_count - 1]] = lowlink[v];
+
+        if (lowlink[v] == index[v])
+        {
+          do
+          {
+            w = stack[--stack_count];
+            on_stack[w] = false;
+            component[w] = component_count;
+          } while (w != v);
+
+          component_count++;
+          w = count;
+        }
+      }
+    }
+  }
+
+  free(index);
+  free(lowlink);
+  free(next_edge);
+  free(stack);
+  free(path);
+  free(on_stack);
+
+  return component_count;
+}
+
+bool static_frames_assign(const VmProgram *program,
+                          const FunctionEntry *functions, size_t count,
+                          FunctionConvention *conventions)
+{
+  CallGraph graph;
+  size_t *component = NULL;
+  size_t *members = NULL;
+  size_t *member_first = NULL;
+  int *component_frame = NULL;
+  size_t component_count = 0;
+  size_t statics;
+  size_t c, k, v, e;
+  int budget;
+  int frame;
+  int size;
+  bool recursive;
+
+  assert(program);
+  assert(functions);
+  assert(conventions);
+
+  /* Without Sys.init the stack frames may be set up by the caller of
+   * the program, as the nand2tetris function tests do */
+  if (function_entry_find(functions, count, OPTIMIZER_ENTRY_FUNCTION) == count)
+    return true;
+
+  statics = static_variable_count(program);
+
+  if (statics >= STATIC_SEGMENT_WORDS)
+    return true;
+
+  budget = (int)(STATIC_SEGMENT_WORDS - statics);
+
+  if (!call_graph_build(program, functions, count, &graph))
+    return false;
+
+  component = (size_t *)calloc(count, sizeof(size_t));
+  members = (size_t *)calloc(count, sizeof(size_t));
+  member_first = (size_t *)calloc(count + 1, sizeof(size_t));
+  component_frame = (int *)calloc(count, sizeof(int));
+
+  if (component && members && member_first && component_frame)
+    component_count = call_graph_components(&graph, count, component);
+
+  if (component_count == 0)
+  {
+    call_graph_fini(&graph);
+    free(component);
+    free(members);
+    free(member_first);
+    free(component_frame);
+    return false;
+  }
+
+  /* List the functions of component c in members[member_first[c]]
+   * to members[member_first[c + 1] - 1] */
+  for (k = 0; k < count; k++)
+    member_first[component[k] + 1]++;
+
+  for (c = 0; c < component_count; c++)
+    member_first[c + 1] += member_first[c];
+
+  for (k = 0; k < count; k++)
+    members[member_first[component[k]]++] = k;
+
+  for (c = component_count; c > 0; c--)
+    member_first[c] = member_first[c - 1];
+
+  member_first[0] = 0;
+
+  /* Callers first, so the frame of a function starts above the frames
+   * of every function that can be live when it is called */
+  for (c = component_count; c-- > 0;)
+  {
+    v = members[member_first[c]];
+    recursive = member_first[c + 1] - member_first[c] > 1;
+
+    for (e = graph.first[v]; e < graph.first[v + 1]; e++)
+      recursive = recursive || graph.callees[e] == v;
+
+    for (k = member_first[c]; k < member_first[c + 1]; k++)
+    {
+      v = members[k];
+      frame = component_frame[c];
+      size = 0;
+
+      if (!recursive &&
+          conventions[v].convention != CALL_CONVENTION_NO_FRAME &&
+          strcmp(functions[v].name, OPTIMIZER_ENTRY_FUNCTION) != 0 &&
+          !function_entry_is_duplicated(functions, count, v))
+      {
+        size = static_frame_layout(program, &functions[v],
+                                   graph.call_arguments[v], &conventions[v]);
+
+        if (frame + size <= budget)
+        {
+          conventions[v].convention = CALL_CONVENTION_STATIC_FRAME;
+          conventions[v].frame = STATIC_SEGMENT_BASE + (int)statics + frame;
+        }
+        else
+          size = 0;
+      }
+
+      for (e = graph.first[v]; e < graph.first[v + 1]; e++)
+      {
+        if (component[graph.callees[e]] != c &&
+            frame + size > component_frame[component[graph.callees[e]]])
+          component_frame[component[graph.callees[e]]] = frame + size;
+      }
+    }
+  }
+
+  call_graph_fini(&graph);
+  free(component);
+  free(members);
+  free(member_first);
+  free(component_frame);
+
+  return true;
+}
+
+int static_frame_layout(const VmProgram *program,
+                        const FunctionEntry *function, int call_arguments,
+                        FunctionConvention *convention)
+{
+  const VmFile *file = NULL;
+  const VmCommand *command = NULL;
+  int size;
+  size_t i;
+
+  assert(program);
+  assert(function);
+  assert(convention);
+
+  file = &program->files[function->file];
+
+  convention->argument_count = call_arguments;
+  convention->saved_pointers = 0;
+
+  for (i = function->begin + 1; i < function->end; i++)
+  {
+    command = &file->commands[i];
+
+    if (command_uses_segment(command, "argument") &&
+        command->arg2 >= convention->argument_count)
+      convention->argument_count = command->arg2 + 1;
+    else if (command->type == C_POP && command_uses_segment(command, "pointer"))
+      convention->saved_pointers |= command->arg2 == 0 ?
+                                    STATIC_FRAME_SAVES_THIS : STATIC_FRAME_SAVES_THAT;
+  }
+
+  size = STATIC_FRAME_HEADER_WORDS + convention->argument_count +
+         file->commands[function->begin].arg2;
+
+  if (convention->saved_pointers & STATIC_FRAME_SAVES_THIS)
+    size++;
+
+  if (convention->saved_pointers & STATIC_FRAME_SAVES_THAT)
+    size++;
+
+  return size;
+}
+
+size_t static_variable_count(const VmProgram *program)
+{
+  const VmCommand *command = NULL;
+  size_t total = 0;
+  int highest;
+  size_t f, i;
+
+  assert(program);
+
+  /* Upper bound: every index up to the highest one of each file */
+  for (f = 0; f < program->file_count; f++)
+  {
+    highest = -1;
+
+    for (i = 0; i < program->files[f].command_count; i++)
+    {
+      command = &program->files[f].commands[i];
+
+      if (command_uses_segment(command, "static") && command->arg2 > highest)
+        highest = command->arg2;
+    }
+
+    total += (size_t)(highest + 1);
+  }
+
+  return total;
+}
+
+void function_entry_reach(FunctionEntry *functions, size_t count,
+                          const char *name,
+                          size_t *worklist, size_t *worklist_count)
+{
+  size_t i;
+
+  /* Calls to undefined functions are left for the assembler to report */
+  for (i = function_entry_find(functions, count, name);
+       i < count && strcmp(functions[i].name, name) == 0;
+       i++)
+  {
+    if (functions[i].reachable)
+      continue;
+
+    functions[i].reachable = true;
+    worklist[(*worklist_count)++] = i;
+  }
+}
+
+void inline_candidate_check(const VmProgram *program,
+                            const FunctionEntry *function,
+                            InlineCandidate *candidate)
+{
+  const VmFile *file = NULL;
+  const VmCommand *command = NULL;
+  int depth = 0;
+  size_t i;
+
+  assert(program);
+  assert(function);
+  assert(candidate);
+
+  file = &program->files[function->file];
+
+  candidate->reason = NULL;
+  candidate->local_count = file->commands[function->begin].arg2;
+  candidate->max_argument = -1;
+  candidate->uses_static = false;
+  candidate->writes_pointer[0] = false;
+  candidate->writes_pointer[1] = false;
+  candidate->sites = 0;
+  candidate->skipped_sites = 0;
+
+  if (function->end - function->begin > INLINE_MAX_COMMANDS + 2)
+  {
+    candidate->reason = "too large";
+    return;
+  }
+  else if (file->commands[function->end - 1].type != C_RETURN)
+  {
+    candidate->reason = "does not end with return";
+    return;
+  }
+
+  for (i = function->begin + 1; i < function->end - 1; i++)
+  {
+    command = &file->commands[i];
+
+    switch (command->type)
+    {
+      case C_PUSH:
+      case C_POP:
+        if (command_uses_segment(command, "argument") &&
+            command->arg2 > candidate->max_argument)
+          candidate->max_argument = command->arg2;
+        else if (command_uses_segment(command, "static"))
+          candidate->uses_static = true;
+        else if (command->type == C_POP &&
+                 command_uses_segment(command, "pointer") &&
+                 command->arg2 < POINTER_SEGMENT_WORDS)
+          candidate->writes_pointer[command->arg2] = true;
+
+        depth += command->type == C_PUSH ? 1 : -1;
+        break;
+      case C_ARITHMETIC:
+        /* Unary commands leave the depth unchanged */
+        if (strcmp(command->arg1, "neg") != 0 && strcmp(command->arg1, "not") != 0)
+          depth--;
+        break;
+      case C_CALL:
+        candidate->reason = "not a leaf function";
+        return;
+      default:
+        candidate->reason = "has control flow";
+        return;
+    }
+
+    /* The body must not reach into the caller frame */
+    if (depth < 0)
+    {
+      candidate->reason = "pops below its frame";
+      return;
+    }
+  }
+
+  if (depth != 1)
+    candidate->reason = "leaves more than the return value";
+}
+
+void function_stack_usage(const VmProgram *program,
+                          const FunctionEntry *functions, size_t count,
+                          size_t k, const size_t *component,
+                          FunctionStackUsage *usage)
+{
+  FunctionStackUsage *function = NULL;
+  const VmFile *file = NULL;
+  const VmCommand *command = NULL;
+  Cfg *cfg = NULL;
+  size_t b, i, j;
+  int deepest = 0;
+  int depth;
+
+  assert(program);
+  assert(functions);
+  assert(usage);
+
+  file = &program->files[functions[k].file];
+  function = &usage[k];
+
+  function->local_words = file->commands[functions[k].begin].arg2;
+  function->working_words = 0;
+  function->deepest_callee = NULL;
+
+  cfg = cfg_build(file, functions[k].begin, functions[k].end);
+
+  if (!cfg)
+  {
+    function->worst_words = FULL_CALL_FRAME_WORDS + function->local_words;
+    return;
+  }
+
+  function->working_words = cfg->depth_max;
+
+  for (b = 0; b < cfg->block_count; b++)
+  {
+    if (!cfg->blocks[b].reachable)
+      continue;
+
+    depth = cfg->blocks[b].depth_in;
+
+    for (i = cfg->blocks[b].begin; i < cfg->blocks[b].end; i++)
+    {
+      command = &file->commands[i];
+      depth += vm_command_stack_effect(command);
+
+      if (command->type != C_CALL)
+        continue;
+
+      /* The arguments are in depth, the call removes them and
+       * pushes the frame on top */
+      if (depth - 1 + command->arg2 + FULL_CALL_FRAME_WORDS > function->working_words)
+        function->working_words = depth - 1 + command->arg2 + FULL_CALL_FRAME_WORDS;
+
+      /* Every definition of a duplicated name may be the callee */
+      for (j = function_entry_find(functions, count, command->arg1);
+           j < count && strcmp(functions[j].name, command->arg1) == 0;
+           j++)
+      {
+        if (component[j] == component[k])
+          continue;
+
+        if (usage[j].recursive)
+          function->recursive = true;
+
+        if (depth - 1 + command->arg2 + usage[j].worst_words > deepest)
+        {
+          deepest = depth - 1 + command->arg2 + usage[j].worst_words;
+          function->deepest_callee = functions[j].name;
+        }
+      }
+    }
+  }
+
+  if (deepest < function->working_words)
+    deepest = function->working_words;
+
+  function->worst_words = FULL_CALL_FRAME_WORDS + function->local_words + deepest;
+
+  cfg_fini(cfg);
+}
+
+size_t cleanup_function_jumps(VmFile *file, size_t function, size_t end,
+                              bool invert_branches, bool *keep)
+{
+  Cfg *cfg = NULL;
+  const CfgBlock *block = NULL;
+  VmCommand *last = NULL;
+  bool *referenced = NULL;
+  size_t removed = 0;
+  size_t b, i, next, target;
+
+  assert(file);
+  assert(keep);
+
+  cfg = cfg_build(file, function, end);
+
+  if (!cfg)
+    return 0;
+
+  referenced = (bool *)calloc(cfg->block_count, sizeof(bool));
+
+  if (!referenced)
+  {
+    cfg_fini(cfg);
+    return 0;
+  }
+
+  for (b = 0; b < cfg->block_count; b++)
+  {
+    block = &cfg->blocks[b];
+
+    if (!block->reachable)
+    {
+      for (i = block->begin; i < block->end; i++)
+        keep[i] = false;
+
+      removed += block->end - block->begin;
+      continue;
+    }
+    else if (block->jump == CFG_NO_BLOCK)
+      continue;
+
+    last = &file->commands[block->end - 1];
+
+    /* if-goto T; goto F; label T, on a comparison, becomes
+     * not; if-goto F; label T */
+    if (invert_branches && last->type == C_IF && block->jump == b + 2 &&
+        cfg->blocks[b + 1].end == cfg->blocks[b + 1].begin + 1 &&
+        file->commands[cfg->blocks[b + 1].begin].type == C_GOTO &&
+        cfg->blocks[b + 1].jump != CFG_NO_BLOCK &&
+        block->end - 1 > block->begin &&
+        command_is_boolean(file, block->begin, block->end - 2))
+    {
+      last->type = C_ARITHMETIC;
+      strcpy(last->arg1, "not");
+      file->commands[cfg->blocks[b + 1].begin].type = C_IF;
+      continue;
+    }
+
+    target = jump_final_block(cfg, block->jump);
+
+    if (target != block->jump)
+      strcpy(last->arg1, file->commands[cfg->blocks[target].begin].arg1);
+
+    /* A goto to the next block that is kept falls through instead */
+    for (next = b + 1; next < cfg->block_count && !cfg->blocks[next].reachable; next++)
+      ;
+
+    if (last->type == C_GOTO && target == next)
+    {
+      keep[block->end - 1] = false;
+      removed++;
+      continue;
+    }
+
+    referenced[target] = true;
+  }
+
+  /* Labels start their block, so a block is referenced by its label */
+  for (b = 0; b < cfg->block_count; b++)
+  {
+    block = &cfg->blocks[b];
+
+    if (block->reachable && !referenced[b] && block->end > block->begin &&
+        file->commands[block->begin].type == C_LABEL)
+    {
+      keep[block->begin] = false;
+      removed++;
+    }
+  }
+
+  free(referenced);
+  cfg_fini(cfg);
+
+  return removed;
+}
+
+size_t jump_final_block(const Cfg *cfg, size_t block)
+{
+  const CfgBlock *current = NULL;
+  size_t target = block;
+  size_t steps;
+  size_t i;
+
+  assert(cfg);
+
+  /* Bounded, since a goto chain may loop */
+  for (steps = 0; steps < cfg->block_count; steps++)
+  {
+    current = &cfg->blocks[target];
+
+    for (i = current->begin;
+         i < current->end && cfg->file->commands[i].type == C_LABEL;
+         i++)
+      ;
+
+    if (i == current->end && current->successor_count == 1)
+      target = current->successors[0];
+    else if (i == current->end - 1 && cfg->file->commands[i].type == C_GOTO &&
+             current->jump != CFG_NO_BLOCK)
+      target = current->jump;
+    else
+      break;
+  }
+
+  if (cfg->blocks[target].end == cfg->blocks[target].begin ||
+      cfg->file->commands[cfg->blocks[target].begin].type != C_LABEL)
+    return block;
+
+  return target;
+}
+
+bool command_is_boolean(const VmFile *file, size_t begin, size_t index)
+{
+  const VmCommand *command = NULL;
+
+  assert(file);
+
+  /* not of a boolean is a boolean */
+  for (; index >= begin; index--)
+  {
+    command = &file->commands[index];
+
+    if (command->type != C_ARITHMETIC)
+      return false;
+    else if (strcmp(command->arg1, "eq") == 0 || strcmp(command->arg1, "gt") == 0 ||
+             strcmp(command->arg1, "lt") == 0)
+      return true;
+    else if (strcmp(command->arg1, "not") != 0 || index == begin)
+      return false;
+  }
+
+  return false;
+}
+
+CallConvention function_convention_check(const VmProgram *program,
+                                         const FunctionEntry *function)
+{
+  const VmFile *file = NULL;
+  const VmCommand *command = NULL;
+  Cfg *cfg = NULL;
+  bool frameless;
+  size_t b, i;
+
+  assert(program);
+  assert(function);
+
+  file = &program->files[function->file];
+
+  /* The bootstrap code calls the entry function with the full frame */
+  if (strcmp(function->name, OPTIMIZER_ENTRY_FUNCTION) == 0)
+    return CALL_CONVENTION_FULL;
+
+  frameless = file->commands[function->begin].arg2 == 0;
+
+  for (i = function->begin + 1; i < function->end; i++)
+  {
+    command = &file->commands[i];
+
+    /* Callees either restore THIS and THAT or never change them,
+     * so only the function own pops decide whether they are saved */
+    if (command->type == C_POP && command_uses_segment(command, "pointer"))
+      return CALL_CONVENTION_FULL;
+    else if (command_uses_segment(command, "argument") ||
+             command_uses_segment(command, "local"))
+      frameless = false;
+  }
+
+  if (!frameless)
+    return CALL_CONVENTION_NO_POINTERS;
+
+  cfg = cfg_build(file, function->begin, function->end);
+
+  /* The return address is the only word below the working stack, and
+   * the return value must land right above it on every path */
+  frameless = cfg && cfg->depth_consistent && cfg->depth_min >= 0;
+
+  for (b = 0; frameless && b < cfg->block_count; b++)
+  {
+    if (cfg->blocks[b].reachable &&
+        cfg->blocks[b].end > cfg->blocks[b].begin &&
+        file->commands[cfg->blocks[b].end - 1].type == C_RETURN &&
+        cfg->blocks[b].depth_out != 0)
+      frameless = false;
+  }
+
+  cfg_fini(cfg);
+
+  return frameless ? CALL_CONVENTION_NO_FRAME : CALL_CONVENTION_NO_POINTERS;
+}
+
+int inline_call_site(VmFile *output, const VmProgram *program,
+                     const FunctionEntry *callee,
+                     const InlineCandidate *candidate,
+                     const VmCommand *call, int base)
+{
+  const VmFile *file = &program->files[callee->file];
+  VmCommand command;
+  int saves[POINTER_SEGMENT_WORDS];
+  int next = base;
+  int i;
+  size_t k;
+
+  memset(&command, 0, sizeof(command));
+  command.line = call->line;
+
+  /* Move the arguments from the stack into caller locals */
+  command.type = C_POP;
+  strcpy(command.arg1, "local");
+
+  for (i = call->arg2 - 1; i >= 0; i--)
+  {
+    command.arg2 = base + i;
+
+    if (!vm_file_append(output, &command)) return -1;
+  }
+
+  next += call->arg2;
+
+  /* Callee locals start at zero on every call */
+  for (i = 0; i < candidate->local_count; i++)
+  {
+    command.type = C_PUSH;
+    strcpy(command.arg1, "constant");
+    command.arg2 = 0;
+
+    if (!vm_file_append(output, &command)) return -1;
+
+    command.type = C_POP;
+    strcpy(command.arg1, "local");
+    command.arg2 = next + i;
+
+    if (!vm_file_append(output, &command)) return -1;
+  }
+
+  next += candidate->local_count;
+
+  /* Save the pointers the callee changes, a return would restore them */
+  for (i = 0; i < POINTER_SEGMENT_WORDS; i++)
+  {
+    if (!candidate->writes_pointer[i])
+      continue;
+
+    saves[i] = next++;
+
+    command.type = C_PUSH;
+    strcpy(command.arg1, "pointer");
+    command.arg2 = i;
+
+    if (!vm_file_append(output, &command)) return -1;
+
+    command.type = C_POP;
+    strcpy(command.arg1, "local");
+    command.arg2 = saves[i];
+
+    if (!vm_file_append(output, &command)) return -1;
+  }
+
+  /* Copy the body, moving argument and local accesses to the caller locals */
+  for (k = callee->begin + 1; k < callee->end - 1; k++)
+  {
+    command = file->commands[k];
+    command.line = call->line;
+
+    if (command_uses_segment(&command, "argument"))
+    {
+      strcpy(command.arg1, "local");
+      command.arg2 += base;
+    }
+    else if (command_uses_segment(&command, "local"))
+    {
+      command.arg2 += base + call->arg2;
+    }
+
+    if (!vm_file_append(output, &command)) return -1;
+  }
+
+  /* Restore the pointers below the return value */
+  memset(&command, 0, sizeof(command));
+  command.line = call->line;
+
+  for (i = 0; i < POINTER_SEGMENT_WORDS; i++)
+  {
+    if (!candidate->writes_pointer[i])
+      continue;
+
+    command.type = C_PUSH;
+    strcpy(command.arg1, "local");
+    command.arg2 = saves[i];
+
+    if (!vm_file_append(output, &command)) return -1;
+
+    command.type = C_POP;
+    strcpy(command.arg1, "pointer");
+    command.arg2 = i;
+
+    if (!vm_file_append(output, &command)) return -1;
+  }
+
+  return next - base;
+}
+
+bool command_uses_segment(const VmCommand *command, MemorySegment segment)
+{
+  assert(command);
+
+  return (command->type == C_PUSH || command->type == C_POP) &&
+         strcmp(command->arg1, segment) == 0;
+}
+
+bool command_is_constant(const VmCommand *command)
+{
+  assert(command);
+
+  return command->type == C_PUSH &&
+         strcmp(command->arg1, "constant") == 0 &&
+         command->arg2 >= VM_WORD_MIN &&
+         command->arg2 <= VM_WORD_MAX;
+}
+
+int fold_word(long value)
+{
+  value &= 0xFFFF;
+
+  if (value > VM_WORD_MAX)
+    value -= 0x10000;
+
+  return (int)value;
+}
+
+bool fold_unary(const char *operation, int x, int *result)
+{
+  if (strcmp(operation, "neg") == 0)
+    *result = fold_word(-(long)x);
+  else if (strcmp(operation, "not") == 0)
+    *result = fold_word(~(long)x);
+  else
+    return false;
+
+  return true;
+}
+
+bool fold_binary(const char *operation, int x, int y, int *result)
+{
+  if (strcmp(operation, "add") == 0)
+    *result = fold_word((long)x + y);
+  else if (strcmp(operation, "sub") == 0)
+    *result = fold_word((long)x - y);
+  else if (strcmp(operation, "and") == 0)
+    *result = fold_word((long)x & y);
+  else if (strcmp(operation, "or") == 0)
+    *result = fold_word((long)x | y);
+  else if (strcmp(operation, "eq") == 0)
+    *result = x == y ? -1 : 0;
+  else if (strcmp(operation, "gt") == 0)
+    *result = fold_word((long)x - y) > 0 ? -1 : 0;
+  else if (strcmp(operation, "lt") == 0)
+    *result = fold_word((long)x - y) < 0 ? -1 : 0;
+  else
+    return false;
+
+  return true;
+}
+
+void known_constants_clear(KnownConstants *known, bool include_pointers)
+{
+  int i;
+
+  assert(known);
+
+  for (i = 0; i < TEMP_SEGMENT_WORDS; i++)
+    known->temp_known[i] = false;
+
+  if (!include_pointers)
+    return;
+
+  for (i = 0; i < POINTER_SEGMENT_WORDS; i++)
+    known->pointer_known[i] = false;
+}
+
+void known_constants_pop(KnownConstants *known, const VmCommand *command)
+{
+  int base;
+  int address;
+
+  assert(known);
+  assert(command);
+
+  if (command_uses_segment(command, "temp") && command->arg2 < TEMP_SEGMENT_WORDS)
+  {
+    known->temp_known[command->arg2] = false;
+  }
+  else if (command_uses_segment(command, "pointer") &&
+           command->arg2 < POINTER_SEGMENT_WORDS)
+  {
+    known->pointer_known[command->arg2] = false;
+  }
+  else if (command_uses_segment(command, "this") ||
+           command_uses_segment(command, "that"))
+  {
+    /* this and that may point anywhere, including RAM[3..12],
+     * unless their base is a known constant */
+    base = command_uses_segment(command, "this") ? 0 : 1;
+
+    /* RAM is addressed with the low 15 bits of the A register */
+    address = (known->pointer[base] + command->arg2) & 0x7FFF;
+
+    if (!known->pointer_known[base] ||
+        (address >= POINTER_SEGMENT_BASE &&
+         address < TEMP_SEGMENT_BASE + TEMP_SEGMENT_WORDS))
+    {
+      known_constants_clear(known, true);
+    }
+  }
+}
@@ -0,0 +1,138 @@
+/* optimizer.h: Passes that rewrite the parsed VM commands
+ *              before they are translated
+ */
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "vm_program.h"
+
+/* Optional passes, combined as a bit mask */
+typedef enum OptimizerOption
+{
+  OPTIMIZER_OPT_NONE = 0,
+  /* Evaluate constant expressions at translation time */
+  OPTIMIZER_OPT_FOLD_CONSTANTS = 1 << 0,
+  /* Remove functions that are never called from Sys.init */
+  OPTIMIZER_OPT_DEAD_FUNCTIONS = 1 << 1,
+  /* Substitute small leaf functions at their call sites */
+  OPTIMIZER_OPT_INLINE = 1 << 2,
+  /* Call functions with the lightest frame they need */
+  OPTIMIZER_OPT_CALL_CONVENTIONS = 1 << 3,
+  /* Keep the frames of non-recursive functions at fixed addresses */
+  OPTIMIZER_OPT_STATIC_FRAMES = 1 << 4,
+  /* Remove unreachable code, jump chains and unused labels */
+  OPTIMIZER_OPT_CLEANUP_JUMPS = 1 << 5
+} OptimizerOption;
+
+/* Function where the program starts, called by the bootstrap code */
+#define OPTIMIZER_ENTRY_FUNCTION "Sys.init"
+
+/* Checks if a call is translated without calling the function, as the
+ * intrinsics of the code writer are */
+typedef bool (*OptimizerIntrinsicCheck)(const char *function_name,
+                                        unsigned int n_args);
+
+
+/* Folds arithmetic, comparison and bitwise commands on constant
+ * operands and propagates constants stored in the temp and pointer
+ * segments.
+ *
+ * Returns the number of commands removed from the file
+ */
+size_t optimizer_fold_constants(VmFile *file);
+
+/* Removes the blocks that cannot be reached from the entry of their
+ * function, makes jumps go straight to the end of goto chains and
+ * drops gotos to the next command and labels no jump refers to.
+ * With invert_branches, an if-goto over a goto becomes a single
+ * negated if-goto when the condition is a comparison, which only pays
+ * off when the negation is folded into the branch.
+ *
+ * Returns the number of commands removed from the file
+ */
+size_t optimizer_cleanup_jumps(VmFile *file, bool invert_branches);
+
+/* Removes the functions that cannot be reached through calls from
+ * Sys.init, or from one of the keep_count functions named in keep.
+ * Calls is_intrinsic accepts, when not NULL, do not reach their
+ * function. Every function is kept when the program has no Sys.init.
+ * Each removed function is appended to removed, when not NULL,
+ * as a file of its own.
+ *
+ * Returns the number of functions removed from the program
+ */
+size_t optimizer_eliminate_dead_functions(VmProgram *program,
+                                          const char *const *keep,
+                                          size_t keep_count,
+                                          OptimizerIntrinsicCheck is_intrinsic,
+                                          VmProgram *removed);
+
+/* Replaces calls to small leaf functions without control flow by
+ * their bodies. The callee arguments and locals become extra locals
+ * of the caller, and pointer values the callee changes are restored
+ * after the body. Calls is_intrinsic accepts, when not NULL, are left
+ * to the code writer. Decisions are written to report when not NULL.
+ *
+ * Returns the number of call sites inlined
+ */
+size_t optimizer_inline_functions(VmProgram *program,
+                                  OptimizerIntrinsicCheck is_intrinsic,
+                                  FILE *report);
+
+/* Selects the calling convention of every function of the program.
+ * With OPTIMIZER_OPT_CALL_CONVENTIONS in options, functions that never
+ * pop into pointer 0/1 do not save THIS and THAT, and functions without
+ * locals and arguments that are called with no arguments, and whose
+ * stack depth at each command is the same on every control-flow path,
+ * with one value on the stack at every return, keep the caller LCL
+ * and ARG.
+ * With OPTIMIZER_OPT_STATIC_FRAMES, functions outside call graph cycles
+ * get a static frame. Functions never live at the same time share
+ * frame words, and those that do not fit in the RAM left by static
+ * variables keep their stack frame. Sys.init and duplicated names use
+ * the full frame.
+ *
+ * Returns the conventions sorted by name, to be freed by the caller,
+ * or NULL if the program has no functions or the list could not be
+ * allocated
+ */
+FunctionConvention *optimizer_select_conventions(const VmProgram *program,
+                                                 unsigned int options,
+                                                 size_t *count);
+
+/* Stack usage of a function, in words */
+typedef struct FunctionStackUsage
+{
+  const char *name;
+  int        local_words;
+  /* Highest working stack depth, including the arguments and frame
+   * of the functions it calls */
+  int        working_words;
+  /* Worst case of a call to the function over every call path,
+   * from the frame its caller builds to the deepest callee */
+  int        worst_words;
+  /* Set if a call path reaches recursion, whose depth is not bounded.
+   * worst_words then leaves out the calls inside each cycle */
+  bool       recursive;
+  /* Callee on the worst case path, NULL if none */
+  const char *deepest_callee;
+} FunctionStackUsage;
+
+/* Computes the stack usage of every function from the stack depths
+ * of its control-flow graph, combined over the call graph
+ *
+ * Returns the usage sorted by name, to be freed by the caller, or NULL
+ * if the program has no functions or it could not be allocated
+ */
+FunctionStackUsage *optimizer_stack_usage(const VmProgram *program,
+                                          size_t *count);
+
+/* Runs the per-file passes selected by options over every file of
+ * the program. Whole-program passes, and the jump cleanup that depends
+ * on how branches are written, are run by their own functions */
+void optimizer_run(VmProgram *program, unsigned int options);
+
+#endif
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hash_table.h"
+#include "profile.h"
+
+#define PROFILE_INITIAL_ENTRIES 256
+
+/* First line of a profile file */
+#define PROFILE_HEADER "# vmtranslator profile 1"
+
+/* Largest file name read from a profile file */
+#define PROFILE_FILENAME_MAX_LENGTH 255
+#define PROFILE_LINE_MAX_LENGTH 512
+
+/* Hot commands make up this share of the executions, in percent */
+#define PROFILE_HOT_PERCENT 99
+
+typedef struct ProfileEntry
+{
+  /* Index in the file names of the profile */
+  size_t             file;
+  unsigned int       line;
+  unsigned long long executions;
+} ProfileEntry;
+
+struct Profile
+{
+  /* Entries in order of addition, at the index of their file index
+   * and line in the command table */
+  ProfileEntry       *entries;
+  size_t             entry_count;
+  size_t             entry_capacity;
+  HashTable          *commands;
+  /* Distinct file names */
+  HashTable          *files;
+  /* Commands executed at least this many times are hot, 0 until the
+   * profile is ranked */
+  unsigned long long hot_executions;
+};
+
+/* Internal Functions */
+
+/* Returns the index of a command, or HASH_TABLE_NOT_FOUND if it is
+ * not in the profile */
+size_t profile_find(const Profile *profile, const char *file, unsigned int line);
+
+/* Doubles the entry array
+ *
+ * Returns true if successful and false otherwise
+ */
+bool profile_grow(Profile *profile);
+
+/* Sets the executions from which commands are hot */
+void profile_rank(Profile *profile);
+
+/* Orders executions from the largest */
+int profile_executions_compare(const void *a, const void *b);
+
+/* End Internal Functions */
+
+/* Creates an empty profile */
+Profile *profile_init(void)
+{
+  Profile *profile = NULL;
+
+  profile = (Profile *)calloc(1, sizeof(Profile));
+
+  if (!profile)
+    return NULL;
+
+  profile->commands = hash_table_init();
+  profile->files = hash_table_init();
+
+  if (!profile->commands || !profile->files || !profile_grow(profile))
+  {
+    profile_fini(profile);
+    return NULL;
+  }
+
+  return profile;
+}
+
+/* Records the executions of a command */
+bool profile_add(Profile *profile, const char *file, unsigned int line,
+                 unsigned long long executions)
+{
+  ProfileEntry *entry = NULL;
+  unsigned long key[2];
+  size_t file_index;
+  size_t index;
+
+  assert(profile);
+  assert(file);
+
+  if (profile->entry_count == profile->entry_capacity && !profile_grow(profile))
+    return false;
+
+  file_index = hash_table_add_string(profile->files, file);
+
+  if (file_index == HASH_TABLE_NOT_FOUND)
+    return false;
+
+  key[0] = (unsigned long)file_index;
+  key[1] = line;
+  index = hash_table_add(profile->commands, key, sizeof(key));
+
+  if (index == HASH_TABLE_NOT_FOUND)
+    return false;
+
+  if (index < profile->entry_count)
+  {
+    entry = &profile->entries[index];
+
+    if (executions > entry->executions)
+      entry->executions = executions;
+
+    return true;
+  }
+
+  entry = &profile->entries[profile->entry_count++];
+  entry->file = file_index;
+  entry->line = line;
+  entry->executions = executions;
+
+  return true;
+}
+
+/* Writes the commands executed at least once */
+bool profile_write(const Profile *profile, const char *filename)
+{
+  const ProfileEntry *entry = NULL;
+  FILE *file = NULL;
+  bool success;
+  size_t i;
+
+  assert(profile);
+  assert(filename);
+
+  file = fopen(filename, "w");
+
+  if (!file)
+    return false;
+
+  fprintf(file, "%s\n# <file> <line> <executions>\n", PROFILE_HEADER);
+
+  for (i = 0; i < profile->entry_count; i++)
+  {
+    entry = &profile->entries[i];
+
+    if (entry->executions > 0)
+      fprintf(file, "%s %u %llu\n", hash_table_key(profile->files, entry->file), entry->line,
+              entry->executions);
+  }
+
+  success = !ferror(file);
+
+  if (fclose(file) != 0)
+    success = false;
+
+  return success;
+}
+
+/* Adds the commands of a profile file and ranks them */
+bool profile_read(Profile *profile, const char *filename)
+{
+  char buffer[PROFILE_LINE_MAX_LENGTH + 1];
+  char file_name[PROFILE_FILENAME_MAX_LENGTH + 1];
+  unsigned long long executions;
+  unsigned int line;
+  unsigned int line_number = 0;
+  FILE *file = NULL;
+  bool success = true;
+  char extra;
+
+  assert(profile);
+  assert(filename);
+
+  file = fopen(filename, "r");
+
+  if (!file)
+  {
+    fprintf(stderr, "profile: Failed to open %s\n", filename);
+    return false;
+  }
+
+  while (success && fgets(buffer, sizeof(buffer), file))
+  {
+    line_number++;
+
+    if (line_number == 1 && strncmp(buffer, PROFILE_HEADER, strlen(PROFILE_HEADER)) != 0)
+    {
+      fprintf(stderr, "profile: %s is not a profile\n", filename);
+      success = false;
+    }
+    else if (buffer[0] == '#' || buffer[0] == '\n')
+      continue;
+    else if (sscanf(buffer, "%255s %u %llu %c", file_name, &line, &executions,
+                    &extra) != 3)
+    {
+      fprintf(stderr, "profile: Invalid line %u in %s\n", line_number, filename);
+      success = false;
+    }
+    else if (!profile_add(profile, file_name, line, executions))
+      success = false;
+  }
+
+  if (ferror(file))
+    success = false;
+
+  fclose(file);
+
+  if (success)
+    profile_rank(profile);
+
+  return success;
+}
+
+/* Returns the executions of a command */
+unsigned long long profile_executions(const Profile *profile, const char *file,
+                                      unsigned int line)
+{
+  size_t index;
+
+  assert(profile);
+  assert(file);
+
+  index = profile_find(profile, file, line);
+
+  if (index == HASH_TABLE_NOT_FOUND)
+    return 0;
+
+  return profile->entries[index].executions;
+}
+
+/* Returns whether a command is hot */
+bool profile_is_hot(const Profile *profile, const char *file, unsigned int line)
+{
+  unsigned long long executions;
+
+  assert(profile);
+
+  executions = profile_executions(profile, file, line);
+
+  return executions > 0 && executions >= profile->hot_executions;
+}
+
+/* Returns the number of commands in the profile */
+size_t profile_size(const Profile *profile)
+{
+  assert(profile);
+
+  return profile->entry_count;
+}
+
+/* Frees the profile */
+void profile_fini(Profile *profile)
+{
+  if (!profile)
+    return;
+
+  hash_table_fini(profile->files);
+  hash_table_fini(profile->commands);
+  free(profile->entries);
+  free(profile);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+size_t profile_find(const Profile *profile, const char *file, unsigned int line)
+{
+  unsigned long key[2];
+  size_t file_index;
+
+  file_index = hash_table_find_string(profile->files, file);
+
+  if (file_index == HASH_TABLE_NOT_FOUND)
+    return HASH_TABLE_NOT_FOUND;
+
+  key[0] = (unsigned long)file_index;
+  key[1] = line;
+
+  return hash_table_find(profile->commands, key, sizeof(key));
+}
+
+bool profile_grow(Profile *profile)
+{
+  ProfileEntry *new_entries = NULL;
+  size_t new_capacity;
+
+  new_capacity = profile->entry_capacity ? 2 * profile->entry_capacity :
+                                           PROFILE_INITIAL_ENTRIES;
+
+  new_entries = (ProfileEntry *)realloc(profile->entries,
+                                        new_capacity * sizeof(ProfileEntry));
+
+  if (!new_entries)
+    return false;
+
+  profile->entries = new_entries;
+  profile->entry_capacity = new_capacity;
+
+  return true;
+}
+
+void profile_rank(Profile *profile)
+{
+  unsigned long long *executions = NULL;
+  unsigned long long total = 0;
+  unsigned long long sum = 0;
+  size_t i;
+
+  profile->hot_executions = 0;
+
+  if (profile->entry_count == 0)
+    return;
+
+  executions = (unsigned long long *)malloc(profile->entry_count *
+                                            sizeof(unsigned long long));
+
+  /* Without memory every executed command is hot, as without ranking */
+  if (!executions)
+    return;
+
+  for (i = 0; i < profile->entry_count; i++)
+  {
+    executions[i] = profile->entries[i].executions;
+    total += executions[i];
+  }
+
+  qsort(executions, profile->entry_count, sizeof(unsigned long long),
+        profile_executions_compare);
+
+  /* The most executed commands, until they make up the hot share */
+  for (i = 0; i < profile->entry_count; i++)
+  {
+    sum += executions[i];
+    profile->hot_executions = executions[i];
+
+    if (sum >= total / 100 * PROFILE_HOT_PERCENT +
+               total % 100 * PROFILE_HOT_PERCENT / 100)
+      break;
+  }
+
+  free(executions);
+}
+
+int profile_executions_compare(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
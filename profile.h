@@ -0,0 +1,58 @@
+/* profile.h: Execution counts of the VM commands of a program, written
+ *            by a run and read back to guide a later translation
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Number of executions of each command, identified by the name of its
+ * file without the .vm extension and its line. The file is text: a
+ * comment header, then one "<file> <line> <executions>" line per
+ * command that was executed */
+typedef struct Profile Profile;
+
+/* Creates an empty profile
+ *
+ * Returns the profile, or NULL if it could not be allocated
+ */
+Profile *profile_init(void);
+
+/* Records the executions of a command. A command recorded twice keeps
+ * the larger count
+ *
+ * Returns true if successful and false otherwise
+ */
+bool profile_add(Profile *profile, const char *file, unsigned int line,
+                 unsigned long long executions);
+
+/* Writes the commands executed at least once
+ *
+ * Returns true if successful and false otherwise
+ */
+bool profile_write(const Profile *profile, const char *filename);
+
+/* Adds the commands of a profile file and ranks them. Errors are
+ * reported on stderr
+ *
+ * Returns true if successful and false otherwise
+ */
+bool profile_read(Profile *profile, const char *filename);
+
+/* Returns the executions of a command, 0 if it is not in the profile */
+unsigned long long profile_executions(const Profile *profile, const char *file,
+                                      unsigned int line);
+
+/* Returns whether a command is among the most executed commands that
+ * together make up most of the executions of the profile read. Every
+ * other command is cold: it runs rarely or never */
+bool profile_is_hot(const Profile *profile, const char *file, unsigned int line);
+
+/* Returns the number of commands in the profile */
+size_t profile_size(const Profile *profile);
+
+/* Frees the profile */
+void profile_fini(Profile *profile);
+
+#endif
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hash_table.h"
+#include "profiler.h"
+
+/* Cycles between two samples of the call stack */
+#define PROFILER_SAMPLE_CYCLES 1000
+
+/* Frames of a sampled stack beyond this depth are dropped */
+#define PROFILER_STACK_DEPTH_MAX 256
+
+/* Commands listed by the report */
+#define PROFILER_REPORT_COMMANDS 20
+
+/* Offsets of the saved values from the LCL of a frame */
+#define FRAME_RETURN_OFFSET 5
+#define FRAME_LCL_OFFSET 4
+
+/* RAM address of the local pointer and of the register holding the
+ * return address while a return runs */
+#define LCL_ADDRESS 1
+#define RETURN_ADDRESS_REGISTER 14
+
+#define PROFILER_INITIAL_STACKS 256
+#define PROFILER_INITIAL_FRAMES 4096
+
+/* Frames that are not functions of the source map */
+#define FRAME_BOOTSTRAP ((unsigned int)-1)
+#define FRAME_UNKNOWN ((unsigned int)-2)
+
+/* A distinct sampled stack, its frames from the root in the frame pool */
+typedef struct ProfilerStack
+{
+  size_t             first_frame;
+  unsigned int       depth;
+  unsigned long long cycles;
+} ProfilerStack;
+
+/* Cycles of a function, a file or a command for the report */
+typedef struct ProfilerRow
+{
+  unsigned int       id;
+  unsigned long long cycles;
+  unsigned long long total_cycles;
+} ProfilerRow;
+
+struct Profiler
+{
+  const SourceMap    *map;
+  unsigned long long *counts;
+  size_t             program_size;
+  unsigned long long cycles;
+  ProfilerStack      *stacks;
+  size_t             stack_count;
+  size_t             stack_capacity;
+  /* Indexes of the stacks, keyed by their frames */
+  HashTable          *stack_table;
+  unsigned int       *frames;
+  size_t             frame_count;
+  size_t             frame_capacity;
+  bool               walk_frames;
+  bool               failed;
+};
+
+/* Internal Functions */
+
+/* Walks the call stack of the emulator and adds cycles to it */
+void profiler_sample(Profiler *profiler, Emulator *emulator,
+                     unsigned long long cycles);
+
+/* Returns the index of the stack with the given frames, from the
+ * root, adding it if needed, or HASH_TABLE_NOT_FOUND if it could not be
+ * added */
+size_t profiler_find_stack(Profiler *profiler, const unsigned int *frames,
+                           unsigned int depth);
+
+/* Doubles the capacity of the stacks
+ *
+ * Returns true if successful and false otherwise
+ */
+bool profiler_grow_stacks(Profiler *profiler);
+
+/* Returns the name of a stack frame */
+const char *frame_name(const Profiler *profiler, unsigned int frame);
+
+/* Orders report rows from the most cycles, for qsort */
+int profiler_row_compare(const void *a, const void *b);
+
+/* End Internal Functions */
+
+/* Creates a profiler for a program translated with the given source map */
+Profiler *profiler_init(const SourceMap *map, bool walk_frames)
+{
+  Profiler *profiler = NULL;
+
+  assert(map);
+
+  profiler = (Profiler *)calloc(1, sizeof(Profiler));
+
+  if (!profiler)
+    return NULL;
+
+  profiler->map = map;
+  profiler->walk_frames = walk_frames;
+  profiler->counts = (unsigned long long *)calloc(EMULATOR_ROM_WORDS,
+                                                  sizeof(unsigned long long));
+  profiler->frames = (unsigned int *)malloc(PROFILER_INITIAL_FRAMES *
+                                            sizeof(unsigned int));
+  profiler->stack_table = hash_table_init();
+
+  if (!profiler->counts || !profiler->frames || !profiler->stack_table ||
+      !profiler_grow_stacks(profiler))
+  {
+    profiler_fini(profiler);
+    return NULL;
+  }
+
+  profiler->frame_capacity = PROFILER_INITIAL_FRAMES;
+
+  return profiler;
+}
+
+/* Runs the emulator, counting instructions and sampling stacks */
+EmulatorStatus profiler_run(Profiler *profiler, Emulator *emulator,
+                            unsigned long long max_cycles)
+{
+  EmulatorStatus status = EMULATOR_CYCLE_LIMIT;
+  unsigned long long slice;
+  unsigned long long start;
+
+  assert(profiler);
+  assert(emulator);
+
+  profiler->program_size = emulator_program_size(emulator);
+  emulator_set_counters(emulator, profiler->counts);
+
+  while (max_cycles > 0)
+  {
+    slice = max_cycles < PROFILER_SAMPLE_CYCLES ? max_cycles : PROFILER_SAMPLE_CYCLES;
+    start = emulator_cycles(emulator);
+    status = emulator_run(emulator, slice);
+
+    profiler_sample(profiler, emulator, emulator_cycles(emulator) - start);
+    max_cycles -= slice;
+
+    if (status != EMULATOR_CYCLE_LIMIT)
+      break;
+  }
+
+  emulator_set_counters(emulator, NULL);
+
+  return status;
+}
+
+/* Prints the hottest functions, files and commands */
+void profiler_print_report(const Profiler *profiler, FILE *output)
+{
+  const SourceMapEntry *entries = NULL;
+  const ProfilerStack *stack = NULL;
+  ProfilerRow *functions = NULL;
+  ProfilerRow *files = NULL;
+  ProfilerRow *commands = NULL;
+  unsigned int *function_files = NULL;
+  size_t *last_stack = NULL;
+  unsigned long long bootstrap_cycles = 0;
+  unsigned long long cycles;
+  unsigned long end;
+  unsigned long address;
+  unsigned int frame;
+  size_t entry_count;
+  size_t name_count;
+  size_t i, j;
+  double total;
+
+  assert(profiler);
+  assert(output);
+
+  entries = source_map_entries(profiler->map, &entry_count);
+  name_count = source_map_name_count(profiler->map);
+  total = profiler->cycles > 0 ? (double)profiler->cycles : 1.0;
+
+  functions = (ProfilerRow *)calloc(name_count + 1, sizeof(ProfilerRow));
+  files = (ProfilerRow *)calloc(name_count + 1, sizeof(ProfilerRow));
+  commands = (ProfilerRow *)calloc(entry_count + 1, sizeof(ProfilerRow));
+  function_files = (unsigned int *)calloc(name_count + 1, sizeof(unsigned int));
+  last_stack = (size_t *)calloc(name_count + 1, sizeof(size_t));
+
+  if (!functions || !files || !commands || !function_files || !last_stack)
+  {
+    fprintf(stderr, "Failed to allocate the profile report\n");
+    free(functions);
+    free(files);
+    free(commands);
+    free(function_files);
+    free(last_stack);
+    return;
+  }
+
+  for (i = 0; i < name_count; i++)
+  {
+    functions[i].id = (unsigned int)i;
+    files[i].id = (unsigned int)i;
+  }
+
+  /* Instructions before the first command are the bootstrap code */
+  end = entry_count > 0 ? entries[0].address : profiler->program_size;
+
+  for (address = 0; address < end && address < profiler->program_size; address++)
+    bootstrap_cycles += profiler->counts[address];
+
+  for (i = 0; i < entry_count; i++)
+  {
+    end = i + 1 < entry_count ? entries[i + 1].address : profiler->program_size;
+    cycles = 0;
+
+    for (address = entries[i].address; address < end; address++)
+      cycles += profiler->counts[address];
+
+    commands[i].id = (unsigned int)i;
+    commands[i].cycles = cycles;
+    functions[entries[i].function].cycles += cycles;
+    files[entries[i].file].cycles += cycles;
+    function_files[entries[i].function] = entries[i].file;
+  }
+
+  /* A function counts once for each sampled stack it is in */
+  for (i = 0; i < profiler->stack_count; i++)
+  {
+    stack = &profiler->stacks[i];
+
+    for (j = 0; j < stack->depth; j++)
+    {
+      frame = profiler->frames[stack->first_frame + j];
+
+      if (frame < name_count && last_stack[frame] != i + 1)
+      {
+        last_stack[frame] = i + 1;
+        functions[frame].total_cycles += stack->cycles;
+      }
+    }
+  }
+
+  qsort(functions, name_count, sizeof(ProfilerRow), profiler_row_compare);
+  qsort(files, name_count, sizeof(ProfilerRow), profiler_row_compare);
+  qsort(commands, entry_count, sizeof(ProfilerRow), profiler_row_compare);
+
+  fprintf(output, "profile: %llu cycles, %llu in the bootstrap code\n",
+          profiler->cycles, bootstrap_cycles);
+  fprintf(output, "%14s %7s %7s  %s\n", "self cycles", "self %", "total %", "function");
+
+  for (i = 0; i < name_count && functions[i].cycles > 0; i++)
+    fprintf(output, "%14llu %6.2f%% %6.2f%%  %s (%s.vm)\n",
+            functions[i].cycles, 100.0 * (double)functions[i].cycles / total,
+            100.0 * (double)functions[i].total_cycles / total,
+            frame_name(profiler, functions[i].id),
+            source_map_name(profiler->map, function_files[functions[i].id]));
+
+  fprintf(output, "%14s %7s  %s\n", "cycles", "%", "file");
+
+  for (i = 0; i < name_count && files[i].cycles > 0; i++)
+    fprintf(output, "%14llu %6.2f%%  %s.vm\n",
+            files[i].cycles, 100.0 * (double)files[i].cycles / total,
+            source_map_name(profiler->map, files[i].id));
+
+  fprintf(output, "%14s %7s  %s\n", "cycles", "%", "command");
+
+  for (i = 0; i < entry_count && i < PROFILER_REPORT_COMMANDS &&
+              commands[i].cycles > 0; i++)
+    fprintf(output, "%14llu %6.2f%%  %s.vm:%u %s in %s\n",
+            commands[i].cycles, 100.0 * (double)commands[i].cycles / total,
+            source_map_name(profiler->map, entries[commands[i].id].file),
+            entries[commands[i].id].line,
+            entries[commands[i].id].opcode,
+            frame_name(profiler, entries[commands[i].id].function));
+
+  free(functions);
+  free(files);
+  free(commands);
+  free(function_files);
+  free(last_stack);
+}
+
+/* Writes the sampled stacks in the collapsed format */
+bool profiler_write_stacks(const Profiler *profiler, const char *filename)
+{
+  const ProfilerStack *stack = NULL;
+  FILE *file = NULL;
+  bool success;
+  size_t i;
+  unsigned int j;
+
+  assert(profiler);
+  assert(filename);
+
+  if (profiler->failed)
+    return false;
+
+  file = fopen(filename, "w");
+
+  if (!file)
+    return false;
+
+  for (i = 0; i < profiler->stack_count; i++)
+  {
+    stack = &profiler->stacks[i];
+
+    for (j = 0; j < stack->depth; j++)
+      fprintf(file, "%s%s", j > 0 ? ";" : "",
+              frame_name(profiler, profiler->frames[stack->first_frame + j]));
+
+    fprintf(file, " %llu\n", stack->cycles);
+  }
+
+  success = !ferror(file);
+
+  if (fclose(file) != 0)
+    success = false;
+
+  return success;
+}
+
+/* Frees the profiler */
+void profiler_fini(Profiler *profiler)
+{
+  if (!profiler)
+    return;
+
+  free(profiler->counts);
+  free(profiler->stacks);
+  hash_table_fini(profiler->stack_table);
+  free(profiler->frames);
+  free(profiler);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+void profiler_sample(Profiler *profiler, Emulator *emulator,
+                     unsigned long long cycles)
+{
+  unsigned int frames[PROFILER_STACK_DEPTH_MAX];
+  unsigned int root_first[PROFILER_STACK_DEPTH_MAX];
+  const unsigned short *ram = NULL;
+  const SourceMapEntry *entry = NULL;
+  const SourceMapEntry *current = NULL;
+  unsigned short lcl, caller_lcl, return_address;
+  unsigned int depth = 0;
+  unsigned int i;
+  size_t stack;
+
+  profiler->cycles += cycles;
+
+  if (cycles == 0 || profiler->failed)
+    return;
+
+  ram = emulator_ram(emulator);
+  entry = source_map_lookup(profiler->map, emulator_pc(emulator));
+  current = entry;
+
+  if (!entry)
+    frames[depth++] = FRAME_BOOTSTRAP;
+  else if (!profiler->walk_frames)
+    frames[depth++] = entry->function;
+  else
+  {
+    frames[depth++] = entry->function;
+    lcl = ram[LCL_ADDRESS];
+
+    /* Each frame was pushed by the call before its return address */
+    while (depth < PROFILER_STACK_DEPTH_MAX)
+    {
+      if (lcl < FRAME_RETURN_OFFSET || lcl >= EMULATOR_RAM_WORDS)
+      {
+        frames[depth++] = FRAME_UNKNOWN;
+        break;
+      }
+
+      return_address = ram[lcl - FRAME_RETURN_OFFSET];
+      caller_lcl = ram[lcl - FRAME_LCL_OFFSET];
+      entry = return_address > 0 ?
+              source_map_lookup(profiler->map, return_address - 1) : NULL;
+
+      /* A return reads the return address into R14 before writing the
+       * return value, which is over it when there are no arguments */
+      if (depth == 1 && current->type == C_RETURN &&
+          !(entry && entry->type == C_CALL))
+      {
+        return_address = ram[RETURN_ADDRESS_REGISTER];
+        entry = return_address > 0 ?
+                source_map_lookup(profiler->map, return_address - 1) : NULL;
+      }
+
+      if (return_address == 0)
+      {
+        frames[depth++] = FRAME_UNKNOWN;
+        break;
+      }
+
+      /* The call of Sys.init by the bootstrap code */
+      if (!entry)
+        break;
+
+      if (entry->type != C_CALL || caller_lcl >= lcl)
+      {
+        frames[depth++] = FRAME_UNKNOWN;
+        break;
+      }
+
+      frames[depth++] = entry->function;
+      lcl = caller_lcl;
+    }
+  }
+
+  for (i = 0; i < depth; i++)
+    root_first[i] = frames[depth - 1 - i];
+
+  stack = profiler_find_stack(profiler, root_first, depth);
+
+  if (stack == HASH_TABLE_NOT_FOUND)
+  {
+    profiler->failed = true;
+    return;
+  }
+
+  profiler->stacks[stack].cycles += cycles;
+}
+
+size_t profiler_find_stack(Profiler *profiler, const unsigned int *frames,
+                           unsigned int depth)
+{
+  ProfilerStack *stack = NULL;
+  unsigned int *new_frames = NULL;
+  size_t new_capacity;
+  size_t index;
+
+  if (profiler->stack_count == profiler->stack_capacity &&
+      !profiler_grow_stacks(profiler))
+    return HASH_TABLE_NOT_FOUND;
+
+  if (profiler->frame_count + depth > profiler->frame_capacity)
+  {
+    new_capacity = 2 * profiler->frame_capacity;
+
+    while (profiler->frame_count + depth > new_capacity)
+      new_capacity *= 2;
+
+    new_frames = (unsigned int *)realloc(profiler->frames,
+                                         new_capacity * sizeof(unsigned int));
+
+    if (!new_frames)
+      return HASH_TABLE_NOT_FOUND;
+
+    profiler->frames = new_frames;
+    profiler->frame_capacity = new_capacity;
+  }
+
+  /* A new stack has room for its frames before it is added */
+  index = hash_table_add(profiler->stack_table, frames,
+                         depth * sizeof(unsigned int));
+
+  if (index == HASH_TABLE_NOT_FOUND || index < profiler->stack_count)
+    return index;
+
+  memcpy(profiler->frames + profiler->frame_count, frames,
+         depth * sizeof(unsigned int));
+
+  stack = &profiler->stacks[profiler->stack_count];
+  stack->first_frame = profiler->frame_count;
+  stack->depth = depth;
+  stack->cycles = 0;
+
+  profiler->frame_count += depth;
+
+  return profiler->stack_count++;
+}
+
+bool profiler_grow_stacks(Profiler *profiler)
+{
+  ProfilerStack *new_stacks = NULL;
+  size_t new_capacity;
+
+  new_capacity = profiler->stack_capacity ? 2 * profiler->stack_capacity :
+                                            PROFILER_INITIAL_STACKS;
+
+  new_stacks = (ProfilerStack *)realloc(profiler->stacks,
+                                        new_capacity * sizeof(ProfilerStack));
+
+  if (!new_stacks)
+    return false;
+
+  profiler->stacks = new_stacks;
+  profiler->stack_capacity = new_capacity;
+
+  return true;
+}
+
+const char *frame_name(const Profiler *profiler, unsigned int frame)
+{
+  if (frame == FRAME_BOOTSTRAP)
+    return "[bootstrap]";
+  else if (frame == FRAME_UNKNOWN)
+    return "[unknown]";
+  else if (source_map_name(profiler->map, frame)[0] == '\0')
+    return "[no function]";
+
+  return source_map_name(profiler->map, frame);
+}
+
+int profiler_row_compare(const void *a, const void *b)
+{
+  const ProfilerRow *row_a = (const ProfilerRow *)a;
+  const ProfilerRow *row_b = (const ProfilerRow *)b;
+
+  if (row_a->cycles != row_b->cycles)
+    return row_a->cycles < row_b->cycles ? 1 : -1;
+
+  return row_a->id < row_b->id ? -1 : row_a->id > row_b->id;
+}
@@ -0,0 +1,49 @@
+/* profiler.h: Attributes the cycles of a program run on the emulator
+ *             to the VM commands, functions and files it came from
+ */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "emulator.h"
+#include "source_map.h"
+
+/* Execution counts of every ROM address, exact, and call stacks
+ * sampled at regular cycle intervals. Stacks are walked through the
+ * frames of code_writer_write_call: the return address of a frame is
+ * at LCL - 5 and the LCL of the caller at LCL - 4 */
+typedef struct Profiler Profiler;
+
+/* Creates a profiler for a program translated with the given source
+ * map, which must outlive the profiler. Unless walk_frames is set,
+ * because some calls do not build the standard frame, stacks only
+ * hold the function running
+ *
+ * Returns the profiler, or NULL if it could not be allocated
+ */
+Profiler *profiler_init(const SourceMap *map, bool walk_frames);
+
+/* Runs the emulator as emulator_run does, counting the executions of
+ * each instruction and sampling the call stack
+ *
+ * Returns why the execution stopped
+ */
+EmulatorStatus profiler_run(Profiler *profiler, Emulator *emulator,
+                            unsigned long long max_cycles);
+
+/* Prints the cycles spent in each function, from the hottest one,
+ * and in each file and the hottest VM commands */
+void profiler_print_report(const Profiler *profiler, FILE *output);
+
+/* Writes the sampled stacks in the collapsed format of flamegraph.pl,
+ * one "root;...;leaf cycles" line per distinct stack
+ *
+ * Returns true if successful and false otherwise
+ */
+bool profiler_write_stacks(const Profiler *profiler, const char *filename);
+
+/* Frees the profiler */
+void profiler_fini(Profiler *profiler);
+
+#endif
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "hash_table.h"
+#include "source_map.h"
+
+#define SOURCE_MAP_INITIAL_ENTRIES 1024
+
+/* Version of the JSON format written by source_map_write */
+#define SOURCE_MAP_VERSION 1
+
+/* VM keywords of the command types */
+typedef struct CommandTypeEntry
+{
+  CommandType type;
+  const char  *name;
+} CommandTypeEntry;
+
+#define COMMAND_TYPE_TABLE_SIZE 9
+
+static const CommandTypeEntry command_type_table[COMMAND_TYPE_TABLE_SIZE] =
+{
+  { C_ARITHMETIC, "arithmetic" },
+  { C_PUSH, "push" },
+  { C_POP, "pop" },
+  { C_LABEL, "label" },
+  { C_GOTO, "goto" },
+  { C_IF, "if-goto" },
+  { C_FUNCTION, "function" },
+  { C_RETURN, "return" },
+  { C_CALL, "call" },
+};
+
+/* Keywords of the arithmetic-logical commands */
+#define ARITHMETIC_OPCODE_TABLE_SIZE 9
+
+static const char *arithmetic_opcode_table[ARITHMETIC_OPCODE_TABLE_SIZE] =
+{
+  "add", "sub", "neg", "eq", "gt", "lt", "and", "or", "not"
+};
+
+struct SourceMap
+{
+  SourceMapEntry *entries;
+  size_t         entry_count;
+  size_t         entry_capacity;
+  unsigned long  size;
+  /* Names, indexed in order of addition */
+  HashTable      *names;
+};
+
+/* Internal Functions */
+
+/* Returns the VM keyword of a command, from the static tables */
+const char *command_opcode(CommandType type, const char *operation);
+
+/* Writes a string as a JSON string */
+void write_json_string(FILE *file, const char *string);
+
+/* End Internal Functions */
+
+/* Creates an empty map */
+SourceMap *source_map_init(void)
+{
+  SourceMap *map = NULL;
+
+  map = (SourceMap *)calloc(1, sizeof(SourceMap));
+
+  if (!map)
+    return NULL;
+
+  map->entries = (SourceMapEntry *)malloc(SOURCE_MAP_INITIAL_ENTRIES *
+                                          sizeof(SourceMapEntry));
+  map->names = hash_table_init();
+
+  if (!map->entries || !map->names)
+  {
+    source_map_fini(map);
+    return NULL;
+  }
+
+  map->entry_capacity = SOURCE_MAP_INITIAL_ENTRIES;
+
+  return map;
+}
+
+/* Returns the index of a name, adding it if needed */
+int source_map_add_name(SourceMap *map, const char *name)
+{
+  size_t index;
+
+  assert(map);
+  assert(name);
+
+  index = hash_table_add_string(map->names, name);
+
+  return index == HASH_TABLE_NOT_FOUND ? -1 : (int)index;
+}
+
+/* Adds the entry of a command */
+bool source_map_add(SourceMap *map, unsigned long address, unsigned int file,
+                    unsigned int function, unsigned int line, CommandType type,
+                    const char *operation)
+{
+  SourceMapEntry *new_entries = NULL;
+  SourceMapEntry *entry = NULL;
+
+  assert(map);
+  assert(file < hash_table_count(map->names) &&
+         function < hash_table_count(map->names));
+
+  if (map->entry_count > 0 && map->entries[map->entry_count - 1].address >= address)
+  {
+    /* The previous command produced no instructions */
+    if (map->entries[map->entry_count - 1].address > address)
+      return false;
+
+    entry = &map->entries[map->entry_count - 1];
+  }
+  else
+  {
+    if (map->entry_count == map->entry_capacity)
+    {
+      new_entries = (SourceMapEntry *)realloc(map->entries, 2 * map->entry_capacity *
+                                                            sizeof(SourceMapEntry));
+
+      if (!new_entries)
+        return false;
+
+      map->entries = new_entries;
+      map->entry_capacity *= 2;
+    }
+
+    entry = &map->entries[map->entry_count++];
+  }
+
+  entry->address = address;
+  entry->file = file;
+  entry->function = function;
+  entry->line = line;
+  entry->type = type;
+  entry->opcode = command_opcode(type, operation);
+
+  if (address >= map->size)
+    map->size = address + 1;
+
+  return true;
+}
+
+/* Sets the number of instructions of the program */
+void source_map_set_size(SourceMap *map, unsigned long instruction_count)
+{
+  assert(map);
+
+  map->size = instruction_count;
+}
+
+/* Returns the number of instructions of the program */
+unsigned long source_map_size(const SourceMap *map)
+{
+  assert(map);
+
+  return map->size;
+}
+
+/* Returns the entry of the command written at address */
+const SourceMapEntry *source_map_lookup(const SourceMap *map,
+                                        unsigned long address)
+{
+  size_t low, high, middle;
+
+  assert(map);
+
+  if (map->entry_count == 0 || address < map->entries[0].address)
+    return NULL;
+
+  /* Last entry whose address is not above address */
+  low = 0;
+  high = map->entry_count;
+
+  while (high - low > 1)
+  {
+    middle = low + (high - low) / 2;
+
+    if (map->entries[middle].address <= address)
+      low = middle;
+    else
+      high = middle;
+  }
+
+  return &map->entries[low];
+}
+
+/* Returns the entries of the map */
+const SourceMapEntry *source_map_entries(const SourceMap *map, size_t *count)
+{
+  assert(map);
+  assert(count);
+
+  *count = map->entry_count;
+
+  return map->entries;
+}
+
+/* Returns the name with the given index */
+const char *source_map_name(const SourceMap *map, unsigned int index)
+{
+  assert(map);
+
+  return hash_table_key(map->names, index);
+}
+
+/* Returns the number of names in the map */
+size_t source_map_name_count(const SourceMap *map)
+{
+  assert(map);
+
+  return hash_table_count(map->names);
+}
+
+/* Writes the map as JSON */
+bool source_map_write(const SourceMap *map, const char *filename)
+{
+  const SourceMapEntry *entry = NULL;
+  FILE *file = NULL;
+  bool success;
+  size_t i;
+
+  assert(map);
+  assert(filename);
+
+  file = fopen(filename, "w");
+
+  if (!file)
+    return false;
+
+  fprintf(file, "{\"version\":%d,\"instructions\":%lu,\"names\":[",
+          SOURCE_MAP_VERSION, map->size);
+
+  for (i = 0; i < hash_table_count(map->names); i++)
+  {
+    if (i > 0)
+      fputc(',', file);
+
+    write_json_string(file, hash_table_key(map->names, i));
+  }
+
+  fputs("],\"entries\":[", file);
+
+  /* One line per entry keeps the file easy to diff */
+  for (i = 0; i < map->entry_count; i++)
+  {
+    entry = &map->entries[i];
+    fprintf(file, "%s\n[%lu,%u,%u,%u,\"%s\"]", i > 0 ? "," : "",
+            entry->address, entry->file, entry->function, entry->line,
+            entry->opcode);
+  }
+
+  fputs("]}\n", file);
+
+  success = !ferror(file);
+
+  if (fclose(file) != 0)
+    success = false;
+
+  return success;
+}
+
+/* Frees the map */
+void source_map_fini(SourceMap *map)
+{
+  if (!map)
+    return;
+
+  hash_table_fini(map->names);
+  free(map->entries);
+  free(map);
+}
+
+/*
+ * INTERNAL FUNCTIONS
+ */
+
+const char *command_opcode(CommandType type, const char *operation)
+{
+  int i;
+
+  if (type == C_ARITHMETIC && operation)
+  {
+    for (i = 0; i < ARITHMETIC_OPCODE_TABLE_SIZE; i++)
+    {
+      if (strcmp(operation, arithmetic_opcode_table[i]) == 0)
+        return arithmetic_opcode_table[i];
+    }
+  }
+
+  for (i = 0; i < COMMAND_TYPE_TABLE_SIZE; i++)
+  {
+    if (command_type_table[i].type == type)
+      return command_type_table[i].name;
+  }
+
+  return "unknown";
+}
+
+void write_json_string(FILE *file, const char *string)
+{
+  fputc('"', file);
+
+  for (; *string; string++)
+  {
+    if (*string == '"' || *string == '\\')
+      fprintf(file, "\\%c", *string);
+    else if ((unsigned char)*string < 0x20)
+      fprintf(file, "\\u%04x", (unsigned char)*string);
+    else
+      fputc(*string, file);
+  }
+
+  fputc('"', file);
+}
@@ -0,0 +1,82 @@
+/* source_map.h: Maps ROM addresses of the translated program back to
+ *               the VM commands they were written for
+ */
+#ifndef SOURCE_MAP_H
+#define SOURCE_MAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "translator_common.h"
+
+/* VM command that the instructions from address up to the address of
+ * the next entry, or the end of the program, were written for. File
+ * and function are indexes of names in the map, opcode is the VM
+ * keyword of the command, such as "push" or "add" */
+typedef struct SourceMapEntry
+{
+  unsigned long address;
+  unsigned int  file;
+  unsigned int  function;
+  unsigned int  line;
+  CommandType   type;
+  const char    *opcode;
+} SourceMapEntry;
+
+/* Entries sorted by address, one for each VM command that produced
+ * instructions, and the names of their files and functions */
+typedef struct SourceMap SourceMap;
+
+/* Creates an empty map
+ *
+ * Returns the map, or NULL if it could not be allocated
+ */
+SourceMap *source_map_init(void);
+
+/* Returns the index of a file or function name, adding it to the map
+ * if it is not there yet, or -1 if it could not be added */
+int source_map_add_name(SourceMap *map, const char *name);
+
+/* Adds the entry of a command whose first instruction is at address,
+ * which must not be lower than the address of the last entry. An
+ * entry at the address of the last entry replaces it. operation is
+ * the command of an arithmetic-logical command and is ignored for
+ * the other types
+ *
+ * Returns true if successful and false otherwise
+ */
+bool source_map_add(SourceMap *map, unsigned long address, unsigned int file,
+                    unsigned int function, unsigned int line, CommandType type,
+                    const char *operation);
+
+/* Sets the number of instructions of the program, where the last
+ * entry ends */
+void source_map_set_size(SourceMap *map, unsigned long instruction_count);
+
+/* Returns the number of instructions of the program */
+unsigned long source_map_size(const SourceMap *map);
+
+/* Returns the entry of the command the instruction at address was
+ * written for, or NULL if the address is before the first entry */
+const SourceMapEntry *source_map_lookup(const SourceMap *map,
+                                        unsigned long address);
+
+/* Returns the entries of the map and stores their number in count */
+const SourceMapEntry *source_map_entries(const SourceMap *map, size_t *count);
+
+/* Returns the name with the given index */
+const char *source_map_name(const SourceMap *map, unsigned int index);
+
+/* Returns the number of names in the map */
+size_t source_map_name_count(const SourceMap *map);
+
+/* Writes the map as JSON: the number of instructions, the names and
+ * an [address, file, function, line, opcode] array for each entry
+ *
+ * Returns true if successful and false otherwise
+ */
+bool source_map_write(const SourceMap *map, const char *filename);
+
+/* Frees the map */
+void source_map_fini(SourceMap *map);
+
+#endif
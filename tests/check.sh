@@ -0,0 +1,124 @@
+#!/bin/sh
+# Runs the sample programs of this directory through every backend.
+# Each sample is a directory of .vm files with an expected file of the
+# RAM words it must leave, in the format of --ram. With the default
+# features and with -O, the Hack emulator (--run) must print them, the
+# --target=c program built with the C compiler must print what --run
+# prints, and so must the interpreter (--interpret), without static
+# frames, which it does not lay out. Return addresses and the R13-R15
+# scratch registers differ between backends, so the samples leave
+# their results elsewhere.
+#
+# An options file adds its options to every translation of a sample.
+# The -O translation must not refer to the functions named in an absent
+# file, nor define them, and must halt within the number of cycles in a
+# cycles file.
+#
+# A profile written by --profile-generate must not make the program
+# larger when it is translated with --profile-use, with the top of stack
+# cached, and it must not change what the program leaves in RAM.
+#
+# Usage: check.sh <vmtranslator> [<cc>]
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 <vmtranslator> [<cc>]" >&2
+  exit 1
+fi
+
+translator=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+cc=${2:-cc}
+samples=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d) || exit 1
+failures=0
+checks=0
+
+trap 'rm -rf "$work"' EXIT
+
+# Compares the RAM words two runs printed
+#   compare <sample> <options> <expected file> <actual file> <description>
+compare()
+{
+  checks=$((checks + 1))
+
+  if ! diff "$3" "$4" > "$work/diff"; then
+    echo "FAIL: $1 $2: $5"
+    sed 's/^/  /' "$work/diff"
+    failures=$((failures + 1))
+  fi
+}
+
+for sample in "$samples"/*/; do
+  name=$(basename "$sample")
+  addresses=$(sed -n 's/^RAM\[\([0-9]*\)\].*/\1/p' "$sample/expected")
+  ram_options=$(for address in $addresses; do printf ' --ram=%s' "$address"; done)
+  extra_options=$(cat "$sample/options" 2>/dev/null)
+
+  for optimize in "" "-O"; do
+    options="$optimize $extra_options"
+    program="$work/$name"
+    rm -rf "$program"
+    cp -r "$sample" "$program"
+
+    "$translator" $options --run $ram_options "$program" > "$work/output"
+    grep '^RAM' "$work/output" > "$work/run"
+    compare "$name" "$options" "$sample/expected" "$work/run" "--run"
+
+    if [ -n "$optimize" ] && [ -f "$sample/absent" ]; then
+      # Names of the (function) labels and @function references
+      sed -n 's/^[(@]\([^)]*\))\{0,1\}$/\1/p' "$program/source.asm" |
+        grep -x -F -f "$sample/absent" | sort -u > "$work/present"
+      compare "$name" "$options" /dev/null "$work/present" "functions left in source.asm"
+    fi
+
+    if [ -n "$optimize" ] && [ -f "$sample/cycles" ]; then
+      checks=$((checks + 1))
+      limit=$(cat "$sample/cycles")
+      cycles=$(sed -n 's/^run: halted after \([0-9]*\) cycles.*/\1/p' "$work/output")
+
+      if [ -z "$cycles" ] || [ "$cycles" -gt "$limit" ]; then
+        echo "FAIL: $name $options: halted after ${cycles:-no} cycles, at most $limit expected"
+        failures=$((failures + 1))
+      fi
+    fi
+
+    "$translator" $options -fno-static-frames --interpret $ram_options "$program" |
+      grep '^RAM' > "$work/interpret"
+    compare "$name" "$options" "$work/run" "$work/interpret" "--interpret"
+
+    : > "$work/c"
+
+    if "$translator" $options --target=c "$program" &&
+       "$cc" -Wall -Werror -O2 -o "$program/program" "$program/source.c"; then
+      "$program/program" $addresses | grep '^RAM' > "$work/c"
+    fi
+
+    compare "$name" "$options" "$work/run" "$work/c" "--target=c"
+  done
+
+  for features in "-ftos-cache" "-ftos-cache -fdefer-sp" "-O -fno-fuse-branches"; do
+    options="$features $extra_options"
+    program="$work/$name"
+    rm -rf "$program"
+    cp -r "$sample" "$program"
+
+    "$translator" $options --run --profile-generate "$program" > /dev/null
+    plain=$("$translator" $options --run --stats "$program" 2>&1 |
+            sed -n 's/^assembler: \([0-9]*\) instructions/\1/p')
+    "$translator" $options --run --stats --profile-use="$program/source.profile" \
+      $ram_options "$program" > "$work/output" 2>&1
+    grep '^RAM' "$work/output" > "$work/run"
+    compare "$name" "$options" "$sample/expected" "$work/run" "--profile-use"
+
+    checks=$((checks + 1))
+    words=$(sed -n 's/^assembler: \([0-9]*\) instructions/\1/p' "$work/output")
+
+    if [ -z "$plain" ] || [ -z "$words" ] || [ "$words" -gt "$plain" ]; then
+      echo "FAIL: $name $options: ${words:-no} instructions with --profile-use, ${plain:-no} without"
+      failures=$((failures + 1))
+    fi
+  done
+done
+
+echo "$((checks - failures)) of $checks checks passed"
+
+[ $failures -eq 0 ]
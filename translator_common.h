@@ -2,6 +2,9 @@
 #ifndef TRANSLATOR_COMMON_H
 #define TRANSLATOR_COMMON_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 /* Supported command types for a VM instruction */
 typedef enum CommandType
 {
@@ -16,8 +19,110 @@ typedef enum CommandType
   C_CALL
 } CommandType;
 
+/* Range of a 16-bit two's complement VM word */
+#define VM_WORD_MIN (-32768)
+#define VM_WORD_MAX 32767
+
+/* RAM of the VM stack, from its first word to one past its last one */
+#define VM_STACK_BASE 256
+#define VM_STACK_END 2048
+
+/* First RAM words of the pointer and temp segments and their sizes */
+#define POINTER_SEGMENT_BASE 3
+#define POINTER_SEGMENT_WORDS 2
+#define TEMP_SEGMENT_BASE 5
+#define TEMP_SEGMENT_WORDS 8
+
+/* RAM given to static variables, from the first address the assembler
+ * gives to variables up to the stack. Static frames share it */
+#define STATIC_SEGMENT_BASE 16
+#define STATIC_SEGMENT_END VM_STACK_BASE
+#define STATIC_SEGMENT_WORDS (STATIC_SEGMENT_END - STATIC_SEGMENT_BASE)
+
+/* Calling conventions, from the standard VM frame to lighter ones
+ * used by functions that do not need all of it */
+typedef enum CallConvention
+{
+  /* Frame holds the return address, LCL, ARG, THIS and THAT */
+  CALL_CONVENTION_FULL,
+  /* Frame holds the return address, LCL and ARG */
+  CALL_CONVENTION_NO_POINTERS,
+  /* Frame holds only the return address, LCL and ARG are not changed */
+  CALL_CONVENTION_NO_FRAME,
+  /* Frame, arguments and locals live at fixed RAM addresses */
+  CALL_CONVENTION_STATIC_FRAME
+} CallConvention;
+
+/* A static frame starts with the return address and the stack pointer
+ * at entry, followed by the arguments, the locals and the saved
+ * THIS and THAT values */
+#define STATIC_FRAME_HEADER_WORDS 2
+#define STATIC_FRAME_SAVES_THIS (1 << 0)
+#define STATIC_FRAME_SAVES_THAT (1 << 1)
+
+/* Calling convention selected for a function */
+typedef struct FunctionConvention
+{
+  const char     *name;
+  CallConvention convention;
+  /* Static frames only: RAM address of the first word, above every
+   * static variable, number of argument words and saved pointers */
+  int            frame;
+  int            argument_count;
+  unsigned int   saved_pointers;
+  /* Stack words the function may use above the stack pointer at its
+   * entry, checked there by the stack guard. 0 if not known */
+  int            stack_words;
+} FunctionConvention;
+
 typedef const char* ArithmeticLogicalCommand;
 
 typedef const char* MemorySegment;
 
+/* Command sequences the code writer translates as a single unit */
+typedef enum IdiomKind
+{
+  /* push x, push constant c, add or sub, pop x */
+  IDIOM_INCREMENT,
+  /* push base, push index, add, pop pointer 1, push that 0 */
+  IDIOM_ARRAY_READ,
+  /* pop pointer 1, push that 0 */
+  IDIOM_ARRAY_LOAD,
+  /* push value, pop temp 0, pop pointer 1, push temp 0, pop that 0 */
+  IDIOM_ARRAY_STORE,
+  /* pop temp 0, pop pointer 1, push temp 0, pop that 0 */
+  IDIOM_ARRAY_WRITE,
+  /* push constant 2^k, then push x unless x is already on the stack,
+   * call Math.multiply 2 */
+  IDIOM_MULTIPLY,
+  IDIOM_KIND_COUNT
+} IdiomKind;
+
+#define IDIOM_MAX_OPERANDS 2
+
+/* A push or pop operand of an idiom */
+typedef struct IdiomOperand
+{
+  MemorySegment segment;
+  int           index;
+} IdiomOperand;
+
+/* An idiom found in the command stream, in the order of the comments
+ * of IdiomKind: increments take the variable and then the constant,
+ * array reads the base and the index, array stores the value and
+ * multiplications the constant and then x when it is pushed after it */
+typedef struct Idiom
+{
+  IdiomKind                kind;
+  const char               *name;
+  IdiomOperand             operands[IDIOM_MAX_OPERANDS];
+  size_t                   operand_count;
+  /* Arithmetic command of the sequence, or NULL */
+  ArithmeticLogicalCommand operation;
+  /* Whether THAT and temp 0, set by array idioms, are overwritten
+   * before they are read again, so setting them can be skipped */
+  bool                     that_dead;
+  bool                     temp_dead;
+} Idiom;
+
 #endif
\ No newline at end of file
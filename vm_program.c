@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "translator_common.h"
+#include "parser.h"
+#include "vm_program.h"
+
+#define VM_PROGRAM_INITIAL_CAPACITY 16
+
+/* Creates an empty program */
+VmProgram *vm_program_init(void)
+{
+  VmProgram *new_program = NULL;
+
+  new_program = (VmProgram *)malloc(sizeof(VmProgram));
+
+  if (!new_program) return NULL;
+
+  new_program->files = NULL;
+  new_program->file_count = 0;
+  new_program->file_capacity = 0;
+
+  return new_program;
+}
+
+/* Parses a VM file and appends it to the program */
+VmFile *vm_program_add_file(VmProgram *program, const char *filename)
+{
+  VmFile *file = NULL;
+
+  assert(program);
+
+  if (!filename) return NULL;
+  else if (strlen(filename) > VM_FILENAME_MAX_LENGTH) return NULL;
+
+  /* Grow file list */
+  if (program->file_count == program->file_capacity)
+  {
+    size_t new_capacity = program->file_capacity ?
+                          program->file_capacity * 2 : VM_PROGRAM_INITIAL_CAPACITY;
+    VmFile *new_files = (VmFile *)realloc(program->files,
+                                          new_capacity * sizeof(VmFile));
+
+    if (!new_files) return NULL;
+
+    program->files = new_files;
+    program->file_capacity = new_capacity;
+  }
+
+  file = &program->files[program->file_count++];
+
+  strcpy(file->filename, filename);
+  file->commands = NULL;
+  file->command_count = 0;
+  file->command_capacity = 0;
+
+  return file;
+}
+
+bool vm_program_load_file(VmProgram *program, const char *input_file)
+{
+  Parser *parser = NULL;
+  VmFile *file = NULL;
+  VmCommand command;
+  unsigned int arg2;
+
+  assert(program);
+
+  if (!input_file) return false;
+  else if (strlen(input_file) > VM_FILENAME_MAX_LENGTH) return false;
+
+  parser = parser_init(input_file);
+
+  if (!parser) return false;
+
+  file = vm_program_add_file(program, input_file);
+
+  if (!file)
+  {
+    parser_fini(parser);
+    return false;
+  }
+
+  /* Parse each line in the file */
+  while (parser_has_more_lines(parser))
+  {
+    if (!parser_advance(parser)) continue;
+
+    memset(&command, 0, sizeof(command));
+
+    command.type = parser_command_type(parser);
+    command.line = parser_get_line_number(parser);
+
+    if (command.type != C_RETURN)
+      parser_arg1(parser, command.arg1, sizeof(command.arg1));
+
+    switch (command.type)
+    {
+      case C_PUSH:
+      case C_POP:
+      case C_FUNCTION:
+      case C_CALL:
+        parser_arg2(parser, &arg2);
+        command.arg2 = (int)arg2;
+        break;
+      default:
+        break;
+    }
+
+    if (!vm_file_append(file, &command))
+    {
+      /* Drop the partially loaded file */
+      free(file->commands);
+      program->file_count--;
+      parser_fini(parser);
+      return false;
+    }
+  }
+
+  parser_fini(parser);
+
+  return true;
+}
+
+/* Appends a command at the end of a file */
+bool vm_file_append(VmFile *file, const VmCommand *command)
+{
+  assert(file);
+  assert(command);
+
+  if (file->command_count == file->command_capacity)
+  {
+    size_t new_capacity = file->command_capacity ?
+                          file->command_capacity * 2 : VM_PROGRAM_INITIAL_CAPACITY;
+    VmCommand *new_commands = (VmCommand *)realloc(file->commands,
+                                                   new_capacity * sizeof(VmCommand));
+
+    if (!new_commands) return false;
+
+    file->commands = new_commands;
+    file->command_capacity = new_capacity;
+  }
+
+  file->commands[file->command_count++] = *command;
+
+  return true;
+}
+
+/* Returns how many words a command adds to the working stack */
+int vm_command_stack_effect(const VmCommand *command)
+{
+  assert(command);
+
+  switch (command->type)
+  {
+    case C_PUSH:
+      return 1;
+    case C_POP:
+    case C_IF:
+    case C_RETURN:
+      return -1;
+    case C_ARITHMETIC:
+      /* Unary commands replace the top of the stack */
+      if (strcmp(command->arg1, "neg") == 0 || strcmp(command->arg1, "not") == 0)
+        return 0;
+      return -1;
+    case C_CALL:
+      return 1 - command->arg2;
+    default:
+      return 0;
+  }
+}
+
+/* Frees the program and all of its files */
+void vm_program_fini(VmProgram *program)
+{
+  size_t i;
+
+  if (!program) return;
+
+  for (i = 0; i < program->file_count; i++)
+  {
+    free(program->files[i].commands);
+  }
+
+  free(program->files);
+
+  free(program);
+}
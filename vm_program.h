@@ -0,0 +1,64 @@
+/* vm_program.h: Holds the parsed VM commands of every input file,
+ *               so they can be rewritten before being translated
+ */
+#ifndef VM_PROGRAM_H
+#define VM_PROGRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "translator_common.h"
+#include "parser.h"
+
+#define VM_COMMAND_ARG1_MAX_LENGTH PARSED_COMMAND_ARG1_MAX_LENGTH
+#define VM_FILENAME_MAX_LENGTH 256
+
+/* A parsed VM command */
+typedef struct VmCommand
+{
+  CommandType  type;
+  char         arg1[VM_COMMAND_ARG1_MAX_LENGTH + 1];
+  int          arg2;
+  unsigned int line;
+} VmCommand;
+
+/* The commands of a VM file, in source order */
+typedef struct VmFile
+{
+  char      filename[VM_FILENAME_MAX_LENGTH + 1];
+  VmCommand *commands;
+  size_t    command_count;
+  size_t    command_capacity;
+} VmFile;
+
+/* The VM files of a translation, in translation order */
+typedef struct VmProgram
+{
+  VmFile *files;
+  size_t file_count;
+  size_t file_capacity;
+} VmProgram;
+
+/* Creates an empty program */
+VmProgram *vm_program_init(void);
+
+/* Appends an empty file to the program
+ *
+ * Returns the new file, or NULL if it could not be created
+ */
+VmFile *vm_program_add_file(VmProgram *program, const char *filename);
+
+/* Parses a VM file and appends it to the program */
+bool vm_program_load_file(VmProgram *program, const char *input_file);
+
+/* Appends a command at the end of a file */
+bool vm_file_append(VmFile *file, const VmCommand *command);
+
+/* Returns how many words a command adds to the working stack,
+ * negative if it removes them. A call counts the value it returns
+ * and a return the value it takes */
+int vm_command_stack_effect(const VmCommand *command);
+
+/* Frees the program and all of its files */
+void vm_program_fini(VmProgram *program);
+
+#endif
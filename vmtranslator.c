@@ -9,13 +9,313 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <time.h>
 
 #include "translator_common.h"
 #include "code_writer.h"
 #include "parser.h"
+#include "vm_program.h"
+#include "optimizer.h"
+#include "idiom.h"
+#include "assembler.h"
+#include "emulator.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "c_writer.h"
+#include "source_map.h"
+#include "profiler.h"
+#include "profile.h"
 
 #define VM_EXTENSION "vm"
 
+/* Code generation features that can be toggled from the command line
+ * with -f<name> and -fno-<name> */
+typedef struct TranslatorOptionEntry
+{
+  const char   *name;
+  unsigned int writer_flag;
+  unsigned int optimizer_flag;
+} TranslatorOptionEntry;
+
+#define TRANSLATOR_OPTION_TABLE_SIZE 16
+
+static const TranslatorOptionEntry
+  translator_option_table[TRANSLATOR_OPTION_TABLE_SIZE] =
+{
+  { "tos-cache", CODE_WRITER_OPT_TOS_CACHE, OPTIMIZER_OPT_NONE },
+  { "defer-sp", CODE_WRITER_OPT_DEFER_SP, OPTIMIZER_OPT_NONE },
+  { "fuse-branches", CODE_WRITER_OPT_FUSE_BRANCHES, OPTIMIZER_OPT_NONE },
+  { "small-operands", CODE_WRITER_OPT_SMALL_OPERANDS, OPTIMIZER_OPT_NONE },
+  { "direct-pop", CODE_WRITER_OPT_DIRECT_POP, OPTIMIZER_OPT_NONE },
+  { "bulk-locals", CODE_WRITER_OPT_BULK_LOCALS, OPTIMIZER_OPT_NONE },
+  { "tail-calls", CODE_WRITER_OPT_TAIL_CALLS, OPTIMIZER_OPT_NONE },
+  { "stack-guard", CODE_WRITER_OPT_STACK_GUARD, OPTIMIZER_OPT_NONE },
+  { "superinstructions", CODE_WRITER_OPT_SUPERINSTRUCTIONS, OPTIMIZER_OPT_NONE },
+  { "intrinsics", CODE_WRITER_OPT_INTRINSICS, OPTIMIZER_OPT_NONE },
+  { "fold-constants", CODE_WRITER_OPT_NONE, OPTIMIZER_OPT_FOLD_CONSTANTS },
+  { "dead-functions", CODE_WRITER_OPT_NONE, OPTIMIZER_OPT_DEAD_FUNCTIONS },
+  { "inline", CODE_WRITER_OPT_NONE, OPTIMIZER_OPT_INLINE },
+  { "light-calls", CODE_WRITER_OPT_NONE, OPTIMIZER_OPT_CALL_CONVENTIONS },
+  { "static-frames", CODE_WRITER_OPT_NONE, OPTIMIZER_OPT_STATIC_FRAMES },
+  { "cleanup-jumps", CODE_WRITER_OPT_NONE, OPTIMIZER_OPT_CLEANUP_JUMPS },
+};
+
+/* Features enabled by -O */
+#define TRANSLATOR_OPTIMIZE_WRITER_FLAGS (CODE_WRITER_OPT_TOS_CACHE | \
+                                          CODE_WRITER_OPT_DEFER_SP | \
+                                          CODE_WRITER_OPT_FUSE_BRANCHES | \
+                                          CODE_WRITER_OPT_SMALL_OPERANDS | \
+                                          CODE_WRITER_OPT_DIRECT_POP | \
+                                          CODE_WRITER_OPT_BULK_LOCALS | \
+                                          CODE_WRITER_OPT_TAIL_CALLS | \
+                                          CODE_WRITER_OPT_SUPERINSTRUCTIONS)
+#define TRANSLATOR_OPTIMIZE_OPTIMIZER_FLAGS (OPTIMIZER_OPT_FOLD_CONSTANTS | \
+                                             OPTIMIZER_OPT_DEAD_FUNCTIONS | \
+                                             OPTIMIZER_OPT_INLINE | \
+                                             OPTIMIZER_OPT_CALL_CONVENTIONS | \
+                                             OPTIMIZER_OPT_STATIC_FRAMES | \
+                                             OPTIMIZER_OPT_CLEANUP_JUMPS)
+
+/* Output files that can be selected with --format=<name> */
+typedef struct TranslatorFormatEntry
+{
+  const char      *name;
+  const char      *output_filename;
+  /* Whether the assembly goes through the integrated assembler */
+  bool            assembled;
+  AssemblerFormat assembler_format;
+} TranslatorFormatEntry;
+
+#define TRANSLATOR_FORMAT_TABLE_SIZE 3
+
+/* Source map written by --source-map */
+#define TRANSLATOR_SOURCE_MAP_FILENAME "source.map"
+
+/* Collapsed stacks written by --profile */
+#define TRANSLATOR_PROFILE_STACKS_FILENAME "source.folded"
+
+/* Execution counts written by --profile-generate */
+#define TRANSLATOR_PROFILE_FILENAME "source.profile"
+
+/* Largest file name recorded in a profile, as in the code writer */
+#define TRANSLATOR_PROFILE_NAME_MAX_LENGTH 256
+
+/* Output file of --target=c */
+#define TRANSLATOR_C_OUTPUT_FILENAME "source.c"
+
+static const TranslatorFormatEntry
+  translator_format_table[TRANSLATOR_FORMAT_TABLE_SIZE] =
+{
+  { "asm", "source.asm", false, ASSEMBLER_FORMAT_HACK },
+  { "hack", "source.hack", true, ASSEMBLER_FORMAT_HACK },
+  { "bin", "source.bin", true, ASSEMBLER_FORMAT_BINARY },
+};
+
+/* Largest number of --keep=<function> options */
+#define TRANSLATOR_KEEP_FUNCTIONS_MAX 64
+
+/* Largest number of --ram=<first>-<last> options */
+#define TRANSLATOR_RAM_RANGES_MAX 16
+
+/* Cycles --run executes, or commands --interpret executes, before
+ * giving up on a program that does not halt */
+#define TRANSLATOR_RUN_DEFAULT_CYCLES 1000000000ULL
+
+/* RAM words shown after a run */
+typedef struct TranslatorRamRange
+{
+  unsigned int first;
+  unsigned int last;
+} TranslatorRamRange;
+
+/* Options selected in the command line */
+typedef struct TranslatorOptions
+{
+  unsigned int writer_options;
+  unsigned int optimizer_options;
+  /* Functions kept by dead function elimination even if never called */
+  const char   *keep_functions[TRANSLATOR_KEEP_FUNCTIONS_MAX];
+  size_t       keep_count;
+  /* Report what the optimizations did on stderr */
+  bool         print_stats;
+  /* Write the VM command of every instruction */
+  bool         source_map;
+  /* Output file, an entry of translator_format_table */
+  const TranslatorFormatEntry *format;
+  /* Run the program on the emulator for at most run_cycles cycles */
+  bool               run;
+  unsigned long long run_cycles;
+  /* Run translated to x86-64 instead of emulated */
+  bool               jit;
+  /* Report where the cycles of the run went */
+  bool               profile;
+  /* Execute the VM commands instead of translating them, at most
+   * run_cycles of them */
+  bool               interpret;
+  TranslatorRamRange ram_ranges[TRANSLATOR_RAM_RANGES_MAX];
+  size_t             ram_range_count;
+  /* Write a C program instead of Hack code */
+  bool               target_c;
+  /* Write how many times the run executed each command */
+  bool               profile_generate;
+  /* Profile file that tells the hot commands from the cold ones, or NULL */
+  const char         *profile_use;
+} TranslatorOptions;
+
+/* Parses a command line option into the translator options
+ *
+ * Returns true if the option is valid and false otherwise
+ */
+bool parse_option(const char *option, TranslatorOptions *options)
+{
+  TranslatorRamRange *range = NULL;
+  const char *name = NULL;
+  char *end = NULL;
+  bool enable = true;
+  int i;
+
+  if (strcmp(option, "-O") == 0)
+  {
+    options->writer_options |= TRANSLATOR_OPTIMIZE_WRITER_FLAGS;
+    options->optimizer_options |= TRANSLATOR_OPTIMIZE_OPTIMIZER_FLAGS;
+    return true;
+  }
+  else if (strcmp(option, "--stats") == 0)
+  {
+    options->print_stats = true;
+    return true;
+  }
+  else if (strcmp(option, "--source-map") == 0)
+  {
+    options->source_map = true;
+    return true;
+  }
+  else if (strncmp(option, "--format=", 9) == 0)
+  {
+    for (i = 0; i < TRANSLATOR_FORMAT_TABLE_SIZE; i++)
+    {
+      if (strcmp(option + 9, translator_format_table[i].name) == 0)
+      {
+        options->format = &translator_format_table[i];
+        return true;
+      }
+    }
+
+    return false;
+  }
+  else if (strcmp(option, "--target=hack") == 0)
+  {
+    options->target_c = false;
+    return true;
+  }
+  else if (strcmp(option, "--target=c") == 0)
+  {
+    options->target_c = true;
+    return true;
+  }
+  else if (strcmp(option, "--run") == 0)
+  {
+    options->run = true;
+    return true;
+  }
+  else if (strncmp(option, "--run=", 6) == 0)
+  {
+    options->run = true;
+    options->run_cycles = strtoull(option + 6, &end, 10);
+
+    return option[6] >= '0' && option[6] <= '9' && *end == '\0';
+  }
+  else if (strcmp(option, "--jit") == 0)
+  {
+    options->run = true;
+    options->jit = true;
+    return true;
+  }
+  else if (strcmp(option, "--profile") == 0)
+  {
+    options->run = true;
+    options->profile = true;
+    return true;
+  }
+  else if (strcmp(option, "--profile-generate") == 0)
+  {
+    options->profile_generate = true;
+    return true;
+  }
+  else if (strncmp(option, "--profile-use=", 14) == 0)
+  {
+    options->profile_use = option + 14;
+    return option[14] != '\0';
+  }
+  else if (strcmp(option, "--interpret") == 0)
+  {
+    options->interpret = true;
+    return true;
+  }
+  else if (strncmp(option, "--interpret=", 12) == 0)
+  {
+    options->interpret = true;
+    options->run_cycles = strtoull(option + 12, &end, 10);
+
+    return option[12] >= '0' && option[12] <= '9' && *end == '\0';
+  }
+  else if (strncmp(option, "--ram=", 6) == 0)
+  {
+    if (options->ram_range_count == TRANSLATOR_RAM_RANGES_MAX ||
+        option[6] < '0' || option[6] > '9')
+      return false;
+
+    range = &options->ram_ranges[options->ram_range_count++];
+    range->first = (unsigned int)strtoul(option + 6, &end, 10);
+    range->last = range->first;
+
+    if (*end == '-')
+      range->last = (unsigned int)strtoul(end + 1, &end, 10);
+
+    return *end == '\0' && range->first <= range->last &&
+           range->last < EMULATOR_RAM_WORDS;
+  }
+  else if (strncmp(option, "--keep=", 7) == 0)
+  {
+    if (option[7] == '\0' || options->keep_count == TRANSLATOR_KEEP_FUNCTIONS_MAX)
+      return false;
+
+    options->keep_functions[options->keep_count++] = option + 7;
+    return true;
+  }
+  else if (strncmp(option, "-f", 2) != 0)
+    return false;
+
+  name = option + 2;
+
+  if (strncmp(name, "no-", 3) == 0)
+  {
+    enable = false;
+    name += 3;
+  }
+
+  for (i = 0; i < TRANSLATOR_OPTION_TABLE_SIZE; i++)
+  {
+    if (strcmp(name, translator_option_table[i].name) == 0)
+    {
+      if (enable)
+      {
+        options->writer_options |= translator_option_table[i].writer_flag;
+        options->optimizer_options |= translator_option_table[i].optimizer_flag;
+      }
+      else
+      {
+        options->writer_options &= ~translator_option_table[i].writer_flag;
+        options->optimizer_options &= ~translator_option_table[i].optimizer_flag;
+      }
+
+      return true;
+    }
+  }
+
+  return false;
+}
+
 bool check_file_extension(const char *filename)
 {
   const char *end = NULL;
@@ -24,186 +324,910 @@ bool check_file_extension(const char *filename)
 
   end = filename + filename_len - 1;
 
-  /* Loop until find first dot from end to begin */
-  while (end != filename && *end != '.')
+  /* Loop until find first dot from end to begin */
+  while (end != filename && *end != '.')
+  {
+    end--;
+  }
+
+  if (end == filename)
+    return false;
+
+  extension = end + 1;
+
+  if (strcmp(extension, VM_EXTENSION) != 0)
+    return false;
+
+  return true;
+}
+
+/* File filter for directories by .vm extension */
+int filter_vm_files(const struct dirent *entry)
+{
+  return entry->d_type == DT_REG && check_file_extension(entry->d_name);
+}
+
+/* Writes the assembly code of a single command
+ *
+ * Returns the writer status
+ */
+CodeWriterStatus translate_command(CodeWriter *writer, const VmCommand *command)
+{
+  switch (command->type) {
+    case C_LABEL:
+      return code_writer_write_label(writer, command->arg1);
+    case C_IF:
+      return code_writer_write_if(writer, command->arg1);
+    case C_GOTO:
+      return code_writer_write_goto(writer, command->arg1);
+    case C_FUNCTION:
+      return code_writer_write_function(writer, command->arg1, sizeof(command->arg1), command->arg2);
+    case C_CALL:
+      return code_writer_write_call(writer, command->arg1, command->arg2);
+    case C_RETURN:
+      return code_writer_write_return(writer);
+    case C_ARITHMETIC:
+      return code_writer_write_arithmetic(writer, command->arg1);
+    case C_PUSH:
+    case C_POP:
+      return code_writer_write_push_pop(writer, command->type, command->arg1, command->arg2);
+    default:
+      return CODE_WRITER_SUCC;
+  }
+}
+
+/* Writes the assembly code of an idiom of length commands starting
+ * at commands, adding to stats the instructions it saves over
+ * writing the commands one by one
+ *
+ * Returns the writer status
+ */
+CodeWriterStatus translate_idiom(CodeWriter *writer, const Idiom *idiom,
+                                 const VmCommand *commands, size_t length,
+                                 IdiomStats *stats)
+{
+  CodeWriter *counter = NULL;
+  unsigned long previous_count;
+  unsigned long plain_words = 0;
+  CodeWriterStatus err;
+  size_t i;
+
+  if (stats)
+  {
+    counter = code_writer_fork_counter(writer);
+
+    for (i = 0; counter && i < length; i++)
+      translate_command(counter, &commands[i]);
+
+    if (counter)
+      plain_words = code_writer_instruction_count(counter);
+
+    code_writer_close(counter);
+  }
+
+  previous_count = code_writer_instruction_count(writer);
+  err = code_writer_write_idiom(writer, idiom);
+
+  if (stats && err == CODE_WRITER_SUCC)
+  {
+    stats->matches[idiom->kind]++;
+    stats->saved_words[idiom->kind] += (long)plain_words -
+      (long)(code_writer_instruction_count(writer) - previous_count);
+  }
+
+  return err;
+}
+
+/* Translates the commands of a file, lowering the idioms found by
+ * matcher when it is not NULL and counting them in stats when it is
+ * not NULL
+ *
+ * Returns true if successful and false otherwise
+ */
+bool translate_file(CodeWriter *writer, const VmFile *file,
+                    const IdiomMatcher *matcher, IdiomStats *stats)
+{
+  const VmCommand *command = NULL;
+  CodeWriterStatus err;
+  Idiom idiom;
+  size_t length;
+  size_t i;
+
+  assert(writer);
+
+  if (!file) return false;
+
+  /* Set input file in code writer */
+  err = code_writer_set_filename(writer, file->filename);
+
+  if (err != CODE_WRITER_SUCC)
+  {
+    fprintf(stderr, "Failed to set filename %s, error %d\n", file->filename, err);
+    return false;
+  }
+
+  /* Generate instructions for each command in the file */
+  for (i = 0; i < file->command_count; i++)
+  {
+    command = &file->commands[i];
+    length = matcher ? idiom_match(matcher, file, i, &idiom) : 0;
+
+    code_writer_set_source_line(writer, command->line, command->type,
+                                command->arg1);
+
+    if (length > 0)
+    {
+      err = translate_idiom(writer, &idiom, command, length, stats);
+      i += length - 1;
+    }
+    /* A call whose result is returned right away */
+    else if (command->type == C_CALL && i + 1 < file->command_count &&
+             file->commands[i + 1].type == C_RETURN)
+    {
+      err = code_writer_write_tail_call(writer, command->arg1, command->arg2);
+      i++;
+    }
+    else
+      err = translate_command(writer, command);
+
+    if (err != CODE_WRITER_SUCC)
+    {
+      fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", command->line, err);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Creates the idiom matcher for the idioms of the enabled
+ * superinstructions and intrinsics
+ *
+ * Returns the matcher, or NULL if idioms are translated command by command
+ */
+IdiomMatcher *create_idiom_matcher(unsigned int writer_options)
+{
+  unsigned int kinds = 0;
+
+  if (writer_options & CODE_WRITER_OPT_SUPERINSTRUCTIONS)
+    kinds |= IDIOM_KIND_BIT(IDIOM_INCREMENT) |
+             IDIOM_KIND_BIT(IDIOM_ARRAY_READ) |
+             IDIOM_KIND_BIT(IDIOM_ARRAY_LOAD) |
+             IDIOM_KIND_BIT(IDIOM_ARRAY_STORE) |
+             IDIOM_KIND_BIT(IDIOM_ARRAY_WRITE);
+
+  if (writer_options & CODE_WRITER_OPT_INTRINSICS)
+    kinds |= IDIOM_KIND_BIT(IDIOM_MULTIPLY);
+
+  if (!kinds)
+    return NULL;
+
+  return idiom_matcher_init(kinds);
+}
+
+/* Reports the idioms translated as a single unit */
+void print_idiom_stats(const IdiomStats *stats)
+{
+  unsigned long total_matches = 0;
+  long total_words = 0;
+  int kind;
+
+  for (kind = 0; kind < IDIOM_KIND_COUNT; kind++)
+  {
+    if (stats->matches[kind] == 0)
+      continue;
+
+    fprintf(stderr, "  %-40s %6lu matches %6ld words\n",
+            idiom_kind_name(kind), stats->matches[kind], stats->saved_words[kind]);
+
+    total_matches += stats->matches[kind];
+    total_words += stats->saved_words[kind];
+  }
+
+  fprintf(stderr, "idioms: %lu translated as a unit, saved %ld ROM words\n",
+          total_matches, total_words);
+}
+
+/* Translates the program with a writer that only counts instructions
+ * and the same profile, so that writer keeps inline the cold
+ * comparisons whose shared routine would not pay off
+ *
+ * Returns true if successful and false otherwise
+ */
+bool plan_shared_routines(CodeWriter *writer, const VmProgram *program,
+                          const TranslatorOptions *options,
+                          const FunctionConvention *conventions,
+                          size_t convention_count,
+                          const IdiomMatcher *matcher, const Profile *profile)
+{
+  CodeWriter *planner = NULL;
+  bool success = true;
+  size_t i;
+
+  planner = code_writer_init(NULL, options->writer_options);
+
+  if (!planner)
+    return false;
+
+  code_writer_set_conventions(planner, conventions, convention_count);
+  code_writer_set_profile(planner, profile);
+
+  for (i = 0; success && i < program->file_count; i++)
+    success = translate_file(planner, &program->files[i], matcher, NULL);
+
+  if (success)
+    code_writer_plan_shared_routines(writer, planner);
+
+  code_writer_close(planner);
+
+  return success;
+}
+
+/* Translates every file of the program into the output file of the
+ * selected format in the current directory, calling functions with
+ * the given conventions. With an assembler the program is also
+ * assembled in memory, with a source map the commands of the
+ * instructions are recorded in it, and with a profile the cold
+ * commands are written compactly */
+bool translate_program(const VmProgram *program,
+                       const TranslatorOptions *options,
+                       const FunctionConvention *conventions,
+                       size_t convention_count, Assembler *assembler,
+                       SourceMap *source_map, const Profile *profile)
+{
+  const TranslatorFormatEntry *format = NULL;
+  CodeWriter *writer = NULL;
+  IdiomMatcher *matcher = NULL;
+  IdiomStats stats = { { 0 }, { 0 } };
+  AssemblerStatus status;
+  bool success = true;
+  size_t i;
+
+  assert(program);
+  assert(options);
+
+  format = options->format;
+
+  /* Create writer, the assembler writes the machine code formats */
+  if (assembler)
+    writer = code_writer_init_assembler(assembler,
+                                        format->assembled ? NULL : format->output_filename,
+                                        options->writer_options);
+  else
+    writer = code_writer_init(format->output_filename, options->writer_options);
+
+  if (!writer)
+  {
+    fprintf(stderr, "Failed to create writer \n");
+    return false;
+  }
+
+  code_writer_set_conventions(writer, conventions, convention_count);
+  code_writer_set_source_map(writer, source_map);
+  code_writer_set_profile(writer, profile);
+  matcher = create_idiom_matcher(options->writer_options);
+
+  if (profile && !plan_shared_routines(writer, program, options, conventions,
+                                       convention_count, matcher, profile))
+  {
+    fprintf(stderr, "Failed to plan the shared routines\n");
+    success = false;
+  }
+
+  for (i = 0; success && i < program->file_count; i++)
+  {
+    if (!translate_file(writer, &program->files[i], matcher,
+                        options->print_stats ? &stats : NULL))
+    {
+      fprintf(stderr, "Failed to translate file %s\n", program->files[i].filename);
+      success = false;
+      break;
+    }
+  }
+
+  if (success && matcher && options->print_stats)
+    print_idiom_stats(&stats);
+
+  idiom_matcher_fini(matcher);
+  code_writer_close(writer);
+
+  if (!success || !assembler)
+    return success;
+
+  if (format->assembled)
+    status = assembler_write(assembler, format->output_filename,
+                             format->assembler_format);
+  else
+    status = assembler_resolve(assembler);
+
+  if (status != ASSEMBLER_SUCC)
+  {
+    fprintf(stderr, "Failed to assemble the program: %s\n",
+            status == ASSEMBLER_ROM_FULL ? "it does not fit in ROM" :
+            status == ASSEMBLER_FAIL_WRITE ? "could not write the output file" :
+            "invalid assembly");
+    return false;
+  }
+
+  if (options->print_stats)
+    fprintf(stderr, "assembler: %zu instructions\n",
+            assembler_instruction_count(assembler));
+
+  return true;
+}
+
+/* Prints the RAM words selected with --ram */
+void print_ram_ranges(const unsigned short *ram, const TranslatorOptions *options)
+{
+  const TranslatorRamRange *range = NULL;
+  unsigned int address;
+  size_t i;
+
+  for (i = 0; i < options->ram_range_count; i++)
+  {
+    range = &options->ram_ranges[i];
+
+    for (address = range->first; address <= range->last; address++)
+      printf("RAM[%u] = %d\n", address, (short)ram[address]);
+  }
+}
+
+/* Records the executions of the commands of a run on the emulator,
+ * from the executions of their first instruction
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_emulator_profile(const SourceMap *source_map,
+                            const unsigned long long *counts)
+{
+  const SourceMapEntry *entries = NULL;
+  const char *file = NULL;
+  Profile *profile = NULL;
+  bool success;
+  size_t count;
+  size_t i;
+
+  profile = profile_init();
+
+  if (!profile)
+    return false;
+
+  entries = source_map_entries(source_map, &count);
+  success = true;
+
+  /* The bootstrap code and the code written after the last file
+   * belong to no line */
+  for (i = 0; success && i < count; i++)
+  {
+    file = source_map_name(source_map, entries[i].file);
+
+    if (entries[i].line > 0 && *file != '\0' && entries[i].address < EMULATOR_ROM_WORDS)
+      success = profile_add(profile, file, entries[i].line, counts[entries[i].address]);
+  }
+
+  if (success)
+    success = profile_write(profile, TRANSLATOR_PROFILE_FILENAME);
+
+  profile_fini(profile);
+
+  return success;
+}
+
+/* Runs the assembled program on the emulator and reports the cycles
+ * executed, the speed of the emulation and the selected RAM words
+ * on stdout. When profiling, where the cycles went is reported as
+ * well, using the source map of the translation, which also maps the
+ * executions of the instructions to the commands of the profile
+ * generated */
+bool run_program(const Assembler *assembler, const SourceMap *source_map,
+                 const TranslatorOptions *options)
+{
+  Emulator *emulator = NULL;
+  Jit *jit = NULL;
+  Profiler *profiler = NULL;
+  unsigned long long *counts = NULL;
+  struct timespec start, finish;
+  EmulatorStatus status;
+  unsigned long long cycles;
+  double seconds;
+
+  assert(assembler);
+  assert(options);
+
+  emulator = emulator_init();
+
+  if (!emulator)
+  {
+    fprintf(stderr, "Failed to create emulator\n");
+    return false;
+  }
+
+  if (emulator_load(emulator, assembler_rom(assembler),
+                    assembler_instruction_count(assembler)) != EMULATOR_SUCC)
+  {
+    fprintf(stderr, "Failed to load the program into the emulator\n");
+    emulator_fini(emulator);
+    return false;
+  }
+
+  if (options->profile)
+  {
+    /* Lighter conventions leave LCL out of date */
+    profiler = profiler_init(source_map, !(options->optimizer_options &
+                                           (OPTIMIZER_OPT_CALL_CONVENTIONS |
+                                            OPTIMIZER_OPT_STATIC_FRAMES)));
+
+    if (!profiler)
+    {
+      fprintf(stderr, "Failed to create profiler\n");
+      emulator_fini(emulator);
+      return false;
+    }
+  }
+  else if (options->profile_generate)
+  {
+    counts = (unsigned long long *)calloc(EMULATOR_ROM_WORDS,
+                                          sizeof(unsigned long long));
+
+    if (!counts)
+    {
+      fprintf(stderr, "Failed to create the profile\n");
+      emulator_fini(emulator);
+      return false;
+    }
+
+    emulator_set_counters(emulator, counts);
+  }
+  else if (options->jit)
+  {
+    jit = jit_init(emulator);
+
+    if (!jit)
+      fprintf(stderr, "The JIT is not available on this machine, "
+                      "emulating instead\n");
+  }
+
+  /* Translation time is part of the time of a JIT run */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (profiler)
+    status = profiler_run(profiler, emulator, options->run_cycles);
+  else
+    status = jit ? jit_run(jit, options->run_cycles) :
+                   emulator_run(emulator, options->run_cycles);
+  clock_gettime(CLOCK_MONOTONIC, &finish);
+
+  cycles = emulator_cycles(emulator);
+  seconds = (double)(finish.tv_sec - start.tv_sec) +
+            (double)(finish.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("run: %s after %llu cycles at ROM[%u], %.1f MIPS\n",
+         status == EMULATOR_HALTED ? "halted" :
+         status == EMULATOR_END_OF_PROGRAM ? "left the program" :
+         "stopped at the cycle limit",
+         cycles, emulator_pc(emulator),
+         seconds > 0 ? (double)cycles / seconds / 1e6 : 0.0);
+
+  if (jit && options->print_stats)
+    fprintf(stderr, "jit: %lu basic blocks translated\n", jit_block_count(jit));
+
+  if (profiler)
+  {
+    profiler_print_report(profiler, stdout);
+
+    if (!profiler_write_stacks(profiler, TRANSLATOR_PROFILE_STACKS_FILENAME))
+      fprintf(stderr, "Failed to write %s\n", TRANSLATOR_PROFILE_STACKS_FILENAME);
+  }
+
+  if (counts && !write_emulator_profile(source_map, counts))
+    fprintf(stderr, "Failed to write %s\n", TRANSLATOR_PROFILE_FILENAME);
+
+  print_ram_ranges(emulator_ram(emulator), options);
+  profiler_fini(profiler);
+  jit_fini(jit);
+  emulator_fini(emulator);
+  free(counts);
+
+  return true;
+}
+
+/* Records the executions of the commands of a run on the interpreter
+ *
+ * Returns true if successful and false otherwise
+ */
+bool write_interpreter_profile(const VmProgram *program,
+                               const Interpreter *interpreter)
+{
+  const VmFile *file = NULL;
+  const char *extension = NULL;
+  char name[TRANSLATOR_PROFILE_NAME_MAX_LENGTH + 1];
+  unsigned long long *counts = NULL;
+  Profile *profile = NULL;
+  size_t command_count = 0;
+  size_t length;
+  size_t i, j, k;
+  bool success = true;
+
+  for (i = 0; i < program->file_count; i++)
+    command_count += program->files[i].command_count;
+
+  counts = (unsigned long long *)malloc((command_count + 1) *
+                                        sizeof(unsigned long long));
+  profile = profile_init();
+
+  if (!counts || !profile)
+  {
+    free(counts);
+    profile_fini(profile);
+    return false;
+  }
+
+  interpreter_command_counts(interpreter, counts, command_count);
+
+  for (i = 0, k = 0; success && i < program->file_count; i++)
+  {
+    file = &program->files[i];
+
+    /* Files are named as in the code writer, without the extension */
+    extension = strrchr(file->filename, '.');
+    length = extension ? (size_t)(extension - file->filename) : strlen(file->filename);
+
+    if (length > TRANSLATOR_PROFILE_NAME_MAX_LENGTH)
+      length = TRANSLATOR_PROFILE_NAME_MAX_LENGTH;
+
+    memcpy(name, file->filename, length);
+    name[length] = '\0';
+
+    for (j = 0; success && j < file->command_count; j++, k++)
+    {
+      if (file->commands[j].type != C_LABEL)
+        success = profile_add(profile, name, file->commands[j].line, counts[k]);
+    }
+  }
+
+  if (success)
+    success = profile_write(profile, TRANSLATOR_PROFILE_FILENAME);
+
+  profile_fini(profile);
+  free(counts);
+
+  return success;
+}
+
+/* Executes the VM commands of the program directly and reports the
+ * commands executed, their speed and the selected RAM words on stdout,
+ * and the executions of each command when generating a profile */
+bool interpret_program(const VmProgram *program, const TranslatorOptions *options)
+{
+  Interpreter *interpreter = NULL;
+  struct timespec start, finish;
+  InterpreterStatus status;
+  unsigned long long commands;
+  double seconds;
+
+  assert(program);
+  assert(options);
+
+  interpreter = interpreter_init();
+
+  if (!interpreter)
+  {
+    fprintf(stderr, "Failed to create interpreter\n");
+    return false;
+  }
+
+  if (interpreter_load(interpreter, program) != INTERPRETER_SUCC)
   {
-    end--;
+    fprintf(stderr, "Failed to load the program into the interpreter\n");
+    interpreter_fini(interpreter);
+    return false;
   }
 
-  if (end == filename)
+  if (options->profile_generate &&
+      interpreter_set_counting(interpreter, true) != INTERPRETER_SUCC)
+  {
+    fprintf(stderr, "Failed to create the profile\n");
+    interpreter_fini(interpreter);
     return false;
+  }
 
-  extension = end + 1;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  status = interpreter_run(interpreter, options->run_cycles);
+  clock_gettime(CLOCK_MONOTONIC, &finish);
 
-  if (strcmp(extension, VM_EXTENSION) != 0)
-    return false;
+  commands = interpreter_command_count(interpreter);
+  seconds = (double)(finish.tv_sec - start.tv_sec) +
+            (double)(finish.tv_nsec - start.tv_nsec) / 1e9;
 
-  return true;
+  printf("interpret: %s after %llu commands, %.1f million commands per second\n",
+         status == INTERPRETER_HALTED ? "halted" :
+         status == INTERPRETER_RETURNED ? "Sys.init returned" :
+         status == INTERPRETER_COMMAND_LIMIT ? "stopped at the command limit" :
+         "failed",
+         commands, seconds > 0 ? (double)commands / seconds / 1e6 : 0.0);
+
+  if (options->profile_generate && !write_interpreter_profile(program, interpreter))
+    fprintf(stderr, "Failed to write %s\n", TRANSLATOR_PROFILE_FILENAME);
+
+  print_ram_ranges(interpreter_ram(interpreter), options);
+  interpreter_fini(interpreter);
+
+  return status == INTERPRETER_HALTED || status == INTERPRETER_RETURNED ||
+         status == INTERPRETER_COMMAND_LIMIT;
 }
 
-/* File filter for directories by .vm extension */
-int filter_vm_files(const struct dirent *entry)
+/* Writes the C code of a single command
+ *
+ * Returns the writer status
+ */
+CodeWriterStatus translate_command_to_c(CWriter *writer, const VmCommand *command)
 {
-  return entry->d_type == DT_REG && check_file_extension(entry->d_name);
+  switch (command->type) {
+    case C_LABEL:
+      return c_writer_write_label(writer, command->arg1);
+    case C_IF:
+      return c_writer_write_if(writer, command->arg1);
+    case C_GOTO:
+      return c_writer_write_goto(writer, command->arg1);
+    case C_FUNCTION:
+      return c_writer_write_function(writer, command->arg1, command->arg2);
+    case C_CALL:
+      return c_writer_write_call(writer, command->arg1, command->arg2);
+    case C_RETURN:
+      return c_writer_write_return(writer);
+    case C_ARITHMETIC:
+      return c_writer_write_arithmetic(writer, command->arg1);
+    case C_PUSH:
+    case C_POP:
+      return c_writer_write_push_pop(writer, command->type, command->arg1, command->arg2);
+    default:
+      return CODE_WRITER_SUCC;
+  }
 }
 
-bool translate_file(CodeWriter *writer, const char *input_file)
+/* Translates every file of the program into a C program in the
+ * current directory
+ *
+ * Returns true if successful and false otherwise
+ */
+bool translate_program_to_c(const VmProgram *program)
 {
-  Parser *parser = NULL;
-  CommandType current_command_type;
-  CodeWriterStatus err;
-  char current_arithmetic_instruction[PARSED_COMMAND_INSTRUCTION_MAX_LENGTH + 1];
-  char current_segment[PARSED_COMMAND_ARG1_MAX_LENGTH + 1];
-  char current_label[PARSED_COMMAND_LABEL_MAX_LENGTH + 1];
-  char current_function[PARSED_COMMAND_FUNCTION_NAME_MAX_LENGTH + 1];
-  unsigned int current_index;
-  unsigned int current_function_nargs;
+  const VmFile *file = NULL;
+  CWriter *writer = NULL;
+  CodeWriterStatus err = CODE_WRITER_SUCC;
+  size_t i, j;
 
-  assert(writer);
-
-  if (!input_file) return false;
+  assert(program);
 
-  /* Create parser */
-  parser = parser_init(input_file);
+  writer = c_writer_init(TRANSLATOR_C_OUTPUT_FILENAME);
 
-  if (!parser)
+  if (!writer)
   {
-    fprintf(stderr, "Failed to create parser for %s\n", input_file);
+    fprintf(stderr, "Failed to create writer \n");
     return false;
   }
 
-  /* Set input file in code writer */
-  err = code_writer_set_filename(writer, input_file);
+  for (i = 0; err == CODE_WRITER_SUCC && i < program->file_count; i++)
+  {
+    file = &program->files[i];
+    err = c_writer_set_filename(writer, file->filename);
 
-  if (err != CODE_WRITER_SUCC)
+    if (err != CODE_WRITER_SUCC)
+    {
+      fprintf(stderr, "Failed to set filename %s, error %d\n", file->filename, err);
+      break;
+    }
+
+    for (j = 0; j < file->command_count; j++)
+    {
+      err = translate_command_to_c(writer, &file->commands[j]);
+
+      if (err != CODE_WRITER_SUCC)
+      {
+        fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n",
+                file->commands[j].line, err);
+        break;
+      }
+    }
+  }
+
+  if (c_writer_close(writer) != CODE_WRITER_SUCC && err == CODE_WRITER_SUCC)
   {
-    fprintf(stderr, "Failed to set filename %s, error %d\n", input_file, err);
-    parser_fini(parser);
+    fprintf(stderr, "Failed to write %s\n", TRANSLATOR_C_OUTPUT_FILENAME);
     return false;
   }
 
-  /* Parse each line in the file and generate instructions */
-  while(parser_has_more_lines(parser))
+  return err == CODE_WRITER_SUCC;
+}
+
+/* Reports the functions removed by dead function elimination
+ * and the ROM words they would have taken */
+void print_dead_function_stats(VmProgram *removed,
+                               const TranslatorOptions *options)
+{
+  CodeWriter *writer = NULL;
+  IdiomMatcher *matcher = NULL;
+  unsigned long previous_count;
+  unsigned long words;
+  unsigned long total_words = 0;
+  size_t i;
+
+  assert(removed);
+
+  /* Count the words the functions would take with the same options */
+  optimizer_run(removed, options->optimizer_options);
+
+  for (i = 0; i < removed->file_count &&
+              (options->optimizer_options & OPTIMIZER_OPT_CLEANUP_JUMPS); i++)
+    optimizer_cleanup_jumps(&removed->files[i],
+                            options->writer_options & CODE_WRITER_OPT_FUSE_BRANCHES);
+
+  writer = code_writer_init(NULL, options->writer_options);
+
+  if (!writer)
+    return;
+
+  matcher = create_idiom_matcher(options->writer_options);
+
+  fprintf(stderr, "dead-functions: removed %zu functions\n", removed->file_count);
+
+  for (i = 0; i < removed->file_count; i++)
   {
-    if (!parser_advance(parser)) continue;
+    previous_count = code_writer_instruction_count(writer);
 
-    current_command_type = parser_command_type(parser);
+    if (!translate_file(writer, &removed->files[i], matcher, NULL))
+      break;
 
-    switch (current_command_type) {
-      case C_LABEL:
-        parser_arg1(parser, current_label, sizeof(current_label));
-  
-        /* Translate instruction */
-        err = code_writer_write_label(writer, current_label);
-  
-        if (err != CODE_WRITER_SUCC)
-        {
-          fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", parser_get_line_number(parser), err);
-          parser_fini(parser);
-          return false;
-        }
-        break;
-      case C_IF:
-        parser_arg1(parser, current_label, sizeof(current_label));
+    words = code_writer_instruction_count(writer) - previous_count;
+    total_words += words;
 
-        /* Translate instruction */
-        err = code_writer_write_if(writer, current_label);
+    fprintf(stderr, "  %-40s %6lu words\n", removed->files[i].commands[0].arg1, words);
+  }
 
-        if (err != CODE_WRITER_SUCC)
-        {
-          fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", parser_get_line_number(parser), err);
-          parser_fini(parser);
-          return false;
-        }
-        break;
-      case C_GOTO:
-        parser_arg1(parser, current_label, sizeof(current_label));
+  fprintf(stderr, "dead-functions: saved %lu ROM words\n", total_words);
 
-        /* Translate instruction */
-        err = code_writer_write_goto(writer, current_label);
+  idiom_matcher_fini(matcher);
+  code_writer_close(writer);
+}
 
-        if (err != CODE_WRITER_SUCC)
-        {
-          fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", parser_get_line_number(parser), err);
-          parser_fini(parser);
-          return false;
-        }
-        break;
-      case C_FUNCTION:
-        parser_arg1(parser, current_function, sizeof(current_function));
-        parser_arg2(parser, &current_function_nargs);
-  
-        /* Translate instruction */
-        err = code_writer_write_function(writer, current_function, sizeof(current_function), current_function_nargs);
-  
-        if (err != CODE_WRITER_SUCC)
-        {
-          fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", parser_get_line_number(parser), err);
-          parser_fini(parser);
-          return false;
-        }
-        break;
-      case C_CALL:
-        parser_arg1(parser, current_function, sizeof(current_function));
-        parser_arg2(parser, &current_function_nargs);
-  
-        /* Translate instruction */
-        err = code_writer_write_call(writer, current_function, current_function_nargs);
-  
-        if (err != CODE_WRITER_SUCC)
-        {
-          fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", parser_get_line_number(parser), err);
-          parser_fini(parser);
-          return false;
-        }
-        break;
-      case C_RETURN:
-        /* Translate instruction */
-        err = code_writer_write_return(writer);
+/* Counts the ROM words of the program translated with writer_options
+ *
+ * Returns the count, or 0 if the program could not be translated
+ */
+unsigned long program_word_count(const VmProgram *program,
+                                 unsigned int writer_options)
+{
+  CodeWriter *writer = NULL;
+  IdiomMatcher *matcher = NULL;
+  unsigned long words = 0;
+  size_t i;
 
-        if (err != CODE_WRITER_SUCC)
-        {
-          fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", parser_get_line_number(parser), err);
-          parser_fini(parser);
-          return false;
-        }
-        break;
-      case C_ARITHMETIC:
-        parser_arg1(parser, current_arithmetic_instruction, sizeof(current_arithmetic_instruction));
+  assert(program);
 
-        /* Translate instruction */
-        err = code_writer_write_arithmetic(writer, current_arithmetic_instruction);
+  writer = code_writer_init(NULL, writer_options);
 
-        if (err != CODE_WRITER_SUCC)
-        {
-          fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", parser_get_line_number(parser), err);
-          parser_fini(parser);
-          return false;
-        }
-        break;
-      case C_PUSH:
-      case C_POP:
-        parser_arg1(parser, current_segment, sizeof(current_segment));
-        parser_arg2(parser, &current_index);
-        
-        /* Translate instruction */
-        err = code_writer_write_push_pop(writer, current_command_type, current_segment, current_index);
-
-        if (err != CODE_WRITER_SUCC)
-        {
-          fprintf(stderr, "Failed to translate instruction at line %u, error: %d\n", parser_get_line_number(parser), err);
-          parser_fini(parser);
-          return false;
-        }
-        break;
-      default:
-        continue;
-    }
+  if (!writer)
+    return 0;
+
+  matcher = create_idiom_matcher(writer_options);
+
+  for (i = 0; i < program->file_count; i++)
+  {
+    if (!translate_file(writer, &program->files[i], matcher, NULL))
+      break;
   }
 
-  parser_fini(parser);
+  if (i == program->file_count)
+    words = code_writer_instruction_count(writer);
 
-  return true;
+  idiom_matcher_fini(matcher);
+  code_writer_close(writer);
+
+  return words;
+}
+
+/* Runs the jump cleanup over every file and reports what it removed */
+void cleanup_program_jumps(VmProgram *program, const TranslatorOptions *options)
+{
+  unsigned long words_before = 0;
+  unsigned long words_after;
+  size_t removed = 0;
+  size_t i;
+
+  assert(program);
+
+  if (options->print_stats)
+    words_before = program_word_count(program, options->writer_options);
+
+  for (i = 0; i < program->file_count; i++)
+    removed += optimizer_cleanup_jumps(&program->files[i],
+                                       options->writer_options &
+                                       CODE_WRITER_OPT_FUSE_BRANCHES);
+
+  if (!options->print_stats)
+    return;
+
+  words_after = program_word_count(program, options->writer_options);
+
+  fprintf(stderr, "cleanup-jumps: removed %zu VM commands, "
+                  "%lu instructions (%lu bytes)\n",
+          removed, words_before - words_after, 2 * (words_before - words_after));
+}
+
+/* Reports how many functions use each calling convention */
+void print_convention_stats(const FunctionConvention *conventions, size_t count)
+{
+  size_t totals[4] = { 0, 0, 0, 0 };
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    totals[conventions[i].convention]++;
+
+    if (conventions[i].convention == CALL_CONVENTION_STATIC_FRAME)
+      fprintf(stderr, "static-frames: %s at RAM %d\n",
+              conventions[i].name, conventions[i].frame);
+  }
+
+  fprintf(stderr, "calls: %zu full frames, %zu without THIS/THAT, "
+                  "%zu without frame, %zu static frames\n",
+          totals[CALL_CONVENTION_FULL],
+          totals[CALL_CONVENTION_NO_POINTERS],
+          totals[CALL_CONVENTION_NO_FRAME],
+          totals[CALL_CONVENTION_STATIC_FRAME]);
+}
+
+/* Reports the worst case stack usage from Sys.init, along the
+ * deepest call path */
+void print_stack_usage(const FunctionStackUsage *usage, size_t count)
+{
+  const FunctionStackUsage *function = NULL;
+  size_t recursive_count = 0;
+  size_t steps;
+  size_t i;
+
+  for (i = 0; i < count; i++)
+  {
+    if (strcmp(usage[i].name, OPTIMIZER_ENTRY_FUNCTION) == 0)
+      function = &usage[i];
+  }
+
+  if (!function)
+  {
+    fprintf(stderr, "stack: no %s, usage not known\n", OPTIMIZER_ENTRY_FUNCTION);
+    return;
+  }
+
+  fprintf(stderr, "stack: %s may use %s%d words, up to RAM[%d] of %d-%d%s\n",
+          function->name, function->recursive ? "at least " : "",
+          function->worst_words,
+          VM_STACK_BASE + function->worst_words - 1,
+          VM_STACK_BASE, VM_STACK_END - 1,
+          VM_STACK_BASE + function->worst_words > VM_STACK_END ? ", OVERFLOW" : "");
+
+  fprintf(stderr, "stack: deepest path %s", function->name);
+
+  /* The path follows the call graph, which has no cycle between components */
+  for (steps = 0; function->deepest_callee && steps < count; steps++)
+  {
+    fprintf(stderr, " > %s", function->deepest_callee);
+
+    for (i = 0; i < count && strcmp(usage[i].name, function->deepest_callee) != 0; i++)
+      ;
+
+    function = &usage[i];
+  }
+
+  fprintf(stderr, "\n");
+
+  for (i = 0; i < count; i++)
+  {
+    if (usage[i].recursive)
+      recursive_count++;
+  }
+
+  if (recursive_count > 0)
+    fprintf(stderr, "stack: %zu functions reach recursion, "
+                    "recursive calls not counted\n", recursive_count);
 }
 
 /* VM Translator
@@ -215,110 +1239,341 @@ bool translate_file(CodeWriter *writer, const char *input_file)
 
 int main(int argc, char *argv[])
 {
-  Parser *parser = NULL;
-  CodeWriter *writer = NULL;
+  VmProgram *program = NULL;
+  VmProgram *removed = NULL;
+  FunctionConvention *conventions = NULL;
+  FunctionStackUsage *usage = NULL;
+  size_t convention_count = 0;
+  size_t usage_count = 0;
+  char *input_path = NULL;
+  char *input_filename = NULL;
+  Assembler *assembler = NULL;
+  SourceMap *source_map = NULL;
+  Profile *profile = NULL;
+  OptimizerIntrinsicCheck is_intrinsic = NULL;
+  TranslatorOptions options = { CODE_WRITER_OPT_NONE, OPTIMIZER_OPT_NONE, { NULL }, 0, false, false,
+                                &translator_format_table[0],
+                                false, TRANSLATOR_RUN_DEFAULT_CYCLES, false, false, false,
+                                { { 0, 0 } }, 0, false, false, NULL };
+  bool success;
+  int i;
   
   struct stat argument_filestat;
 
-  if (argc == 1)
+  for (i = 1; i < argc; i++)
+  {
+    if (argv[i][0] == '-')
+    {
+      if (!parse_option(argv[i], &options))
+      {
+        fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (!input_path)
+    {
+      input_path = argv[i];
+    }
+    else
+    {
+      fprintf(stderr, "Unrecognized argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  if (!input_path)
+  {
+    fprintf(stderr, "Usage: ./vmtranslator [-O] [-f[no-]<feature>] [--keep=<function>] [--target=hack|c] [--format=asm|hack|bin] [--run[=<cycles>] [--jit | --profile] | --interpret[=<commands>]] [--ram=<first>[-<last>]] [--profile-generate] [--profile-use=<file>] [--source-map] [--stats] <filename | directory >\n");
+    return 1;
+  }
+
+  /* The executions are counted on the emulator unless interpreting */
+  if (options.profile_generate && !options.interpret)
+    options.run = true;
+
+  /* Profiling counts every instruction on the emulator */
+  if (options.profile && options.jit)
+  {
+    fprintf(stderr, "--profile cannot be combined with --jit\n");
+    return 1;
+  }
+
+  if (options.profile_generate && (options.jit || options.profile))
+  {
+    fprintf(stderr, "--profile-generate cannot be combined with --jit or --profile\n");
+    return 1;
+  }
+
+  /* The C program is built and run outside the translator */
+  if (options.target_c && (options.run || options.interpret))
+  {
+    fprintf(stderr, "--target=c cannot be combined with --run, --jit or --interpret\n");
+    return 1;
+  }
+
+  /* The map is of the Hack instructions */
+  if (options.source_map && (options.target_c || options.interpret))
   {
-    fprintf(stderr, "Usage: ./vmtranslator <filename | directory >\n");
+    fprintf(stderr, "--source-map cannot be combined with --target=c or --interpret\n");
     return 1;
-  } else if (argc > 2)
+  }
+
+  /* The profile selects among Hack code sequences */
+  if (options.profile_use && (options.target_c || options.interpret))
   {
-    fprintf(stderr, "Unrecognized argument: %s\n", argv[2]);
+    fprintf(stderr, "--profile-use cannot be combined with --target=c or --interpret\n");
     return 1;
   }
 
+  /* Read before moving to the directory of the program */
+  if (options.profile_use)
+  {
+    profile = profile_init();
+
+    if (!profile || !profile_read(profile, options.profile_use))
+    {
+      fprintf(stderr, "Failed to read profile %s\n", options.profile_use);
+      profile_fini(profile);
+      return 1;
+    }
+  }
+
   /* Check if argument is directory or filename */
-  if (stat(argv[1], &argument_filestat) != 0)
+  if (stat(input_path, &argument_filestat) != 0)
   {
-    fprintf(stderr, "Failed to open %s\n", argv[1]);
+    fprintf(stderr, "Failed to open %s\n", input_path);
+    profile_fini(profile);
     return 1;
   }
 
-  
+  program = vm_program_init();
+
+  if (!program)
+  {
+    fprintf(stderr, "Failed to create program\n");
+    profile_fini(profile);
+    return 1;
+  }
 
   switch (argument_filestat.st_mode & S_IFMT)
   {
     case S_IFREG:
-      /* Normal Path :D */
+      /* Check if file ends with .vm extension */
+      if (!check_file_extension(input_path))
+      {
+        fprintf(stderr, "Error: file %s must have .vm extension\n", input_path);
+        vm_program_fini(program);
+        profile_fini(profile);
+        return 1;
+      }
+
+      /* basename and dirname may modify their argument */
+      input_filename = strdup(input_path);
+
+      if (!input_filename)
+      {
+        vm_program_fini(program);
+        profile_fini(profile);
+        return 1;
+      }
+
+      chdir(dirname(input_path));
+
+      if (!vm_program_load_file(program, basename(input_filename)))
+      {
+        fprintf(stderr, "Error: Failed to translate %s\n", basename(input_filename));
+        free(input_filename);
+        vm_program_fini(program);
+        profile_fini(profile);
+        return 1;
+      }
+
+      free(input_filename);
       break;
     case S_IFDIR:
     {
       struct dirent **dir_entries = NULL;
-      int i;
-      int num_entries = scandir(argv[1], &dir_entries, filter_vm_files, NULL);
+      int num_entries = scandir(input_path, &dir_entries, filter_vm_files, NULL);
 
       if (num_entries == -1)
       {
-        fprintf(stderr, "Failed to open directory %s\n", argv[1]);
+        fprintf(stderr, "Failed to open directory %s\n", input_path);
+        vm_program_fini(program);
+        profile_fini(profile);
         return 1;
       } else if (num_entries == 0)
       {
-        fprintf(stderr, "No .vm files were found in directory %s\n", argv[1]);
+        fprintf(stderr, "No .vm files were found in directory %s\n", input_path);
+        vm_program_fini(program);
+        profile_fini(profile);
         return 1;
       }
 
       /* Switch to provided directory 
        * This allows to create the output file in the same directory
        * as the soruce file */
-      chdir(argv[1]);
-
-      /* Create writer */
-      writer = code_writer_init("source.asm");
+      chdir(input_path);
 
-      if (!writer)
-      {
-        fprintf(stderr, "Failed to create writer \n");
-        return 1;
-      }
+      success = true;
 
       for (i = 0; i < num_entries; i++) {
-        if (!translate_file(writer, dir_entries[i]->d_name))
+        if (success && !vm_program_load_file(program, dir_entries[i]->d_name))
         {
           fprintf(stderr, "Failed to translate file %s\n", dir_entries[i]->d_name);
-          code_writer_close(writer);
-          return 1;
+          success = false;
         }
+
+        free(dir_entries[i]);
       }
 
       free(dir_entries);
-      code_writer_close(writer);
 
-      return 0;
+      if (!success)
+      {
+        vm_program_fini(program);
+        profile_fini(profile);
+        return 1;
+      }
+      break;
     }
     default:
-      fprintf(stderr, "Error: %s is not a regular file or directory\n", argv[1]);
+      fprintf(stderr, "Error: %s is not a regular file or directory\n", input_path);
+      vm_program_fini(program);
+      profile_fini(profile);
       return 1;
   }
 
-  /* Check if file ends with .vm extension */
-  if (!check_file_extension(argv[1]))
+  /* Only the Hack code writer translates intrinsics, the interpreter
+   * and the C program call the functions */
+  if ((options.writer_options & CODE_WRITER_OPT_INTRINSICS) &&
+      !options.interpret && !options.target_c)
+    is_intrinsic = code_writer_is_intrinsic;
+
+  /* Inlining first, so that functions it makes unused are removed */
+  if (options.optimizer_options & OPTIMIZER_OPT_INLINE)
+    optimizer_inline_functions(program, is_intrinsic,
+                               options.print_stats ? stderr : NULL);
+
+  if (options.optimizer_options & OPTIMIZER_OPT_DEAD_FUNCTIONS)
   {
-    fprintf(stderr, "Error: file %s must have .vm extension\n", argv[1]);
-    code_writer_close(writer);
-    return 1;
+    removed = options.print_stats ? vm_program_init() : NULL;
+
+    optimizer_eliminate_dead_functions(program,
+                                       options.keep_functions,
+                                       options.keep_count,
+                                       is_intrinsic,
+                                       removed);
+
+    if (removed)
+    {
+      print_dead_function_stats(removed, &options);
+      vm_program_fini(removed);
+    }
   }
 
-  chdir(dirname(argv[1]));
+  optimizer_run(program, options.optimizer_options);
 
-  /* Create writer */
-  writer = code_writer_init("source.asm");
-  if (!writer)
+  /* After folding, which turns constant conditions into gotos */
+  if (options.optimizer_options & OPTIMIZER_OPT_CLEANUP_JUMPS)
+    cleanup_program_jumps(program, &options);
+
+  /* The interpreter runs the optimized commands instead of their translation */
+  if (options.interpret)
   {
-    fprintf(stderr, "Failed to create writer \n");
-    return 1;
+    success = interpret_program(program, &options);
+    vm_program_fini(program);
+
+    return success ? 0 : 1;
   }
 
-  if (!translate_file(writer, basename(argv[1])))
+  /* The C program is written from the optimized commands */
+  if (options.target_c)
   {
-    fprintf(stderr, "Error: Failed to translate %s\n", basename(argv[1]));
-    code_writer_close(writer);
-    return 1;
+    success = translate_program_to_c(program);
+    vm_program_fini(program);
+
+    return success ? 0 : 1;
   }
-  
-  code_writer_close(writer);
 
-  return 0;
-}
\ No newline at end of file
+  /* Conventions depend on the final function bodies */
+  if ((options.optimizer_options & (OPTIMIZER_OPT_CALL_CONVENTIONS |
+                                    OPTIMIZER_OPT_STATIC_FRAMES)) ||
+      (options.writer_options & CODE_WRITER_OPT_STACK_GUARD))
+  {
+    conventions = optimizer_select_conventions(program,
+                                               options.optimizer_options,
+                                               &convention_count);
+
+    if (conventions && options.print_stats)
+      print_convention_stats(conventions, convention_count);
+  }
+
+  if (options.print_stats || (options.writer_options & CODE_WRITER_OPT_STACK_GUARD))
+    usage = optimizer_stack_usage(program, &usage_count);
+
+  if (usage && options.print_stats)
+    print_stack_usage(usage, usage_count);
+
+  /* Both lists are sorted by name */
+  for (i = 0; usage && conventions && (size_t)i < usage_count &&
+              (size_t)i < convention_count; i++)
+  {
+    if (conventions[i].name == usage[i].name)
+      conventions[i].stack_words = usage[i].local_words + usage[i].working_words;
+  }
+
+  free(usage);
+
+  if (options.format->assembled || options.run)
+  {
+    assembler = assembler_init();
+
+    if (!assembler)
+    {
+      fprintf(stderr, "Failed to create assembler\n");
+      free(conventions);
+      vm_program_fini(program);
+      profile_fini(profile);
+      return 1;
+    }
+  }
+
+  /* A generated profile maps the executions through the source map */
+  if (options.profile || options.source_map || options.profile_generate)
+  {
+    source_map = source_map_init();
+
+    if (!source_map)
+    {
+      fprintf(stderr, "Failed to create source map\n");
+      assembler_fini(assembler);
+      free(conventions);
+      vm_program_fini(program);
+      profile_fini(profile);
+      return 1;
+    }
+  }
+
+  success = translate_program(program, &options, conventions, convention_count,
+                              assembler, source_map, profile);
+
+  if (success && options.source_map &&
+      !source_map_write(source_map, TRANSLATOR_SOURCE_MAP_FILENAME))
+  {
+    fprintf(stderr, "Failed to write %s\n", TRANSLATOR_SOURCE_MAP_FILENAME);
+    success = false;
+  }
+
+  if (success && options.run)
+    success = run_program(assembler, source_map, &options);
+
+  source_map_fini(source_map);
+  assembler_fini(assembler);
+  profile_fini(profile);
+
+  /* Convention names point into the program commands */
+  free(conventions);
+  vm_program_fini(program);
+
+  return success ? 0 : 1;
+}